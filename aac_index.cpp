@@ -0,0 +1,249 @@
+#include "aac_index.h"
+
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+#include "adts.h"
+#include "h264_reader.h"
+#include "rtp.h"
+
+// 缓存中的一个文件，和H264IndexEntry一样在锁外建立，index建完后就绪
+struct AacIndexEntry {
+    uint64_t file_size;
+    time_t file_mtime;
+    uint64_t build_id;
+    std::shared_future<std::shared_ptr<const struct AacIndex>> index;
+};
+
+// 所有工作线程共用，索引建好后只读。锁只保护缓存表
+static std::unordered_map<std::string, struct AacIndexEntry> aac_indexes;
+static std::mutex aac_indexes_mutex;
+static uint64_t aac_index_builds = 0;
+
+static inline bool is_sync(const uint8_t* data, size_t size, size_t pos) {
+    return pos + 1 < size && data[pos] == 0xFF &&
+           (data[pos + 1] & 0xF0) == 0xF0;
+}
+
+/*
+ * 按负载上限把帧聚合成包，超过上限的AU分片。Mtu是编译期常量，为0时用
+ * 运行时的mtu；分片数在循环前算好，循环体没有分支
+ */
+template <uint32_t Mtu>
+static void index_add_packets(struct AacIndex* index, uint32_t runtime_mtu) {
+    const uint32_t mtu = Mtu ? Mtu : runtime_mtu;
+    uint32_t i = 0;
+    while (i < index->frames.size()) {
+        struct AacIndexPacket packet;
+        bzero(&packet, sizeof(packet));
+        packet.first_frame = i;
+        packet.timestamp = index->frames[i].timestamp;
+        packet.marker = true;
+        uint32_t size = AAC_AU_HEADER_SIZE;
+        // 接收端按每个AU AAC_SAMPLES_PER_FRAME推算包中各AU的时间，
+        // 丢弃的帧留下的空缺不能聚合在同一个包中
+        while (i < index->frames.size() &&
+               packet.frame_count < AAC_INDEX_MAX_FRAMES_PER_PACKET &&
+               size + AAC_AU_HEADER_SIZE + index->frames[i].size <= mtu &&
+               index->frames[i].timestamp ==
+                       packet.timestamp +
+                               packet.frame_count * AAC_SAMPLES_PER_FRAME) {
+            size += AAC_AU_HEADER_SIZE + index->frames[i].size;
+            ++packet.frame_count;
+            ++i;
+        }
+        if (packet.frame_count > 0) {
+            index->packets.push_back(packet);
+            continue;
+        }
+        // 单个AU放不下，每个分片都带一个AU-header，AU-size为整个AU的大小
+        const uint32_t max_fragment = mtu - 2 * AAC_AU_HEADER_SIZE;
+        uint32_t au_size = index->frames[i].size;
+        uint32_t count = (au_size + max_fragment - 1) / max_fragment;
+        packet.frame_count = 1;
+        packet.fragment_size = max_fragment;
+        packet.marker = false;
+        size_t first = index->packets.size();
+        index->packets.resize(first + count, packet);
+        struct AacIndexPacket* out = index->packets.data() + first;
+        for (uint32_t k = 0; k < count; ++k) {
+            out[k].fragment_offset = k * max_fragment;
+        }
+        out[count - 1].fragment_size = au_size - (count - 1) * max_fragment;
+        out[count - 1].marker = true;
+        ++i;
+    }
+}
+
+int aac_index_build(struct AacIndex* index, const char* file_name,
+                    uint32_t mtu) {
+    struct H264Reader reader; // 只用来映射文件
+    if (h264_reader_open(&reader, file_name) < 0) {
+        return -1;
+    }
+    const uint8_t* data = reader.data;
+    size_t size = reader.size;
+    index->file_name = file_name;
+    index->file_size = size;
+    index->frames.clear();
+    index->packets.clear();
+
+    struct AdtsHeader first;
+    bool have_first = false;
+    bool synced = false; // pos是上一帧的结尾
+    uint32_t skipped = 0;
+    uint64_t samples = 0; // 已经解析的所有帧的采样数
+    size_t pos = 0;
+    while (pos + ADTS_HEADER_SIZE <= size) {
+        struct AdtsHeader header;
+        // 正常情况下按帧长直接跳到下一帧。帧头不合法时认为失步，向后查找
+        // 下一个0xFF；重新同步时还要求下一帧的位置也是同步字，避免把
+        // 数据中的0xFFF当成帧头
+        if (parse_adts_header(data + pos, &header) < 0 ||
+            pos + header.aac_frame_length > size ||
+            (!synced && pos + header.aac_frame_length + 1 < size &&
+             !is_sync(data, size, pos + header.aac_frame_length))) {
+            const uint8_t* next = (const uint8_t*) memchr(
+                    data + pos + 1, 0xFF, size - pos - 1);
+            if (!next) {
+                break;
+            }
+            pos = next - data;
+            synced = false;
+            continue;
+        }
+        synced = true;
+        if (!have_first) {
+            first = header;
+            have_first = true;
+        }
+        uint32_t header_size = adts_header_size(&header);
+        if (header.sampling_frequency_index !=
+                    first.sampling_frequency_index ||
+            header.channel_cfg != first.channel_cfg ||
+            header.number_of_raw_data_blocks_in_frame != 0) {
+            // 一个ADTS帧中的多个原始块没有边界信息，无法拆成AU
+            ++skipped;
+        }
+        else {
+            struct AacIndexFrame frame;
+            frame.offset = pos + header_size;
+            frame.size = header.aac_frame_length - header_size;
+            frame.timestamp = samples;
+            index->frames.push_back(frame);
+        }
+        samples += (header.number_of_raw_data_blocks_in_frame + 1) *
+                   AAC_SAMPLES_PER_FRAME;
+        pos += header.aac_frame_length;
+    }
+    h264_reader_close(&reader);
+    if (index->frames.empty()) {
+        printf("no adts frame in %s\n", file_name);
+        return -1;
+    }
+    if (skipped) {
+        printf("%s: skipped %u adts frames\n", file_name, skipped);
+    }
+    index->sample_rate = adts_sample_rate(first.sampling_frequency_index);
+    index->channels = first.channel_cfg;
+    adts_audio_specific_config(&first, index->config);
+    if (mtu == RTP_MAX_PKT_SIZE) {
+        index_add_packets<RTP_MAX_PKT_SIZE>(index, mtu);
+    }
+    else {
+        index_add_packets<0>(index, mtu);
+    }
+    return 0;
+}
+
+std::shared_ptr<const struct AacIndex> aac_index_get(const char* file_name) {
+    struct stat st;
+    if (stat(file_name, &st) < 0) {
+        return nullptr;
+    }
+    std::promise<std::shared_ptr<const struct AacIndex>> promise;
+    std::shared_future<std::shared_ptr<const struct AacIndex>> pending;
+    uint64_t build_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(aac_indexes_mutex);
+        auto it = aac_indexes.find(file_name);
+        if (it != aac_indexes.end() &&
+            it->second.file_size == (uint64_t) st.st_size &&
+            it->second.file_mtime == st.st_mtime) {
+            pending = it->second.index;
+        }
+        else {
+            // 正在播放的源还持有旧索引的引用，放开后释放
+            build_id = ++aac_index_builds;
+            struct AacIndexEntry& entry = aac_indexes[file_name];
+            entry.file_size = st.st_size;
+            entry.file_mtime = st.st_mtime;
+            entry.build_id = build_id;
+            entry.index = promise.get_future().share();
+        }
+    }
+    if (pending.valid()) {
+        return pending.get();
+    }
+
+    std::shared_ptr<struct AacIndex> index = std::make_shared<AacIndex>();
+    if (aac_index_build(index.get(), file_name, RTP_MAX_PKT_SIZE) < 0) {
+        std::lock_guard<std::mutex> lock(aac_indexes_mutex);
+        auto it = aac_indexes.find(file_name);
+        if (it != aac_indexes.end() && it->second.build_id == build_id) {
+            aac_indexes.erase(it);
+        }
+        promise.set_value(nullptr);
+        return nullptr;
+    }
+    index->file_mtime = st.st_mtime;
+    printf("build aac index: %s, %zu frames, %zu packets, %u Hz, %u "
+           "channels\n",
+           file_name, index->frames.size(), index->packets.size(),
+           index->sample_rate, index->channels);
+    promise.set_value(index);
+    return index;
+}
+
+uint32_t aac_index_packet_payload(const struct AacIndex* index,
+                                  const uint8_t* data,
+                                  const struct AacIndexPacket* packet,
+                                  uint8_t* payload) {
+    /*
+     * +---------+-----------+-----------+---------------+
+     * | RTP     | AU Header | Auxiliary | Access Unit   |
+     * | Header  | Section   | Section   | Data Section  |
+     * +---------+-----------+-----------+---------------+
+     * AU Header Section：16bit的AU-headers-length（单位bit）加上每个AU
+     * 的AU-header，没有Auxiliary Section
+     */
+    uint32_t headers_bits = packet->frame_count * AAC_AU_HEADER_SIZE * 8;
+    payload[0] = (uint8_t) (headers_bits >> 8);
+    payload[1] = (uint8_t) headers_bits;
+    uint8_t* header = payload + 2;
+    uint8_t* au = header + packet->frame_count * AAC_AU_HEADER_SIZE;
+    // 高13位为AU-size，低3位AU-Index/AU-Index-delta，连续的AU都为0。
+    // 分片只有一个AU，单独处理，聚合的循环中不再判断
+    if (packet->fragment_size) {
+        const struct AacIndexFrame& frame = index->frames[packet->first_frame];
+        header[0] = (uint8_t) (frame.size >> 5);
+        header[1] = (uint8_t) ((frame.size & 0x1F) << 3);
+        memcpy(au, data + frame.offset + packet->fragment_offset,
+               packet->fragment_size);
+        return au + packet->fragment_size - payload;
+    }
+    const struct AacIndexFrame* frames = &index->frames[packet->first_frame];
+    for (uint32_t i = 0; i < packet->frame_count; ++i) {
+        header[0] = (uint8_t) (frames[i].size >> 5);
+        header[1] = (uint8_t) ((frames[i].size & 0x1F) << 3);
+        header += AAC_AU_HEADER_SIZE;
+        memcpy(au, data + frames[i].offset, frames[i].size);
+        au += frames[i].size;
+    }
+    return au - payload;
+}
@@ -0,0 +1,68 @@
+#ifndef RTSPSERVER_AAC_INDEX_H
+#define RTSPSERVER_AAC_INDEX_H
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <vector>
+
+// RFC 3640 AAC-hbr：每个AU-header为13bit的AU-size加3bit的AU-Index(-delta)
+#define AAC_AU_HEADER_SIZE 2
+// 一个RTP包最多聚合的AU数，限制包内第一个AU等待发送的时间
+#define AAC_INDEX_MAX_FRAMES_PER_PACKET 8
+
+// 一个AU（AAC原始帧）在文件中的位置，不含ADTS头
+struct AacIndexFrame {
+    uint64_t offset;
+    uint16_t size;
+    // 第一个采样在文件中的位置，被丢弃的帧也计入，之后的帧不会提前
+    uint64_t timestamp;
+};
+
+/*
+ * 一个RTP包：frame_count个连续的AU聚合在一起，或者是一个大于负载上限的
+ * AU的一个分片（frame_count为1，fragment_size不为0）
+ */
+struct AacIndexPacket {
+    uint32_t first_frame;
+    uint16_t frame_count;
+    uint16_t fragment_offset; // 分片在AU中的偏移
+    uint16_t fragment_size; // 0表示包含完整的AU
+    bool marker; // AU的最后一个分片或完整的AU
+    uint64_t timestamp; // 第一个AU的时间戳，单位为采样
+};
+
+struct AacIndex {
+    std::string file_name;
+    uint64_t file_size;
+    time_t file_mtime;
+    uint32_t sample_rate; // 也是RTP时钟频率
+    uint8_t channels;
+    uint8_t config[2]; // AudioSpecificConfig
+    std::vector<struct AacIndexFrame> frames;
+    std::vector<struct AacIndexPacket> packets;
+};
+
+/*
+ * 映射file_name并按ADTS同步字扫描出所有AU，再按负载上限mtu把连续的AU
+ * 聚合成RTP包。采样率或声道数与第一帧不同的帧被丢弃。失败返回-1
+ */
+int aac_index_build(struct AacIndex* index, const char* file_name,
+                    uint32_t mtu);
+/*
+ * 取得file_name的索引，同一文件（大小和修改时间不变）的后续调用复用缓存。
+ * 文件被替换后缓存换成新的索引，旧索引在最后一个引用放开时释放
+ */
+std::shared_ptr<const struct AacIndex> aac_index_get(const char* file_name);
+
+/*
+ * 在payload中生成packet的RTP负载：AU-headers-length、AU-headers和AU数据，
+ * data为映射的文件，payload至少要有建索引时mtu大小。返回负载长度
+ */
+uint32_t aac_index_packet_payload(const struct AacIndex* index,
+                                  const uint8_t* data,
+                                  const struct AacIndexPacket* packet,
+                                  uint8_t* payload);
+
+#endif
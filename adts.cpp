@@ -0,0 +1,56 @@
+#include "adts.h"
+
+#include <strings.h>
+
+static const uint32_t sample_rates[16] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050,
+        16000, 12000, 11025, 8000,  7350,  0,     0,     0,
+};
+
+int parse_adts_header(const uint8_t* in, struct AdtsHeader* res) {
+    bzero(res, sizeof(*res));
+    if (in[0] != 0xFF || (in[1] & 0xF0) != 0xF0) {
+        return -1;
+    }
+    // 符合同步字
+    res->syncword = 0xFFF;
+    res->id = (in[1] & 0x08) >> 3; // 获取第十三位的bit值
+    res->layer = (in[1] & 0x06) >> 1; // 获取第14、15位bit值
+    res->protection_absent = in[1] & 0x01;
+    res->profile = (in[2] & 0xC0) >> 6;
+    res->sampling_frequency_index = (in[2] & 0x3C) >> 2;
+    res->private_bit = (in[2] & 0x02) >> 1;
+    res->channel_cfg = (in[2] & 0x01) << 2 | (in[3] & 0xC0) >> 6;
+    res->original_copy = (in[3] & 0x20) >> 5;
+    res->home = (in[3] & 0x10) >> 4;
+    res->copyright_identification_bit = (in[3] & 0x08) >> 3;
+    res->copyright_identification_start = (in[3] & 0x04) >> 2;
+    // 13bit：in[3]的低2位、in[4]的8位、in[5]的高3位
+    res->aac_frame_length = (in[3] & 0x03) << 11 | in[4] << 3 |
+                            (in[5] & 0xE0) >> 5;
+    res->adts_buffer_fullness = (in[5] & 0x1F) << 6 | (in[6] & 0xFC) >> 2;
+    res->number_of_raw_data_blocks_in_frame = in[6] & 0x03;
+
+    if (res->layer != 0 || sample_rates[res->sampling_frequency_index] == 0 ||
+        res->aac_frame_length <= adts_header_size(res)) {
+        return -1;
+    }
+    return 0;
+}
+
+uint32_t adts_header_size(const struct AdtsHeader* header) {
+    return header->protection_absent ? ADTS_HEADER_SIZE : ADTS_HEADER_SIZE + 2;
+}
+
+uint32_t adts_sample_rate(uint8_t sampling_frequency_index) {
+    return sample_rates[sampling_frequency_index & 0x0F];
+}
+
+void adts_audio_specific_config(const struct AdtsHeader* header,
+                                uint8_t config[2]) {
+    uint8_t object_type = header->profile + 1;
+    config[0] = (uint8_t) (object_type << 3 |
+                           header->sampling_frequency_index >> 1);
+    config[1] = (uint8_t) ((header->sampling_frequency_index & 0x01) << 7 |
+                           header->channel_cfg << 3);
+}
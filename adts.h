@@ -0,0 +1,54 @@
+#ifndef RTSPSERVER_ADTS_H
+#define RTSPSERVER_ADTS_H
+
+#include <cstdint>
+
+// 没有CRC时的ADTS头长度，protection_absent为0时后面还有2字节CRC
+#define ADTS_HEADER_SIZE 7
+// 一个AAC原始帧（AU）包含的采样数
+#define AAC_SAMPLES_PER_FRAME 1024
+
+struct AdtsHeader {
+    unsigned int syncword; // 12bit同步字，'1111.1111.1111'表示一个ADTS帧的开始
+    uint8_t id; // 1bit 0表示MPEG-4，1表示MPEG-2
+    uint8_t layer; // 2bit 必须为0
+    uint8_t protection_absent; // 1bit 1表示没有CRC 0表示有CRC
+    uint8_t profile; // 2bit AAC级别（MPEG-2定义了3中profile
+                     // MPEG-4中定义了6种profile）
+    uint8_t sampling_frequency_index; // 4bit 采样率
+    uint8_t private_bit; // 1bit 编码时设置为0，解码时忽略
+    uint8_t channel_cfg; // 3bit 声道数量
+    uint8_t original_copy; // 1bit 编码时设置为0，解码时忽略
+    uint8_t home; // 1bit 编码时设置为0，解码时忽略
+
+    uint8_t copyright_identification_bit; // 1bit 编码时设置为0，解码时忽略
+    uint8_t copyright_identification_start; //
+    unsigned int aac_frame_length; // 13bit 一个ADTS帧的长度包含ADTS头和AAC原始流
+    unsigned int adts_buffer_fullness; // 11bit 缓冲区充满度, 0x7FF说明是码率可变
+    // 的码流，不需要此字段，CBR可能需要此字段，不同编码器的使用情况不同。
+    /*
+     * number_of_raw_data_blocks_in_frame
+     * 表示ADTS帧有number_of_raw_data_blocks_in_frame + 1个AAC原始帧
+     * 所以说该字段=0说明ADTS帧中有一个AAC数据块，并不是说没有
+     * 一个AAC原始帧包含一段时间内1024个采样及相关数据*
+     */
+    uint8_t number_of_raw_data_blocks_in_frame; // 2bit
+};
+
+/*
+ * 解析in开始的ADTS头，in至少有ADTS_HEADER_SIZE字节。
+ * 同步字、layer、采样率或帧长不合法时返回-1
+ */
+int parse_adts_header(const uint8_t* in, struct AdtsHeader* res);
+// ADTS头的长度，包括可能有的CRC
+uint32_t adts_header_size(const struct AdtsHeader* header);
+// sampling_frequency_index对应的采样率，保留值返回0
+uint32_t adts_sample_rate(uint8_t sampling_frequency_index);
+/*
+ * 由ADTS头生成2字节的AudioSpecificConfig（SDP中fmtp的config）：
+ * 5bit audioObjectType(= profile + 1)、4bit采样率下标、4bit声道配置
+ */
+void adts_audio_specific_config(const struct AdtsHeader* header,
+                                uint8_t config[2]);
+
+#endif
@@ -0,0 +1,302 @@
+/*
+ * 推流热路径的单核微基准，输入是synth_media生成的合成码流：
+ *   start_code      find_next_start_code扫描整个文件
+ *   h264_reader     逐个取出NALU（原来的get_frame_from_H264_file）
+ *   h264_index      扫描码流，按MTU规划RTP包
+ *   h264_plan       只按MTU规划RTP包（按RTP_MAX_PKT_SIZE特化的版本）
+ *   h264_packetize  按索引生成RTP头、FU-A前缀并加入批次，不发送
+ *   h264_single     同上，只有单NALU包（码流中没有的包类型不运行）
+ *   h264_fu_a       同上，只有FU-A分片
+ *   h264_stap_a     同上，只有STAP-A包
+ *   adts_header     逐帧解析ADTS头
+ *   aac_packetize   按RFC 3640生成AAC的RTP负载
+ *   rtsp_parse      解析SETUP和PLAY请求，更细的对比见bench_rtsp_parser
+ */
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "aac_index.h"
+#include "adts.h"
+#include "h264_index.h"
+#include "h264_reader.h"
+#include "rtp.h"
+#include "rtp_batch.h"
+#include "rtsp_parser.h"
+#include "synth_media.h"
+
+#define BENCH_MEDIA_SECONDS 30
+#define BENCH_FRAME_RATE 25
+
+// 每一轮处理整个输入一次，ops和bytes累加处理的单位数和字节数
+typedef void (*BenchPass)(void* arg, uint64_t* ops, uint64_t* bytes);
+
+static double bench_seconds = 1.0;
+static volatile uint64_t sink;
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void bench_run(const char* name, const char* unit, BenchPass pass,
+                      void* arg) {
+    uint64_t ops = 0, bytes = 0;
+    double begin = now_seconds(), elapsed;
+    do {
+        pass(arg, &ops, &bytes);
+        elapsed = now_seconds() - begin;
+    } while (elapsed < bench_seconds);
+    char rate_unit[32], time_unit[32];
+    snprintf(rate_unit, sizeof(rate_unit), "%s/s", unit);
+    snprintf(time_unit, sizeof(time_unit), "ns/%s", unit);
+    printf("%-15s %12.0f %-9s %9.1f %-10s %9.1f MB/s\n", name, ops / elapsed,
+           rate_unit, elapsed * 1e9 / ops, time_unit, bytes / elapsed / 1e6);
+}
+
+static void pass_start_code(void* arg, uint64_t* ops, uint64_t* bytes) {
+    const std::vector<uint8_t>* data = (const std::vector<uint8_t>*) arg;
+    const uint8_t* pos = data->data();
+    const uint8_t* end = pos + data->size();
+    const uint8_t* start;
+    while ((start = find_next_start_code(pos, end - pos))) {
+        pos = start + 3;
+        ++*ops;
+    }
+    *bytes += data->size();
+}
+
+static void pass_h264_reader(void* arg, uint64_t* ops, uint64_t* bytes) {
+    struct H264Reader* reader = (struct H264Reader*) arg;
+    struct H264Nalu nalu;
+    h264_reader_seek(reader, 0);
+    while (h264_reader_next(reader, &nalu) == 0) {
+        sink += nalu.type;
+        ++*ops;
+    }
+    *bytes += reader->size;
+}
+
+static void pass_h264_index(void* arg, uint64_t* ops, uint64_t* bytes) {
+    const char* file_name = (const char*) arg;
+    struct H264Index index;
+    if (h264_index_build(&index, file_name, RTP_MAX_PKT_SIZE, 0) < 0) {
+        exit(1);
+    }
+    *ops += index.packets.size();
+    *bytes += index.file_size;
+}
+
+// 一种负载格式的一个包：在索引中的下标、所属帧的时间戳和是否是帧的
+// 最后一个包
+struct BenchPacket {
+    uint32_t packet;
+    uint32_t timestamp;
+    bool last;
+};
+
+struct PacketizeArg {
+    const struct H264Index* index;
+    const uint8_t* data;
+    uint8_t rtp_header[RTP_HEADER_SIZE];
+    struct RtpBatch* batch;
+    std::vector<struct BenchPacket> packets;
+};
+
+// 和media_source_add_packet一样生成每个包的头部，批次满时直接清空而不
+// 发送。负载不拷贝，bytes是生成的RTP包的大小
+static void pass_h264_packetize(void* arg, uint64_t* ops, uint64_t* bytes) {
+    struct PacketizeArg* packetize = (struct PacketizeArg*) arg;
+    const struct H264Index* index = packetize->index;
+    struct RtpBatch* batch = packetize->batch;
+    uint16_t seq = 0;
+    for (const struct BenchPacket& packet : packetize->packets) {
+        if (batch->count == RTP_BATCH_MAX_PACKETS) {
+            batch->count = 0;
+        }
+        const struct H264IndexPacket& entry = index->packets[packet.packet];
+        uint8_t header[RTP_HEADER_SIZE + 2];
+        uint32_t header_size = h264_index_packet_header(
+                header, packetize->rtp_header, entry, seq++,
+                packet.timestamp, packet.last);
+        const uint8_t* payload = h264_index_is_aggregate(entry)
+                                         ? index->aggregates.data()
+                                         : packetize->data;
+        rtp_batch_add(batch, -1, nullptr, header, header_size,
+                      payload + entry.offset, entry.size, 0);
+        *bytes += header_size + entry.size;
+    }
+    *ops += packetize->packets.size();
+    batch->count = 0;
+}
+
+static void pass_h264_plan(void* arg, uint64_t* ops, uint64_t* bytes) {
+    struct PacketizeArg* packetize = (struct PacketizeArg*) arg;
+    const struct H264Index* index = packetize->index;
+    static std::vector<struct H264IndexPacket> packets;
+    packets.clear();
+    for (uint32_t i = 0; i < index->nalus.size(); ++i) {
+        const struct H264IndexNalu& nalu = index->nalus[i];
+        h264_index_packetize(packetize->data + nalu.offset, nalu.size,
+                             nalu.offset, i, RTP_MAX_PKT_SIZE, &packets);
+        *bytes += nalu.size;
+    }
+    *ops += packets.size();
+}
+
+/*
+ * 对一种包运行h264_packetize：type为-1时是所有的包，否则只取单NALU包（0）、
+ * FU-A或STAP-A包。码流中没有这种包时跳过
+ */
+static void bench_packetize(const char* name, struct PacketizeArg* packetize,
+                            int type) {
+    const struct H264Index* index = packetize->index;
+    packetize->packets.clear();
+    for (const struct H264IndexFrame& frame : index->frames) {
+        for (uint32_t i = 0; i < frame.packet_count; ++i) {
+            uint32_t pos = frame.first_packet + i;
+            if (type < 0 || (index->packets[pos].fu_indicator & 0x1F) == type) {
+                packetize->packets.push_back(
+                        {pos, (uint32_t) frame.timestamp,
+                         i + 1 == frame.packet_count});
+            }
+        }
+    }
+    if (!packetize->packets.empty()) {
+        bench_run(name, "packet", pass_h264_packetize, packetize);
+    }
+}
+
+static void pass_adts_header(void* arg, uint64_t* ops, uint64_t* bytes) {
+    const std::vector<uint8_t>* data = (const std::vector<uint8_t>*) arg;
+    struct AdtsHeader header;
+    size_t pos = 0;
+    while (pos + ADTS_HEADER_SIZE <= data->size() &&
+           parse_adts_header(data->data() + pos, &header) == 0) {
+        pos += header.aac_frame_length;
+        ++*ops;
+    }
+    *bytes += pos;
+}
+
+struct AacPacketizeArg {
+    const struct AacIndex* index;
+    const uint8_t* data;
+};
+
+static void pass_aac_packetize(void* arg, uint64_t* ops, uint64_t* bytes) {
+    struct AacPacketizeArg* packetize = (struct AacPacketizeArg*) arg;
+    uint8_t payload[RTP_MAX_PKT_SIZE];
+    for (const struct AacIndexPacket& packet : packetize->index->packets) {
+        *bytes += aac_index_packet_payload(packetize->index, packetize->data,
+                                           &packet, payload);
+        sink += payload[0];
+    }
+    *ops += packetize->index->packets.size();
+}
+
+static const char rtsp_requests[] =
+        "SETUP rtsp://192.168.1.10:8554/live/track0 RTSP/1.0\r\n"
+        "CSeq: 3\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Transport: RTP/AVP;unicast;client_port=50124-50125\r\n"
+        "\r\n"
+        "PLAY rtsp://192.168.1.10:8554/live RTSP/1.0\r\n"
+        "CSeq: 4\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Session: 5F3A9C0E12B47D68\r\n"
+        "Range: npt=0.000-\r\n"
+        "\r\n";
+
+static void pass_rtsp_parse(void* arg, uint64_t* ops, uint64_t* bytes) {
+    struct RtspParser parser;
+    struct RtspMessage message;
+    rtsp_parser_init(&parser);
+    uint32_t pos = 0, size;
+    uint32_t total = sizeof(rtsp_requests) - 1;
+    while (rtsp_parse(&parser, rtsp_requests + pos, total - pos, &message,
+                      &size) == RTSP_PARSE_REQUEST) {
+        const struct RtspView* transport =
+                rtsp_message_header(&message, "Transport");
+        sink += message.cseq + (transport ? transport->size : 0);
+        pos += size;
+        ++*ops;
+    }
+    *bytes += pos;
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [-d dir] [-t seconds]\n"
+           "  -d  directory for the synthetic media files, default /tmp\n"
+           "  -t  time spent on each benchmark, default 1\n",
+           prog);
+}
+
+int main(int argc, char* argv[]) {
+    const char* dir = "/tmp";
+    int opt;
+    while ((opt = getopt(argc, argv, "d:t:h")) != -1) {
+        switch (opt) {
+            case 'd': dir = optarg; break;
+            case 't': bench_seconds = atof(optarg); break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+
+    std::vector<uint8_t> h264, adts;
+    synth_h264_generate(&h264, BENCH_MEDIA_SECONDS, BENCH_FRAME_RATE);
+    synth_adts_generate(&adts, BENCH_MEDIA_SECONDS);
+    std::string h264_file = std::string(dir) + "/bench_synth.h264";
+    std::string aac_file = std::string(dir) + "/bench_synth.aac";
+    if (synth_write_file(h264_file.c_str(), h264) < 0 ||
+        synth_write_file(aac_file.c_str(), adts) < 0) {
+        return 1;
+    }
+    printf("synthetic media: %d s, %s %zu bytes, %s %zu bytes\n",
+           BENCH_MEDIA_SECONDS, h264_file.c_str(), h264.size(),
+           aac_file.c_str(), adts.size());
+
+    struct H264Reader reader;
+    if (h264_reader_open(&reader, h264_file.c_str()) < 0) {
+        return 1;
+    }
+    struct H264Index index;
+    struct AacIndex aac_index;
+    if (h264_index_build(&index, h264_file.c_str(), RTP_MAX_PKT_SIZE, 0) < 0 ||
+        aac_index_build(&aac_index, aac_file.c_str(), RTP_MAX_PKT_SIZE) < 0) {
+        return 1;
+    }
+
+    bench_run("start_code", "nalu", pass_start_code, &h264);
+    bench_run("h264_reader", "nalu", pass_h264_reader, &reader);
+    bench_run("h264_index", "packet", pass_h264_index,
+              (void*) h264_file.c_str());
+
+    struct PacketizeArg packetize;
+    packetize.index = &index;
+    packetize.data = reader.data;
+    rtp_header_template(packetize.rtp_header, RTP_PAYLOAD_TYPE_H264,
+                        0x12345678);
+    packetize.batch = new RtpBatch;
+    rtp_batch_init(packetize.batch);
+    bench_run("h264_plan", "packet", pass_h264_plan, &packetize);
+    bench_packetize("h264_packetize", &packetize, -1);
+    bench_packetize("h264_single", &packetize, 0);
+    bench_packetize("h264_fu_a", &packetize, H264_NALU_TYPE_FU_A);
+    bench_packetize("h264_stap_a", &packetize, H264_NALU_TYPE_STAP_A);
+    delete packetize.batch;
+
+    bench_run("adts_header", "frame", pass_adts_header, &adts);
+    struct AacPacketizeArg aac_packetize = {&aac_index, adts.data()};
+    bench_run("aac_packetize", "packet", pass_aac_packetize, &aac_packetize);
+    bench_run("rtsp_parse", "request", pass_rtsp_parse, nullptr);
+
+    h264_reader_close(&reader);
+    return 0;
+}
@@ -0,0 +1,163 @@
+/*
+ * RTSP请求解析的单核吞吐量：
+ *   pipelined  一次收到多个完整请求
+ *   partial    每次只收到16字节，模拟慢速或被拆分的TCP段
+ *   legacy     原来的做法：拷贝进std::string后strtok + sscanf
+ * 每个请求都取出Transport和Session头，和服务器处理请求时一样
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+
+#include "rtsp_parser.h"
+
+#define BENCH_SECONDS 1.0
+#define PARTIAL_CHUNK_SIZE 16
+
+static const char* requests[] = {
+        "OPTIONS rtsp://192.168.1.10:8554/live RTSP/1.0\r\n"
+        "CSeq: 1\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "\r\n",
+        "DESCRIBE rtsp://192.168.1.10:8554/live RTSP/1.0\r\n"
+        "CSeq: 2\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Accept: application/sdp\r\n"
+        "\r\n",
+        "SETUP rtsp://192.168.1.10:8554/live/track0 RTSP/1.0\r\n"
+        "CSeq: 3\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Transport: RTP/AVP;unicast;client_port=50124-50125\r\n"
+        "\r\n",
+        "PLAY rtsp://192.168.1.10:8554/live RTSP/1.0\r\n"
+        "CSeq: 4\r\n"
+        "User-Agent: LibVLC/3.0.18 (LIVE555 Streaming Media v2016.11.28)\r\n"
+        "Session: 5F3A9C0E12B47D68\r\n"
+        "Range: npt=0.000-\r\n"
+        "\r\n",
+};
+
+static double now_seconds() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static volatile uint64_t sink;
+
+static void use_message(const struct RtspMessage* message) {
+    const struct RtspView* transport =
+            rtsp_message_header(message, "Transport");
+    const struct RtspView* session = rtsp_message_header(message, "Session");
+    sink += message->cseq + message->method.size +
+            (transport ? transport->size : 0) + (session ? session->size : 0);
+}
+
+static void report(const char* name, uint64_t count, double elapsed) {
+    printf("%-10s %12.0f requests/s  %8.1f ns/request\n", name,
+           count / elapsed, elapsed * 1e9 / count);
+}
+
+static void bench_pipelined(const std::string& stream, int per_stream) {
+    struct RtspParser parser;
+    struct RtspMessage message;
+    rtsp_parser_init(&parser);
+    uint64_t count = 0;
+    double begin = now_seconds(), elapsed;
+    do {
+        for (int round = 0; round < 100; ++round) {
+            uint32_t pos = 0, size;
+            while (rtsp_parse(&parser, stream.data() + pos,
+                              stream.size() - pos, &message, &size) ==
+                   RTSP_PARSE_REQUEST) {
+                use_message(&message);
+                pos += size;
+            }
+            count += per_stream;
+        }
+        elapsed = now_seconds() - begin;
+    } while (elapsed < BENCH_SECONDS);
+    report("pipelined", count, elapsed);
+}
+
+static void bench_partial(const std::string& stream, int per_stream) {
+    struct RtspParser parser;
+    struct RtspMessage message;
+    rtsp_parser_init(&parser);
+    uint64_t count = 0;
+    double begin = now_seconds(), elapsed;
+    do {
+        for (int round = 0; round < 100; ++round) {
+            // [pos, received)是已经收到还没有解析完的数据
+            uint32_t pos = 0, received = 0, size;
+            while (received < stream.size()) {
+                received += PARTIAL_CHUNK_SIZE;
+                if (received > stream.size()) {
+                    received = stream.size();
+                }
+                while (rtsp_parse(&parser, stream.data() + pos, received - pos,
+                                  &message, &size) == RTSP_PARSE_REQUEST) {
+                    use_message(&message);
+                    pos += size;
+                }
+            }
+            count += per_stream;
+        }
+        elapsed = now_seconds() - begin;
+    } while (elapsed < BENCH_SECONDS);
+    report("partial", count, elapsed);
+}
+
+static void bench_legacy(int request_count) {
+    uint64_t count = 0;
+    double begin = now_seconds(), elapsed;
+    do {
+        for (int round = 0; round < 100; ++round) {
+            for (int i = 0; i < request_count; ++i) {
+                std::string copy(requests[i]);
+                char method[40], url[100], version[40];
+                int cseq = 0, rtp_port = 0, rtcp_port = 0;
+                char* line = strtok(&copy[0], "\n");
+                while (line) {
+                    if (strstr(line, "OPTIONS") || strstr(line, "DESCRIBE") ||
+                        strstr(line, "SETUP") || strstr(line, "PLAY")) {
+                        sscanf(line, "%39s %99s %39s\r\n", method, url,
+                               version);
+                    }
+                    else if (strstr(line, "CSeq")) {
+                        sscanf(line, "CSeq: %d\r\n", &cseq);
+                    }
+                    else if (strncmp(line, "Transport:", 10) == 0) {
+                        sscanf(line,
+                               "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n",
+                               &rtp_port, &rtcp_port);
+                    }
+                    line = strtok(nullptr, "\n");
+                }
+                sink += cseq + rtp_port + method[0];
+            }
+            count += request_count;
+        }
+        elapsed = now_seconds() - begin;
+    } while (elapsed < BENCH_SECONDS);
+    report("legacy", count, elapsed);
+}
+
+int main() {
+    int request_count = sizeof(requests) / sizeof(requests[0]);
+    // 一个连接的完整建连过程重复多次，模拟断网恢复后的集中重连
+    std::string stream;
+    int per_stream = 0;
+    for (int k = 0; k < 16; ++k) {
+        for (int i = 0; i < request_count; ++i) {
+            stream += requests[i];
+            ++per_stream;
+        }
+    }
+    bench_pipelined(stream, per_stream);
+    bench_partial(stream, per_stream);
+    bench_legacy(request_count);
+    return 0;
+}
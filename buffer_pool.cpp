@@ -0,0 +1,76 @@
+#include "buffer_pool.h"
+
+#include <cstdlib>
+
+// 一级的空闲缓冲
+struct BufferPoolClass {
+    struct PoolBuffer* free_list;
+    uint32_t free_count;
+};
+
+static thread_local struct BufferPoolClass pool[BUFFER_POOL_CLASS_COUNT];
+
+static uint32_t class_size(int size_class) {
+    return BUFFER_POOL_MIN_SIZE << 2 * size_class;
+}
+
+static int size_class_of(uint32_t capacity) {
+    for (int i = 0; i < BUFFER_POOL_CLASS_COUNT; ++i) {
+        if (capacity <= class_size(i)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct PoolBuffer* pool_buffer_alloc(uint32_t capacity) {
+    int size_class = size_class_of(capacity);
+    struct PoolBuffer* buffer = nullptr;
+    if (size_class >= 0) {
+        struct BufferPoolClass* cls = &pool[size_class];
+        buffer = cls->free_list;
+        if (buffer) {
+            cls->free_list = buffer->next;
+            --cls->free_count;
+        }
+        capacity = class_size(size_class);
+    }
+    if (!buffer) {
+        buffer = (struct PoolBuffer*) malloc(sizeof(struct PoolBuffer) +
+                                             capacity);
+        if (!buffer) {
+            return nullptr;
+        }
+        buffer->data = (uint8_t*) (buffer + 1);
+        buffer->capacity = capacity;
+        buffer->size_class = size_class;
+    }
+    buffer->size = 0;
+    buffer->refcount = 1;
+    buffer->next = nullptr;
+    return buffer;
+}
+
+struct PoolBuffer* pool_buffer_ref(struct PoolBuffer* buffer) {
+    ++buffer->refcount;
+    return buffer;
+}
+
+void pool_buffer_unref(struct PoolBuffer* buffer) {
+    if (--buffer->refcount > 0) {
+        return;
+    }
+    if (buffer->size_class < 0) {
+        free(buffer);
+        return;
+    }
+    struct BufferPoolClass* cls = &pool[buffer->size_class];
+    if ((uint64_t) (cls->free_count + 1) * buffer->capacity >
+        BUFFER_POOL_CACHE_BYTES) {
+        free(buffer);
+        return;
+    }
+    buffer->next = cls->free_list;
+    cls->free_list = buffer;
+    ++cls->free_count;
+}
@@ -0,0 +1,36 @@
+#ifndef RTSPSERVER_BUFFER_POOL_H
+#define RTSPSERVER_BUFFER_POOL_H
+
+#include <cstdint>
+
+/*
+ * 按大小分级的缓冲池，每个工作线程一个。最小的一级放得下RTSP回复和
+ * 满MTU的RTP包（含'$'前缀），每一级是上一级的4倍，更大的几级用于排队的
+ * 帧。超过最大一级（2MB）的直接malloc，释放时不回收
+ */
+#define BUFFER_POOL_CLASS_COUNT 6
+#define BUFFER_POOL_MIN_SIZE 2048
+// 每一级空闲链表最多缓存的字节数，多出的直接释放
+#define BUFFER_POOL_CACHE_BYTES (4 * 1024 * 1024)
+
+/*
+ * 带引用计数的缓冲，数据在结构体之后。同一个帧的负载可以被多个连接的
+ * 输出队列同时引用。引用计数不是原子的：缓冲只在分配它的线程中共享，
+ * 连接交给其他线程时队列中只有它自己的缓冲
+ */
+struct PoolBuffer {
+    uint8_t* data;
+    uint32_t capacity;
+    uint32_t size; // 已写入的字节数
+    uint32_t refcount;
+    int size_class; // -1表示不属于任何一级
+    struct PoolBuffer* next; // 空闲链表
+};
+
+// 至少capacity字节的缓冲，引用计数为1，size为0
+struct PoolBuffer* pool_buffer_alloc(uint32_t capacity);
+struct PoolBuffer* pool_buffer_ref(struct PoolBuffer* buffer);
+// 最后一个引用释放时回到当前线程的空闲链表
+void pool_buffer_unref(struct PoolBuffer* buffer);
+
+#endif
@@ -0,0 +1,163 @@
+#include "event_loop.h"
+
+#include <fcntl.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+struct EventHandler {
+    EventCallback callback;
+    void* arg;
+    uint32_t generation; // 每次注册递增，用来过滤已经移除的fd的残留事件
+    bool active;
+};
+
+struct EventLoop {
+    int epoll_fd;
+    bool running;
+    uint32_t generation;
+    std::vector<struct EventHandler> handlers; // 以fd为下标
+};
+
+static inline uint64_t make_event_data(int fd, uint32_t generation) {
+    return ((uint64_t) generation << 32) | (uint32_t) fd;
+}
+
+struct EventLoop* event_loop_create() {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return nullptr;
+    }
+    struct EventLoop* loop = new EventLoop();
+    loop->epoll_fd = epoll_fd;
+    loop->running = false;
+    loop->generation = 0;
+    return loop;
+}
+
+void event_loop_destroy(struct EventLoop* loop) {
+    if (!loop) {
+        return;
+    }
+    close(loop->epoll_fd);
+    delete loop;
+}
+
+int event_loop_add(struct EventLoop* loop, int fd, uint32_t events,
+                   EventCallback callback, void* arg) {
+    if (fd < 0) {
+        return -1;
+    }
+    if ((size_t) fd >= loop->handlers.size()) {
+        loop->handlers.resize(fd + 1);
+    }
+    struct EventHandler& handler = loop->handlers[fd];
+    handler.callback = callback;
+    handler.arg = arg;
+    handler.generation = ++loop->generation;
+    handler.active = true;
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = make_event_data(fd, handler.generation);
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        handler.active = false;
+        return -1;
+    }
+    return 0;
+}
+
+int event_loop_modify(struct EventLoop* loop, int fd, uint32_t events) {
+    if (fd < 0 || (size_t) fd >= loop->handlers.size() ||
+        !loop->handlers[fd].active) {
+        return -1;
+    }
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = events;
+    ev.data.u64 = make_event_data(fd, loop->handlers[fd].generation);
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+}
+
+int event_loop_remove(struct EventLoop* loop, int fd) {
+    if (fd < 0 || (size_t) fd >= loop->handlers.size() ||
+        !loop->handlers[fd].active) {
+        return -1;
+    }
+    loop->handlers[fd].active = false;
+    return epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+}
+
+int event_loop_add_timer(struct EventLoop* loop, uint32_t interval_us,
+                         EventCallback callback, void* arg) {
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        return -1;
+    }
+    struct itimerspec spec;
+    bzero(&spec, sizeof(spec));
+    spec.it_interval.tv_sec = interval_us / 1000000;
+    spec.it_interval.tv_nsec = (interval_us % 1000000) * 1000;
+    spec.it_value = spec.it_interval;
+    if (timerfd_settime(timer_fd, 0, &spec, nullptr) < 0 ||
+        event_loop_add(loop, timer_fd, EPOLLIN, callback, arg) < 0) {
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+uint64_t event_loop_read_timer(int timer_fd) {
+    uint64_t expirations = 0;
+    if (read(timer_fd, &expirations, sizeof(expirations)) !=
+        sizeof(expirations)) {
+        return 0;
+    }
+    return expirations;
+}
+
+int event_loop_run(struct EventLoop* loop) {
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    loop->running = true;
+    while (loop->running) {
+        int n = epoll_wait(loop->epoll_fd, events, EVENT_LOOP_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            printf("epoll_wait error: %s\n", strerror(errno));
+            return -1;
+        }
+        for (int i = 0; i < n; ++i) {
+            int fd = (int) (events[i].data.u64 & 0xFFFFFFFF);
+            uint32_t generation = (uint32_t) (events[i].data.u64 >> 32);
+            // 同一轮中前面的回调可能已经关闭甚至复用了这个fd
+            if ((size_t) fd >= loop->handlers.size()) {
+                continue;
+            }
+            struct EventHandler& handler = loop->handlers[fd];
+            if (!handler.active || handler.generation != generation) {
+                continue;
+            }
+            handler.callback(loop, fd, events[i].events, handler.arg);
+        }
+    }
+    return 0;
+}
+
+void event_loop_stop(struct EventLoop* loop) {
+    loop->running = false;
+}
+
+int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
@@ -0,0 +1,36 @@
+#ifndef RTSPSERVER_EVENT_LOOP_H
+#define RTSPSERVER_EVENT_LOOP_H
+
+#include <sys/epoll.h>
+
+#include <cstdint>
+
+#define EVENT_LOOP_MAX_EVENTS 1024
+
+struct EventLoop;
+
+// fd就绪时的回调，events为epoll返回的事件集合
+typedef void (*EventCallback)(struct EventLoop* loop, int fd, uint32_t events,
+                              void* arg);
+
+struct EventLoop* event_loop_create();
+void event_loop_destroy(struct EventLoop* loop);
+
+// 注册/修改/移除fd，移除后本轮循环中已取出的该fd事件不会再回调
+int event_loop_add(struct EventLoop* loop, int fd, uint32_t events,
+                   EventCallback callback, void* arg);
+int event_loop_modify(struct EventLoop* loop, int fd, uint32_t events);
+int event_loop_remove(struct EventLoop* loop, int fd);
+
+// 创建一个周期性timerfd并注册到loop中，返回timerfd，失败返回-1
+int event_loop_add_timer(struct EventLoop* loop, uint32_t interval_us,
+                         EventCallback callback, void* arg);
+// 读取timerfd的超时次数，返回到期次数
+uint64_t event_loop_read_timer(int timer_fd);
+
+int event_loop_run(struct EventLoop* loop);
+void event_loop_stop(struct EventLoop* loop);
+
+int set_nonblocking(int fd);
+
+#endif
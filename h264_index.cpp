@@ -0,0 +1,593 @@
+#include "h264_index.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <future>
+#include <mutex>
+#include <unordered_map>
+
+#include "h264_reader.h"
+#include "h264_sps.h"
+#include "rtp.h"
+
+// 旁路文件头，后面依次是nalus、packets、frames三个数组
+struct H264IndexFileHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t mtu;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint32_t frame_rate;
+    uint32_t frame_rate_num;
+    uint32_t frame_rate_den;
+    uint32_t nalu_count;
+    uint32_t packet_count;
+    uint32_t frame_count;
+};
+
+/*
+ * 缓存中的一个文件。index在建立完成后就绪，建立期间其他请求这个文件的
+ * 线程等待它，请求其他文件的线程不受影响
+ */
+struct H264IndexEntry {
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint32_t frame_rate;
+    uint64_t build_id;
+    std::shared_future<std::shared_ptr<const struct H264Index>> index;
+};
+
+// 所有工作线程共用，索引建好后只读。锁只保护缓存表，不在建立索引时持有
+static std::unordered_map<std::string, struct H264IndexEntry> h264_indexes;
+static std::mutex h264_indexes_mutex;
+static uint64_t h264_index_builds = 0;
+
+// 第frame_pos帧的时间戳，按整数帧率计算避免累加误差（如29.97fps）
+static uint64_t frame_timestamp(const struct H264Index* index,
+                                uint64_t frame_pos) {
+    return frame_pos * H264_CLOCK_RATE * index->frame_rate_den /
+           index->frame_rate_num;
+}
+
+// 从SPS的VUI取帧率，没有或不合理时返回-1
+static int sps_frame_rate(const struct H264Nalu* nalu, uint32_t* num,
+                          uint32_t* den) {
+    struct H264Sps sps;
+    if (h264_sps_parse(nalu->data, nalu->size, &sps) < 0 ||
+        !sps.timing_info_present) {
+        return -1;
+    }
+    // 一帧两场，帧率 = time_scale / (2 * num_units_in_tick)
+    uint64_t frame_num = sps.time_scale;
+    uint64_t frame_den = 2ull * sps.num_units_in_tick;
+    uint64_t a = frame_num, b = frame_den;
+    while (b) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    frame_num /= a;
+    frame_den /= a;
+    // 约分后分母很大的帧率按时间戳公式计算会溢出，也不会是真实的帧率
+    if (frame_den > 0xFFFF || frame_num < frame_den ||
+        frame_num > 240 * frame_den) {
+        return -1;
+    }
+    *num = (uint32_t) frame_num;
+    *den = (uint32_t) frame_den;
+    return 0;
+}
+
+/*
+ * 负载上限是编译期常量Mtu（为0时用运行时的mtu）。FU-A的分片数在循环前
+ * 算好，除法变成乘法，循环体只是按下标写入，首尾分片的S/E位和最后一片
+ * 的大小在循环外修正
+ */
+template <uint32_t Mtu>
+static void packetize_nalu(const uint8_t* nalu, uint32_t size,
+                           uint64_t offset, uint32_t nalu_pos,
+                           uint32_t runtime_mtu,
+                           std::vector<struct H264IndexPacket>* packets) {
+    const uint32_t mtu = Mtu ? Mtu : runtime_mtu;
+    if (size <= mtu) {
+        // 单NALU模式
+        struct H264IndexPacket packet;
+        bzero(&packet, sizeof(packet));
+        packet.offset = offset;
+        packet.size = size;
+        packet.nalu = nalu_pos;
+        packets->push_back(packet);
+        return;
+    }
+
+    // FU-A分片模式，NALU头由FU indicator和FU header还原，不发送
+    uint32_t count = (size - 1 + mtu - 1) / mtu;
+    size_t first = packets->size();
+    packets->resize(first + count);
+    struct H264IndexPacket* out = packets->data() + first;
+    uint8_t fu_indicator = (nalu[0] & 0x60) | H264_NALU_TYPE_FU_A;
+    uint8_t fu_header = nalu[0] & 0x1F;
+    for (uint32_t i = 0; i < count; ++i) {
+        out[i].offset = offset + 1 + (uint64_t) i * mtu;
+        out[i].size = mtu;
+        out[i].fu_indicator = fu_indicator;
+        out[i].fu_header = fu_header;
+        out[i].nalu = nalu_pos;
+    }
+    out[0].fu_header |= 0x80;
+    out[count - 1].fu_header |= 0x40;
+    out[count - 1].size = size - 1 - (count - 1) * mtu;
+}
+
+void h264_index_packetize(const uint8_t* nalu, uint32_t size,
+                          uint64_t offset, uint32_t nalu_pos, uint32_t mtu,
+                          std::vector<struct H264IndexPacket>* packets) {
+    if (mtu == RTP_MAX_PKT_SIZE) {
+        packetize_nalu<RTP_MAX_PKT_SIZE>(nalu, size, offset, nalu_pos, mtu,
+                                         packets);
+    }
+    else {
+        packetize_nalu<0>(nalu, size, offset, nalu_pos, mtu, packets);
+    }
+}
+
+void h264_stap_a_append(std::vector<uint8_t>* out, size_t start,
+                        const uint8_t* nalu, uint32_t size) {
+    if (out->size() == start) {
+        out->push_back(H264_NALU_TYPE_STAP_A);
+    }
+    uint8_t header = (*out)[start];
+    uint8_t nri = std::max(header & 0x60, nalu[0] & 0x60);
+    (*out)[start] = ((header | nalu[0]) & 0x80) | nri | H264_NALU_TYPE_STAP_A;
+    uint8_t length[H264_STAP_A_LENGTH_SIZE] = {(uint8_t) (size >> 8),
+                                               (uint8_t) size};
+    out->insert(out->end(), length, length + H264_STAP_A_LENGTH_SIZE);
+    out->insert(out->end(), nalu, nalu + size);
+}
+
+/*
+ * 当前帧的第nalu_pos个NALU能和帧中的上一个包合成不超过mtu的STAP-A包时
+ * 加入那个包并返回true：上一个包是单NALU包时先把它改成STAP-A包。
+ * data是映射的码流
+ */
+static bool index_aggregate(struct H264Index* index, const uint8_t* data,
+                            uint32_t nalu_pos) {
+    struct H264IndexPacket& last = index->packets.back();
+    const struct H264IndexNalu& nalu = index->nalus[nalu_pos];
+    uint32_t size = H264_STAP_A_LENGTH_SIZE + nalu.size;
+    if (h264_index_is_aggregate(last)) {
+        if (last.fu_header == H264_STAP_A_MAX_NALUS ||
+            last.size + size > index->mtu) {
+            return false;
+        }
+    }
+    else if (last.fu_indicator != 0 ||
+             1 + H264_STAP_A_LENGTH_SIZE + last.size + size > index->mtu) {
+        return false;
+    }
+    else {
+        size_t start = index->aggregates.size();
+        h264_stap_a_append(&index->aggregates, start, data + last.offset,
+                           last.size);
+        last.offset = start;
+        last.fu_header = 1;
+    }
+    h264_stap_a_append(&index->aggregates, last.offset, data + nalu.offset,
+                       nalu.size);
+    last.size = (uint16_t) (index->aggregates.size() - last.offset);
+    last.fu_indicator = index->aggregates[last.offset];
+    ++last.fu_header;
+    return true;
+}
+
+static void index_collect_keyframes(struct H264Index* index) {
+    index->keyframes.clear();
+    for (size_t i = 0; i < index->frames.size(); ++i) {
+        if (index->frames[i].flags & H264_INDEX_FRAME_KEY) {
+            index->keyframes.push_back(i);
+        }
+    }
+}
+
+uint32_t h264_index_seek(const struct H264Index* index, uint64_t timestamp) {
+    const std::vector<uint32_t>& keyframes = index->keyframes;
+    if (keyframes.empty()) {
+        return 0;
+    }
+    // 第一个晚于timestamp的IDR帧，它的前一个就是要找的
+    auto it = std::upper_bound(
+            keyframes.begin(), keyframes.end(), timestamp,
+            [index](uint64_t value, uint32_t pos) {
+                return value < index->frames[pos].timestamp;
+            });
+    return it == keyframes.begin() ? keyframes.front() : *(it - 1);
+}
+
+int h264_index_build(struct H264Index* index, const char* file_name,
+                     uint32_t mtu, uint32_t frame_rate) {
+    struct H264Reader reader;
+    struct H264Nalu nalu;
+    if (h264_reader_open(&reader, file_name) < 0) {
+        return -1;
+    }
+    index->file_name = file_name;
+    index->file_size = reader.size;
+    index->mtu = mtu;
+    index->frame_rate = frame_rate;
+    index->frame_rate_num = frame_rate;
+    index->frame_rate_den = 1;
+    index->nalus.clear();
+    index->packets.clear();
+    index->frames.clear();
+    index->aggregates.clear();
+
+    struct H264IndexFrame frame;
+    bzero(&frame, sizeof(frame));
+    bool sps_found = false;
+    bool vcl_found = false; // 当前帧中已有图像NALU
+    while (h264_reader_next(&reader, &nalu) == 0) {
+        if (nalu.type == H264_NALU_TYPE_PPS && index->pps.empty()) {
+            index->pps.assign((const char*) nalu.data, nalu.size);
+        }
+        if (nalu.type == H264_NALU_TYPE_SPS && !sps_found) {
+            sps_found = true;
+            index->sps.assign((const char*) nalu.data, nalu.size);
+            uint32_t num, den;
+            if (frame_rate == 0 && sps_frame_rate(&nalu, &num, &den) == 0) {
+                index->frame_rate_num = num;
+                index->frame_rate_den = den;
+            }
+        }
+        // 一帧可以分成多个slice，到下一个访问单元的第一个NALU才结束
+        if (vcl_found && h264_nalu_starts_frame(nalu.data, nalu.size)) {
+            frame.packet_count = index->packets.size() - frame.first_packet;
+            index->frames.push_back(frame);
+            bzero(&frame, sizeof(frame));
+            vcl_found = false;
+        }
+        struct H264IndexNalu entry;
+        bzero(&entry, sizeof(entry));
+        entry.offset = nalu.offset;
+        entry.size = nalu.size;
+        entry.type = nalu.type;
+        if (frame.nalu_count == 0) {
+            frame.first_nalu = index->nalus.size();
+            frame.first_packet = index->packets.size();
+        }
+        index->nalus.push_back(entry);
+        // 同一帧的NALU共用时间戳，连续的小NALU聚合成STAP-A包
+        uint32_t nalu_pos = index->nalus.size() - 1;
+        if (frame.nalu_count == 0 ||
+            !index_aggregate(index, reader.data, nalu_pos)) {
+            h264_index_packetize(nalu.data, nalu.size, nalu.offset, nalu_pos,
+                                 index->mtu, &index->packets);
+        }
+        ++frame.nalu_count;
+        if (nalu.type == H264_NALU_TYPE_IDR) {
+            frame.flags |= H264_INDEX_FRAME_KEY;
+        }
+        vcl_found = vcl_found || h264_nalu_is_vcl(nalu.type);
+    }
+    h264_reader_close(&reader);
+    if (vcl_found) {
+        frame.packet_count = index->packets.size() - frame.first_packet;
+        index->frames.push_back(frame);
+        bzero(&frame, sizeof(frame));
+    }
+
+    // SPS不一定在第一帧之前，帧率确定后再统一填写时间戳
+    if (index->frame_rate_num == 0) {
+        index->frame_rate_num = H264_DEFAULT_FRAME_RATE;
+        index->frame_rate_den = 1;
+    }
+    for (size_t i = 0; i < index->frames.size(); ++i) {
+        struct H264IndexFrame& entry = index->frames[i];
+        entry.timestamp = frame_timestamp(index, i);
+        for (uint32_t k = 0; k < entry.nalu_count; ++k) {
+            index->nalus[entry.first_nalu + k].timestamp = entry.timestamp;
+        }
+    }
+    // 文件末尾不属于任何帧的NALU
+    for (uint32_t k = 0; k < frame.nalu_count; ++k) {
+        index->nalus[frame.first_nalu + k].timestamp =
+                frame_timestamp(index, index->frames.size());
+    }
+    index_collect_keyframes(index);
+    return 0;
+}
+
+// [offset, offset + size)在[begin, end)之内
+static bool range_within(uint64_t offset, uint64_t size, uint64_t begin,
+                         uint64_t end) {
+    return offset >= begin && offset <= end && size <= end - offset;
+}
+
+/*
+ * 旁路文件中的位置发送时直接用来读映射的文件，加载后逐项检查：NALU在
+ * 码流内，包在所属的NALU内（STAP-A包聚合的NALU都在数组内，负载生成时
+ * 再检查），帧的NALU和包都在数组内
+ */
+static int index_validate(const struct H264Index* index) {
+    for (const struct H264IndexNalu& nalu : index->nalus) {
+        if (nalu.size == 0 ||
+            !range_within(nalu.offset, nalu.size, 0, index->file_size)) {
+            return -1;
+        }
+    }
+    for (const struct H264IndexPacket& packet : index->packets) {
+        if (packet.nalu >= index->nalus.size() || packet.size == 0 ||
+            packet.size > index->mtu) {
+            return -1;
+        }
+        if (h264_index_is_aggregate(packet)) {
+            if (packet.fu_header < 2 ||
+                packet.fu_header > index->nalus.size() - packet.nalu) {
+                return -1;
+            }
+            continue;
+        }
+        bool fu_a = h264_index_prefix_size(packet) != 0;
+        if (packet.fu_indicator != 0 && !fu_a) {
+            return -1;
+        }
+        const struct H264IndexNalu& nalu = index->nalus[packet.nalu];
+        // FU-A分片不含NALU头
+        if (!range_within(packet.offset, packet.size, nalu.offset + fu_a,
+                          nalu.offset + nalu.size)) {
+            return -1;
+        }
+    }
+    for (const struct H264IndexFrame& frame : index->frames) {
+        if (frame.nalu_count == 0 || frame.packet_count == 0 ||
+            !range_within(frame.first_nalu, frame.nalu_count, 0,
+                          index->nalus.size()) ||
+            !range_within(frame.first_packet, frame.packet_count, 0,
+                          index->packets.size())) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int h264_index_load(struct H264Index* index, const char* index_file_name) {
+    struct H264IndexFileHeader header;
+    FILE* fp = fopen(index_file_name, "rb");
+    if (!fp) {
+        return -1;
+    }
+    if (fread(&header, sizeof(header), 1, fp) != 1 ||
+        memcmp(header.magic, H264_INDEX_MAGIC, sizeof(H264_INDEX_MAGIC)) != 0 ||
+        header.version != H264_INDEX_VERSION) {
+        fclose(fp);
+        return -1;
+    }
+    // 数组的大小要和旁路文件的长度一致，损坏的计数不会导致巨大的分配
+    struct stat st;
+    uint64_t expected =
+            sizeof(header) +
+            (uint64_t) header.nalu_count * sizeof(struct H264IndexNalu) +
+            (uint64_t) header.packet_count * sizeof(struct H264IndexPacket) +
+            (uint64_t) header.frame_count * sizeof(struct H264IndexFrame);
+    if (fstat(fileno(fp), &st) < 0 || (uint64_t) st.st_size != expected) {
+        fclose(fp);
+        return -1;
+    }
+    index->file_size = header.file_size;
+    index->file_mtime = header.file_mtime;
+    index->mtu = header.mtu;
+    index->frame_rate = header.frame_rate;
+    index->frame_rate_num = header.frame_rate_num;
+    index->frame_rate_den = header.frame_rate_den;
+    index->nalus.resize(header.nalu_count);
+    index->packets.resize(header.packet_count);
+    index->frames.resize(header.frame_count);
+    if (fread(index->nalus.data(), sizeof(struct H264IndexNalu),
+              header.nalu_count, fp) != header.nalu_count ||
+        fread(index->packets.data(), sizeof(struct H264IndexPacket),
+              header.packet_count, fp) != header.packet_count ||
+        fread(index->frames.data(), sizeof(struct H264IndexFrame),
+              header.frame_count, fp) != header.frame_count) {
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    if (index_validate(index) < 0) {
+        return -1;
+    }
+    index_collect_keyframes(index);
+    return 0;
+}
+
+int h264_index_save(const struct H264Index* index,
+                    const char* index_file_name) {
+    struct H264IndexFileHeader header;
+    bzero(&header, sizeof(header));
+    memcpy(header.magic, H264_INDEX_MAGIC, sizeof(H264_INDEX_MAGIC));
+    header.version = H264_INDEX_VERSION;
+    header.mtu = index->mtu;
+    header.file_size = index->file_size;
+    header.file_mtime = index->file_mtime;
+    header.frame_rate = index->frame_rate;
+    header.frame_rate_num = index->frame_rate_num;
+    header.frame_rate_den = index->frame_rate_den;
+    header.nalu_count = index->nalus.size();
+    header.packet_count = index->packets.size();
+    header.frame_count = index->frames.size();
+
+    // 先写临时文件再rename，避免其他进程读到写了一半的索引
+    std::string temp_file_name = std::string(index_file_name) + ".tmp";
+    FILE* fp = fopen(temp_file_name.c_str(), "wb");
+    if (!fp) {
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(index->nalus.data(), sizeof(struct H264IndexNalu),
+                     header.nalu_count, fp) == header.nalu_count &&
+              fwrite(index->packets.data(), sizeof(struct H264IndexPacket),
+                     header.packet_count, fp) == header.packet_count &&
+              fwrite(index->frames.data(), sizeof(struct H264IndexFrame),
+                     header.frame_count, fp) == header.frame_count;
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    if (!ok || rename(temp_file_name.c_str(), index_file_name) < 0) {
+        remove(temp_file_name.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+// 从码流中读出加载的索引中第一个SPS和PPS
+static int index_read_parameter_sets(struct H264Index* index,
+                                     const char* file_name) {
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = 0;
+    for (const struct H264IndexNalu& nalu : index->nalus) {
+        std::string* target = nalu.type == H264_NALU_TYPE_SPS ? &index->sps
+                              : nalu.type == H264_NALU_TYPE_PPS ? &index->pps
+                                                                : nullptr;
+        if (!target || !target->empty()) {
+            continue;
+        }
+        target->resize(nalu.size);
+        if (pread(fd, &(*target)[0], nalu.size, nalu.offset) !=
+            (ssize_t) nalu.size) {
+            result = -1;
+            break;
+        }
+        if (!index->sps.empty() && !index->pps.empty()) {
+            break;
+        }
+    }
+    close(fd);
+    return result;
+}
+
+// 按加载的packets从码流中重新生成STAP-A包的负载
+static int index_read_aggregates(struct H264Index* index,
+                                 const char* file_name) {
+    struct H264Reader reader;
+    if (h264_reader_open(&reader, file_name) < 0) {
+        return -1;
+    }
+    index->aggregates.clear();
+    int result = 0;
+    for (const struct H264IndexPacket& packet : index->packets) {
+        if (!h264_index_is_aggregate(packet)) {
+            continue;
+        }
+        size_t start = index->aggregates.size();
+        if (packet.offset != start ||
+            packet.nalu + packet.fu_header > index->nalus.size()) {
+            result = -1;
+            break;
+        }
+        for (uint32_t k = 0; k < packet.fu_header; ++k) {
+            const struct H264IndexNalu& nalu = index->nalus[packet.nalu + k];
+            h264_stap_a_append(&index->aggregates, start,
+                               reader.data + nalu.offset, nalu.size);
+        }
+        if (index->aggregates.size() - start != packet.size ||
+            index->aggregates[start] != packet.fu_indicator) {
+            result = -1;
+            break;
+        }
+    }
+    h264_reader_close(&reader);
+    return result;
+}
+
+// 加载或建立索引，不持有全局锁
+static std::shared_ptr<const struct H264Index>
+index_create(const char* file_name, const struct stat& st, uint32_t frame_rate,
+             bool persist) {
+    std::shared_ptr<struct H264Index> owner = std::make_shared<H264Index>();
+    struct H264Index* index = owner.get();
+    std::string index_file_name = std::string(file_name) + H264_INDEX_SUFFIX;
+    if (h264_index_load(index, index_file_name.c_str()) == 0 &&
+        index->file_size == (uint64_t) st.st_size &&
+        index->file_mtime == st.st_mtime && index->mtu == RTP_MAX_PKT_SIZE &&
+        index->frame_rate == frame_rate && index->frame_rate_num > 0 &&
+        index->frame_rate_den > 0 &&
+        index_read_aggregates(index, file_name) == 0) {
+        index->file_name = file_name;
+        if (index_read_parameter_sets(index, file_name) < 0) {
+            index->sps.clear();
+            index->pps.clear();
+        }
+        printf("load h264 index: %s\n", index_file_name.c_str());
+    }
+    else {
+        if (h264_index_build(index, file_name, RTP_MAX_PKT_SIZE, frame_rate) <
+            0) {
+            return nullptr;
+        }
+        index->file_mtime = st.st_mtime;
+        printf("build h264 index: %s, %zu nalus, %zu packets, %zu frames, "
+               "%.3f fps\n",
+               file_name, index->nalus.size(), index->packets.size(),
+               index->frames.size(),
+               (double) index->frame_rate_num / index->frame_rate_den);
+        if (persist && h264_index_save(index, index_file_name.c_str()) < 0) {
+            printf("failed to save h264 index: %s\n",
+                   index_file_name.c_str());
+        }
+    }
+    return owner;
+}
+
+std::shared_ptr<const struct H264Index>
+h264_index_get(const char* file_name, uint32_t frame_rate, bool persist) {
+    struct stat st;
+    if (stat(file_name, &st) < 0) {
+        return nullptr;
+    }
+    std::promise<std::shared_ptr<const struct H264Index>> promise;
+    std::shared_future<std::shared_ptr<const struct H264Index>> pending;
+    uint64_t build_id = 0;
+    {
+        std::lock_guard<std::mutex> lock(h264_indexes_mutex);
+        auto it = h264_indexes.find(file_name);
+        if (it != h264_indexes.end() &&
+            it->second.file_size == (uint64_t) st.st_size &&
+            it->second.file_mtime == st.st_mtime &&
+            it->second.frame_rate == frame_rate) {
+            pending = it->second.index;
+        }
+        else {
+            // 文件被替换时覆盖旧项，正在播放的源还持有旧索引的引用
+            build_id = ++h264_index_builds;
+            struct H264IndexEntry& entry = h264_indexes[file_name];
+            entry.file_size = st.st_size;
+            entry.file_mtime = st.st_mtime;
+            entry.frame_rate = frame_rate;
+            entry.build_id = build_id;
+            entry.index = promise.get_future().share();
+        }
+    }
+    if (pending.valid()) {
+        // 同一文件同时被多个线程请求时只建一次索引，其余的在锁外等它建完
+        return pending.get();
+    }
+
+    std::shared_ptr<const struct H264Index> index =
+            index_create(file_name, st, frame_rate, persist);
+    if (!index) {
+        // 失败的结果不缓存，下次请求重新建立
+        std::lock_guard<std::mutex> lock(h264_indexes_mutex);
+        auto it = h264_indexes.find(file_name);
+        if (it != h264_indexes.end() && it->second.build_id == build_id) {
+            h264_indexes.erase(it);
+        }
+    }
+    promise.set_value(index);
+    return index;
+}
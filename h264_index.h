@@ -0,0 +1,163 @@
+#ifndef RTSPSERVER_H264_INDEX_H
+#define RTSPSERVER_H264_INDEX_H
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "rtp.h"
+
+#define H264_INDEX_MAGIC "H264IDX"
+#define H264_INDEX_VERSION 5
+// 索引旁路文件名 = 码流文件名 + 后缀
+#define H264_INDEX_SUFFIX ".idx"
+
+#define H264_CLOCK_RATE 90000
+#define H264_DEFAULT_FRAME_RATE 25
+
+#define H264_INDEX_FRAME_KEY 0x01 // 帧中包含IDR
+
+#define H264_NALU_TYPE_STAP_A 24
+#define H264_NALU_TYPE_FU_A 28
+// STAP-A包中每个NALU前的两字节长度
+#define H264_STAP_A_LENGTH_SIZE 2
+// 一个STAP-A包最多聚合的NALU数，包中记录的个数是一个字节
+#define H264_STAP_A_MAX_NALUS 255
+
+/*
+ * 帧和NALU的时间戳都是从文件开头算起的90kHz位置，用64位不会回绕，
+ * 写RTP头时才截成32位
+ */
+struct H264IndexNalu {
+    uint64_t offset; // NALU第一个字节在文件中的偏移（不含起始码）
+    uint64_t timestamp; // 90kHz的显示时间戳
+    uint32_t size;
+    uint8_t type;
+    uint8_t reserved[3];
+};
+
+/*
+ * 一个RTP包的负载，按fu_indicator的类型分三种：
+ * - 0：单NALU包，负载就是文件中的[offset, offset + size)
+ * - FU-A：负载为FU indicator、FU header加上文件中的[offset, offset + size)
+ * - STAP-A：同一帧中连续的fu_header个NALU（从nalu起）聚合成的包，负载
+ *   是聚合负载（索引的aggregates）中的[offset, offset + size)，已经包含
+ *   STAP-A头，fu_indicator是它的拷贝
+ */
+struct H264IndexPacket {
+    uint64_t offset;
+    uint16_t size;
+    uint8_t fu_indicator;
+    uint8_t fu_header;
+    uint32_t nalu; // 所属NALU在nalus中的下标
+};
+
+// FU-A包的负载前有FU indicator和FU header两个字节，其他包没有
+inline uint32_t h264_index_prefix_size(const struct H264IndexPacket& packet) {
+    return (uint32_t) ((packet.fu_indicator & 0x1F) == H264_NALU_TYPE_FU_A)
+           << 1;
+}
+
+// 负载在聚合负载中而不是文件中
+inline bool h264_index_is_aggregate(const struct H264IndexPacket& packet) {
+    return (packet.fu_indicator & 0x1F) == H264_NALU_TYPE_STAP_A;
+}
+
+/*
+ * 在out写出packet的RTP头和负载前缀，返回两者的长度。header是网络字节序
+ * 的RTP头模板，last为true时是帧的最后一个包，置M位（RFC 6184 5.1）。
+ * 单NALU包和STAP-A包也写前缀的两个字节但不计入长度，所以三种包都走
+ * 同一段没有分支的代码；out至少要有RTP_HEADER_SIZE + 2字节
+ */
+inline uint32_t h264_index_packet_header(uint8_t* out, const uint8_t* header,
+                                         const struct H264IndexPacket& packet,
+                                         uint16_t seq, uint32_t timestamp,
+                                         bool last) {
+    memcpy(out, header, RTP_HEADER_SIZE);
+    rtp_header_stamp(out, seq, timestamp);
+    out[1] |= last ? RTP_MARKER : 0;
+    out[RTP_HEADER_SIZE] = packet.fu_indicator;
+    out[RTP_HEADER_SIZE + 1] = packet.fu_header;
+    return RTP_HEADER_SIZE + h264_index_prefix_size(packet);
+}
+
+/*
+ * 共用一个时间戳一起发送的一组NALU，即一个访问单元：前导的SPS/PPS/SEI
+ * 等加一帧图像的所有slice。最后一个包带RTP的M位
+ */
+struct H264IndexFrame {
+    uint32_t first_nalu;
+    uint32_t nalu_count;
+    uint32_t first_packet;
+    uint32_t packet_count;
+    uint64_t timestamp;
+    uint32_t flags;
+    uint32_t reserved;
+};
+
+struct H264Index {
+    std::string file_name;
+    uint64_t file_size;
+    int64_t file_mtime;
+    uint32_t mtu; // 单个RTP包的最大负载
+    uint32_t frame_rate; // 建索引时指定的帧率，0表示取自SPS
+    // 实际使用的帧率 = frame_rate_num / frame_rate_den，
+    // 第k帧的时间戳 = k * 90000 * frame_rate_den / frame_rate_num
+    uint32_t frame_rate_num;
+    uint32_t frame_rate_den;
+
+    std::vector<struct H264IndexNalu> nalus;
+    std::vector<struct H264IndexPacket> packets;
+    std::vector<struct H264IndexFrame> frames;
+    // STAP-A包的负载，由nalus和码流生成，不写入旁路文件
+    std::vector<uint8_t> aggregates;
+    // IDR帧在frames中的下标，按时间戳递增，跳转时二分查找。由frames
+    // 生成，不写入旁路文件；IDR帧的文件偏移是它第一个NALU的offset
+    std::vector<uint32_t> keyframes;
+
+    // 第一个SPS和PPS（不含起始码），用于SDP的sprop-parameter-sets。
+    // 不写入旁路文件，加载索引后从码流中读取，没有时为空
+    std::string sps;
+    std::string pps;
+};
+
+/*
+ * 取得file_name的索引：先查进程内缓存，再尝试加载与文件大小、修改时间、
+ * MTU和帧率都匹配的旁路文件，都没有时扫描码流建立索引，persist为true时
+ * 把新建的索引写到旁路文件。同一文件的后续会话直接复用缓存，失败返回nullptr。
+ * frame_rate为0时使用第一个SPS的VUI中的帧率，没有时为H264_DEFAULT_FRAME_RATE。
+ * 文件被替换后缓存换成新的索引，旧索引在最后一个引用放开时释放
+ */
+std::shared_ptr<const struct H264Index>
+h264_index_get(const char* file_name, uint32_t frame_rate, bool persist);
+
+/*
+ * 按mtu把一个NALU规划成RTP包追加到packets。offset是NALU第一个字节的
+ * 位置（包的offset以它为基准），nalu_pos填入每个包的nalu。
+ * mtu为RTP_MAX_PKT_SIZE时使用按它编译的特化版本
+ */
+void h264_index_packetize(const uint8_t* nalu, uint32_t size,
+                          uint64_t offset, uint32_t nalu_pos, uint32_t mtu,
+                          std::vector<struct H264IndexPacket>* packets);
+
+/*
+ * 把一个NALU加入out中从start开始的STAP-A负载，负载为空（start等于
+ * out的大小）时先写STAP-A头。头的F位取所有NALU的或，NRI取最大值
+ */
+void h264_stap_a_append(std::vector<uint8_t>* out, size_t start,
+                        const uint8_t* nalu, uint32_t size);
+
+/*
+ * 时间戳不晚于timestamp的最近的IDR帧在frames中的下标，O(log n)。
+ * timestamp在第一个IDR帧之前时返回第一个IDR帧，没有IDR帧时返回0
+ */
+uint32_t h264_index_seek(const struct H264Index* index, uint64_t timestamp);
+
+int h264_index_build(struct H264Index* index, const char* file_name,
+                     uint32_t mtu, uint32_t frame_rate);
+int h264_index_load(struct H264Index* index, const char* index_file_name);
+int h264_index_save(const struct H264Index* index,
+                    const char* index_file_name);
+
+#endif
@@ -0,0 +1,184 @@
+#include "h264_reader.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define H264_READER_X86 1
+#endif
+
+/*
+ * 标量实现：每次检查p[2]，p[2] > 1时p、p+1、p+2开始都不可能是起始码，
+ * 直接跳过3个字节；p[2] == 1时只有p开始可能是起始码
+ */
+static const uint8_t* find_start_code_scalar(const uint8_t* p,
+                                             const uint8_t* end) {
+    while (p + 3 <= end) {
+        if (p[2] > 1) {
+            p += 3;
+        }
+        else if (p[2] == 1) {
+            if (p[0] == 0 && p[1] == 0) {
+                return p;
+            }
+            p += 3;
+        }
+        else {
+            ++p;
+        }
+    }
+    return nullptr;
+}
+
+#ifdef H264_READER_X86
+// 一次比较16个位置：p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1
+__attribute__((target("sse2"))) static const uint8_t* find_start_code_sse2(
+        const uint8_t* p, const uint8_t* end) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    while (p + 18 <= end) {
+        __m128i c = _mm_loadu_si128((const __m128i*) (p + 2));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(c, one));
+        if (mask) {
+            __m128i a = _mm_loadu_si128((const __m128i*) p);
+            __m128i b = _mm_loadu_si128((const __m128i*) (p + 1));
+            mask &= _mm_movemask_epi8(_mm_cmpeq_epi8(a, zero)) &
+                    _mm_movemask_epi8(_mm_cmpeq_epi8(b, zero));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+        p += 16;
+    }
+    return find_start_code_scalar(p, end);
+}
+
+__attribute__((target("avx2"))) static const uint8_t* find_start_code_avx2(
+        const uint8_t* p, const uint8_t* end) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    while (p + 34 <= end) {
+        __m256i c = _mm256_loadu_si256((const __m256i*) (p + 2));
+        uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(c, one));
+        if (mask) {
+            __m256i a = _mm256_loadu_si256((const __m256i*) p);
+            __m256i b = _mm256_loadu_si256((const __m256i*) (p + 1));
+            mask &= (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(a, zero)) &
+                    (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(b, zero));
+            if (mask) {
+                return p + __builtin_ctz(mask);
+            }
+        }
+        p += 32;
+    }
+    return find_start_code_sse2(p, end);
+}
+#endif
+
+typedef const uint8_t* (*FindStartCodeFunc)(const uint8_t* p,
+                                            const uint8_t* end);
+
+static FindStartCodeFunc select_find_start_code() {
+#ifdef H264_READER_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return find_start_code_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        return find_start_code_sse2;
+    }
+#endif
+    return find_start_code_scalar;
+}
+
+static const FindStartCodeFunc find_start_code_impl = select_find_start_code();
+
+const uint8_t* find_next_start_code(const uint8_t* buffer, size_t len) {
+    return find_start_code_impl(buffer, buffer + len);
+}
+
+int h264_reader_open(struct H264Reader* reader, const char* file_name) {
+    reader->fd = -1;
+    reader->data = nullptr;
+    reader->size = 0;
+    reader->pos = 0;
+
+    int fd = open(file_name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+    void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    reader->fd = fd;
+    reader->data = (const uint8_t*) data;
+    reader->size = st.st_size;
+    return 0;
+}
+
+void h264_reader_close(struct H264Reader* reader) {
+    if (reader->data) {
+        munmap((void*) reader->data, reader->size);
+        reader->data = nullptr;
+    }
+    if (reader->fd >= 0) {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+}
+
+int h264_reader_next(struct H264Reader* reader, struct H264Nalu* nalu) {
+    const uint8_t* end = reader->data + reader->size;
+    while (reader->pos < reader->size) {
+        const uint8_t* start = find_next_start_code(
+                reader->data + reader->pos, reader->size - reader->pos);
+        if (!start) {
+            reader->pos = reader->size;
+            return -1;
+        }
+        const uint8_t* nalu_begin = start + 3;
+        const uint8_t* next = find_next_start_code(nalu_begin, end - nalu_begin);
+        const uint8_t* nalu_end = next ? next : end;
+        reader->pos = nalu_end - reader->data;
+        // 四字节起始码多出的0和trailing_zero_8bits都不属于NALU
+        while (nalu_end > nalu_begin && nalu_end[-1] == 0) {
+            --nalu_end;
+        }
+        if (nalu_end == nalu_begin) {
+            continue;
+        }
+        nalu->data = nalu_begin;
+        nalu->size = nalu_end - nalu_begin;
+        nalu->type = nalu_begin[0] & 0x1F;
+        nalu->offset = nalu_begin - reader->data;
+        return 0;
+    }
+    return -1;
+}
+
+void h264_reader_seek(struct H264Reader* reader, uint64_t nalu_offset) {
+    // 回退到起始码00 00 01的位置
+    uint64_t pos = nalu_offset >= 3 ? nalu_offset - 3 : 0;
+    reader->pos = pos < reader->size ? pos : reader->size;
+}
+
+bool h264_nalu_starts_frame(const uint8_t* nalu, uint32_t size) {
+    uint8_t type = nalu[0] & 0x1F;
+    if (h264_nalu_is_vcl(type)) {
+        return size > 1 && (nalu[1] & 0x80);
+    }
+    return (type >= H264_NALU_TYPE_SEI && type <= H264_NALU_TYPE_AUD) ||
+           (type >= 14 && type <= 18);
+}
@@ -0,0 +1,56 @@
+#ifndef RTSPSERVER_H264_READER_H
+#define RTSPSERVER_H264_READER_H
+
+#include <cstddef>
+#include <cstdint>
+
+#define H264_NALU_TYPE_SLICE 1
+#define H264_NALU_TYPE_IDR 5
+#define H264_NALU_TYPE_SEI 6
+#define H264_NALU_TYPE_SPS 7
+#define H264_NALU_TYPE_PPS 8
+#define H264_NALU_TYPE_AUD 9
+
+// 指向映射文件内部的一个NALU，不含起始码，不拷贝数据
+struct H264Nalu {
+    const uint8_t* data;
+    uint32_t size;
+    uint8_t type;
+    uint64_t offset; // NALU第一个字节在文件中的偏移
+};
+
+// 基于mmap的Annex-B码流读取器
+struct H264Reader {
+    int fd;
+    const uint8_t* data;
+    size_t size;
+    size_t pos; // 下一个起始码的搜索位置
+};
+
+int h264_reader_open(struct H264Reader* reader, const char* file_name);
+void h264_reader_close(struct H264Reader* reader);
+// 取出下一个NALU，文件中最后一个NALU延伸到文件末尾，读完返回-1
+int h264_reader_next(struct H264Reader* reader, struct H264Nalu* nalu);
+// 定位到偏移为nalu_offset的NALU（H264Nalu::offset），下次next返回该NALU
+void h264_reader_seek(struct H264Reader* reader, uint64_t nalu_offset);
+
+// 图像NALU（非IDR和IDR的slice）
+inline bool h264_nalu_is_vcl(uint8_t type) {
+    return type >= H264_NALU_TYPE_SLICE && type <= H264_NALU_TYPE_IDR;
+}
+
+/*
+ * 访问单元（一帧图像）中已有图像NALU时，nalu是否开始下一个访问单元
+ * （H.264 7.4.1.2.3）：first_mb_in_slice为0的slice，或者AUD、SEI、
+ * SPS、PPS和14~18类NALU。first_mb_in_slice是slice头的第一个ue(v)，
+ * 为0时编码为一个1位，即NALU头之后第一个字节的最高位
+ */
+bool h264_nalu_starts_frame(const uint8_t* nalu, uint32_t size);
+
+/*
+ * 在[buffer, buffer + len)中查找第一个00 00 01，返回指向第一个00的指针，
+ * 找不到返回nullptr。x86上按CPU能力使用AVX2/SSE2，其他平台使用标量实现
+ */
+const uint8_t* find_next_start_code(const uint8_t* buffer, size_t len);
+
+#endif
@@ -0,0 +1,185 @@
+#include "h264_sps.h"
+
+#include <cstring>
+
+#define SPS_RBSP_MAX_SIZE 1024
+
+struct BitReader {
+    const uint8_t* data;
+    uint32_t size; // 字节数
+    uint32_t pos; // 已读取的位数
+    bool overflow;
+};
+
+static uint32_t read_bits(struct BitReader* reader, int n) {
+    uint32_t value = 0;
+    for (int i = 0; i < n; ++i) {
+        if (reader->pos >= reader->size * 8) {
+            reader->overflow = true;
+            return 0;
+        }
+        uint8_t byte = reader->data[reader->pos >> 3];
+        value = (value << 1) | ((byte >> (7 - (reader->pos & 7))) & 1);
+        ++reader->pos;
+    }
+    return value;
+}
+
+// 无符号指数哥伦布码ue(v)
+static uint32_t read_ue(struct BitReader* reader) {
+    int leading_zeros = 0;
+    while (read_bits(reader, 1) == 0) {
+        if (reader->overflow || ++leading_zeros > 31) {
+            reader->overflow = true;
+            return 0;
+        }
+    }
+    return ((1u << leading_zeros) - 1) + read_bits(reader, leading_zeros);
+}
+
+// 有符号指数哥伦布码se(v)
+static int32_t read_se(struct BitReader* reader) {
+    uint32_t value = read_ue(reader);
+    if (value & 1) {
+        return (int32_t) ((value + 1) / 2);
+    }
+    return -(int32_t) (value / 2);
+}
+
+static void skip_scaling_list(struct BitReader* reader, int size) {
+    int32_t last_scale = 8, next_scale = 8;
+    for (int i = 0; i < size; ++i) {
+        if (next_scale != 0) {
+            int32_t delta_scale = read_se(reader);
+            next_scale = (last_scale + delta_scale + 256) % 256;
+        }
+        last_scale = next_scale == 0 ? last_scale : next_scale;
+    }
+}
+
+int h264_sps_parse(const uint8_t* nalu, uint32_t size, struct H264Sps* sps) {
+    // 去掉防竞争字节00 00 03中的03得到RBSP
+    uint8_t rbsp[SPS_RBSP_MAX_SIZE];
+    uint32_t rbsp_size = 0;
+    int zeros = 0;
+    for (uint32_t i = 1; i < size && rbsp_size < SPS_RBSP_MAX_SIZE; ++i) {
+        if (zeros >= 2 && nalu[i] == 0x03) {
+            zeros = 0;
+            continue;
+        }
+        zeros = nalu[i] == 0 ? zeros + 1 : 0;
+        rbsp[rbsp_size++] = nalu[i];
+    }
+
+    bzero(sps, sizeof(*sps));
+    if (size < 4 || (nalu[0] & 0x1F) != 7) {
+        return -1;
+    }
+    struct BitReader reader = {rbsp, rbsp_size, 0, false};
+    sps->profile_idc = read_bits(&reader, 8);
+    sps->constraint_flags = read_bits(&reader, 8);
+    sps->level_idc = read_bits(&reader, 8);
+    read_ue(&reader); // seq_parameter_set_id
+
+    uint32_t chroma_format_idc = 1;
+    uint8_t profile = sps->profile_idc;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 ||
+        profile == 44 || profile == 83 || profile == 86 || profile == 118 ||
+        profile == 128 || profile == 138 || profile == 139 || profile == 134 ||
+        profile == 135) {
+        chroma_format_idc = read_ue(&reader);
+        if (chroma_format_idc == 3) {
+            read_bits(&reader, 1); // separate_colour_plane_flag
+        }
+        read_ue(&reader); // bit_depth_luma_minus8
+        read_ue(&reader); // bit_depth_chroma_minus8
+        read_bits(&reader, 1); // qpprime_y_zero_transform_bypass_flag
+        if (read_bits(&reader, 1)) {
+            // seq_scaling_matrix_present_flag
+            int count = chroma_format_idc != 3 ? 8 : 12;
+            for (int i = 0; i < count; ++i) {
+                if (read_bits(&reader, 1)) {
+                    skip_scaling_list(&reader, i < 6 ? 16 : 64);
+                }
+            }
+        }
+    }
+    read_ue(&reader); // log2_max_frame_num_minus4
+    uint32_t pic_order_cnt_type = read_ue(&reader);
+    if (pic_order_cnt_type == 0) {
+        read_ue(&reader); // log2_max_pic_order_cnt_lsb_minus4
+    }
+    else if (pic_order_cnt_type == 1) {
+        read_bits(&reader, 1); // delta_pic_order_always_zero_flag
+        read_se(&reader); // offset_for_non_ref_pic
+        read_se(&reader); // offset_for_top_to_bottom_field
+        uint32_t cycle = read_ue(&reader);
+        for (uint32_t i = 0; i < cycle && !reader.overflow; ++i) {
+            read_se(&reader);
+        }
+    }
+    read_ue(&reader); // max_num_ref_frames
+    read_bits(&reader, 1); // gaps_in_frame_num_value_allowed_flag
+    uint32_t pic_width_in_mbs = read_ue(&reader) + 1;
+    uint32_t pic_height_in_map_units = read_ue(&reader) + 1;
+    uint32_t frame_mbs_only_flag = read_bits(&reader, 1);
+    if (!frame_mbs_only_flag) {
+        read_bits(&reader, 1); // mb_adaptive_frame_field_flag
+    }
+    read_bits(&reader, 1); // direct_8x8_inference_flag
+    uint32_t crop_left = 0, crop_right = 0, crop_top = 0, crop_bottom = 0;
+    if (read_bits(&reader, 1)) {
+        crop_left = read_ue(&reader);
+        crop_right = read_ue(&reader);
+        crop_top = read_ue(&reader);
+        crop_bottom = read_ue(&reader);
+    }
+    uint32_t crop_unit_x =
+            chroma_format_idc == 0 || chroma_format_idc == 3 ? 1 : 2;
+    uint32_t crop_unit_y = (chroma_format_idc == 1 ? 2 : 1) *
+                           (2 - frame_mbs_only_flag);
+    sps->width = pic_width_in_mbs * 16 - crop_unit_x * (crop_left + crop_right);
+    sps->height = (2 - frame_mbs_only_flag) * pic_height_in_map_units * 16 -
+                  crop_unit_y * (crop_top + crop_bottom);
+    if (reader.overflow) {
+        return -1;
+    }
+
+    if (read_bits(&reader, 1)) {
+        // vui_parameters_present_flag
+        if (read_bits(&reader, 1)) {
+            // aspect_ratio_info_present_flag
+            if (read_bits(&reader, 8) == 255) {
+                read_bits(&reader, 16); // sar_width
+                read_bits(&reader, 16); // sar_height
+            }
+        }
+        if (read_bits(&reader, 1)) {
+            read_bits(&reader, 1); // overscan_appropriate_flag
+        }
+        if (read_bits(&reader, 1)) {
+            // video_signal_type_present_flag
+            read_bits(&reader, 3); // video_format
+            read_bits(&reader, 1); // video_full_range_flag
+            if (read_bits(&reader, 1)) {
+                read_bits(&reader, 24); // colour_primaries等3个字段
+            }
+        }
+        if (read_bits(&reader, 1)) {
+            // chroma_loc_info_present_flag
+            read_ue(&reader);
+            read_ue(&reader);
+        }
+        if (read_bits(&reader, 1)) {
+            // timing_info_present_flag
+            sps->num_units_in_tick = read_bits(&reader, 32);
+            sps->time_scale = read_bits(&reader, 32);
+            sps->fixed_frame_rate = read_bits(&reader, 1);
+            sps->timing_info_present = !reader.overflow &&
+                                       sps->num_units_in_tick > 0 &&
+                                       sps->time_scale > 0;
+        }
+    }
+    // VUI不完整时只是没有帧率信息，前面的字段仍然有效
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef RTSPSERVER_H264_SPS_H
+#define RTSPSERVER_H264_SPS_H
+
+#include <cstdint>
+
+// SPS中推流需要用到的字段
+struct H264Sps {
+    uint8_t profile_idc;
+    uint8_t constraint_flags; // constraint_set0_flag ~ constraint_set5_flag
+    uint8_t level_idc;
+    uint32_t width;
+    uint32_t height;
+
+    // VUI中的timing_info，帧率 = time_scale / (2 * num_units_in_tick)
+    bool timing_info_present;
+    uint32_t num_units_in_tick;
+    uint32_t time_scale;
+    bool fixed_frame_rate;
+};
+
+// 解析一个SPS NALU（含NALU头，不含起始码），失败返回-1
+int h264_sps_parse(const uint8_t* nalu, uint32_t size, struct H264Sps* sps);
+
+#endif
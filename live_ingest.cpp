@@ -0,0 +1,653 @@
+#include "live_ingest.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include "buffer_pool.h"
+#include "h264_reader.h"
+#include "scheduler.h"
+
+#define LIVE_RING_MASK (LIVE_RING_FRAMES - 1)
+// 每次read的大小，已处理的数据超过这么多时才从输入缓冲中移走
+#define LIVE_READ_SIZE 65536
+#define LIVE_UDP_RCVBUF (4 * 1024 * 1024)
+
+/*
+ * 环中的一帧。seq为2n+2表示存放着第n帧，奇数表示正在写入。帧的数据在
+ * 字节环的[data_pos, data_pos + size)（按LIVE_RING_BYTES取模），字段都用
+ * relaxed原子读写，由seq保证一致
+ */
+struct LiveSlot {
+    std::atomic<uint64_t> seq;
+    std::atomic<uint64_t> data_pos;
+    std::atomic<uint64_t> capture_ns;
+    std::atomic<uint32_t> size;
+    std::atomic<uint32_t> timestamp;
+    std::atomic<uint32_t> flags;
+};
+
+struct LiveIngest {
+    std::string input;
+    int fd;
+    bool fifo;
+    uint64_t latency_ns;
+    pthread_t thread;
+
+    uint8_t* ring;
+    struct LiveSlot slots[LIVE_RING_FRAMES];
+    // 已发布的帧数，最新IDR帧的序号加1（0表示还没有）
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint64_t> key_head;
+    // 正在写入的帧的结束位置，字节环中比它早LIVE_RING_BYTES以上的数据
+    // 都可能已被覆盖
+    std::atomic<uint64_t> reserve_pos;
+    std::atomic<bool> ended;
+    // 各消费者线程的eventfd，-1表示空位
+    std::atomic<int> wake_fds[LIVE_MAX_READERS];
+    // 最近的参数集，读线程写，DESCRIBE时读
+    std::mutex parameter_mutex;
+    std::string sps;
+    std::string pps;
+
+    // 以下只有读线程使用
+    alignas(64) uint64_t write_pos;
+    uint32_t last_timestamp;
+    uint64_t read_ns; // 最近一次读到数据的时间
+    // 读入还没有处理完的数据；当前NALU第一个字节的位置，-1表示还没有
+    // 遇到起始码；下一次查找起始码的位置
+    std::vector<uint8_t> buffer;
+    int64_t nalu_begin;
+    size_t scan;
+    // 正在组装的帧，格式同LiveFrame::data；帧中最后一个单元的位置
+    std::vector<uint8_t> frame;
+    size_t frame_unit;
+    uint32_t frame_flags;
+    bool frame_oversize;
+    bool frame_vcl; // 帧中已有图像NALU
+};
+
+// 每个工作线程一个，消费者关闭后不关闭：读线程可能还拿着旧的值
+static thread_local int thread_wake_fd = -1;
+
+static void ring_write(struct LiveIngest* ingest, uint64_t pos,
+                       const uint8_t* data, uint32_t size) {
+    uint32_t offset = (uint32_t) (pos % LIVE_RING_BYTES);
+    uint32_t first = LIVE_RING_BYTES - offset;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(ingest->ring + offset, data, first);
+    memcpy(ingest->ring, data + first, size - first);
+}
+
+static void ring_read(const struct LiveIngest* ingest, uint64_t pos,
+                      uint8_t* data, uint32_t size) {
+    uint32_t offset = (uint32_t) (pos % LIVE_RING_BYTES);
+    uint32_t first = LIVE_RING_BYTES - offset;
+    if (first > size) {
+        first = size;
+    }
+    memcpy(data, ingest->ring + offset, first);
+    memcpy(data + first, ingest->ring, size - first);
+}
+
+static void live_ingest_wake(struct LiveIngest* ingest) {
+    uint64_t one = 1;
+    for (std::atomic<int>& wake_fd : ingest->wake_fds) {
+        int fd = wake_fd.load();
+        if (fd >= 0) {
+            while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+            }
+        }
+    }
+}
+
+/*
+ * 把组装好的帧写入环。写之前先声明要覆盖的字节和帧位置，消费者拷贝后
+ * 据此判断读到的数据是否完整
+ */
+static void live_ingest_publish(struct LiveIngest* ingest) {
+    uint64_t n = ingest->head.load(std::memory_order_relaxed);
+    uint32_t size = (uint32_t) ingest->frame.size();
+    uint64_t pos = ingest->write_pos;
+    struct LiveSlot* slot = &ingest->slots[n & LIVE_RING_MASK];
+    // 同一次读入的几帧时间戳相同，至少相差1保证递增
+    uint32_t timestamp = (uint32_t) (ingest->read_ns * H264_CLOCK_RATE /
+                                     1000000000ull);
+    if (n > 0 && (int32_t) (timestamp - ingest->last_timestamp) <= 0) {
+        timestamp = ingest->last_timestamp + 1;
+    }
+    ingest->last_timestamp = timestamp;
+
+    ingest->reserve_pos.store(pos + size, std::memory_order_relaxed);
+    slot->seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    ring_write(ingest, pos, ingest->frame.data(), size);
+    slot->data_pos.store(pos, std::memory_order_relaxed);
+    slot->capture_ns.store(ingest->read_ns, std::memory_order_relaxed);
+    slot->size.store(size, std::memory_order_relaxed);
+    slot->timestamp.store(timestamp, std::memory_order_relaxed);
+    slot->flags.store(ingest->frame_flags, std::memory_order_relaxed);
+    slot->seq.store(2 * n + 2, std::memory_order_release);
+    ingest->write_pos = pos + size;
+    if (ingest->frame_flags & H264_INDEX_FRAME_KEY) {
+        ingest->key_head.store(n + 1, std::memory_order_release);
+    }
+    // 与消费者登记eventfd之间是先写后读的两边，都用顺序一致
+    ingest->head.store(n + 1);
+    live_ingest_wake(ingest);
+}
+
+// 参数集通常每个GOP重复一次，内容不变时不加锁。比较时读的是只有
+// 本线程写的字符串，不需要锁
+static void live_ingest_set_parameter(struct LiveIngest* ingest,
+                                      uint8_t type, const uint8_t* data,
+                                      size_t size) {
+    std::string* target =
+            type == H264_NALU_TYPE_SPS ? &ingest->sps : &ingest->pps;
+    if (target->size() == size && memcmp(target->data(), data, size) == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(ingest->parameter_mutex);
+    target->assign((const char*) data, size);
+}
+
+static uint32_t read_length(const uint8_t* data) {
+    return ((uint32_t) data[0] << 24) | ((uint32_t) data[1] << 16) |
+           ((uint32_t) data[2] << 8) | data[3];
+}
+
+static void write_length(uint8_t* data, uint32_t size) {
+    data[0] = (uint8_t) (size >> 24);
+    data[1] = (uint8_t) (size >> 16);
+    data[2] = (uint8_t) (size >> 8);
+    data[3] = (uint8_t) size;
+}
+
+/*
+ * NALU能和帧中的上一个单元合成不超过RTP_MAX_PKT_SIZE的STAP-A负载时加入
+ * 那个单元并返回true：上一个单元是单个NALU时先把它改成STAP-A负载。
+ * 在这里聚合一次，所有消费者取出的帧都不用再拷贝
+ */
+static bool live_ingest_aggregate(struct LiveIngest* ingest,
+                                  const uint8_t* data, size_t size) {
+    std::vector<uint8_t>& frame = ingest->frame;
+    if (frame.empty()) {
+        return false;
+    }
+    size_t payload = ingest->frame_unit + 4;
+    uint32_t unit_size = read_length(&frame[ingest->frame_unit]);
+    size_t added = H264_STAP_A_LENGTH_SIZE + size;
+    if ((frame[payload] & 0x1F) == H264_NALU_TYPE_STAP_A) {
+        if (unit_size + added > RTP_MAX_PKT_SIZE) {
+            return false;
+        }
+    }
+    else {
+        if (1 + H264_STAP_A_LENGTH_SIZE + unit_size + added >
+            RTP_MAX_PKT_SIZE) {
+            return false;
+        }
+        // 上一个单元在帧的末尾，取出后原地写成STAP-A负载
+        uint8_t nalu[RTP_MAX_PKT_SIZE];
+        memcpy(nalu, &frame[payload], unit_size);
+        frame.resize(payload);
+        h264_stap_a_append(&frame, payload, nalu, unit_size);
+    }
+    h264_stap_a_append(&frame, payload, data, size);
+    write_length(&frame[ingest->frame_unit], frame.size() - payload);
+    return true;
+}
+
+// 结束正在组装的帧：有图像NALU时发布，然后清空
+static void live_ingest_end_frame(struct LiveIngest* ingest) {
+    if (!ingest->frame_vcl) {
+        return;
+    }
+    if (ingest->frame_oversize) {
+        printf("%s: frame larger than %d bytes dropped\n",
+               ingest->input.c_str(), LIVE_MAX_FRAME_SIZE);
+    }
+    else {
+        live_ingest_publish(ingest);
+    }
+    ingest->frame.clear();
+    ingest->frame_flags = 0;
+    ingest->frame_oversize = false;
+    ingest->frame_vcl = false;
+}
+
+/*
+ * 一个完整的NALU加入正在组装的帧。一帧可以分成多个slice，下一个访问
+ * 单元的第一个NALU到达时才结束上一帧
+ */
+static void live_ingest_add_nalu(struct LiveIngest* ingest,
+                                 const uint8_t* data, size_t size) {
+    // 四字节起始码多出的0和trailing_zero_8bits都不属于NALU
+    while (size > 0 && data[size - 1] == 0) {
+        --size;
+    }
+    if (size == 0) {
+        return;
+    }
+    uint8_t type = data[0] & 0x1F;
+    if (type == H264_NALU_TYPE_SPS || type == H264_NALU_TYPE_PPS) {
+        live_ingest_set_parameter(ingest, type, data, size);
+    }
+    if (h264_nalu_starts_frame(data, size)) {
+        live_ingest_end_frame(ingest);
+    }
+    std::vector<uint8_t>& frame = ingest->frame;
+    if (frame.size() + 4 + size > LIVE_MAX_FRAME_SIZE) {
+        ingest->frame_oversize = true;
+    }
+    else if (!live_ingest_aggregate(ingest, data, size)) {
+        ingest->frame_unit = frame.size();
+        frame.resize(frame.size() + 4);
+        write_length(&frame[ingest->frame_unit], size);
+        frame.insert(frame.end(), data, data + size);
+    }
+    if (type == H264_NALU_TYPE_IDR) {
+        ingest->frame_flags |= H264_INDEX_FRAME_KEY;
+    }
+    ingest->frame_vcl = ingest->frame_vcl || h264_nalu_is_vcl(type);
+}
+
+/*
+ * 把缓冲中两个起始码之间的NALU交给帧。flush时最后一个NALU延伸到缓冲
+ * 末尾，正在组装的帧也随之结束：写者如果在一帧中间停顿超过
+ * LIVE_FLUSH_IDLE_MS，这一帧会被截断，剩下的数据在下一个起始码之前都
+ * 被跳过，后面的slice成为单独的一帧
+ */
+static void live_ingest_parse(struct LiveIngest* ingest, bool flush) {
+    std::vector<uint8_t>& buffer = ingest->buffer;
+    const uint8_t* data = buffer.data();
+    size_t size = buffer.size();
+    const uint8_t* start;
+    while ((start = find_next_start_code(data + ingest->scan,
+                                         size - ingest->scan))) {
+        size_t pos = start - data;
+        if (ingest->nalu_begin >= 0) {
+            live_ingest_add_nalu(ingest, data + ingest->nalu_begin,
+                                 pos - ingest->nalu_begin);
+        }
+        ingest->nalu_begin = pos + 3;
+        ingest->scan = pos + 3;
+    }
+    // 起始码可能跨两次读入，最后两个字节下次重新查找
+    if (size >= 2 && ingest->scan < size - 2) {
+        ingest->scan = size - 2;
+    }
+    if (flush && ingest->nalu_begin >= 0 &&
+        size > (size_t) ingest->nalu_begin) {
+        live_ingest_add_nalu(ingest, data + ingest->nalu_begin,
+                             size - ingest->nalu_begin);
+        ingest->nalu_begin = -1;
+        ingest->scan = size;
+    }
+    if (flush) {
+        live_ingest_end_frame(ingest);
+    }
+
+    size_t consumed = ingest->nalu_begin >= 0 ? ingest->nalu_begin
+                                              : ingest->scan;
+    if (size - consumed > LIVE_MAX_FRAME_SIZE) {
+        printf("%s: no start code in %d bytes, data dropped\n",
+               ingest->input.c_str(), LIVE_MAX_FRAME_SIZE);
+        consumed = size;
+        ingest->nalu_begin = -1;
+        ingest->scan = size;
+    }
+    if (consumed >= LIVE_READ_SIZE || consumed == size) {
+        buffer.erase(buffer.begin(), buffer.begin() + consumed);
+        if (ingest->nalu_begin >= 0) {
+            ingest->nalu_begin -= consumed;
+        }
+        ingest->scan -= consumed;
+    }
+}
+
+// FIFO的写端都关闭后等待下一个写者
+static int live_ingest_reopen(struct LiveIngest* ingest) {
+    if (ingest->fd >= 0) {
+        close(ingest->fd);
+    }
+    ingest->fd = open(ingest->input.c_str(), O_RDONLY | O_CLOEXEC);
+    if (ingest->fd < 0) {
+        printf("failed to open %s: %s\n", ingest->input.c_str(),
+               strerror(errno));
+        return -1;
+    }
+    printf("%s: live input opened\n", ingest->input.c_str());
+    return 0;
+}
+
+static void* live_ingest_main(void* arg) {
+    struct LiveIngest* ingest = (struct LiveIngest*) arg;
+    if (ingest->fd < 0 && live_ingest_reopen(ingest) < 0) {
+        ingest->ended.store(true, std::memory_order_release);
+        live_ingest_wake(ingest);
+        return nullptr;
+    }
+    std::vector<uint8_t>& buffer = ingest->buffer;
+    while (true) {
+        // 还有没结束的NALU，或者帧的最后一个NALU已经结束但下一帧还没有
+        // 开始
+        bool pending = (ingest->nalu_begin >= 0 &&
+                        buffer.size() > (size_t) ingest->nalu_begin) ||
+                       ingest->frame_vcl;
+        struct pollfd pfd = {ingest->fd, POLLIN, 0};
+        int ready = poll(&pfd, 1, pending ? LIVE_FLUSH_IDLE_MS : -1);
+        if (ready < 0 && errno != EINTR) {
+            printf("%s: poll failed: %s\n", ingest->input.c_str(),
+                   strerror(errno));
+            break;
+        }
+        if (ready == 0) {
+            live_ingest_parse(ingest, true);
+            continue;
+        }
+        if (ready < 0) {
+            continue;
+        }
+        size_t size = buffer.size();
+        buffer.resize(size + LIVE_READ_SIZE);
+        ssize_t n = read(ingest->fd, buffer.data() + size, LIVE_READ_SIZE);
+        buffer.resize(size + (n > 0 ? n : 0));
+        if (n > 0) {
+            ingest->read_ns = scheduler_now_ns();
+            live_ingest_parse(ingest, false);
+            continue;
+        }
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            printf("%s: read failed: %s\n", ingest->input.c_str(),
+                   strerror(errno));
+            break;
+        }
+        live_ingest_parse(ingest, true);
+        if (!ingest->fifo || live_ingest_reopen(ingest) < 0) {
+            break;
+        }
+    }
+    printf("%s: live input ended\n", ingest->input.c_str());
+    ingest->ended.store(true, std::memory_order_release);
+    live_ingest_wake(ingest);
+    return nullptr;
+}
+
+// "udp://[ip]:port"，ip为空时接收所有地址，组播地址时加入组播组
+static int open_udp(const char* input) {
+    const char* addr = input + strlen("udp://");
+    const char* colon = strrchr(addr, ':');
+    char ip[INET_ADDRSTRLEN] = "0.0.0.0";
+    int port = colon ? atoi(colon + 1) : 0;
+    if (!colon || port <= 0 || port > 65535 ||
+        colon - addr >= (long) sizeof(ip)) {
+        printf("invalid live input %s\n", input);
+        return -1;
+    }
+    if (colon > addr) {
+        memcpy(ip, addr, colon - addr);
+        ip[colon - addr] = '\0';
+    }
+    struct sockaddr_in sin;
+    bzero(&sin, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &sin.sin_addr) != 1) {
+        printf("invalid live input %s\n", input);
+        return -1;
+    }
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    int on = 1;
+    int rcvbuf = LIVE_UDP_RCVBUF;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    if (bind(sockfd, (struct sockaddr*) &sin, sizeof(sin)) < 0) {
+        printf("failed to bind %s: %s\n", input, strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    if (IN_MULTICAST(ntohl(sin.sin_addr.s_addr))) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = sin.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq,
+                       sizeof(mreq)) < 0) {
+            printf("failed to join %s: %s\n", ip, strerror(errno));
+            close(sockfd);
+            return -1;
+        }
+    }
+    return sockfd;
+}
+
+struct LiveIngest* live_ingest_start(const char* input, uint32_t latency_ms) {
+    struct LiveIngest* ingest = new LiveIngest();
+    ingest->input = input;
+    ingest->fd = -1;
+    ingest->fifo = false;
+    ingest->latency_ns = latency_ms * 1000000ull;
+    ingest->nalu_begin = -1;
+    for (std::atomic<int>& wake_fd : ingest->wake_fds) {
+        wake_fd.store(-1);
+    }
+    if (strcmp(input, "-") == 0) {
+        ingest->fd = STDIN_FILENO;
+    }
+    else if (strncmp(input, "udp://", strlen("udp://")) == 0) {
+        ingest->fd = open_udp(input);
+        if (ingest->fd < 0) {
+            delete ingest;
+            return nullptr;
+        }
+    }
+    else {
+        // FIFO在读线程中打开，没有写者时open会阻塞
+        struct stat st;
+        if (stat(input, &st) < 0) {
+            printf("failed to open %s: %s\n", input, strerror(errno));
+            delete ingest;
+            return nullptr;
+        }
+        ingest->fifo = S_ISFIFO(st.st_mode);
+    }
+    ingest->ring = new uint8_t[LIVE_RING_BYTES];
+    if (pthread_create(&ingest->thread, nullptr, live_ingest_main, ingest) !=
+        0) {
+        printf("failed to start live input thread\n");
+        if (ingest->fd >= 0 && ingest->fd != STDIN_FILENO) {
+            close(ingest->fd);
+        }
+        delete[] ingest->ring;
+        delete ingest;
+        return nullptr;
+    }
+    pthread_detach(ingest->thread);
+    printf("live input: %s, latency budget %u ms\n", input, latency_ms);
+    return ingest;
+}
+
+int live_reader_open(struct LiveIngest* ingest, struct LiveReader* reader) {
+    if (thread_wake_fd < 0) {
+        thread_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (thread_wake_fd < 0) {
+            printf("failed to create eventfd: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    int slot = 0;
+    while (slot < LIVE_MAX_READERS) {
+        int expected = -1;
+        if (ingest->wake_fds[slot].compare_exchange_strong(expected,
+                                                           thread_wake_fd)) {
+            break;
+        }
+        ++slot;
+    }
+    if (slot == LIVE_MAX_READERS) {
+        printf("too many live readers\n");
+        return -1;
+    }
+    reader->ingest = ingest;
+    reader->wake_slot = slot;
+    reader->wake_fd = thread_wake_fd;
+    reader->dropped = 0;
+    // 登记之后发布的帧一定会唤醒这个线程
+    uint64_t head = ingest->head.load();
+    uint64_t key = ingest->key_head.load(std::memory_order_acquire);
+    if (key && head - (key - 1) <= LIVE_RING_FRAMES) {
+        reader->next = key - 1;
+        reader->need_key = false;
+    }
+    else {
+        reader->next = head;
+        reader->need_key = true;
+    }
+    return 0;
+}
+
+void live_reader_close(struct LiveReader* reader) {
+    reader->ingest->wake_fds[reader->wake_slot].store(-1);
+    reader->ingest = nullptr;
+}
+
+// 跳到最新的IDR帧，没有比next更新的IDR帧时返回false
+static bool live_reader_skip_to_key(struct LiveReader* reader) {
+    uint64_t key = reader->ingest->key_head.load(std::memory_order_acquire);
+    if (key == 0 || key - 1 <= reader->next) {
+        return false;
+    }
+    reader->dropped += (uint32_t) (key - 1 - reader->next);
+    reader->next = key - 1;
+    return true;
+}
+
+// 要读的帧已被覆盖：跳到最新的IDR帧，没有时跳到最新的帧并等待IDR帧
+static void live_reader_overrun(struct LiveReader* reader, uint64_t head) {
+    if (!live_reader_skip_to_key(reader)) {
+        reader->dropped += (uint32_t) (head - reader->next);
+        reader->next = head;
+        reader->need_key = true;
+    }
+}
+
+enum LiveReadResult live_reader_next(struct LiveReader* reader, uint64_t now,
+                                     struct LiveFrame* frame) {
+    struct LiveIngest* ingest = reader->ingest;
+    while (true) {
+        // 结束标志在最后一帧发布之后设置，看到结束后再确认一次head
+        bool ended = ingest->ended.load(std::memory_order_acquire);
+        uint64_t head = ingest->head.load(std::memory_order_acquire);
+        if (reader->next >= head) {
+            return ended ? LIVE_READ_END : LIVE_READ_EMPTY;
+        }
+        uint64_t n = reader->next;
+        struct LiveSlot* slot = &ingest->slots[n & LIVE_RING_MASK];
+        uint64_t seq = slot->seq.load(std::memory_order_acquire);
+        if (head - n > LIVE_RING_FRAMES || seq != 2 * n + 2) {
+            live_reader_overrun(reader, head);
+            continue;
+        }
+        uint64_t data_pos = slot->data_pos.load(std::memory_order_relaxed);
+        uint64_t capture_ns = slot->capture_ns.load(std::memory_order_relaxed);
+        uint32_t size = slot->size.load(std::memory_order_relaxed);
+        uint32_t timestamp = slot->timestamp.load(std::memory_order_relaxed);
+        uint32_t flags = slot->flags.load(std::memory_order_relaxed);
+        if (reader->need_key && !(flags & H264_INDEX_FRAME_KEY)) {
+            ++reader->dropped;
+            ++reader->next;
+            continue;
+        }
+        if (now > capture_ns + ingest->latency_ns &&
+            live_reader_skip_to_key(reader)) {
+            continue;
+        }
+
+        struct PoolBuffer* buffer = pool_buffer_alloc(size);
+        if (!buffer) {
+            ++reader->dropped;
+            ++reader->next;
+            reader->need_key = true;
+            continue;
+        }
+        ring_read(ingest, data_pos, buffer->data, size);
+        // 拷贝期间帧位置或字节被覆盖时数据不完整
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != seq ||
+            ingest->reserve_pos.load(std::memory_order_relaxed) - data_pos >
+                    LIVE_RING_BYTES) {
+            pool_buffer_unref(buffer);
+            live_reader_overrun(reader, ingest->head.load());
+            continue;
+        }
+        buffer->size = size;
+        frame->timestamp = timestamp;
+        frame->flags = flags;
+        frame->capture_ns = capture_ns;
+        frame->dropped = reader->dropped;
+        frame->data = buffer;
+        reader->dropped = 0;
+        reader->need_key = false;
+        ++reader->next;
+        return LIVE_READ_FRAME;
+    }
+}
+
+int live_ingest_parameter_sets(struct LiveIngest* ingest, std::string* sps,
+                               std::string* pps) {
+    std::lock_guard<std::mutex> lock(ingest->parameter_mutex);
+    if (ingest->sps.empty() || ingest->pps.empty()) {
+        return -1;
+    }
+    *sps = ingest->sps;
+    *pps = ingest->pps;
+    return 0;
+}
+
+void live_frame_packetize(const struct LiveFrame* frame, uint32_t mtu,
+                          std::vector<struct H264IndexPacket>* packets) {
+    const uint8_t* data = frame->data->data;
+    uint32_t size = frame->data->size;
+    uint32_t pos = 0;
+    uint32_t nalu_pos = 0;
+    packets->clear();
+    while (pos + 4 <= size) {
+        uint32_t unit_size = read_length(data + pos);
+        pos += 4;
+        if ((data[pos] & 0x1F) == H264_NALU_TYPE_STAP_A) {
+            struct H264IndexPacket packet;
+            bzero(&packet, sizeof(packet));
+            packet.offset = pos;
+            packet.size = unit_size;
+            packet.fu_indicator = data[pos];
+            packet.nalu = nalu_pos++;
+            packets->push_back(packet);
+        }
+        else {
+            h264_index_packetize(data + pos, unit_size, pos, nalu_pos++, mtu,
+                                 packets);
+        }
+        pos += unit_size;
+    }
+}
@@ -0,0 +1,101 @@
+#ifndef RTSPSERVER_LIVE_INGEST_H
+#define RTSPSERVER_LIVE_INGEST_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "h264_index.h"
+#include "worker.h"
+
+/*
+ * 直播输入：一个线程从标准输入、FIFO或UDP读取Annex-B码流，切成和索引
+ * 相同的帧（前导的非图像NALU加一帧图像的所有slice），写入一个单生产者
+ * 多消费者的环。每个工作线程的直播源是一个消费者，各自读取、打包和
+ * 发送，生产者不等待任何消费者：环满时覆盖最旧的帧，落后的消费者跳到
+ * 最新的IDR帧
+ */
+// 环中的帧数和字节数，帧数必须是2的幂
+#define LIVE_RING_FRAMES 1024
+#define LIVE_RING_BYTES (16 * 1024 * 1024)
+// 超过这个大小的帧直接丢弃，保证环中至少能放下几帧
+#define LIVE_MAX_FRAME_SIZE (LIVE_RING_BYTES / 4)
+// 每个工作线程最多一个消费者
+#define LIVE_MAX_READERS WORKER_MAX_COUNT
+/*
+ * 码流中NALU的结尾要等到下一个起始码才知道。编码器通常一次写出一帧，
+ * 输入空闲这么久之后把缓冲中最后一个NALU当作完整的，不用等下一帧
+ */
+#define LIVE_FLUSH_IDLE_MS 2
+#define LIVE_DEFAULT_LATENCY_MS 500
+
+struct LiveIngest;
+struct PoolBuffer;
+
+// 消费者取出的一帧
+struct LiveFrame {
+    uint32_t timestamp; // 90kHz，由到达时间换算
+    uint32_t flags; // H264_INDEX_FRAME_KEY
+    uint64_t capture_ns; // 帧的最后一个字节读入的时间，CLOCK_MONOTONIC
+    uint32_t dropped; // 这一帧之前跳过的帧数
+    /*
+     * 帧的单元，每个单元前是4字节大端的长度，没有起始码。单元是一个
+     * NALU，或者帧中连续几个小NALU按RTP_MAX_PKT_SIZE聚合成的STAP-A负载
+     */
+    struct PoolBuffer* data;
+};
+
+// 一个消费者，只在打开它的线程中使用
+struct LiveReader {
+    struct LiveIngest* ingest;
+    uint64_t next; // 下一个要读的帧序号
+    bool need_key; // 跳过了帧，IDR帧之前的帧都不发送
+    uint32_t dropped; // 跳过的帧数，随下一个取出的帧报告
+    int wake_slot;
+    int wake_fd; // 生产者发布新帧或输入结束时可读
+};
+
+enum LiveReadResult {
+    LIVE_READ_FRAME,
+    LIVE_READ_EMPTY,
+    LIVE_READ_END, // 输入已经结束，所有帧都已读完
+};
+
+/*
+ * 打开输入并启动读线程："-"为标准输入，"udp://[ip]:port"为UDP（ip是
+ * 组播地址时加入组播组），其余是FIFO或文件的路径，FIFO的写端关闭后
+ * 等待下一个写者。latency_ms是消费者允许落后的时间。失败返回nullptr
+ */
+struct LiveIngest* live_ingest_start(const char* input, uint32_t latency_ms);
+
+/*
+ * 在当前线程打开一个消费者，从环中最新的IDR帧开始读，没有时从下一个
+ * IDR帧开始。wake_fd是本线程共用的eventfd，由调用者注册到事件循环，
+ * 可读时读空后调用live_reader_next。失败返回-1
+ */
+int live_reader_open(struct LiveIngest* ingest, struct LiveReader* reader);
+void live_reader_close(struct LiveReader* reader);
+
+/*
+ * 取出下一帧，数据拷贝到新分配的缓冲中，调用者负责释放frame->data。
+ * 要读的帧已被覆盖，或者比now早了超过延迟预算而环中有更新的IDR帧时，
+ * 跳到最新的IDR帧
+ */
+enum LiveReadResult live_reader_next(struct LiveReader* reader, uint64_t now,
+                                     struct LiveFrame* frame);
+
+/*
+ * 输入中最近的SPS和PPS（不含起始码），用于SDP。还没有读到时返回-1。
+ * 读线程只在参数集变化时加锁更新
+ */
+int live_ingest_parameter_sets(struct LiveIngest* ingest, std::string* sps,
+                               std::string* pps);
+
+/*
+ * 按mtu规划frame的RTP包，包的offset相对于frame->data->data。STAP-A单元
+ * 整个是一个包，聚合负载就在帧中
+ */
+void live_frame_packetize(const struct LiveFrame* frame, uint32_t mtu,
+                          std::vector<struct H264IndexPacket>* packets);
+
+#endif
@@ -1,21 +1,75 @@
 #include <arpa/inet.h>
+#include <cerrno>
+#include <climits>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <ctime>
 #include <unistd.h>
 
 #include <string>
+#include <vector>
 
+#include "aac_index.h"
+#include "buffer_pool.h"
+#include "event_loop.h"
+#include "h264_index.h"
+#include "live_ingest.h"
+#include "media_source.h"
+#include "metrics.h"
+#include "metrics_http.h"
 #include "rtp.h"
+#include "rtp_batch.h"
+#include "rtp_pacing.h"
+#include "rtsp_parser.h"
+#include "rtsp_session.h"
+#include "scheduler.h"
+#include "worker.h"
 
 #define SERVER_PORT 8554
+// 独占模式下会话的RTP/RTCP端口对从这个范围分配，共享模式只用前两个。
+// 多个工作线程时按线程平均分成几段，每个线程只用自己的一段
 #define SERVER_RTP_PORT 55532
-#define SERVER_RTCP_PORT 55533
+#define SERVER_RTP_PORT_MAX 65535
+// 组播源只在这个工作线程上，保证每个组播组只有一个发送者
+#define MULTICAST_WORKER 0
+// handle_request的返回值，连接连同还没处理的请求交给其他工作线程
+#define RTSP_CLIENT_HANDOFF 1
 
 #define H264_FILE_NAME "/home/llz/CPP/data/test.h264"
+// SDP中SPS加PPS的最大字节数，更大时不写sprop-parameter-sets
+#define SDP_MAX_PARAMETER_SETS 512
+// 读缓冲和输出队列的上限。读缓冲从RTSP_READ_BUFFER_SIZE开始按需增长，
+// 输出队列由缓冲池中的片段组成，都不预先分配
 #define BUFFER_MAX_SIZE (1024 * 1024)
+#define RTSP_READ_BUFFER_SIZE 4096
+#define RTSP_OUTPUT_MIN_SEGMENTS 16
+// 一次sendmsg最多发送的片段数
+#define RTSP_OUTPUT_IOV_MAX 64
+// RTP over TCP的媒体数据最多占用的输出队列大小，剩余部分留给RTSP回复
+#define RTSP_RESPONSE_RESERVE (64 * 1024)
+#define RTSP_TCP_QUEUE_MAX_SIZE (BUFFER_MAX_SIZE - RTSP_RESPONSE_RESERVE)
+// 输出片段的内容：交织的RTP/RTCP数据，其中一帧的第一个片段另外标记，
+// 第一个片段发出一部分后标记清除，这一帧必须发完
+#define RTSP_OUTPUT_MEDIA 0x1
+#define RTSP_OUTPUT_FRAME_START 0x2
+
+static const char* h264_file_name = H264_FILE_NAME;
+// 打印每个请求、回复和开始播放的轨道。默认关闭：事件循环线程同步写
+// stdout，会话多时拖慢所有连接
+static bool verbose = false;
+
+// 每个工作线程初始化时用到的配置
+struct ServerConfig {
+    bool shared_udp;
+    int workers;
+    // 统计的HTTP端口，0表示不开启，只在第0个工作线程上监听
+    char metrics_ip[INET_ADDRSTRLEN];
+    int metrics_port;
+};
 
 static int create_tcp_socket() {
     int sockfd;
@@ -25,20 +79,8 @@ static int create_tcp_socket() {
         return -1;
     }
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    return sockfd;
-}
-
-static int create_udp_socket() {
-    int sockfd;
-    int on = 1;
-    
-    sockfd = socket(PF_INET, SOCK_DGRAM, 0);
-    if (sockfd < 0) {
-        return -1;
-    }
-    // 设置端口复用
-    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
-    
+    // 每个工作线程监听同一个端口，由内核把新连接分散到各个线程
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
     return sockfd;
 }
 
@@ -81,424 +123,1846 @@ static int handle_cmd_OPTIONS(char* result, int cseq) {
     sprintf(result,
             "RTSP/1.0 200 OK\r\n"
             "CSeq: %d\r\n"
-            "Public: OPTIONS, DESCRIBE, SETUP, Play\r\n"
+            "Public: OPTIONS, DESCRIBE, SETUP, PLAY, PAUSE, TEARDOWN, "
+            "GET_PARAMETER\r\n"
             "\r\n",
             cseq);
     return 0;
 }
 
-static inline int start_code_3(const char* buffer) {
-    if (buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 1) {
-        return 1;
+static std::string base64_encode(const std::string& data) {
+    static const char table[] =
+            "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= data.size(); i += 3) {
+        uint32_t v = ((uint8_t) data[i] << 16) | ((uint8_t) data[i + 1] << 8) |
+                     (uint8_t) data[i + 2];
+        out.push_back(table[v >> 18]);
+        out.push_back(table[(v >> 12) & 0x3F]);
+        out.push_back(table[(v >> 6) & 0x3F]);
+        out.push_back(table[v & 0x3F]);
     }
-    else {
-        return 0;
+    if (i < data.size()) {
+        uint32_t v = (uint8_t) data[i] << 16;
+        if (i + 1 < data.size()) {
+            v |= (uint8_t) data[i + 1] << 8;
+        }
+        out.push_back(table[v >> 18]);
+        out.push_back(table[(v >> 12) & 0x3F]);
+        out.push_back(i + 1 < data.size() ? table[(v >> 6) & 0x3F] : '=');
+        out.push_back('=');
     }
+    return out;
 }
 
-static inline int start_code_4(const char* buffer) {
-    if (buffer[0] == 0 && buffer[1] == 0 && buffer[2] == 0 && buffer[3] == 1) {
-        return 1;
-    }
-    else {
-        return 0;
+/*
+ * 视频的fmtp：FU-A和STAP-A需要packetization-mode=1；有参数集时带上
+ * profile-level-id和sprop-parameter-sets，客户端不用等带内的SPS/PPS
+ */
+static void describe_video_fmtp(char* fmtp, size_t size) {
+    std::string sps, pps;
+    if (media_source_parameter_sets(h264_file_name, &sps, &pps) < 0 ||
+        sps.size() < 4 || sps.size() + pps.size() > SDP_MAX_PARAMETER_SETS) {
+        snprintf(fmtp, size, "a=fmtp:96 packetization-mode=1\r\n");
+        return;
     }
+    snprintf(fmtp, size,
+             "a=fmtp:96 packetization-mode=1;profile-level-id=%02X%02X%02X;"
+             "sprop-parameter-sets=%s,%s\r\n",
+             (uint8_t) sps[1], (uint8_t) sps[2], (uint8_t) sps[3],
+             base64_encode(sps).c_str(), base64_encode(pps).c_str());
 }
 
-static char* find_next_start_code(char* buffer, int len) {
-    int i;
-    
-    if (len < 3) {
-        return nullptr;
-    }
+static int handle_cmd_DESCRIBE(char* result, int cseq,
+                               const struct RtspView* url) {
+    char sdp[2048];
+    char fmtp[SDP_MAX_PARAMETER_SETS * 2];
+    char local_ip[100];
+    char connection[100] = "";
+    char range[64] = "";
+    char audio[400] = "";
+    int media_port = 0;
     
-    for (i = 0; i < len - 3; ++i) {
-        if (start_code_3(buffer) || start_code_4(buffer)) {
-            return buffer;
-        }
-        ++buffer;
+    // rtsp://host[:port]/path
+    struct RtspView host = *url;
+    if (rtsp_view_starts_with(&host, "rtsp://")) {
+        host.data += strlen("rtsp://");
+        host.size -= strlen("rtsp://");
     }
-    if (start_code_3(buffer)) {
-        return buffer;
+    uint32_t host_size = 0;
+    while (host_size < host.size && host_size < sizeof(local_ip) - 1 &&
+           host.data[host_size] != ':' && host.data[host_size] != '/') {
+        ++host_size;
     }
-    return nullptr;
-}
-
-static int get_frame_from_H264_file(FILE* fp, char* frame, int size) {
-    int read_size, frame_size;
-    char* next_start_code;
-    
-    // fread(指针保存读取的数据，每块数据的字节数，需要读取的块数，文件指针)
-    // 返回读取的块数
-    read_size = fread(frame, 1, size, fp);
+    memcpy(local_ip, host.data, host_size);
+    local_ip[host_size] = '\0';
     
-    if (!start_code_3(frame) && !start_code_4(frame)) {
-        return -1;
+    // 支持组播时给出组播组，客户端可以直接加入或者SETUP时选择组播
+    const struct MediaMulticast* multicast = media_source_get_multicast();
+    if (multicast) {
+        sprintf(connection, "c=IN IP4 %s/%d\r\n", inet_ntoa(multicast->group),
+                multicast->ttl);
+        media_port = multicast->port;
     }
     
-    next_start_code = find_next_start_code(frame + 3, read_size - 3);
-    if (!next_start_code) {
-        // lseek(fd, 0, SEEK_SET);
-        // frame_size = read_Size;
-        return -1;
-    }
-    else {
-        frame_size = next_start_code - frame;
-        fseek(fp, frame_size - read_size, SEEK_CUR);
+    // 配置了音频时再描述一个AAC轨道，组播时使用视频之后的一对端口
+    const char* audio_file = media_source_get_audio_file();
+    std::shared_ptr<const struct AacIndex> aac =
+            audio_file ? aac_index_get(audio_file) : nullptr;
+    if (aac) {
+        sprintf(audio,
+                "m=audio %d RTP/AVP 97\r\n"
+                "a=rtpmap:97 mpeg-generic/%u/%u\r\n"
+                "a=fmtp:97 streamtype=5;profile-level-id=1;mode=AAC-hbr;"
+                "sizelength=13;indexlength=3;indexdeltalength=3;"
+                "config=%02X%02X\r\n"
+                "a=control:track1\r\n",
+                multicast ? media_port + 2 : 0,
+                aac->sample_rate,
+                aac->channels,
+                aac->config[0],
+                aac->config[1]);
     }
     
-    return frame_size;
-}
-
-static int rtp_send_H264_frame(int server_rtp_sockfd, const char* ip,
-                               int16_t port, struct RtpPacket* rtp_packet,
-                               char* frame, uint32_t frame_size) {
-    uint8_t nalu_first_byte;
-    int send_bytes = 0;
-    int ret;
-    
-    nalu_first_byte = frame[0];
-    
-    printf("frame size = %d \n", frame_size);
-    if (frame_size <= RTP_MAX_PKT_SIZE) {
-        // 单NALU模式
-        //*   0 1 2 3 4 5 6 7 8 9
-        //*  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-        //*  |F|NRI|  Type   | a single NAL unit ... |
-        //*  +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-        memcpy(rtp_packet->payload, frame, frame_size);
-        ret = rtp_send_packet_over_udp(server_rtp_sockfd, ip, port, rtp_packet,
-                                       frame_size);
-        if (ret < 0) {
-            return -1;
-        }
-        
-        ++rtp_packet->rtp_header.seq;
-        send_bytes += ret;
-        if ((nalu_first_byte & 0x1F) == 7 || (nalu_first_byte & 0x1F) == 8) {
-            // 如果是SPS或者PPS类型，就不需要加时间戳
-            goto out;
-        }
-    }
-    else {
-        // NALU包长度大于最大包长，分片模式
-        //*  0                   1                   2
-        //*  0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3
-        //* +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-        //* | FU indicator  |   FU header   |   FU payload   ...  |
-        //* +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-        
-        
-        
-        //*     FU Indicator
-        //*    0 1 2 3 4 5 6 7
-        //*   +-+-+-+-+-+-+-+-+
-        //*   |F|NRI|  Type   |
-        //*   +---------------+
-        
-        
-        
-        //*      FU Header
-        //*    0 1 2 3 4 5 6 7
-        //*   +-+-+-+-+-+-+-+-+
-        //*   |S|E|R|  Type   |
-        //*   +---------------+
-        
-        int packet_num = frame_size / RTP_MAX_PKT_SIZE; // 完整的包的数量
-        int remain_packet_size = frame_size % RTP_MAX_PKT_SIZE; // 剩余的不完整的包的大小
-        int i, pos = 1;
-        // 发送完整的包
-        for (i = 0; i < packet_num; ++i) {
-            rtp_packet->payload[0] = (nalu_first_byte & 0x60) | 28;
-            rtp_packet->payload[1] = nalu_first_byte & 0x1F;
-            if (i == 0) {
-                // 第一包数据
-                rtp_packet->payload[1] |= 0x80;
-            }
-            else if (remain_packet_size == 0 && i == packet_num - 1) {
-                // 最后一包数据
-                rtp_packet->payload[1] |= 0x40;
-            }
-            
-            memcpy(rtp_packet->payload + 2, frame + pos, RTP_MAX_PKT_SIZE);
-            ret = rtp_send_packet_over_udp(server_rtp_sockfd, ip, port,
-                                           rtp_packet, RTP_MAX_PKT_SIZE + 2);
-            if (ret < 0) {
-                return -1;
-            }
-            ++rtp_packet->rtp_header.seq;
-            send_bytes += ret;
-            pos += RTP_MAX_PKT_SIZE;
-        }
-        // 发送剩余的内容
-        if (remain_packet_size > 0) {
-            rtp_packet->payload[0] = (nalu_first_byte & 0x60) | 28;
-            rtp_packet->payload[1] = nalu_first_byte & 0x1F;
-            rtp_packet->payload[1] |= 0x40;
-            
-            memcpy(rtp_packet->payload + 2, frame + pos,
-                   remain_packet_size + 2);
-            ret = rtp_send_packet_over_udp(server_rtp_sockfd, ip, port,
-                                           rtp_packet, remain_packet_size + 2);
-            if (ret < 0) {
-                return -1;
-            }
-            ++rtp_packet->rtp_header.seq;
-            send_bytes += ret;
-        }
+    // 点播文件给出时长，客户端据此显示进度条和跳转
+    uint64_t duration;
+    if (media_source_duration(h264_file_name, &duration) == 0) {
+        sprintf(range, "a=range:npt=0-%.3f\r\n",
+                (double) duration / H264_CLOCK_RATE);
     }
-    rtp_packet->rtp_header.timestamp += 90000 / 25;
-    out:
-    
-    return send_bytes;
-}
-
-static int handle_cmd_DESCRIBE(char* result, int cseq, char* url) {
-    char sdp[500];
-    char local_ip[100];
-    
-    sscanf(url, "rtsp://%[^:]:", local_ip);
     
+    describe_video_fmtp(fmtp, sizeof(fmtp));
     sprintf(sdp,
             "v=0\r\n"
             "o=- 9%ld 1 IN IP4 %s\r\n"
             "t=0 0\r\n"
             "a=control:*\r\n"
-            "m=video 0 RTP/AVP 96\r\n"
+            "%s"
+            "%s"
+            "m=video %d RTP/AVP 96\r\n"
             "a=rtpmap:96 H264/90000\r\n"
-            "a=control:track0\r\n",
+            "%s"
+            "a=control:track0\r\n"
+            "%s",
             time(nullptr),
-            local_ip);
+            local_ip,
+            range,
+            connection,
+            media_port,
+            fmtp,
+            audio);
     sprintf(result,
             "RTSP/1.0 200 OK\r\n"
             "CSeq: %d\r\n"
-            "Content-Base: %s\r\n"
+            "Content-Base: %.*s\r\n"
             "Content-type: application/sdp\r\n"
             "Content-length: %zu\r\n"
             "\r\n"
             "%s",
             cseq,
-            url,
+            (int) url->size,
+            url->data,
             strlen(sdp),
             sdp);
     return 0;
 }
 
-static int handle_cmd_SETUP(char* result, int cseq, int client_rtp_port) {
+static int handle_cmd_SETUP(char* result, int cseq,
+                            const struct RtspSession* session, int track) {
+    const struct RtspTransport* transport = &session->transports[track];
     sprintf(result,
             "RTSP/1.0 200 OK\r\n"
             "CSeq: %d\r\n"
             "Transport: RTP/AVP;unicast;client_port=%d-%d;server_port=%d-%d\r\n"
-            "Session: 66334873\r\n"
+            "Session: %s\r\n"
+            "\r\n",
+            cseq,
+            ntohs(transport->client_rtp_addr.sin_port),
+            ntohs(transport->client_rtcp_addr.sin_port),
+            transport->server_rtp_port,
+            transport->server_rtcp_port,
+            session->id_str);
+    return 0;
+}
+
+static int handle_cmd_SETUP_interleaved(char* result, int cseq,
+                                        int rtp_channel, int rtcp_channel,
+                                        const struct RtspSession* session) {
+    sprintf(result,
+            "RTSP/1.0 200 OK\r\n"
+            "CSeq: %d\r\n"
+            "Transport: RTP/AVP/TCP;unicast;interleaved=%d-%d\r\n"
+            "Session: %s\r\n"
+            "\r\n",
+            cseq,
+            rtp_channel,
+            rtcp_channel,
+            session->id_str);
+    return 0;
+}
+
+static int handle_cmd_SETUP_multicast(char* result, int cseq,
+                                      const struct MediaMulticast* multicast,
+                                      const struct RtspSession* session,
+                                      int track) {
+    // 每个轨道占用组播的一对端口
+    int port = multicast->port + 2 * track;
+    sprintf(result,
+            "RTSP/1.0 200 OK\r\n"
+            "CSeq: %d\r\n"
+            "Transport: RTP/AVP;multicast;destination=%s;port=%d-%d;ttl=%d\r\n"
+            "Session: %s\r\n"
             "\r\n",
             cseq,
-            client_rtp_port,
-            client_rtp_port + 1,
-            SERVER_RTP_PORT,
-            SERVER_RTCP_PORT);
+            inet_ntoa(multicast->group),
+            port,
+            port + 1,
+            multicast->ttl,
+            session->id_str);
     return 0;
 }
 
-static int handle_cmd_PLAY(char* result, int cseq) {
+// range是开始播放的npt，rtp_info为空时不带RTP-Info头
+static int handle_cmd_PLAY(char* result, int size, int cseq,
+                           const struct RtspSession* session,
+                           const char* range, const std::string& rtp_info) {
+    int ret = snprintf(result, size,
+                       "RTSP/1.0 200 OK\r\n"
+                       "CSeq: %d\r\n"
+                       "Range: %s\r\n"
+                       "%s%s%s"
+                       "Session: %s; timeout=10\r\n"
+                       "\r\n",
+                       cseq,
+                       range,
+                       rtp_info.empty() ? "" : "RTP-Info: ",
+                       rtp_info.c_str(),
+                       rtp_info.empty() ? "" : "\r\n",
+                       session->id_str);
+    return ret < 0 || ret >= size ? -1 : 0;
+}
+
+static int handle_cmd_PAUSE(char* result, int cseq,
+                            const struct RtspSession* session) {
     sprintf(result,
             "RTSP/1.0 200 OK\r\n"
             "CSeq: %d\r\n"
-            "Range: npt=0.000-\r\n"
-            "Session: 66334873; timeout=10\r\n"
+            "Session: %s\r\n"
+            "\r\n",
+            cseq,
+            session->id_str);
+    return 0;
+}
+
+static int handle_cmd_TEARDOWN(char* result, int cseq) {
+    sprintf(result,
+            "RTSP/1.0 200 OK\r\n"
+            "CSeq: %d\r\n"
+            "\r\n",
+            cseq);
+    return 0;
+}
+
+/*
+ * body是选出的"名字: 值"行，为空时是保活请求。回复超过result的大小时
+ * 返回-1
+ */
+static int handle_cmd_GET_PARAMETER(char* result, int size, int cseq,
+                                    const struct RtspSession* session,
+                                    const std::string& body) {
+    char session_line[64] = "";
+    if (session) {
+        snprintf(session_line, sizeof(session_line), "Session: %s\r\n",
+                 session->id_str);
+    }
+    int ret;
+    if (body.empty()) {
+        ret = snprintf(result, size,
+                       "RTSP/1.0 200 OK\r\n"
+                       "CSeq: %d\r\n"
+                       "%s"
+                       "\r\n",
+                       cseq, session_line);
+    }
+    else {
+        ret = snprintf(result, size,
+                       "RTSP/1.0 200 OK\r\n"
+                       "CSeq: %d\r\n"
+                       "%s"
+                       "Content-Type: text/parameters\r\n"
+                       "Content-Length: %zu\r\n"
+                       "\r\n"
+                       "%s",
+                       cseq, session_line, body.size(), body.c_str());
+    }
+    return ret < 0 || ret >= size ? -1 : 0;
+}
+
+static int handle_cmd_error(char* result, int cseq, int code,
+                            const char* reason) {
+    sprintf(result,
+            "RTSP/1.0 %d %s\r\n"
+            "CSeq: %d\r\n"
             "\r\n",
+            code,
+            reason,
             cseq);
     return 0;
 }
 
-static void do_client(int clientfd, const char* client_ip, int client_port) {
-    char method[40];
-    char url[100];
-    char version[40];
-    int CSeq;
+enum RtspState {
+    RTSP_STATE_INIT, // 尚未SETUP
+    RTSP_STATE_READY, // 已SETUP，等待PLAY
+    RTSP_STATE_PLAYING, // 正在推流
+};
+
+// 从解析出的消息中取出处理需要的字段，method和url指向接收缓冲
+struct RtspRequest {
+    struct RtspView method;
+    struct RtspView url;
+    int cseq;
+    enum MediaTrackType track; // SETUP的轨道，由URL最后的control确定
+    int client_rtp_port;
+    int client_rtcp_port;
+    int interleaved_rtp_channel; // -1表示UDP传输
+    int interleaved_rtcp_channel;
+    bool multicast;
+    char session[RTSP_SESSION_ID_SIZE + 1]; // Session头，没有时为空串
+    // PLAY的Range头给出了起点（npt，90kHz）；range_invalid表示Range头
+    // 无法解析
+    bool range;
+    uint64_t range_start;
+    bool range_invalid;
+};
+
+// 一个轨道的传输方式和观看者，每个轨道单独SETUP
+struct RtspClientTrack {
+    bool setup;
+    int client_rtp_port;
+    int client_rtcp_port;
     
-    int server_rtp_sockfd = -1, server_rtcp_sockfd = -1;
-    int client_rtp_port, client_rtcp_port;
-    char* read_buffer = (char*) malloc(BUFFER_MAX_SIZE);
-    char* write_buffer = (char*) malloc(BUFFER_MAX_SIZE);
+    // RTP over RTSP(TCP)，媒体数据和RTSP回复共用同一个输出队列
+    bool interleaved;
+    int interleaved_rtp_channel;
+    int interleaved_rtcp_channel;
     
-    while (true) {
-        int recv_len;
-        recv_len = recv(clientfd, read_buffer, BUFFER_MAX_SIZE, 0);
-        if (recv_len <= 0) {
-            break;
+    bool multicast; // 加入源的组播组，不单独发送
+    
+    // 播放过。暂停后继续和跳转时沿用原来的ssrc、seq和RTP时间戳的起点，
+    // 客户端看到的是同一个流
+    bool started;
+    uint32_t timestamp_offset;
+    
+    struct MediaSubscriber subscriber;
+};
+
+// 输出队列中的一段数据，引用缓冲池中的缓冲
+struct RtspOutput {
+    struct PoolBuffer* buffer;
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags; // RTSP_OUTPUT_*
+};
+
+// 每个RTSP控制连接对应一个会话状态机，由事件循环驱动
+struct RtspClient {
+    struct EventLoop* loop;
+    int client_sockfd;
+    char client_ip[40];
+    int client_port;
+    enum RtspState state;
+    
+    char* read_buffer;
+    int read_capacity; // 满了时加倍，空了时缩回RTSP_READ_BUFFER_SIZE
+    int read_len;
+    struct RtspParser parser; // 不完整的请求留在read_buffer开头
+    // 输出队列是片段的环形数组。帧的负载引用源的共享缓冲，回复和包头
+    // 拷贝进scratch，scratch在队列发空时放回缓冲池
+    struct RtspOutput* output;
+    int output_head;
+    int output_count;
+    int output_capacity;
+    int queued; // 队列中待发送的字节数
+    // 队列为空时整帧接受的一帧超过RTSP_TCP_QUEUE_MAX_SIZE的部分，回复的
+    // 上限相应放宽，队列发空时清零
+    int queue_overshoot;
+    struct PoolBuffer* scratch;
+    bool closing; // 写缓冲发送完后关闭连接
+    
+    struct RtspSession* session; // SETUP时创建
+    struct RtspClientTrack tracks[MEDIA_TRACK_COUNT];
+    // 暂停时记下的文件中的位置（90kHz），PLAY不带Range时从这里继续
+    bool paused;
+    uint64_t position;
+    
+    // RTP over TCP的视频输出队列满后丢帧，直到下一个IDR
+    bool waiting_key;
+    uint64_t dropped_frames;
+    int queue_reported; // 已计入METRICS_TCP_QUEUE_BYTES的输出队列大小
+    
+    struct WorkerTask handoff; // 交给其他工作线程时投递的任务
+};
+
+static void on_client_event(struct EventLoop* loop, int fd, uint32_t events,
+                            void* arg);
+
+static struct RtspClient* rtsp_client_create(struct EventLoop* loop,
+                                             int client_sockfd,
+                                             const char* client_ip,
+                                             int client_port) {
+    struct RtspClient* client =
+            (struct RtspClient*) calloc(1, sizeof(struct RtspClient));
+    client->loop = loop;
+    client->client_sockfd = client_sockfd;
+    strcpy(client->client_ip, client_ip);
+    client->client_port = client_port;
+    client->state = RTSP_STATE_INIT;
+    client->read_buffer = (char*) malloc(RTSP_READ_BUFFER_SIZE);
+    client->read_capacity = RTSP_READ_BUFFER_SIZE;
+    rtsp_parser_init(&client->parser);
+    for (struct RtspClientTrack& track : client->tracks) {
+        track.interleaved_rtp_channel = -1;
+        track.interleaved_rtcp_channel = -1;
+    }
+    metrics_add(METRICS_RTSP_CONNECTIONS, 1);
+    return client;
+}
+
+static void rtsp_client_close(struct EventLoop* loop,
+                              struct RtspClient* client) {
+    event_loop_remove(loop, client->client_sockfd);
+    close(client->client_sockfd);
+    for (struct RtspClientTrack& track : client->tracks) {
+        media_source_unsubscribe(&track.subscriber);
+    }
+    rtsp_session_destroy(client->session);
+    metrics_add(METRICS_RTSP_CONNECTIONS, -1);
+    metrics_add(METRICS_TCP_QUEUE_BYTES, -client->queue_reported);
+    free(client->read_buffer);
+    for (int i = 0; i < client->output_count; ++i) {
+        pool_buffer_unref(
+                client->output[(client->output_head + i) %
+                               client->output_capacity].buffer);
+    }
+    free(client->output);
+    if (client->scratch) {
+        pool_buffer_unref(client->scratch);
+    }
+    printf("close client: client ip: %s client port: %d dropped frames: "
+           "%lu\n",
+           client->client_ip, client->client_port, client->dropped_frames);
+    free(client);
+}
+
+static inline int rtsp_client_queued(struct RtspClient* client) {
+    return client->queued;
+}
+
+static void rtsp_client_update_events(struct EventLoop* loop,
+                                      struct RtspClient* client) {
+    uint32_t events = EPOLLIN;
+    int queued = rtsp_client_queued(client);
+    if (queued > 0) {
+        events |= EPOLLOUT;
+    }
+    metrics_add(METRICS_TCP_QUEUE_BYTES, queued - client->queue_reported);
+    client->queue_reported = queued;
+    event_loop_modify(loop, client->client_sockfd, events);
+}
+
+static inline struct RtspOutput* rtsp_client_output(struct RtspClient* client,
+                                                    int i) {
+    return &client->output[(client->output_head + i) %
+                           client->output_capacity];
+}
+
+// 追加一个片段，调用者的引用转给队列
+static void rtsp_client_push_output(struct RtspClient* client,
+                                    struct PoolBuffer* buffer,
+                                    uint32_t offset, uint32_t size,
+                                    uint32_t flags) {
+    if (client->output_count == client->output_capacity) {
+        int capacity = client->output_capacity
+                               ? client->output_capacity * 2
+                               : RTSP_OUTPUT_MIN_SEGMENTS;
+        struct RtspOutput* output = (struct RtspOutput*) malloc(
+                capacity * sizeof(struct RtspOutput));
+        for (int i = 0; i < client->output_count; ++i) {
+            output[i] = *rtsp_client_output(client, i);
         }
-        
-        read_buffer[recv_len] = '\0';
-        std::string recv_str = read_buffer;
-        printf(">>>>>>>>>>>>>>>>>>>>>>\n");
-        printf("%s read_buffer = %s \n", __FUNCTION__, read_buffer);
-        
-        const char* sep = "\n";
-        char* line = strtok(read_buffer, sep);
-        while (line) {
-            if (strstr(line, "OPTIONS") != NULL ||
-                strstr(line, "DESCRIBE") != NULL ||
-                strstr(line, "SETUP") != NULL ||
-                strstr(line, "PLAY") != NULL) {
-                if (sscanf(line, "%s %s %s\r\n", method, url, version) != 3) {
-                    //error
-                }
-            }
-            else if (strstr(line, "CSeq") != NULL) {
-                if (sscanf(line, "CSeq: %d\r\n", &CSeq) != 1) {
-                    //error
-                }
+        free(client->output);
+        client->output = output;
+        client->output_head = 0;
+        client->output_capacity = capacity;
+    }
+    client->output_count++;
+    struct RtspOutput* tail =
+            rtsp_client_output(client, client->output_count - 1);
+    tail->buffer = buffer;
+    tail->offset = offset;
+    tail->size = size;
+    tail->flags = flags;
+    client->queued += size;
+}
+
+// 队列发空后scratch放回缓冲池，空闲的连接不占用缓冲
+static void rtsp_client_release_scratch(struct RtspClient* client) {
+    if (client->scratch) {
+        pool_buffer_unref(client->scratch);
+        client->scratch = nullptr;
+    }
+}
+
+// 尽量发送输出队列中的数据，发不完的部分等待EPOLLOUT
+static int rtsp_client_flush(struct EventLoop* loop,
+                             struct RtspClient* client) {
+    while (client->output_count > 0) {
+        struct iovec iov[RTSP_OUTPUT_IOV_MAX];
+        int count = client->output_count < RTSP_OUTPUT_IOV_MAX
+                            ? client->output_count
+                            : RTSP_OUTPUT_IOV_MAX;
+        for (int i = 0; i < count; ++i) {
+            struct RtspOutput* output = rtsp_client_output(client, i);
+            iov[i].iov_base = output->buffer->data + output->offset;
+            iov[i].iov_len = output->size;
+        }
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t ret = sendmsg(client->client_sockfd, &msg, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
             }
-            else if (strncmp(line, "Transport:", strlen("Transport:")) >= 0) {
-                // Transport: RTP/AVP/UDP;unicast;client_port=13358-13359
-                // Transport: RTP/AVP;unicast;client_port=13358-13359
-                if (sscanf(line,
-                           "Transport: RTP/AVP/UDP;unicast;client_port=%d-%d\r\n",
-                           &client_rtp_port,
-                           &client_rtcp_port) != 2) {
-                    // error
-                    printf("parse Transport error\n");
-                }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
             }
-            line = strtok(nullptr, sep);
+            return -1;
         }
-        
-        if (strcmp(method, "OPTIONS") == 0) {
-            if (handle_cmd_OPTIONS(write_buffer, CSeq) != 0) {
-                printf("failed to handle OPTIONS\n");
+        client->queued -= ret;
+        while (ret > 0) {
+            struct RtspOutput* output = rtsp_client_output(client, 0);
+            if ((size_t) ret < output->size) {
+                output->offset += ret;
+                output->size -= ret;
+                output->flags &= ~RTSP_OUTPUT_FRAME_START;
                 break;
             }
+            ret -= output->size;
+            pool_buffer_unref(output->buffer);
+            client->output_head =
+                    (client->output_head + 1) % client->output_capacity;
+            --client->output_count;
         }
-        else if (strcmp(method, "DESCRIBE") == 0) {
-            if (handle_cmd_DESCRIBE(write_buffer, CSeq, url) != 0) {
-                printf("failed to handle DESCRIBE\n");
-                break;
+    }
+    if (client->output_count == 0) {
+        client->output_head = 0;
+        client->queue_overshoot = 0;
+        rtsp_client_release_scratch(client);
+        if (client->closing) {
+            return -1;
+        }
+    }
+    rtsp_client_update_events(loop, client);
+    return 0;
+}
+
+/*
+ * 丢弃输出队列中还没有开始发送的交织数据，回复保留。队列开头已经发出
+ * 一部分的帧要发完，否则客户端无法从中间找到之后数据的边界
+ */
+static void rtsp_client_drop_media(struct RtspClient* client) {
+    int kept = 0;
+    bool partial = true;
+    for (int i = 0; i < client->output_count; ++i) {
+        struct RtspOutput output = *rtsp_client_output(client, i);
+        if (output.flags != RTSP_OUTPUT_MEDIA) {
+            partial = false;
+        }
+        if ((output.flags & RTSP_OUTPUT_MEDIA) && !partial) {
+            client->queued -= output.size;
+            pool_buffer_unref(output.buffer);
+            continue;
+        }
+        *rtsp_client_output(client, kept++) = output;
+    }
+    client->output_count = kept;
+    if (client->output_count == 0) {
+        client->output_head = 0;
+        client->queue_overshoot = 0;
+        rtsp_client_release_scratch(client);
+    }
+}
+
+// 拷贝到输出队列，不检查上限
+static void rtsp_client_copy(struct RtspClient* client, const char* data,
+                             int len, uint32_t flags) {
+    while (len > 0) {
+        struct PoolBuffer* scratch = client->scratch;
+        if (!scratch || scratch->size == scratch->capacity) {
+            if (scratch) {
+                pool_buffer_unref(scratch);
             }
+            scratch = pool_buffer_alloc(len > BUFFER_POOL_MIN_SIZE
+                                                ? len
+                                                : BUFFER_POOL_MIN_SIZE);
+            client->scratch = scratch;
         }
-        else if (strcmp(method, "SETUP") == 0) {
-            if (handle_cmd_SETUP(write_buffer, CSeq, client_rtp_port) != 0) {
-                printf("failed to handle SETUP\n");
-                break;
+        uint32_t n = scratch->capacity - scratch->size;
+        if (n > (uint32_t) len) {
+            n = len;
+        }
+        memcpy(scratch->data + scratch->size, data, n);
+        // 紧接着上一段并且属于同一个回复或同一帧时直接延长它
+        struct RtspOutput* tail =
+                client->output_count > 0
+                        ? rtsp_client_output(client, client->output_count - 1)
+                        : nullptr;
+        if (tail && tail->buffer == scratch &&
+            tail->offset + tail->size == scratch->size &&
+            (tail->flags & RTSP_OUTPUT_MEDIA) == (flags & RTSP_OUTPUT_MEDIA) &&
+            !(flags & RTSP_OUTPUT_FRAME_START)) {
+            tail->size += n;
+            client->queued += n;
+        }
+        else {
+            rtsp_client_push_output(client, pool_buffer_ref(scratch),
+                                    scratch->size, n, flags);
+        }
+        scratch->size += n;
+        data += n;
+        len -= n;
+        flags &= ~RTSP_OUTPUT_FRAME_START;
+    }
+}
+
+// 拷贝到输出队列，不立即发送
+static int rtsp_client_enqueue(struct RtspClient* client, const char* data,
+                               int len) {
+    if (client->queued + len > BUFFER_MAX_SIZE + client->queue_overshoot) {
+        printf("write buffer overflow\n");
+        return -1;
+    }
+    rtsp_client_copy(client, data, len, 0);
+    return 0;
+}
+
+/*
+ * 把帧从iov[pos]的offset处开始的剩余部分加入输出队列：共用的负载引用
+ * 源的共享缓冲，其余拷贝。上限由调用者检查
+ */
+static void rtsp_client_enqueue_frame(struct RtspClient* client,
+                                      const struct MediaTcpFrame* frame,
+                                      int pos, size_t offset) {
+    struct PoolBuffer* shared = nullptr;
+    // 已经发出一部分的帧没有开头，剩下的部分必须发完
+    uint32_t flags = RTSP_OUTPUT_MEDIA;
+    if (pos == 0 && offset == 0) {
+        flags |= RTSP_OUTPUT_FRAME_START;
+    }
+    for (; pos < frame->iovcnt;
+         ++pos, offset = 0, flags &= ~RTSP_OUTPUT_FRAME_START) {
+        const uint8_t* base =
+                (const uint8_t*) frame->iov[pos].iov_base + offset;
+        size_t len = frame->iov[pos].iov_len - offset;
+        if (frame->data && base >= frame->data &&
+            base + len <= frame->data + frame->data_size) {
+            if (!shared) {
+                shared = media_tcp_frame_share(frame);
             }
-            server_rtp_sockfd = create_udp_socket();
-            server_rtcp_sockfd = create_udp_socket();
-            if (server_rtp_sockfd < 0 || server_rtcp_sockfd < 0) {
-                printf("failed to create udp socket\n");
+            if (shared) {
+                rtsp_client_push_output(client, pool_buffer_ref(shared),
+                                        base - frame->data, len, flags);
+                continue;
+            }
+        }
+        rtsp_client_copy(client, (const char*) base, len, flags);
+    }
+    if (shared) {
+        pool_buffer_unref(shared);
+    }
+}
+
+static int rtsp_client_write(struct EventLoop* loop, struct RtspClient* client,
+                             const char* data, int len) {
+    if (rtsp_client_enqueue(client, data, len) < 0) {
+        return -1;
+    }
+    return rtsp_client_flush(loop, client);
+}
+
+/*
+ * 源把一整帧RTP包（含'$'前缀）交给TCP观看者。输出队列为空时直接writev，
+ * 发不完的部分加入队列，负载只引用源的共享缓冲，多个慢连接不各自拷贝；
+ * 队列中还有数据并且放不下整帧时丢弃该帧并一直丢到下一个IDR，
+ * 既不阻塞发送也不无限占用内存。队列为空时总是接受整帧，超过上限的
+ * 大IDR帧在空闲的连接上也能发出。音频包互相独立，放不下时只丢这一个包。
+ * 返回-1表示该帧被丢弃
+ */
+static int on_tcp_frame(struct MediaSubscriber* subscriber,
+                        const struct MediaTcpFrame* frame, void* arg) {
+    struct RtspClient* client = (struct RtspClient*) arg;
+    const struct iovec* iov = frame->iov;
+    int iovcnt = frame->iovcnt;
+    bool video = subscriber->track == MEDIA_TRACK_VIDEO;
+    if (client->closing) {
+        return -1;
+    }
+    if (video && client->waiting_key) {
+        if (!frame->key) {
+            ++client->dropped_frames;
+            return -1;
+        }
+        client->waiting_key = false;
+    }
+    bool idle = rtsp_client_queued(client) == 0;
+    if (!idle &&
+        rtsp_client_queued(client) + frame->size > RTSP_TCP_QUEUE_MAX_SIZE) {
+        if (video) {
+            printf("client %s:%d is too slow, drop frames until next IDR\n",
+                   client->client_ip, client->client_port);
+            client->waiting_key = true;
+        }
+        ++client->dropped_frames;
+        return -1;
+    }
+    
+    int pos = 0;
+    size_t offset = 0; // iov[pos]中已经发送的字节数
+    if (idle) {
+        while (pos < iovcnt) {
+            int count = iovcnt - pos < IOV_MAX ? iovcnt - pos : IOV_MAX;
+            struct msghdr msg;
+            bzero(&msg, sizeof(msg));
+            msg.msg_iov = (struct iovec*) iov + pos;
+            msg.msg_iovlen = count;
+            ssize_t ret = sendmsg(client->client_sockfd, &msg, MSG_NOSIGNAL);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    // 连接已经出错，由之后的EPOLLERR/EPOLLHUP关闭
+                    client->closing = true;
+                    return -1;
+                }
                 break;
             }
-            if (bind_socket_addr(server_rtp_sockfd, "0.0.0.0",
-                                 SERVER_RTP_PORT) < 0 ||
-                bind_socket_addr(server_rtcp_sockfd, "0.0.0.0",
-                                 SERVER_RTCP_PORT) < 0) {
-                printf("failed to bind addr\n");
+            while (pos < iovcnt && (size_t) ret >= iov[pos].iov_len) {
+                ret -= iov[pos].iov_len;
+                ++pos;
+            }
+            if (pos < iovcnt && ret > 0) {
+                offset = ret;
                 break;
             }
         }
-        else if (strcmp(method, "PLAY") == 0) {
-            if (handle_cmd_PLAY(write_buffer, CSeq) != 0) {
-                printf("failed to handle PLAY\n");
-                break;
+    }
+    rtsp_client_enqueue_frame(client, frame, pos, offset);
+    if (rtsp_client_queued(client) > RTSP_TCP_QUEUE_MAX_SIZE) {
+        client->queue_overshoot =
+                rtsp_client_queued(client) - RTSP_TCP_QUEUE_MAX_SIZE;
+    }
+    rtsp_client_update_events(client->loop, client);
+    return 0;
+}
+
+// "a-b"形式的端口或通道范围，只有一个数时第二个为第一个加1
+static int parse_range(const struct RtspView* text, int* first, int* second) {
+    struct RtspView rest = *text, token;
+    if (!rtsp_view_next_token(&rest, '-', &token) ||
+        rtsp_view_to_int(&token, first) < 0) {
+        return -1;
+    }
+    if (!rtsp_view_next_token(&rest, '-', &token)) {
+        *second = *first + 1;
+        return 0;
+    }
+    return rtsp_view_to_int(&token, second);
+}
+
+static void parse_transport(const struct RtspView* value,
+                            struct RtspRequest* req) {
+    // Transport: RTP/AVP/UDP;unicast;client_port=13358-13359
+    // Transport: RTP/AVP;unicast;client_port=13358-13359
+    // Transport: RTP/AVP/TCP;unicast;interleaved=0-1
+    // Transport: RTP/AVP;multicast
+    // 客户端可以用逗号分隔列出多个候选，只看第一个
+    struct RtspView transports = *value, spec, param;
+    rtsp_view_next_token(&transports, ',', &spec);
+    rtsp_view_next_token(&spec, ';', &param);
+    bool tcp = rtsp_view_equals(&param, "RTP/AVP/TCP");
+    if (!tcp && !rtsp_view_equals(&param, "RTP/AVP") &&
+        !rtsp_view_equals(&param, "RTP/AVP/UDP")) {
+        printf("parse Transport error\n");
+        return;
+    }
+    if (tcp) {
+        // 客户端没有指定时每个轨道使用各自的一对通道
+        req->interleaved_rtp_channel = 2 * req->track;
+        req->interleaved_rtcp_channel = 2 * req->track + 1;
+    }
+    while (rtsp_view_next_token(&spec, ';', &param)) {
+        struct RtspView range = param;
+        if (rtsp_view_starts_with(&param, "client_port=") && !tcp) {
+            range.data += strlen("client_port=");
+            range.size -= strlen("client_port=");
+            parse_range(&range, &req->client_rtp_port, &req->client_rtcp_port);
+        }
+        else if (rtsp_view_starts_with(&param, "interleaved=") && tcp) {
+            range.data += strlen("interleaved=");
+            range.size -= strlen("interleaved=");
+            parse_range(&range, &req->interleaved_rtp_channel,
+                        &req->interleaved_rtcp_channel);
+        }
+        else if (rtsp_view_equals(&param, "multicast") && !tcp) {
+            // 组播组、端口和TTL由服务器决定，客户端给出的destination等忽略
+            req->multicast = true;
+        }
+    }
+}
+
+// npt时间：秒数或hh:mm:ss[.小数]，换算成90kHz。失败返回-1
+static int parse_npt(const struct RtspView* text, uint64_t* npt) {
+    char value[32];
+    if (text->size == 0 || text->size >= sizeof(value) ||
+        text->data[0] < '0' || text->data[0] > '9') {
+        return -1;
+    }
+    memcpy(value, text->data, text->size);
+    value[text->size] = '\0';
+    unsigned hours = 0, minutes = 0;
+    int consumed = 0;
+    if (strchr(value, ':') &&
+        (sscanf(value, "%u:%u:%n", &hours, &minutes, &consumed) != 2 ||
+         consumed == 0 || minutes >= 60)) {
+        return -1;
+    }
+    char* end;
+    double seconds = strtod(value + consumed, &end);
+    if (end == value + consumed || *end != '\0' || !(seconds >= 0) ||
+        (consumed > 0 && seconds >= 60)) {
+        return -1;
+    }
+    double total = (hours * 3600.0 + minutes * 60.0 + seconds) *
+                   H264_CLOCK_RATE;
+    if (total >= (double) INT64_MAX) {
+        return -1;
+    }
+    *npt = (uint64_t) (total + 0.5);
+    return 0;
+}
+
+/*
+ * Range: npt=起点-[终点]，起点为空或"now"时没有起点。终点忽略，总是
+ * 播放到文件结尾；不支持其他时间格式（smpte、clock）
+ */
+static int parse_play_range(const struct RtspView* value,
+                            struct RtspRequest* req) {
+    struct RtspView rest = *value, spec, start;
+    rtsp_view_next_token(&rest, ';', &spec);
+    if (!rtsp_view_starts_with(&spec, "npt=")) {
+        return -1;
+    }
+    spec.data += strlen("npt=");
+    spec.size -= strlen("npt=");
+    if (!rtsp_view_next_token(&spec, '-', &start)) {
+        return -1;
+    }
+    if (start.size == 0 || rtsp_view_equals(&start, "now")) {
+        return 0;
+    }
+    if (parse_npt(&start, &req->range_start) < 0) {
+        return -1;
+    }
+    req->range = true;
+    return 0;
+}
+
+// SETUP的URL以DESCRIBE中轨道的a=control结尾，track1是音频，其余是视频
+static enum MediaTrackType parse_track(const struct RtspView* url) {
+    static const char audio_control[] = "track1";
+    uint32_t size = sizeof(audio_control) - 1;
+    if (url->size >= size &&
+        memcmp(url->data + url->size - size, audio_control, size) == 0) {
+        return MEDIA_TRACK_AUDIO;
+    }
+    return MEDIA_TRACK_VIDEO;
+}
+
+static void parse_request(const struct RtspMessage* message,
+                          struct RtspRequest* req) {
+    bzero(req, sizeof(*req));
+    req->method = message->method;
+    req->url = message->url;
+    req->cseq = message->cseq;
+    req->track = parse_track(&message->url);
+    req->interleaved_rtp_channel = -1;
+    req->interleaved_rtcp_channel = -1;
+    
+    const struct RtspView* transport =
+            rtsp_message_header(message, "Transport");
+    if (transport) {
+        parse_transport(transport, req);
+    }
+    const struct RtspView* range = rtsp_message_header(message, "Range");
+    if (range && parse_play_range(range, req) < 0) {
+        req->range_invalid = true;
+    }
+    const struct RtspView* session = rtsp_message_header(message, "Session");
+    if (session) {
+        // Session: 0123456789ABCDEF; timeout=60
+        struct RtspView rest = *session, id;
+        rtsp_view_next_token(&rest, ';', &id);
+        if (id.size < sizeof(req->session)) {
+            memcpy(req->session, id.data, id.size);
+            req->session[id.size] = '\0';
+        }
+    }
+}
+
+static void on_session_rtcp(struct RtspSession* session, int track,
+                            const uint8_t* data, int size) {
+    struct RtspClient* client = (struct RtspClient*) session->owner;
+    media_source_on_rtcp(&client->tracks[track].subscriber, data, size);
+}
+
+/*
+ * 源播放结束，和原来单独推流时一样断开客户端，TCP观看者先发完输出队列。
+ * 音频和视频的观看者都会回调，关闭连接时其余轨道一起取消订阅
+ */
+static void on_play_end(struct MediaSubscriber* subscriber, void* arg) {
+    struct RtspClient* client = (struct RtspClient*) arg;
+    client->closing = true;
+    if (rtsp_client_queued(client) == 0) {
+        rtsp_client_close(client->loop, client);
+    }
+}
+
+// 按轨道的传输方式初始化观看者，PLAY回复的RTP-Info由它生成
+static void prepare_track(struct RtspClient* client, int index) {
+    struct RtspClientTrack* track = &client->tracks[index];
+    struct MediaSubscriber* subscriber = &track->subscriber;
+    uint32_t ssrc = subscriber->ssrc;
+    uint16_t seq = subscriber->seq;
+    if (track->multicast) {
+        media_subscriber_init(subscriber, -1, client->client_ip, 0);
+        subscriber->multicast = true;
+    }
+    else if (track->interleaved) {
+        media_subscriber_init(subscriber, -1, client->client_ip, 0);
+        subscriber->interleaved_channel = track->interleaved_rtp_channel;
+        subscriber->on_tcp_frame = on_tcp_frame;
+        subscriber->tcp_queue_size = RTSP_TCP_QUEUE_MAX_SIZE;
+        subscriber->rtcp_channel = track->interleaved_rtcp_channel;
+        // RTP包和RTSP回复共用连接，按会话速率由TCP自己平滑
+        rtp_pacing_setup_socket(client->client_sockfd, true);
+    }
+    else {
+        const struct RtspTransport* transport =
+                &client->session->transports[index];
+        media_subscriber_init(subscriber, transport->rtp_sockfd,
+                              client->client_ip, track->client_rtp_port);
+        // 共享socket没有connect，发送时带上客户端地址
+        subscriber->rtp_connected = !transport->shared;
+        subscriber->rtcp_sockfd = transport->rtcp_sockfd;
+        subscriber->rtcp_addr = transport->client_rtcp_addr;
+    }
+    if (track->started) {
+        subscriber->ssrc = ssrc;
+        subscriber->seq = seq;
+        subscriber->timestamp_offset = track->timestamp_offset;
+    }
+    else {
+        track->started = true;
+        track->timestamp_offset = subscriber->timestamp_offset;
+    }
+    subscriber->track = (enum MediaTrackType) index;
+    subscriber->on_end = on_play_end;
+    subscriber->arg = client;
+}
+
+/*
+ * 所有SETUP过的轨道加入同一个源，由源的时钟一起驱动。private_source为
+ * true时是会话私有的源，从position开始，否则从共享源的当前位置加入
+ */
+static int start_play(struct EventLoop* loop, struct RtspClient* client,
+                      bool private_source, uint64_t position) {
+    if (verbose) {
+        printf("start play: client ip: %s\n", client->client_ip);
+    }
+    struct Scheduler* scheduler = worker_current()->scheduler;
+    for (int i = 0; i < MEDIA_TRACK_COUNT; ++i) {
+        struct RtspClientTrack* track = &client->tracks[i];
+        if (!track->setup) {
+            continue;
+        }
+        int ret = private_source
+                          ? media_source_subscribe_at(
+                                    scheduler, h264_file_name,
+                                    client->session->id_str, position,
+                                    &track->subscriber)
+                          : media_source_subscribe(scheduler, h264_file_name,
+                                                   &track->subscriber);
+        if (ret < 0) {
+            return -1;
+        }
+        if (verbose) {
+            printf("client port: %d track %d\n", track->client_rtp_port, i);
+        }
+    }
+    client->state = RTSP_STATE_PLAYING;
+    client->paused = false;
+    return 0;
+}
+
+// 所有轨道取消订阅，私有源随之销毁，共享源继续为其他观看者播放
+static void stop_play(struct RtspClient* client) {
+    for (struct RtspClientTrack& track : client->tracks) {
+        media_source_unsubscribe(&track.subscriber);
+    }
+}
+
+/*
+ * 决定PLAY从哪里开始，返回0或RTSP错误码。点播文件可以跳转：Range给出
+ * 起点时从它之前最近的IDR帧开始，暂停后不带Range时从暂停的位置继续，
+ * 这两种情况使用会话私有的源；第一次PLAY不带Range或从0开始时加入共享
+ * 源。组播和直播只能加入共享源，seekable为false
+ */
+static int plan_play(struct RtspClient* client, const struct RtspRequest* req,
+                     bool* seekable, bool* private_source,
+                     uint64_t* position) {
+    bool multicast = false;
+    for (const struct RtspClientTrack& track : client->tracks) {
+        multicast = multicast || (track.setup && track.multicast);
+    }
+    uint64_t duration;
+    *seekable = !multicast &&
+                media_source_duration(h264_file_name, &duration) == 0;
+    *private_source = false;
+    if (!*seekable) {
+        return client->state == RTSP_STATE_PLAYING ? 455 : 0;
+    }
+    if (req->range) {
+        if (media_source_seek(h264_file_name, req->range_start, position) <
+            0) {
+            return 457;
+        }
+        *private_source = client->state == RTSP_STATE_PLAYING ||
+                          client->paused || req->range_start > 0;
+    }
+    else if (client->paused) {
+        *position = client->position;
+        *private_source = true;
+    }
+    else if (client->state == RTSP_STATE_PLAYING) {
+        return 455;
+    }
+    uint32_t queue_size = client->tracks[MEDIA_TRACK_VIDEO].interleaved
+                                  ? RTSP_TCP_QUEUE_MAX_SIZE
+                                  : UINT32_MAX;
+    if (!*private_source &&
+        media_source_join_position(h264_file_name, queue_size, position) <
+                0) {
+        return 455;
+    }
+    return 0;
+}
+
+// 每个轨道从position开始的第一个包的seq和对应的rtptime
+static std::string play_rtp_info(struct RtspClient* client,
+                                 const struct RtspView* url,
+                                 uint64_t position) {
+    std::string base(url->data, url->size);
+    if (!base.empty() && base.back() == '/') {
+        base.pop_back();
+    }
+    std::string rtp_info;
+    for (int i = 0; i < MEDIA_TRACK_COUNT; ++i) {
+        const struct MediaSubscriber* subscriber =
+                &client->tracks[i].subscriber;
+        if (!client->tracks[i].setup) {
+            continue;
+        }
+        char info[64];
+        snprintf(info, sizeof(info), "/track%d;seq=%u;rtptime=%u", i,
+                 subscriber->seq,
+                 media_subscriber_rtptime(subscriber, position));
+        rtp_info += (rtp_info.empty() ? "url=" : ",url=") + base + info;
+    }
+    return rtp_info;
+}
+
+/*
+ * 记下位置后停止播放，会话回到READY。组播和直播不能暂停，返回-1。
+ * 位置取自视频轨，只有音频时取自音频轨
+ */
+static int pause_play(struct RtspClient* client) {
+    const struct RtspClientTrack* track =
+            client->tracks[MEDIA_TRACK_VIDEO].setup
+                    ? &client->tracks[MEDIA_TRACK_VIDEO]
+                    : &client->tracks[MEDIA_TRACK_AUDIO];
+    uint64_t position;
+    if (track->multicast ||
+        media_subscriber_position(&track->subscriber, &position) < 0) {
+        return -1;
+    }
+    stop_play(client);
+    client->paused = true;
+    client->position = position;
+    client->state = RTSP_STATE_READY;
+    printf("pause at %.3f s\n", (double) position / H264_CLOCK_RATE);
+    return 0;
+}
+
+// GET_PARAMETER可以查询的一项统计，名字为"分组.项"
+struct RtspParameter {
+    std::string name;
+    int64_t value;
+};
+
+static void add_parameter(std::vector<struct RtspParameter>* params,
+                          const std::string& name, int64_t value) {
+    params->push_back({name, value});
+}
+
+/*
+ * session：本连接各轨道的发送和RR统计、积压；source：播放的文件在所有
+ * 线程上的计数之和；server：服务器总计。都在连接所属的线程中读取
+ */
+static void collect_parameters(struct RtspClient* client,
+                               std::vector<struct RtspParameter>* params) {
+    static const char* track_names[MEDIA_TRACK_COUNT] = {"video", "audio"};
+    if (client->session) {
+        add_parameter(params, "session.frames_dropped",
+                      client->dropped_frames);
+        add_parameter(params, "session.queue_bytes",
+                      rtsp_client_queued(client));
+    }
+    for (int i = 0; i < MEDIA_TRACK_COUNT; ++i) {
+        const struct MediaSubscriber* subscriber =
+                &client->tracks[i].subscriber;
+        if (!subscriber->source) {
+            continue;
+        }
+        std::string prefix = std::string("session.") + track_names[i] + ".";
+        add_parameter(params, prefix + "packets", subscriber->packet_count);
+        add_parameter(params, prefix + "payload_bytes",
+                      subscriber->octet_count);
+        add_parameter(params, prefix + "retransmits",
+                      subscriber->retransmitted);
+        add_parameter(params, prefix + "pacing_backlog",
+                      media_subscriber_backlog(subscriber));
+        add_parameter(params, prefix + "fraction_lost",
+                      subscriber->fraction_lost);
+        add_parameter(params, prefix + "cumulative_lost",
+                      subscriber->cumulative_lost);
+        add_parameter(params, prefix + "jitter", subscriber->jitter);
+        add_parameter(params, prefix + "rtt_ms", subscriber->rtt_ms);
+    }
+
+    int64_t values[METRICS_COUNTER_COUNT];
+    if (metrics_source_snapshot(h264_file_name, values) == 0) {
+        for (int i = METRICS_FIRST_SOURCE_COUNTER; i < METRICS_COUNTER_COUNT;
+             ++i) {
+            add_parameter(params,
+                          std::string("source.") +
+                                  metrics_counter_name((enum MetricsCounter) i),
+                          values[i]);
+        }
+    }
+    struct MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+    for (int i = 0; i < METRICS_COUNTER_COUNT; ++i) {
+        add_parameter(params,
+                      std::string("server.") +
+                              metrics_counter_name((enum MetricsCounter) i),
+                      snapshot.values[i]);
+    }
+    add_parameter(params, "server.pacing_lateness_p50_us",
+                  metrics_lateness_quantile_us(&snapshot, 0.5));
+    add_parameter(params, "server.pacing_lateness_p99_us",
+                  metrics_lateness_quantile_us(&snapshot, 0.99));
+    add_parameter(params, "server.pacing_lateness_p999_us",
+                  metrics_lateness_quantile_us(&snapshot, 0.999));
+}
+
+/*
+ * 请求体每行一个名字：完整的名字选出一项，"session"、"source"、"server"
+ * 选出整个分组。有不认识的名字时返回-1
+ */
+static int select_parameters(struct RtspClient* client,
+                             const struct RtspView* body, std::string* out) {
+    std::vector<struct RtspParameter> params;
+    struct RtspView rest = *body, line;
+    while (rtsp_view_next_token(&rest, '\n', &line)) {
+        if (line.size > 0 && line.data[line.size - 1] == '\r') {
+            --line.size;
+        }
+        if (line.size == 0) {
+            continue;
+        }
+        if (params.empty()) {
+            collect_parameters(client, &params);
+        }
+        std::string name(line.data, line.size);
+        std::string group = name + ".";
+        bool found = false;
+        for (const struct RtspParameter& param : params) {
+            if (param.name == name ||
+                param.name.compare(0, group.size(), group) == 0) {
+                *out += param.name + ": " + std::to_string(param.value) +
+                        "\r\n";
+                found = true;
             }
         }
-        else {
-            printf("invalid method\n");
-            break;
+        if (!found) {
+            return -1;
         }
-        printf("<<<<<<<<<<<<<<<<<<<<<<<\n");
-        printf("%s write_buffer: %s \n", __FUNCTION__, write_buffer);
-        send(clientfd, write_buffer, strlen(write_buffer), 0);
-        // 开始播放，发送RTP包
-        if (strcmp(method, "PLAY") == 0) {
-            int frame_size, start_code;
-            char* frame = (char*) malloc(500000);
-            struct RtpPacket* rtp_packet = (struct RtpPacket*) malloc(500000);
-            FILE* fp = fopen(H264_FILE_NAME, "rb");
-            if (!fp) {
-                printf("读取 %s 失败\n", H264_FILE_NAME);
-                break;
+    }
+    return 0;
+}
+
+/*
+ * 处理一个完整的请求，返回-1表示需要关闭连接，RTSP_CLIENT_HANDOFF表示
+ * 请求没有处理，要把连接交给其他工作线程
+ */
+static int handle_request(struct EventLoop* loop, struct RtspClient* client,
+                          const struct RtspMessage* message, uint32_t size) {
+    struct RtspRequest req;
+    char result[4096];
+    bool play = false;
+    bool play_private = false;
+    uint64_t play_position = 0;
+    
+    if (verbose) {
+        printf(">>>>>>>>>>>>>>>>>>>>>>\n");
+        printf("%s read_buffer = %.*s \n", __FUNCTION__, (int) size,
+               message->method.data);
+    }
+    parse_request(message, &req);
+    
+    if (rtsp_view_equals(&req.method, "OPTIONS")) {
+        if (handle_cmd_OPTIONS(result, req.cseq) != 0) {
+            printf("failed to handle OPTIONS\n");
+            return -1;
+        }
+    }
+    else if (rtsp_view_equals(&req.method, "DESCRIBE")) {
+        if (handle_cmd_DESCRIBE(result, req.cseq, &req.url) != 0) {
+            printf("failed to handle DESCRIBE\n");
+            return -1;
+        }
+    }
+    else if (rtsp_view_equals(&req.method, "SETUP")) {
+        if (req.session[0] &&
+            (!client->session ||
+             rtsp_session_find(req.session) != client->session)) {
+            // 只接受本连接自己的会话
+            handle_cmd_error(result, req.cseq, 454, "Session Not Found");
+        }
+        else if (client->state == RTSP_STATE_PLAYING) {
+            handle_cmd_error(result, req.cseq, 455,
+                             "Method Not Valid in This State");
+        }
+        else if (req.track == MEDIA_TRACK_AUDIO &&
+                 !media_source_get_audio_file()) {
+            handle_cmd_error(result, req.cseq, 404, "Stream Not Found");
+        }
+        else if (req.multicast && media_source_get_multicast() &&
+                 worker_current()->id != MULTICAST_WORKER) {
+            if (!client->session) {
+                // 组播源在另一个线程上，连同这个请求一起交给它处理
+                return RTSP_CLIENT_HANDOFF;
             }
-            rtp_header_init(rtp_packet, 0, 0, 0, RTP_VERSION,
-                            RTP_PAYLOAD_TYPE_H264, 0, 0, 0, 0x88923423);
-            printf("start play\n");
-            printf("client ip: %s\n", client_ip);
-            printf("client port: %d\n", client_rtp_port);
-            
-            while (true) {
-                frame_size = get_frame_from_H264_file(fp, frame, 500000);
-                if (frame_size < 0) {
-                    printf("读取 %s 结束，frame size = %d \n", H264_FILE_NAME,
-                           frame_size);
-                    break;
+            // 会话已经在本线程建立了单播传输，不能再迁移
+            handle_cmd_error(result, req.cseq, 461, "Unsupported Transport");
+        }
+        else {
+            struct RtspClientTrack* track = &client->tracks[req.track];
+            if (!client->session) {
+                client->session = rtsp_session_create(client);
+            }
+            if (req.interleaved_rtp_channel >= 0) {
+                track->setup = true;
+                track->interleaved = true;
+                track->multicast = false;
+                track->interleaved_rtp_channel = req.interleaved_rtp_channel;
+                track->interleaved_rtcp_channel = req.interleaved_rtcp_channel;
+                if (handle_cmd_SETUP_interleaved(
+                            result, req.cseq, req.interleaved_rtp_channel,
+                            req.interleaved_rtcp_channel, client->session) !=
+                    0) {
+                    printf("failed to handle SETUP\n");
+                    return -1;
                 }
-                if (start_code_3(frame)) {
-                    start_code = 3;
+                client->state = RTSP_STATE_READY;
+            }
+            else if (req.multicast) {
+                const struct MediaMulticast* multicast =
+                        media_source_get_multicast();
+                if (!multicast) {
+                    handle_cmd_error(result, req.cseq, 461,
+                                     "Unsupported Transport");
                 }
                 else {
-                    start_code = 4;
+                    track->setup = true;
+                    track->interleaved = false;
+                    track->multicast = true;
+                    handle_cmd_SETUP_multicast(result, req.cseq, multicast,
+                                               client->session, req.track);
+                    client->state = RTSP_STATE_READY;
                 }
-                frame_size -= start_code;
-                rtp_send_H264_frame(server_rtp_sockfd, client_ip,
-                                    client_rtp_port, rtp_packet,
-                                    frame + start_code, frame_size);
-                
-                usleep(40000);
             }
-            free(frame);
-            free(rtp_packet);
-            
-            break;
+            else if (req.client_rtp_port <= 0) {
+                handle_cmd_error(result, req.cseq, 461,
+                                 "Unsupported Transport");
+            }
+            else if (rtsp_session_setup_udp(client->session, req.track,
+                                            client->client_ip,
+                                            req.client_rtp_port,
+                                            req.client_rtcp_port) < 0) {
+                handle_cmd_error(result, req.cseq, 453, "Not Enough Bandwidth");
+            }
+            else {
+                track->setup = true;
+                track->interleaved = false;
+                track->multicast = false;
+                track->client_rtp_port = req.client_rtp_port;
+                track->client_rtcp_port = req.client_rtcp_port;
+                if (handle_cmd_SETUP(result, req.cseq, client->session,
+                                     req.track) != 0) {
+                    printf("failed to handle SETUP\n");
+                    return -1;
+                }
+                client->state = RTSP_STATE_READY;
+            }
         }
-        
-        bzero(method, sizeof(method));
-        bzero(url, sizeof(url));
-        CSeq = 0;
     }
-    
-    close(clientfd);
-    if (server_rtp_sockfd) {
-        close(server_rtp_sockfd);
+    else if (rtsp_view_equals(&req.method, "PLAY")) {
+        if (!client->session ||
+            rtsp_session_find(req.session) != client->session) {
+            handle_cmd_error(result, req.cseq, 454, "Session Not Found");
+        }
+        else if (client->state == RTSP_STATE_INIT) {
+            handle_cmd_error(result, req.cseq, 455,
+                             "Method Not Valid in This State");
+        }
+        else if (req.range_invalid) {
+            handle_cmd_error(result, req.cseq, 457, "Invalid Range");
+        }
+        else {
+            bool seekable;
+            int code = plan_play(client, &req, &seekable, &play_private,
+                                 &play_position);
+            if (code == 455) {
+                handle_cmd_error(result, req.cseq, 455,
+                                 "Method Not Valid in This State");
+            }
+            else if (code == 457) {
+                handle_cmd_error(result, req.cseq, 457, "Invalid Range");
+            }
+            else {
+                // 播放中的跳转先停下，观看者重新初始化后沿用原来的流
+                if (client->state == RTSP_STATE_PLAYING) {
+                    stop_play(client);
+                }
+                for (int i = 0; i < MEDIA_TRACK_COUNT; ++i) {
+                    if (client->tracks[i].setup) {
+                        prepare_track(client, i);
+                    }
+                }
+                char range[64] = "npt=0.000-";
+                std::string rtp_info;
+                if (seekable) {
+                    snprintf(range, sizeof(range), "npt=%.3f-",
+                             (double) play_position / H264_CLOCK_RATE);
+                    rtp_info = play_rtp_info(client, &req.url, play_position);
+                }
+                if (handle_cmd_PLAY(result, sizeof(result), req.cseq,
+                                    client->session, range, rtp_info) != 0) {
+                    printf("failed to handle PLAY\n");
+                    return -1;
+                }
+                play = true;
+            }
+        }
+    }
+    else if (rtsp_view_equals(&req.method, "PAUSE")) {
+        if (!client->session ||
+            rtsp_session_find(req.session) != client->session) {
+            handle_cmd_error(result, req.cseq, 454, "Session Not Found");
+        }
+        else if (client->state == RTSP_STATE_INIT ||
+                 (client->state == RTSP_STATE_PLAYING &&
+                  pause_play(client) < 0)) {
+            handle_cmd_error(result, req.cseq, 455,
+                             "Method Not Valid in This State");
+        }
+        else {
+            // 已经暂停或还没有PLAY时什么都不做
+            handle_cmd_PAUSE(result, req.cseq, client->session);
+        }
+    }
+    else if (rtsp_view_equals(&req.method, "TEARDOWN")) {
+        if (!client->session ||
+            rtsp_session_find(req.session) != client->session) {
+            handle_cmd_error(result, req.cseq, 454, "Session Not Found");
+        }
+        else {
+            // 释放会话的传输，连接保留，客户端可以重新SETUP。排队的帧
+            // 属于这个会话，不再发送，丢帧的状态也不带到下一个会话
+            stop_play(client);
+            rtsp_client_drop_media(client);
+            client->waiting_key = false;
+            client->dropped_frames = 0;
+            rtsp_session_destroy(client->session);
+            client->session = nullptr;
+            for (struct RtspClientTrack& track : client->tracks) {
+                track.setup = false;
+                track.started = false;
+            }
+            client->paused = false;
+            client->state = RTSP_STATE_INIT;
+            handle_cmd_TEARDOWN(result, req.cseq);
+        }
+    }
+    else if (rtsp_view_equals(&req.method, "GET_PARAMETER")) {
+        // 没有请求体时只是保活
+        std::string parameters;
+        if (req.session[0] &&
+            (!client->session ||
+             rtsp_session_find(req.session) != client->session)) {
+            handle_cmd_error(result, req.cseq, 454, "Session Not Found");
+        }
+        else if (select_parameters(client, &message->body, &parameters) < 0) {
+            handle_cmd_error(result, req.cseq, 451,
+                             "Parameter Not Understood");
+        }
+        else if (handle_cmd_GET_PARAMETER(result, sizeof(result), req.cseq,
+                                          client->session, parameters) < 0) {
+            handle_cmd_error(result, req.cseq, 413,
+                             "Request Entity Too Large");
+        }
+    }
+    else {
+        printf("invalid method\n");
+        handle_cmd_error(result, req.cseq, 501, "Not Implemented");
     }
-    if (server_rtcp_sockfd) {
-        close(server_rtcp_sockfd);
+    metrics_add(METRICS_RTSP_REQUESTS, 1);
+    if (verbose) {
+        printf("<<<<<<<<<<<<<<<<<<<<<<<\n");
+        printf("%s write_buffer: %s \n", __FUNCTION__, result);
     }
-    free(read_buffer);
-    free(write_buffer);
+    if (rtsp_client_write(loop, client, result, strlen(result)) < 0) {
+        return -1;
+    }
+    // 开始播放，之后由定时器驱动发送RTP包
+    if (play) {
+        return start_play(loop, client, play_private, play_position);
+    }
+    return 0;
 }
 
-int main() {
-    int server_sockfd;
-    server_sockfd = create_tcp_socket();
-    if (server_sockfd == -1) {
-        printf("failed to create socket\n");
-        return -1;
+/*
+ * 从读缓冲中取出所有完整的请求和交织数据帧依次处理，不完整的留到下次。
+ * 返回RTSP_CLIENT_HANDOFF时还没处理的请求留在读缓冲开头
+ */
+static int process_read_buffer(struct EventLoop* loop,
+                               struct RtspClient* client) {
+    uint32_t consumed = 0;
+    int ret_code = 0;
+    while (!client->closing) {
+        struct RtspMessage message;
+        uint32_t size;
+        enum RtspParseResult ret =
+                rtsp_parse(&client->parser, client->read_buffer + consumed,
+                           client->read_len - consumed, &message, &size);
+        if (ret == RTSP_PARSE_INCOMPLETE) {
+            break;
+        }
+        if (ret == RTSP_PARSE_ERROR) {
+            // 无法确定请求边界，回复错误后关闭连接
+            char result[256];
+            int status = client->parser.status;
+            printf("bad request: %d\n", status);
+            handle_cmd_error(result, 0, status,
+                             status == 413   ? "Request Entity Too Large"
+                             : status == 414 ? "Request-URI Too Large"
+                                             : "Bad Request");
+            client->closing = true;
+            return rtsp_client_write(loop, client, result, strlen(result));
+        }
+        if (ret == RTSP_PARSE_REQUEST) {
+            ret_code = handle_request(loop, client, &message, size);
+            if (ret_code < 0) {
+                return -1;
+            }
+            if (ret_code == RTSP_CLIENT_HANDOFF) {
+                break;
+            }
+        }
+        // RTP over TCP时客户端通过各轨道的RTCP通道发来的接收报告
+        for (struct RtspClientTrack& track : client->tracks) {
+            if (ret == RTSP_PARSE_INTERLEAVED && track.interleaved &&
+                message.channel == track.interleaved_rtcp_channel) {
+                media_source_on_rtcp(&track.subscriber,
+                                     (const uint8_t*) message.body.data,
+                                     message.body.size);
+            }
+        }
+        consumed += size;
     }
-    
-    if (bind_socket_addr(server_sockfd, "0.0.0.0", SERVER_PORT) == -1) {
-        printf("failed to bind\n");
+    memmove(client->read_buffer, client->read_buffer + consumed,
+            client->read_len - consumed);
+    client->read_len -= consumed;
+    if (client->read_len >= BUFFER_MAX_SIZE) {
+        printf("request too large\n");
         return -1;
     }
-    
-    if (listen(server_sockfd, 5) == -1) {
-        printf("failed to listen\n");
-        return -1;
+    if (client->read_len == 0 &&
+        client->read_capacity > RTSP_READ_BUFFER_SIZE) {
+        free(client->read_buffer);
+        client->read_buffer = (char*) malloc(RTSP_READ_BUFFER_SIZE);
+        client->read_capacity = RTSP_READ_BUFFER_SIZE;
     }
+    return ret_code;
+}
+
+// 在目标线程中接手连接，继续处理留在读缓冲中的请求
+static void on_client_handoff(struct Worker* worker, void* arg) {
+    struct RtspClient* client = (struct RtspClient*) arg;
+    client->loop = worker->loop;
+    if (event_loop_add(client->loop, client->client_sockfd, EPOLLIN,
+                       on_client_event, client) < 0) {
+        rtsp_client_close(client->loop, client);
+        return;
+    }
+    rtsp_client_update_events(client->loop, client);
+    if (process_read_buffer(client->loop, client) != 0) {
+        rtsp_client_close(client->loop, client);
+    }
+}
+
+// 把连接从本线程的事件循环中移除后投递给worker，之后本线程不再访问client
+static void rtsp_client_handoff(struct EventLoop* loop,
+                                struct RtspClient* client,
+                                struct Worker* worker) {
+    printf("hand off client %s:%d to worker %d\n", client->client_ip,
+           client->client_port, worker->id);
+    event_loop_remove(loop, client->client_sockfd);
+    // 请求要在目标线程从头重新解析
+    rtsp_parser_init(&client->parser);
+    worker_task_init(&client->handoff, on_client_handoff, client);
+    worker_post(worker, &client->handoff);
+}
+
+static void on_client_event(struct EventLoop* loop, int fd, uint32_t events,
+                            void* arg) {
+    struct RtspClient* client = (struct RtspClient*) arg;
     
-    printf("%s rtsp://127.0.0.1:%d\n", __FILE__, SERVER_PORT);
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        rtsp_client_close(loop, client);
+        return;
+    }
+    if (events & EPOLLOUT) {
+        if (rtsp_client_flush(loop, client) < 0) {
+            rtsp_client_close(loop, client);
+            return;
+        }
+    }
+    if (events & EPOLLIN) {
+        while (true) {
+            // 读缓冲满时加倍，超过BUFFER_MAX_SIZE的请求已经在
+            // process_read_buffer中被拒绝
+            if (client->read_len == client->read_capacity) {
+                client->read_capacity *= 2;
+                client->read_buffer = (char*) realloc(client->read_buffer,
+                                                      client->read_capacity);
+            }
+            int recv_len = recv(fd, client->read_buffer + client->read_len,
+                                client->read_capacity - client->read_len, 0);
+            if (recv_len < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                    break;
+                }
+                rtsp_client_close(loop, client);
+                return;
+            }
+            if (recv_len == 0) {
+                rtsp_client_close(loop, client);
+                return;
+            }
+            client->read_len += recv_len;
+            int ret = process_read_buffer(loop, client);
+            if (ret < 0) {
+                rtsp_client_close(loop, client);
+                return;
+            }
+            if (ret == RTSP_CLIENT_HANDOFF) {
+                rtsp_client_handoff(loop, client,
+                                    worker_get(MULTICAST_WORKER));
+                return;
+            }
+        }
+    }
+}
+
+static void on_accept(struct EventLoop* loop, int fd, uint32_t events,
+                      void* arg) {
     while (true) {
         int client_sockfd;
         int client_port;
         char client_ip[40];
         
-        client_sockfd = accept_client(server_sockfd, client_ip, &client_port);
+        client_sockfd = accept_client(fd, client_ip, &client_port);
         if (client_sockfd == -1) {
-            printf("failed to accept\n");
-            return -1;
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("failed to accept\n");
+            }
+            return;
         }
         printf("accept client: client ip: %s client port: %d\n",
                client_ip,
                client_port);
-        do_client(client_sockfd, client_ip, client_port);
+        set_nonblocking(client_sockfd);
+        struct RtspClient* client =
+                rtsp_client_create(loop, client_sockfd, client_ip,
+                                   client_port);
+        if (event_loop_add(loop, client_sockfd, EPOLLIN, on_client_event,
+                           client) < 0) {
+            rtsp_client_close(loop, client);
+        }
+    }
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [-f h264_file] [-a aac_file] [-i] "
+           "[-m sendmsg|sendmmsg|gso|uring] [-r fps]\n"
+           "       [-p none|bucket|fq|txtime] [-s rate[:burst]] "
+           "[-g rate[:burst]] [-U]\n"
+           "       [-M group:port[:ttl]] [-w workers] [-c] [-S [ip:]port]\n"
+           "       [-l input [-L ms]] [-K] [-v]\n"
+           "  -f  H.264 Annex-B file to stream, default %s\n"
+           "  -a  ADTS AAC file played as a second track in sync with the "
+           "video\n"
+           "  -i  persist the NAL/RTP index next to the file (<file>%s)\n"
+           "  -m  RTP send mode, default gso (falls back to sendmmsg); uring "
+           "submits the\n"
+           "      whole batch of every socket with one io_uring_enter\n"
+           "  -r  frame rate, default from the SPS VUI timing, else %d\n"
+           "  -p  burst smoothing, default none; fq and txtime need the fq "
+           "qdisc\n"
+           "  -s  per-session peak rate in bit/s and burst in bytes, "
+           "e.g. 20m:64k\n"
+           "  -g  peak rate and burst shared by all sessions, split evenly "
+           "across workers\n"
+           "  -U  send the UDP sessions of each worker from one RTP/RTCP "
+           "socket pair\n"
+           "      (worker 0 on ports %d-%d) instead of a port pair per "
+           "session\n"
+           "  -M  allow multicast SETUP, one sender per source to the group, "
+           "default ttl %d\n"
+           "  -w  worker threads, each with its own listening socket and "
+           "event loop,\n"
+           "      default one per CPU (%d)\n"
+           "  -c  pin worker i to CPU i\n"
+           "  -S  serve Prometheus metrics at http://ip:port/metrics, default "
+           "ip %s;\n"
+           "      RTSP clients can also query them with GET_PARAMETER\n"
+           "  -l  stream live H.264 Annex-B instead of -f: '-' for stdin, a "
+           "FIFO path,\n"
+           "      or udp://[ip]:port, e.g. ffmpeg ... -f h264 pipe: | %s -l -\n"
+           "  -L  how far a live viewer may fall behind before skipping to "
+           "the newest\n"
+           "      IDR frame, default %d ms\n"
+           "  -K  no GOP cache: new viewers are not sent the frames since the "
+           "last IDR\n"
+           "      and start mid-GOP (files) or at the next IDR (live)\n"
+           "  -v  print every RTSP request and response\n",
+           prog, H264_FILE_NAME, H264_INDEX_SUFFIX, H264_DEFAULT_FRAME_RATE,
+           SERVER_RTP_PORT, SERVER_RTP_PORT + 1, MEDIA_MULTICAST_DEFAULT_TTL,
+           worker_default_count(), METRICS_HTTP_DEFAULT_IP, prog,
+           LIVE_DEFAULT_LATENCY_MS);
+}
+
+/*
+ * 在工作线程中创建它自己的监听socket（SO_REUSEPORT）和会话表，
+ * 端口范围按线程数平分
+ */
+static int init_worker(struct Worker* worker, void* arg) {
+    const struct ServerConfig* config = (const struct ServerConfig*) arg;
+    int server_sockfd = create_tcp_socket();
+    if (server_sockfd == -1) {
+        printf("failed to create socket\n");
+        return -1;
+    }
+    if (bind_socket_addr(server_sockfd, "0.0.0.0", SERVER_PORT) == -1) {
+        printf("failed to bind\n");
+        close(server_sockfd);
+        return -1;
+    }
+    if (listen(server_sockfd, SOMAXCONN) == -1) {
+        printf("failed to listen\n");
+        close(server_sockfd);
+        return -1;
+    }
+    set_nonblocking(server_sockfd);
+    if (event_loop_add(worker->loop, server_sockfd, EPOLLIN, on_accept,
+                       nullptr) < 0) {
+        printf("failed to watch listen socket\n");
+        close(server_sockfd);
+        return -1;
+    }
+    int ports = ((SERVER_RTP_PORT_MAX - SERVER_RTP_PORT + 1) /
+                 config->workers) & ~1;
+    int port_min = SERVER_RTP_PORT + worker->id * ports;
+    if (rtsp_session_manager_init(worker->loop, port_min,
+                                  port_min + ports - 1, config->shared_udp,
+                                  on_session_rtcp) < 0) {
+        printf("failed to init session manager\n");
+        return -1;
+    }
+    if (worker->id == 0 && config->metrics_port &&
+        metrics_http_start(worker->loop, config->metrics_ip,
+                           config->metrics_port) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    int opt;
+    enum RtpSendMode send_mode = RTP_SEND_MODE_GSO;
+    enum RtpPacingMode pacing_mode = RTP_PACING_NONE;
+    uint64_t session_rate = 0, global_rate = 0;
+    uint32_t session_burst = RTP_PACING_DEFAULT_BURST;
+    uint32_t global_burst = RTP_PACING_DEFAULT_BURST;
+    struct ServerConfig config = {false, worker_default_count(), "", 0};
+    bool pin_cpu = false;
+    struct MediaMulticast multicast;
+    const char* live_input = nullptr;
+    int live_latency_ms = LIVE_DEFAULT_LATENCY_MS;
+    while ((opt = getopt(argc, argv, "f:a:im:r:p:s:g:UM:w:cS:l:L:Kvh")) != -1) {
+        switch (opt) {
+            case 'f': h264_file_name = optarg; break;
+            case 'a': media_source_set_audio_file(optarg); break;
+            case 'i': media_source_set_index_persist(true); break;
+            case 'm':
+                if (rtp_send_mode_parse(optarg, &send_mode) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'r': {
+                int frame_rate = atoi(optarg);
+                if (frame_rate <= 0 || frame_rate > 240) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                media_source_set_frame_rate(frame_rate);
+                break;
+            }
+            case 'p':
+                if (rtp_pacing_mode_parse(optarg, &pacing_mode) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 's':
+                if (rtp_pacing_parse_rate(optarg, &session_rate,
+                                          &session_burst) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'g':
+                if (rtp_pacing_parse_rate(optarg, &global_rate,
+                                          &global_burst) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'U': config.shared_udp = true; break;
+            case 'M':
+                if (media_source_parse_multicast(optarg, &multicast) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                media_source_set_multicast(&multicast);
+                break;
+            case 'w':
+                config.workers = atoi(optarg);
+                if (config.workers <= 0 || config.workers > WORKER_MAX_COUNT) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'c': pin_cpu = true; break;
+            case 'S':
+                if (metrics_http_parse_addr(optarg, config.metrics_ip,
+                                            sizeof(config.metrics_ip),
+                                            &config.metrics_port) < 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            case 'l': live_input = optarg; break;
+            case 'K': media_source_set_gop_cache(false); break;
+            case 'v': verbose = true; break;
+            case 'L':
+                live_latency_ms = atoi(optarg);
+                if (live_latency_ms <= 0) {
+                    usage(argv[0]);
+                    return -1;
+                }
+                break;
+            default: usage(argv[0]); return opt == 'h' ? 0 : -1;
+        }
+    }
+    if (live_input) {
+        // 直播流只有视频，URL都指向直播流
+        if (media_source_get_audio_file()) {
+            printf("-a can not be used with -l\n");
+            return -1;
+        }
+        struct LiveIngest* ingest =
+                live_ingest_start(live_input, live_latency_ms);
+        if (!ingest) {
+            return -1;
+        }
+        h264_file_name = live_input;
+        media_source_set_live(live_input, ingest);
+    }
+    else {
+        // 建索引要扫描整个文件，放在这里而不是第一个DESCRIBE或PLAY中，
+        // 不阻塞事件循环；文件还不存在时之后的请求再建
+        media_source_preload(h264_file_name);
+    }
+    send_mode = rtp_batch_set_mode(send_mode);
+    printf("rtp send mode: %s\n", rtp_send_mode_name(send_mode));
+    // 每个工作线程维护自己的全局令牌桶，各分得全局速率和桶深的一份，
+    // 桶深不足一个包时由rtp_pacing_configure补足
+    pacing_mode = rtp_pacing_configure(pacing_mode, session_rate,
+                                       session_burst,
+                                       global_rate / config.workers,
+                                       global_burst / config.workers);
+    printf("rtp pacing: %s\n", rtp_pacing_mode_name(pacing_mode));
+    // 客户端断开后继续写socket不应该杀死整个进程
+    signal(SIGPIPE, SIG_IGN);
+    
+    srandom(time(nullptr) ^ getpid());
+    if (worker_start(config.workers, pin_cpu, init_worker, &config) < 0) {
+        printf("failed to start workers\n");
+        return -1;
     }
-    close(server_sockfd);
+    printf("%s rtsp://127.0.0.1:%d, %d workers\n", __FILE__, SERVER_PORT,
+           config.workers);
+    worker_join();
     return 0;
 }
@@ -1,13 +1,19 @@
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <unistd.h>
 
+#include <cerrno>
+#include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
 #include <string>
 
+#include "aac_index.h"
+#include "h264_reader.h"
 #include "rtp.h"
+#include "rtsp_parser.h"
 
 #define SERVER_PORT 8554
 #define SERVER_RTP_PORT 55532
@@ -76,30 +82,49 @@ static int handle_cmd_OPTIONS(char* result, int cseq) {
     return 0;
 }
 
-static int handle_cmd_DESCRIBE(char* result, int cseq, char* url) {
+static int handle_cmd_DESCRIBE(char* result, int cseq,
+                               const struct RtspView* url,
+                               const struct AacIndex* index) {
     char sdp[500];
     char local_ip[100];
-    sscanf(url, "rtsp://%[^:]:", local_ip);
+    
+    // rtsp://host[:port]/path
+    struct RtspView host = *url;
+    if (rtsp_view_starts_with(&host, "rtsp://")) {
+        host.data += strlen("rtsp://");
+        host.size -= strlen("rtsp://");
+    }
+    uint32_t host_size = 0;
+    while (host_size < host.size && host_size < sizeof(local_ip) - 1 &&
+           host.data[host_size] != ':' && host.data[host_size] != '/') {
+        ++host_size;
+    }
+    memcpy(local_ip, host.data, host_size);
+    local_ip[host_size] = '\0';
+    
+    // RFC 3640 AAC-hbr，config为AudioSpecificConfig的十六进制
     sprintf(sdp,
             "v=0\r\n"
-            "o-= 9%ld 1 IN IP4 %s\r\n"
+            "o=- 9%ld 1 IN IP4 %s\r\n"
             "t=0 0\r\n"
             "a=control:*\r\n"
             "m=audio 0 RTP/AVP 97\r\n"
-            "a=rtpmap:97 mpeg-generic/44100/2\r\n"
-            "a=fmtp:97 profile-level-id=1;mode=AAC=hbr;sizelength=13;"
-            "indexdeltalength=3;config=1210;\r\n"
+            "a=rtpmap:97 mpeg-generic/%u/%u\r\n"
+            "a=fmtp:97 streamtype=5;profile-level-id=1;mode=AAC-hbr;"
+            "sizelength=13;indexlength=3;indexdeltalength=3;"
+            "config=%02X%02X\r\n"
             "a=control:track0\r\n",
-            time(nullptr), local_ip);
+            time(nullptr), local_ip, index->sample_rate, index->channels,
+            index->config[0], index->config[1]);
     sprintf(result,
             "RTSP/1.0 200 OK\r\n"
             "CSeq: %d\r\n"
-            "Content-Base: %s\r\n"
+            "Content-Base: %.*s\r\n"
             "Content-type: application/sdp\r\n"
             "Content-length: %zu\r\n"
             "\r\n"
             "%s",
-            cseq, url, strlen(sdp), sdp);
+            cseq, (int) url->size, url->data, strlen(sdp), sdp);
     return 0;
 }
 
@@ -126,72 +151,260 @@ static int handle_cmd_PLAY(char* result, int cseq) {
     return 0;
 }
 
-struct AdtsHeader {
-    unsigned int syncword; // 12bit同步字，'1111.1111.1111'表示一个ADTS帧的开始
-    uint8_t id; // 1bit 0表示MPEG-4，1表示MPEG-2
-    uint8_t layer; // 2bit 必须为0
-    uint8_t protection_absent; // 1bit 1表示没有CRC 0表示有CRC
-    uint8_t profile; // 2bit AAC级别（MPEG-2定义了3中profile
-                     // MPEG-4中定义了6种profile）
-    uint8_t sampling_frequency_index; // 4bit 采样率
-    uint8_t private_bit; // 1bit 编码时设置为0，解码时忽略
-    uint8_t channel_cfg; // 3bit 声道数量
-    uint8_t original_copy; // 1bit 编码时设置为0，解码时忽略
-    uint8_t home; // 1bit 编码时设置为0，解码时忽略
+/*
+ * 把文件中所有的包发给客户端。每个包在其第一个AU的时间戳对应的绝对时间
+ * 发送，时间戳由采样率换算，不会像固定间隔sleep那样累积误差。
+ * 客户端断开RTSP连接时返回-1
+ */
+static int rtp_send_aac_file(int rtp_sockfd, const struct sockaddr_in* addr,
+                             int client_sockfd, const struct AacIndex* index,
+                             const uint8_t* data) {
+    uint8_t header_template[RTP_HEADER_SIZE];
+    uint8_t header[RTP_HEADER_SIZE];
+    uint8_t payload[RTP_MAX_PKT_SIZE];
+    uint32_t ssrc = (uint32_t) random();
+    uint16_t seq = (uint16_t) random();
+    uint32_t timestamp_offset = (uint32_t) random();
+    rtp_header_template(header_template, RTP_PAYLOAD_TYPE_AAC, ssrc);
     
-    uint8_t copyright_identification_bit; // 1bit 编码时设置为0，解码时忽略
-    uint8_t copyright_identification_start; //
-    unsigned int aac_frame_length; // 13bit 一个ADTS帧的长度包含ADTS头和AAC原始流
-    unsigned int adts_buffer_fullness; // 11bit 缓冲区充满度, 0x7FF说明是码率可变
-    // 的码流，不需要此字段，CBR可能需要此字段，不同编码器的使用情况不同。
-    /*
-     * number_of_raw_data_blocks_in_frame
-     * 表示ADTS帧有number_of_raw_data_blocks_in_frame + 1个AAC原始帧
-     * 所以说该字段=0说明ADTS帧中有一个AAC数据块，并不是说没有
-     * 一个AAC原始帧包含一段时间内1024个采样及相关数据*
-     */
-    uint8_t number_of_raw_data_blocks_in_frame; // 2bit
-};
-
-static int parse_adts_header(uint8_t* in, struct AdtsHeader* res) {
-    static int frame_number;
-    bzero(res, sizeof(*res));
-    if (in[0] == 0xFF && (in[1] & 0xF0) == 0xF0) {
-        // 符合同步字
-        res->id = ((uint8_t)in[1] & 0x08) >> 3; // 获取第十三位的bit值
-        res->layer = ((uint8_t)in[1] & 0x06) >> 1; // 获取第14、15位bit值
-        res->protection_absent = ((uint8_t)in[1] & 0x01);
-        res->profile = ((uint8_t)in[2] & 0xc0) >> 6;
-        res->sampling_frequency_index = ((uint8_t)in[2] & 0x3c) >> 2;
-        res->private_bit = ((uint8_t)in[2] & 0x02) >> 1;
-        res->channel_cfg = ((uint8_t)in[2] & 0x01) << 2 |
-                           ((uint8_t)in[3] & 0xc0) >> 6;
-        res->original_copy = ((uint8_t)in[3] & 0x20) >> 5;
-        res->home = ((uint8_t)in[3] & 0x10) >> 4;
-        res->copyright_identification_bit = ((uint8_t)in[3] & 0x08) >> 3;
-        res->copyright_identification_start = ((uint8_t)in[3] & 0x04) >> 2;
-        res->aac_frame_length = ((uint8_t)in[3] & 0x03) << 11 |
-                                ((uint8_t)in[4] & 0xFF) << 3 |
-                                ((uint8_t)in[4] & 0xE0) >> 5;
-        res->adts_buffer_fullness = ((uint8_t)in[4] & 0x1F) << 6 |
-                                    ((uint8_t)in[5] & 0xFc) >> 2;
-        res->number_of_raw_data_blocks_in_frame = ((uint8_t)in[5] & 0x3);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (const struct AacIndexPacket& packet : index->packets) {
+        uint64_t ns = start.tv_nsec + (uint64_t) packet.timestamp *
+                                              1000000000ull /
+                                              index->sample_rate;
+        struct timespec deadline;
+        deadline.tv_sec = start.tv_sec + ns / 1000000000ull;
+        deadline.tv_nsec = ns % 1000000000ull;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                               nullptr) == EINTR) {
+        }
         
+        uint32_t size = aac_index_packet_payload(index, data, &packet,
+                                                 payload);
+        // 包含完整AU（或AU的最后一个分片）的包置M位
+        memcpy(header, header_template, RTP_HEADER_SIZE);
+        header[1] |= packet.marker ? RTP_MARKER : 0;
+        rtp_header_stamp(header, seq++,
+                         (uint32_t) (packet.timestamp + timestamp_offset));
+        if (rtp_send_iov_over_udp(rtp_sockfd, addr, header, RTP_HEADER_SIZE,
+                                  payload, size) < 0) {
+            printf("failed to send rtp packet: %s\n", strerror(errno));
+        }
+        
+        char c;
+        if (recv(client_sockfd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Transport: RTP/AVP;unicast;client_port=13358-13359
+static int parse_client_port(const struct RtspView* transport, int* rtp_port,
+                             int* rtcp_port) {
+    struct RtspView rest = *transport, param;
+    while (rtsp_view_next_token(&rest, ';', &param)) {
+        if (!rtsp_view_starts_with(&param, "client_port=")) {
+            continue;
+        }
+        param.data += strlen("client_port=");
+        param.size -= strlen("client_port=");
+        struct RtspView port;
+        if (!rtsp_view_next_token(&param, '-', &port) ||
+            rtsp_view_to_int(&port, rtp_port) < 0) {
+            return -1;
+        }
+        if (!rtsp_view_next_token(&param, '-', &port) ||
+            rtsp_view_to_int(&port, rtcp_port) < 0) {
+            *rtcp_port = *rtp_port + 1;
+        }
         return 0;
     }
-    else {
-        printf("failed to parse adts header\n");
-        return -1;
+    return -1;
+}
+
+static void do_client(int client_sockfd, const char* client_ip,
+                      int client_port, const struct AacIndex* index,
+                      const uint8_t* data) {
+    int server_rtp_sockfd = -1, server_rtcp_sockfd = -1;
+    int client_rtp_port = 0, client_rtcp_port = 0;
+    char* read_buffer = (char*) malloc(BUFFER_MAX_SIZE);
+    char* write_buffer = (char*) malloc(BUFFER_MAX_SIZE);
+    int read_len = 0;
+    struct RtspParser parser;
+    rtsp_parser_init(&parser);
+    bool playing = false;
+    
+    while (!playing) {
+        int recv_len = recv(client_sockfd, read_buffer + read_len,
+                            BUFFER_MAX_SIZE - read_len, 0);
+        if (recv_len <= 0) {
+            break;
+        }
+        read_len += recv_len;
+        
+        uint32_t consumed = 0;
+        while (!playing) {
+            struct RtspMessage message;
+            uint32_t size;
+            enum RtspParseResult ret =
+                    rtsp_parse(&parser, read_buffer + consumed,
+                               read_len - consumed, &message, &size);
+            if (ret == RTSP_PARSE_INCOMPLETE) {
+                break;
+            }
+            if (ret == RTSP_PARSE_ERROR) {
+                printf("bad request: %d\n", parser.status);
+                read_len = BUFFER_MAX_SIZE;
+                break;
+            }
+            consumed += size;
+            if (ret != RTSP_PARSE_REQUEST) {
+                continue;
+            }
+            printf(">>>>>>>>>>>>>>>>>>>>>>\n");
+            printf("%s read_buffer = %.*s \n", __FUNCTION__, (int) size,
+                   message.method.data);
+            
+            const struct RtspView* method = &message.method;
+            if (rtsp_view_equals(method, "OPTIONS")) {
+                handle_cmd_OPTIONS(write_buffer, message.cseq);
+            }
+            else if (rtsp_view_equals(method, "DESCRIBE")) {
+                handle_cmd_DESCRIBE(write_buffer, message.cseq, &message.url,
+                                    index);
+            }
+            else if (rtsp_view_equals(method, "SETUP")) {
+                const struct RtspView* transport =
+                        rtsp_message_header(&message, "Transport");
+                if (!transport ||
+                    parse_client_port(transport, &client_rtp_port,
+                                      &client_rtcp_port) < 0) {
+                    printf("parse Transport error\n");
+                    read_len = BUFFER_MAX_SIZE;
+                    break;
+                }
+                handle_cmd_SETUP(write_buffer, message.cseq, client_rtp_port);
+                if (server_rtp_sockfd < 0) {
+                    server_rtp_sockfd = create_udp_socket();
+                    server_rtcp_sockfd = create_udp_socket();
+                    if (server_rtp_sockfd < 0 || server_rtcp_sockfd < 0 ||
+                        bind_socket_addr(server_rtp_sockfd, "0.0.0.0",
+                                         SERVER_RTP_PORT) < 0 ||
+                        bind_socket_addr(server_rtcp_sockfd, "0.0.0.0",
+                                         SERVER_RTCP_PORT) < 0) {
+                        printf("failed to bind addr\n");
+                        read_len = BUFFER_MAX_SIZE;
+                        break;
+                    }
+                }
+            }
+            else if (rtsp_view_equals(method, "PLAY")) {
+                if (server_rtp_sockfd < 0) {
+                    printf("PLAY before SETUP\n");
+                    read_len = BUFFER_MAX_SIZE;
+                    break;
+                }
+                handle_cmd_PLAY(write_buffer, message.cseq);
+                playing = true;
+            }
+            else {
+                printf("未定义的method\n");
+                read_len = BUFFER_MAX_SIZE;
+                break;
+            }
+            printf("<<<<<<<<<<<<<<<<<<<<<<<\n");
+            printf("%s write_buffer: %s \n", __FUNCTION__, write_buffer);
+            send(client_sockfd, write_buffer, strlen(write_buffer),
+                 MSG_NOSIGNAL);
+        }
+        if (read_len >= BUFFER_MAX_SIZE) {
+            break;
+        }
+        memmove(read_buffer, read_buffer + consumed, read_len - consumed);
+        read_len -= consumed;
+    }
+    
+    if (playing) {
+        struct sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = inet_addr(client_ip);
+        addr.sin_port = htons(client_rtp_port);
+        printf("start play aac: client ip: %s client port: %d\n", client_ip,
+               client_rtp_port);
+        if (rtp_send_aac_file(server_rtp_sockfd, &addr, client_sockfd, index,
+                              data) < 0) {
+            printf("client closed the connection\n");
+        }
     }
+    if (server_rtp_sockfd >= 0) {
+        close(server_rtp_sockfd);
+    }
+    if (server_rtcp_sockfd >= 0) {
+        close(server_rtcp_sockfd);
+    }
+    free(read_buffer);
+    free(write_buffer);
+    close(client_sockfd);
+    printf("close client: client ip: %s client port: %d\n", client_ip,
+           client_port);
 }
 
-static int rtp_send_aac_frame(int socket, const char* ip, int16_t port,
-                              struct RtpPacket* rtp_packet, uint8_t* frame,
-                              uint32_t frame_size) {
-    int ret;
+int main(int argc, char* argv[]) {
+    const char* aac_file_name = ACC_FILE_NAME;
+    int opt;
+    while ((opt = getopt(argc, argv, "f:h")) != -1) {
+        switch (opt) {
+            case 'f': aac_file_name = optarg; break;
+            default:
+                printf("usage: %s [-f adts_aac_file]\n"
+                       "  -f  ADTS AAC file to stream, default %s\n",
+                       argv[0], ACC_FILE_NAME);
+                return opt == 'h' ? 0 : -1;
+        }
+    }
+    signal(SIGPIPE, SIG_IGN);
+    
+    std::shared_ptr<const struct AacIndex> index = aac_index_get(aac_file_name);
+    struct H264Reader reader; // 只用来映射文件，AU的位置都来自索引
+    if (!index || h264_reader_open(&reader, aac_file_name) < 0) {
+        printf("读取 %s 失败\n", aac_file_name);
+        return -1;
+    }
     
-    rtp_packet->payload[0] = 0x00;
-    rtp_packet->payload[1] = 0x10;
-    rtp_packet->payload[2] = (frame_size & 0x1FE0) >> 5; // 高八位
-    rtp_packet->payload[3] = (frame_size & 0x1f); // 低五位
+    int server_sockfd = create_tcp_socket();
+    if (server_sockfd < 0) {
+        printf("failed to create socket\n");
+        return -1;
+    }
+    if (bind_socket_addr(server_sockfd, "0.0.0.0", SERVER_PORT) < 0) {
+        printf("failed to bind\n");
+        return -1;
+    }
+    if (listen(server_sockfd, SOMAXCONN) < 0) {
+        printf("failed to listen\n");
+        return -1;
+    }
+    srandom(time(nullptr) ^ getpid());
+    printf("%s rtsp://127.0.0.1:%d\n", __FILE__, SERVER_PORT);
+    
+    while (true) {
+        char client_ip[40];
+        int client_port;
+        int client_sockfd = accept_client(server_sockfd, client_ip,
+                                          &client_port);
+        if (client_sockfd < 0) {
+            printf("failed to accept\n");
+            continue;
+        }
+        printf("accept client: client ip: %s client port: %d\n", client_ip,
+               client_port);
+        do_client(client_sockfd, client_ip, client_port, index.get(),
+                  reader.data);
+    }
+    h264_reader_close(&reader);
+    close(server_sockfd);
+    return 0;
 }
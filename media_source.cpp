@@ -0,0 +1,1681 @@
+#include "media_source.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "aac_index.h"
+#include "buffer_pool.h"
+#include "event_loop.h"
+#include "h264_index.h"
+#include "h264_reader.h"
+#include "live_ingest.h"
+#include "rtcp.h"
+#include "metrics.h"
+#include "rtp_batch.h"
+#include "scheduler.h"
+#include "worker.h"
+
+// 直播源GOP缓存中的一帧
+struct MediaGopFrame {
+    struct PoolBuffer* buffer;
+    uint32_t timestamp;
+    uint32_t flags;
+};
+
+// 历史中的一个包：在索引中的位置和发送时的源时间戳
+struct MediaPacketHistory {
+    uint32_t packet;
+    uint32_t timestamp;
+    bool last; // 帧的最后一个包
+};
+
+#define HISTORY_MASK (MEDIA_SOURCE_HISTORY_SIZE - 1)
+#define RTCP_CNAME "rtspserver"
+
+// 一个轨道的观看者
+struct MediaTrack {
+    std::vector<struct MediaSubscriber*> subscribers;
+
+    // 组播：有组播观看者时multicast_sender作为一个普通的UDP观看者加入
+    // subscribers，目的地址是组播组，所有组播观看者收到的都是它发的包
+    struct MediaSubscriber* multicast_sender;
+    std::vector<struct MediaSubscriber*> multicast_viewers;
+};
+
+struct MediaSource {
+    std::string file_name;
+    // 在源表中的键：共享源是文件名，会话私有的源是文件名、'\0'加会话ID
+    std::string key;
+    struct Scheduler* scheduler;
+    struct SchedulerTimer timer;
+    struct H264Reader reader; // 只用来映射文件，NALU位置都来自索引
+    // 源持有索引的引用，文件被替换后旧索引在源结束时释放
+    std::shared_ptr<const struct H264Index> index;
+    uint32_t frame_pos; // 下一个要发送的帧在索引中的下标
+    // 最近发送的IDR帧在索引中的下标，[key_pos, frame_pos)是文件源的GOP
+    // 缓存，还没有发送过IDR帧时为UINT32_MAX
+    uint32_t key_pos;
+    uint32_t timestamp; // 源时间戳，观看者的时间戳 = 源时间戳 + 各自偏移
+
+    // 时间戳为start_timestamp的帧在start_ns发送，其余帧的发送时间由
+    // 时间戳之差换算，不随发送耗时累积误差。文件源的时间戳是索引中
+    // 64位的位置，source->timestamp和RTP头中是它的低32位
+    uint64_t start_ns;
+    uint64_t start_timestamp;
+
+    const struct H264IndexFrame* frame; // 当前要发送的帧
+    // 当前帧的包是packets[frame->first_packet]起的packet_count个，负载在
+    // data + offset，STAP-A包在aggregates + offset。文件源指向索引、映射的
+    // 文件和索引的聚合负载，直播源都指向取出的帧
+    const struct H264IndexPacket* packets;
+    const uint8_t* data;
+    const uint8_t* aggregates;
+    // 源的包序号：当前帧第一个包的序号和下一帧第一个包的序号。
+    // 序号为n的包记录在history[n & HISTORY_MASK]，数据仍在映射的文件中，
+    // 重传时不用重新读文件
+    uint32_t frame_packet;
+    uint32_t next_packet;
+    std::vector<struct MediaPacketHistory> history;
+
+    // TCP观看者的'$'前缀加包头，以及指向它们和负载的iovec
+    std::vector<uint8_t> tcp_headers;
+    std::vector<struct iovec> tcp_iov;
+    // 当前帧（或音频包）负载的共享拷贝，有TCP观看者需要排队时才创建，
+    // 发给所有观看者之后源放开自己的引用
+    struct PoolBuffer* tcp_shared;
+
+    // 音频轨，audio_index为nullptr时没有音频。音频包的时间戳以采样为单位，
+    // 以第一帧视频的时间戳base_timestamp为0时刻换算到视频的时间线上，
+    // 与视频共用start_ns/start_timestamp计时
+    std::shared_ptr<const struct AacIndex> audio_index;
+    struct H264Reader audio_reader;
+    uint32_t audio_pos; // 下一个要发送的音频包在索引中的下标
+    uint64_t base_timestamp;
+    // 音频包的负载（AU-header要重新生成），所有观看者共用，每个包发完即刷新
+    uint8_t audio_payload[RTP_MAX_PKT_SIZE];
+
+    struct MediaTrack tracks[MEDIA_TRACK_COUNT];
+    struct MediaMulticast multicast;
+    // 正在逐个通知观看者播放结束，此时取消订阅不销毁源
+    bool ending;
+    // 本线程中这个文件的计数，文件太多没有登记时为nullptr
+    struct MetricsBlock* metrics;
+
+    // 直播源（index为nullptr）：环的消费者和当前帧。帧的缓冲直接作为
+    // TCP排队的共享负载；包的位置每帧都变，不保留重传历史
+    struct LiveReader live;
+    struct PoolBuffer* live_buffer;
+    struct H264IndexFrame live_frame;
+    std::vector<struct H264IndexPacket> live_packets;
+    // 直播源的GOP缓存：最近的IDR帧起每一帧的缓冲引用
+    std::vector<struct MediaGopFrame> gop;
+    uint32_t gop_bytes;
+};
+
+// 源和发送批次属于各自的工作线程，配置在启动线程前设置，之后只读
+static thread_local std::unordered_map<std::string, struct MediaSource*>
+        media_sources;
+static bool index_persist = false;
+static bool gop_cache = true;
+static uint32_t source_frame_rate = 0;
+static std::string audio_file;
+static bool multicast_enabled = false;
+static struct MediaMulticast multicast_config;
+static struct LiveIngest* live_ingest = nullptr;
+static std::string live_name;
+static thread_local struct RtpBatch rtp_batch;
+// 上次计入计数时批次的累计值。每个源发完都会flush，两次之间的增量
+// （包括批次满时自动flush的部分）都属于这次flush的源
+struct BatchReported {
+    uint64_t packets_sent;
+    uint64_t bytes_sent;
+    uint64_t syscalls;
+    uint64_t packets_dropped;
+    uint64_t send_errors;
+};
+static thread_local struct BatchReported batch_reported;
+
+// 同时计入服务器和源的计数
+static void media_source_count(struct MediaSource* source,
+                               enum MetricsCounter counter, int64_t n) {
+    metrics_add(counter, n);
+    if (source->metrics) {
+        metrics_block_add(source->metrics, counter, n);
+    }
+}
+
+static void media_source_flush(struct MediaSource* source) {
+    rtp_batch_flush(&rtp_batch);
+    struct BatchReported* reported = &batch_reported;
+    media_source_count(source, METRICS_RTP_PACKETS,
+                       rtp_batch.packets_sent - reported->packets_sent);
+    media_source_count(source, METRICS_RTP_BYTES,
+                       rtp_batch.bytes_sent - reported->bytes_sent);
+    media_source_count(source, METRICS_SEND_SYSCALLS,
+                       rtp_batch.syscalls - reported->syscalls);
+    media_source_count(source, METRICS_SEND_DROPPED,
+                       rtp_batch.packets_dropped - reported->packets_dropped);
+    media_source_count(source, METRICS_SEND_ERRORS,
+                       rtp_batch.send_errors - reported->send_errors);
+    reported->packets_sent = rtp_batch.packets_sent;
+    reported->bytes_sent = rtp_batch.bytes_sent;
+    reported->syscalls = rtp_batch.syscalls;
+    reported->packets_dropped = rtp_batch.packets_dropped;
+    reported->send_errors = rtp_batch.send_errors;
+}
+
+#define TCP_HEADER_SLOT (RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE + 2)
+
+// 没有共用负载的帧，如SR
+static void tcp_frame_init(struct MediaTcpFrame* frame,
+                           const struct iovec* iov, int iovcnt, uint32_t size,
+                           bool key) {
+    frame->iov = iov;
+    frame->iovcnt = iovcnt;
+    frame->size = size;
+    frame->key = key;
+    frame->data = nullptr;
+    frame->data_size = 0;
+    frame->shared = nullptr;
+}
+
+// 放开源对共享负载的引用，排队的连接各自持有引用直到发完
+static void media_source_release_shared(struct MediaSource* source) {
+    if (source->tcp_shared) {
+        pool_buffer_unref(source->tcp_shared);
+        source->tcp_shared = nullptr;
+    }
+}
+
+struct PoolBuffer* media_tcp_frame_share(const struct MediaTcpFrame* frame) {
+    if (!frame->data) {
+        return nullptr;
+    }
+    struct PoolBuffer* buffer = *frame->shared;
+    if (!buffer) {
+        buffer = pool_buffer_alloc(frame->data_size);
+        if (!buffer) {
+            return nullptr;
+        }
+        memcpy(buffer->data, frame->data, frame->data_size);
+        buffer->size = frame->data_size;
+        *frame->shared = buffer;
+    }
+    return pool_buffer_ref(buffer);
+}
+
+static const uint8_t* packet_payload(const struct MediaSource* source,
+                                     const struct H264IndexPacket& entry) {
+    return (h264_index_is_aggregate(entry) ? source->aggregates
+                                           : source->data) +
+           entry.offset;
+}
+
+static void media_source_send_tcp(struct MediaSource* source,
+                                  struct MediaSubscriber* subscriber) {
+    const struct H264IndexFrame* frame = source->frame;
+    uint32_t timestamp = source->timestamp + subscriber->timestamp_offset;
+    uint16_t seq = subscriber->seq;
+    uint32_t size = 0;
+    uint32_t octets = 0;
+
+    source->tcp_headers.resize(frame->packet_count * TCP_HEADER_SLOT);
+    source->tcp_iov.resize(frame->packet_count * 2);
+    for (uint32_t i = 0; i < frame->packet_count; ++i) {
+        const struct H264IndexPacket& entry =
+                source->packets[frame->first_packet + i];
+        uint8_t* slot = &source->tcp_headers[i * TCP_HEADER_SLOT];
+        uint32_t header_size = h264_index_packet_header(
+                slot + RTP_TCP_PREFIX_SIZE, subscriber->rtp_header, entry,
+                seq++, timestamp, i + 1 == frame->packet_count);
+        uint32_t rtp_size = header_size + entry.size;
+        octets += rtp_size - RTP_HEADER_SIZE;
+        slot[0] = 0x24;
+        slot[1] = (uint8_t) subscriber->interleaved_channel;
+        slot[2] = (uint8_t) ((rtp_size & 0xFF00) >> 8);
+        slot[3] = (uint8_t) (rtp_size & 0xFF);
+        source->tcp_iov[2 * i].iov_base = slot;
+        source->tcp_iov[2 * i].iov_len = RTP_TCP_PREFIX_SIZE + header_size;
+        source->tcp_iov[2 * i + 1].iov_base =
+                (void*) packet_payload(source, entry);
+        source->tcp_iov[2 * i + 1].iov_len = entry.size;
+        size += RTP_TCP_PREFIX_SIZE + rtp_size;
+    }
+    // 一帧的NALU在文件中是连续的一段，直播源是整个帧的缓冲。STAP-A包的
+    // 负载不在这一段中，排队时各自拷贝
+    struct MediaTcpFrame tcp_frame;
+    tcp_frame_init(&tcp_frame, source->tcp_iov.data(),
+                   frame->packet_count * 2, size,
+                   frame->flags & H264_INDEX_FRAME_KEY);
+    if (source->live_buffer) {
+        tcp_frame.data = source->live_buffer->data;
+        tcp_frame.data_size = source->live_buffer->size;
+    }
+    else {
+        const struct H264IndexNalu& first =
+                source->index->nalus[frame->first_nalu];
+        const struct H264IndexNalu& last =
+                source->index->nalus[frame->first_nalu + frame->nalu_count - 1];
+        tcp_frame.data = source->data + first.offset;
+        tcp_frame.data_size = last.offset + last.size - first.offset;
+    }
+    tcp_frame.shared = &source->tcp_shared;
+    if (subscriber->on_tcp_frame(subscriber, &tcp_frame, subscriber->arg) ==
+        0) {
+        subscriber->seq = seq;
+        subscriber->packet_count += frame->packet_count;
+        subscriber->octet_count += octets;
+        media_source_count(source, METRICS_RTP_PACKETS, frame->packet_count);
+        media_source_count(source, METRICS_RTP_BYTES,
+                           size - frame->packet_count * RTP_TCP_PREFIX_SIZE);
+    }
+    else {
+        media_source_count(source, METRICS_FRAMES_DROPPED, 1);
+    }
+}
+
+static uint32_t packet_size(const struct H264IndexPacket& entry) {
+    return RTP_HEADER_SIZE + h264_index_prefix_size(entry) + entry.size;
+}
+
+// 把索引中的一个包加入批次，RTP头和FU-A的两个字节由观看者的模板在
+// 栈上生成，负载直接指向映射的文件或聚合负载
+static void media_source_add_packet(struct MediaSource* source,
+                                    struct MediaSubscriber* subscriber,
+                                    const struct H264IndexPacket& entry,
+                                    uint16_t seq, uint32_t timestamp,
+                                    bool last, uint64_t txtime_ns) {
+    uint8_t header[RTP_HEADER_SIZE + 2];
+    uint32_t header_size = h264_index_packet_header(
+            header, subscriber->rtp_header, entry, seq,
+            timestamp + subscriber->timestamp_offset, last);
+    rtp_batch_add(&rtp_batch, subscriber->rtp_sockfd,
+                  subscriber->rtp_connected ? nullptr : &subscriber->rtp_addr,
+                  header, header_size, packet_payload(source, entry),
+                  entry.size, txtime_ns);
+}
+
+// 把当前帧的第i个包发给subscriber
+static void media_source_add_udp(struct MediaSource* source,
+                                 struct MediaSubscriber* subscriber,
+                                 uint32_t i, uint64_t txtime_ns) {
+    const struct H264IndexPacket& entry =
+            source->packets[source->frame->first_packet + i];
+    media_source_add_packet(source, subscriber, entry, subscriber->seq++,
+                            source->timestamp,
+                            i + 1 == source->frame->packet_count, txtime_ns);
+    ++subscriber->packet_count;
+    subscriber->octet_count += h264_index_prefix_size(entry) + entry.size;
+}
+
+/*
+ * 用户态整形：发送subscriber在当前帧中令牌足够的包，force时不等令牌
+ * 全部发出。返回剩余的包可以继续发送的时间，没有积压时返回0
+ */
+static uint64_t media_source_pace(struct MediaSource* source,
+                                  struct MediaSubscriber* subscriber,
+                                  uint64_t now, bool force) {
+    const struct H264IndexFrame* frame = source->frame;
+    while (subscriber->pending_packet < frame->packet_count) {
+        uint32_t size = packet_size(
+                source->packets[frame->first_packet +
+                                subscriber->pending_packet]);
+        uint64_t ready = rtp_pacer_ready_ns(&subscriber->pacer, now, size);
+        if (ready > now + RTP_PACING_SLACK_NS && !force) {
+            return ready;
+        }
+        rtp_pacer_consume(&subscriber->pacer, ready > now ? ready : now, size);
+        media_source_add_udp(source, subscriber, subscriber->pending_packet++,
+                             0);
+    }
+    return 0;
+}
+
+// 发送所有用户态整形积压的包，返回最早的继续发送时间，没有积压时返回0
+static uint64_t media_source_pace_all(struct MediaSource* source, uint64_t now,
+                                      bool force) {
+    uint64_t resume = 0;
+    if (!source->frame || rtp_pacing_get_mode() != RTP_PACING_BUCKET) {
+        return 0;
+    }
+    for (struct MediaSubscriber* subscriber :
+         source->tracks[MEDIA_TRACK_VIDEO].subscribers) {
+        if (subscriber->interleaved_channel >= 0) {
+            continue;
+        }
+        uint64_t ready = media_source_pace(source, subscriber, now, force);
+        if (ready && (!resume || ready < resume)) {
+            resume = ready;
+        }
+    }
+    media_source_flush(source);
+    return resume;
+}
+
+static void media_source_send_sr(struct MediaSource* source,
+                                 struct MediaSubscriber* subscriber,
+                                 uint64_t now) {
+    if (subscriber->rtcp_sockfd < 0 && subscriber->rtcp_channel < 0) {
+        return;
+    }
+    uint8_t buffer[RTP_TCP_PREFIX_SIZE + RTCP_SR_MAX_SIZE];
+    uint8_t* sr = buffer + RTP_TCP_PREFIX_SIZE;
+    // now对应的RTP时间戳，与RTP包使用同一条时间线。音频和视频的SR由
+    // 同一个时钟换算，接收端据此对齐两个轨道
+    uint64_t ntp = rtcp_ntp_now();
+    uint64_t timestamp =
+            source->start_timestamp +
+            (now - source->start_ns) * H264_CLOCK_RATE / 1000000000ull;
+    if (subscriber->track == MEDIA_TRACK_AUDIO) {
+        // 换算成从音频0时刻起的微秒数再乘采样率，避免溢出
+        uint64_t us = (timestamp - source->base_timestamp) * 1000000ull /
+                      H264_CLOCK_RATE;
+        timestamp = us * source->audio_index->sample_rate / 1000000ull;
+    }
+    timestamp += subscriber->timestamp_offset;
+    int size = rtcp_build_sr(sr, subscriber->ssrc, ntp, timestamp,
+                             subscriber->packet_count,
+                             subscriber->octet_count, RTCP_CNAME);
+    subscriber->last_sr_ns = now;
+    subscriber->last_sr_ntp = (uint32_t) (ntp >> 16);
+    if (subscriber->rtcp_channel >= 0) {
+        buffer[0] = 0x24;
+        buffer[1] = (uint8_t) subscriber->rtcp_channel;
+        buffer[2] = (uint8_t) (size >> 8);
+        buffer[3] = (uint8_t) size;
+        struct iovec iov = {buffer, (size_t) (RTP_TCP_PREFIX_SIZE + size)};
+        struct MediaTcpFrame tcp_frame;
+        tcp_frame_init(&tcp_frame, &iov, 1, iov.iov_len, false);
+        subscriber->on_tcp_frame(subscriber, &tcp_frame, subscriber->arg);
+        return;
+    }
+    sendto(subscriber->rtcp_sockfd, sr, size, 0,
+           (struct sockaddr*) &subscriber->rtcp_addr,
+           sizeof(subscriber->rtcp_addr));
+}
+
+// 发送当前帧，返回用户态整形时积压的包的继续发送时间，没有积压时返回0
+static uint64_t media_source_send(struct MediaSource* source, uint64_t now) {
+    const struct H264IndexFrame* frame = source->frame;
+    enum RtpPacingMode mode = rtp_pacing_get_mode();
+    uint64_t resume = 0;
+
+    source->frame_packet = source->next_packet;
+    for (uint32_t i = 0; source->index && i < frame->packet_count; ++i) {
+        struct MediaPacketHistory& history =
+                source->history[(source->next_packet + i) & HISTORY_MASK];
+        history.packet = frame->first_packet + i;
+        history.timestamp = source->timestamp;
+        history.last = i + 1 == frame->packet_count;
+    }
+    source->next_packet += frame->packet_count;
+
+    const auto& subscribers = source->tracks[MEDIA_TRACK_VIDEO].subscribers;
+    for (struct MediaSubscriber* subscriber : subscribers) {
+        if (subscriber->catching_up) {
+            if (!(frame->flags & H264_INDEX_FRAME_KEY)) {
+                subscriber->pending_packet = frame->packet_count;
+                // 直播源的GOP超过缓存上限被清空，补不上了，等下一个IDR帧
+                if (!source->index && source->gop.empty()) {
+                    subscriber->catching_up = false;
+                    subscriber->waiting_key = true;
+                }
+                continue;
+            }
+            // 新的GOP开始，不用再补
+            subscriber->catching_up = false;
+            subscriber->seq_offset =
+                    subscriber->seq - (uint16_t) source->frame_packet;
+        }
+        if (subscriber->waiting_key) {
+            if (!(frame->flags & H264_INDEX_FRAME_KEY)) {
+                subscriber->pending_packet = frame->packet_count;
+                continue;
+            }
+            subscriber->waiting_key = false;
+        }
+        if (subscriber->interleaved_channel >= 0) {
+            media_source_send_tcp(source, subscriber);
+            continue;
+        }
+        if (mode == RTP_PACING_BUCKET) {
+            subscriber->pending_packet = 0;
+            uint64_t ready = media_source_pace(source, subscriber, now, false);
+            if (ready && (!resume || ready < resume)) {
+                resume = ready;
+            }
+            continue;
+        }
+        for (uint32_t i = 0; i < frame->packet_count; ++i) {
+            uint64_t txtime = 0;
+            if (mode == RTP_PACING_TXTIME) {
+                // 发送时间由内核的qdisc保证，这里只按令牌桶计算
+                uint32_t size = packet_size(
+                        source->packets[frame->first_packet + i]);
+                txtime = rtp_pacer_ready_ns(&subscriber->pacer, now, size);
+                rtp_pacer_consume(&subscriber->pacer, txtime, size);
+            }
+            media_source_add_udp(source, subscriber, i, txtime);
+        }
+    }
+    media_source_release_shared(source);
+    // 一帧发给所有观看者的包一起发送，UDP发送失败（如发送缓冲满）直接丢弃
+    media_source_flush(source);
+
+    for (struct MediaSubscriber* subscriber : subscribers) {
+        if (now - subscriber->last_sr_ns >= MEDIA_SOURCE_SR_INTERVAL_NS) {
+            media_source_send_sr(source, subscriber, now);
+        }
+    }
+    return resume;
+}
+
+/*
+ * 把一个音频包发给所有音频观看者。音频码率低，不做整形；AU-header
+ * 按包生成在audio_payload中，发完马上刷新批次
+ */
+static void media_source_send_audio(struct MediaSource* source,
+                                    const struct AacIndexPacket* packet,
+                                    uint64_t now) {
+    uint32_t size = aac_index_packet_payload(
+            source->audio_index.get(), source->audio_reader.data, packet,
+            source->audio_payload);
+    // 包含完整AU（或AU的最后一个分片）的包置M位
+    uint8_t marker = packet->marker ? RTP_MARKER : 0;
+    uint8_t header[RTP_TCP_PREFIX_SIZE + RTP_HEADER_SIZE];
+    uint8_t* rtp_header = header + RTP_TCP_PREFIX_SIZE;
+
+    const auto& subscribers = source->tracks[MEDIA_TRACK_AUDIO].subscribers;
+    for (struct MediaSubscriber* subscriber : subscribers) {
+        memcpy(rtp_header, subscriber->rtp_header, RTP_HEADER_SIZE);
+        rtp_header[1] |= marker;
+        rtp_header_stamp(rtp_header, subscriber->seq,
+                         (uint32_t) (packet->timestamp +
+                                     subscriber->timestamp_offset));
+        if (subscriber->interleaved_channel >= 0) {
+            uint32_t rtp_size = RTP_HEADER_SIZE + size;
+            header[0] = 0x24;
+            header[1] = (uint8_t) subscriber->interleaved_channel;
+            header[2] = (uint8_t) (rtp_size >> 8);
+            header[3] = (uint8_t) rtp_size;
+            struct iovec iov[2] = {
+                    {header, sizeof(header)},
+                    {source->audio_payload, size},
+            };
+            struct MediaTcpFrame tcp_frame;
+            tcp_frame_init(&tcp_frame, iov, 2, RTP_TCP_PREFIX_SIZE + rtp_size,
+                           true);
+            tcp_frame.data = source->audio_payload;
+            tcp_frame.data_size = size;
+            tcp_frame.shared = &source->tcp_shared;
+            if (subscriber->on_tcp_frame(subscriber, &tcp_frame,
+                                         subscriber->arg) < 0) {
+                media_source_count(source, METRICS_FRAMES_DROPPED, 1);
+                continue;
+            }
+            media_source_count(source, METRICS_RTP_PACKETS, 1);
+            media_source_count(source, METRICS_RTP_BYTES, rtp_size);
+        }
+        else {
+            rtp_batch_add(&rtp_batch, subscriber->rtp_sockfd,
+                          subscriber->rtp_connected ? nullptr
+                                                    : &subscriber->rtp_addr,
+                          rtp_header, RTP_HEADER_SIZE, source->audio_payload,
+                          size, 0);
+        }
+        ++subscriber->seq;
+        ++subscriber->packet_count;
+        subscriber->octet_count += size;
+    }
+    media_source_release_shared(source);
+    media_source_flush(source);
+
+    for (struct MediaSubscriber* subscriber : subscribers) {
+        if (now - subscriber->last_sr_ns >= MEDIA_SOURCE_SR_INTERVAL_NS) {
+            media_source_send_sr(source, subscriber, now);
+        }
+    }
+}
+
+static int create_multicast_socket(const struct MediaMulticast* multicast,
+                                   int port) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    int ttl = multicast->ttl;
+    // 本机的接收者（包括在回环上测试）也能收到
+    unsigned char loop = 1;
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr = multicast->group;
+    addr.sin_port = htons(port);
+    if (setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) <
+                0 ||
+        setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop,
+                   sizeof(loop)) < 0 ||
+        connect(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        rtp_pacing_setup_socket(sockfd, false) < 0) {
+        printf("failed to set up multicast socket: %s\n", strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    set_nonblocking(sockfd);
+    return sockfd;
+}
+
+/*
+ * 新的视频观看者收到的第一帧在索引中的下标：GOP缓存打开且有缓存时是
+ * 缓存中的IDR帧，否则是下一帧。文件源和直播源的GOP缓存一样受帧数和
+ * 字节数的限制，交织发送时还要放得进连接的queue_size字节排队，超过
+ * 限制时从下一帧开始
+ */
+static uint32_t media_source_join_pos(const struct MediaSource* source,
+                                      uint32_t queue_size) {
+    if (!gop_cache || !source->frame || source->key_pos >= source->frame_pos ||
+        source->frame_pos - source->key_pos > MEDIA_SOURCE_GOP_MAX_FRAMES) {
+        return source->frame_pos;
+    }
+    const struct H264Index* index = source->index.get();
+    uint64_t bytes = 0;
+    uint64_t tcp_bytes = 0;
+    for (uint32_t pos = source->key_pos; pos < source->frame_pos; ++pos) {
+        const struct H264IndexFrame& frame = index->frames[pos];
+        for (uint32_t i = 0; i < frame.packet_count; ++i) {
+            bytes += packet_size(index->packets[frame.first_packet + i]);
+        }
+        tcp_bytes += frame.packet_count * RTP_TCP_PREFIX_SIZE;
+    }
+    tcp_bytes += bytes;
+    if (bytes > MEDIA_SOURCE_GOP_MAX_BYTES || tcp_bytes > queue_size) {
+        return source->frame_pos;
+    }
+    return source->key_pos;
+}
+
+/*
+ * 直播源GOP缓存交织发送的字节数。帧还没有打包，按每个包都是FU-A估计
+ * 包数，不会少算
+ */
+static uint64_t live_gop_tcp_bytes(const struct MediaSource* source) {
+    uint64_t bytes = 0;
+    for (const struct MediaGopFrame& cached : source->gop) {
+        uint32_t packets = cached.buffer->size / (RTP_MAX_PKT_SIZE - 2) + 1;
+        bytes += cached.buffer->size + packets * TCP_HEADER_SLOT;
+    }
+    return bytes;
+}
+
+// 当前帧只发给subscriber，不整形
+static void media_source_send_to(struct MediaSource* source,
+                                 struct MediaSubscriber* subscriber) {
+    if (subscriber->interleaved_channel >= 0) {
+        media_source_send_tcp(source, subscriber);
+    }
+    else {
+        for (uint32_t i = 0; i < source->frame->packet_count; ++i) {
+            media_source_add_udp(source, subscriber, i, 0);
+        }
+    }
+    media_source_release_shared(source);
+}
+
+// 补发结束，新的帧照常发送，重新对齐seq_offset
+static void media_source_caught_up(struct MediaSource* source,
+                                   struct MediaSubscriber* subscriber,
+                                   uint32_t count) {
+    subscriber->catching_up = false;
+    subscriber->seq_offset = subscriber->seq - (uint16_t) source->next_packet;
+    printf("ssrc %08X: caught up %u frames from the last IDR\n",
+           subscriber->ssrc, count);
+}
+
+/*
+ * 从catch_up_pos起补发GOP缓存中的帧，比实时快，直到发出limit字节或者补到
+ * 当前帧。逐帧借用当前帧的字段发送，发完恢复；这些包不进重传历史
+ */
+static void media_source_catch_up_chunk(struct MediaSource* source,
+                                        struct MediaSubscriber* subscriber,
+                                        uint64_t limit) {
+    const struct H264IndexFrame* frame = source->frame;
+    const struct H264IndexPacket* packets = source->packets;
+    const uint8_t* data = source->data;
+    const uint8_t* aggregates = source->aggregates;
+    uint32_t timestamp = source->timestamp;
+    struct PoolBuffer* live_buffer = source->live_buffer;
+    uint32_t end = source->index ? source->frame_pos : source->gop.size();
+    std::vector<struct H264IndexPacket> gop_packets;
+    struct H264IndexFrame entry;
+    uint64_t bytes = 0;
+    while (subscriber->catch_up_pos < end && bytes < limit) {
+        if (source->index) {
+            source->frame = &source->index->frames[subscriber->catch_up_pos];
+            source->timestamp = (uint32_t) source->frame->timestamp;
+        }
+        else {
+            const struct MediaGopFrame& cached =
+                    source->gop[subscriber->catch_up_pos];
+            struct LiveFrame live_frame;
+            live_frame.data = cached.buffer;
+            live_frame_packetize(&live_frame, RTP_MAX_PKT_SIZE, &gop_packets);
+            bzero(&entry, sizeof(entry));
+            entry.packet_count = gop_packets.size();
+            entry.timestamp = cached.timestamp;
+            entry.flags = cached.flags;
+            source->frame = &entry;
+            source->packets = gop_packets.data();
+            source->data = cached.buffer->data;
+            source->aggregates = cached.buffer->data;
+            source->timestamp = cached.timestamp;
+            source->live_buffer = cached.buffer;
+            source->tcp_shared = pool_buffer_ref(cached.buffer);
+        }
+        for (uint32_t i = 0; i < source->frame->packet_count; ++i) {
+            bytes += packet_size(
+                    source->packets[source->frame->first_packet + i]);
+        }
+        media_source_send_to(source, subscriber);
+        ++subscriber->catch_up_pos;
+    }
+    source->frame = frame;
+    source->packets = packets;
+    source->data = data;
+    source->aggregates = aggregates;
+    source->timestamp = timestamp;
+    source->live_buffer = live_buffer;
+    media_source_flush(source);
+    if (subscriber->catch_up_pos == end) {
+        media_source_caught_up(
+                source, subscriber,
+                source->index ? end - source->key_pos : end);
+    }
+}
+
+/*
+ * 开始把GOP缓存中的帧补发给新的视频观看者，观看者马上有可以解码的画面。
+ * TCP观看者由连接排队，一次发完；UDP观看者一次发出太多会超出socket的
+ * 发送缓冲被丢弃，先发一块，其余由源的定时器分块补发
+ */
+static void media_source_catch_up(struct MediaSource* source,
+                                  struct MediaSubscriber* subscriber) {
+    bool tcp = subscriber->interleaved_channel >= 0;
+    if (source->index) {
+        subscriber->catch_up_pos = media_source_join_pos(
+                source, tcp ? subscriber->tcp_queue_size : UINT32_MAX);
+        if (subscriber->catch_up_pos == source->frame_pos) {
+            return;
+        }
+    }
+    else {
+        if (source->gop.empty() ||
+            (tcp && live_gop_tcp_bytes(source) > subscriber->tcp_queue_size)) {
+            return;
+        }
+        subscriber->catch_up_pos = 0;
+    }
+    subscriber->catching_up = true;
+    subscriber->waiting_key = false;
+    if (tcp) {
+        media_source_catch_up_chunk(source, subscriber, UINT64_MAX);
+        return;
+    }
+    media_source_catch_up_chunk(source, subscriber,
+                                MEDIA_SOURCE_CATCH_UP_CHUNK);
+    if (subscriber->catching_up) {
+        subscriber->catch_up_ns =
+                scheduler_now_ns() + MEDIA_SOURCE_CATCH_UP_INTERVAL_NS;
+        if (!source->timer.pending ||
+            subscriber->catch_up_ns < source->timer.deadline_ns) {
+            scheduler_add(source->scheduler, &source->timer,
+                          subscriber->catch_up_ns);
+        }
+    }
+}
+
+/*
+ * 给到时间的UDP观看者补发下一块GOP缓存，返回最早的下一块的发送时间，
+ * 没有观看者在补发时返回0
+ */
+static uint64_t media_source_catch_up_all(struct MediaSource* source,
+                                          uint64_t now) {
+    uint64_t resume = 0;
+    for (struct MediaSubscriber* subscriber :
+         source->tracks[MEDIA_TRACK_VIDEO].subscribers) {
+        if (!subscriber->catching_up) {
+            continue;
+        }
+        if (subscriber->catch_up_ns <= now + RTP_PACING_SLACK_NS) {
+            media_source_catch_up_chunk(source, subscriber,
+                                        MEDIA_SOURCE_CATCH_UP_CHUNK);
+            subscriber->catch_up_ns = now + MEDIA_SOURCE_CATCH_UP_INTERVAL_NS;
+        }
+        if (subscriber->catching_up &&
+            (!resume || subscriber->catch_up_ns < resume)) {
+            resume = subscriber->catch_up_ns;
+        }
+    }
+    return resume;
+}
+
+/*
+ * 观看者的时间戳从各自的随机起点开始，从下一帧开始发送。文件源的视频
+ * 时间戳是起点加帧在文件中的位置，音频的时间戳直接是采样数加偏移，
+ * 暂停后继续和跳转时都可以由位置算出RTP-Info的rtptime；直播源的视频
+ * 时间戳以加入时的帧为起点。GOP缓存打开时视频观看者先收到缓存的帧
+ */
+static void media_source_add(struct MediaSource* source,
+                             struct MediaSubscriber* subscriber) {
+    rtp_header_template(subscriber->rtp_header,
+                        subscriber->track == MEDIA_TRACK_AUDIO
+                                ? RTP_PAYLOAD_TYPE_AAC
+                                : RTP_PAYLOAD_TYPE_H264,
+                        subscriber->ssrc);
+    if (subscriber->track == MEDIA_TRACK_VIDEO) {
+        subscriber->timestamp_offset -=
+                source->index ? (uint32_t) source->base_timestamp
+                              : source->timestamp;
+        subscriber->pending_packet =
+                source->frame ? source->frame->packet_count : 0;
+        subscriber->seq_offset =
+                subscriber->seq - (uint16_t) source->next_packet;
+        // 直播源没有从头播放，中途加入的观看者从IDR帧开始才能解码
+        subscriber->waiting_key = source->index == nullptr;
+        subscriber->catching_up = false;
+        if (gop_cache && source->frame) {
+            media_source_catch_up(source, subscriber);
+        }
+    }
+    subscriber->source = source;
+    source->tracks[subscriber->track].subscribers.push_back(subscriber);
+}
+
+static void media_source_remove(struct MediaSource* source,
+                                struct MediaSubscriber* subscriber) {
+    auto& subscribers = source->tracks[subscriber->track].subscribers;
+    for (size_t i = 0; i < subscribers.size(); ++i) {
+        if (subscribers[i] == subscriber) {
+            subscribers[i] = subscribers.back();
+            subscribers.pop_back();
+            break;
+        }
+    }
+}
+
+// 轨道track的组播端口，每个轨道占用RTP和RTCP两个端口
+static int multicast_port(const struct MediaMulticast* multicast, int track) {
+    return multicast->port + 2 * track;
+}
+
+static int media_source_start_multicast(struct MediaSource* source,
+                                        enum MediaTrackType track) {
+    int port = multicast_port(&source->multicast, track);
+    int sockfd = create_multicast_socket(&source->multicast, port);
+    if (sockfd < 0) {
+        return -1;
+    }
+    struct MediaSubscriber* sender = new MediaSubscriber();
+    media_subscriber_init(sender, sockfd, inet_ntoa(source->multicast.group),
+                          port);
+    sender->track = track;
+    sender->rtp_connected = true;
+    // SR发到组播组的RTCP端口，connect过的UDP socket也可以sendto其他地址
+    sender->rtcp_sockfd = sockfd;
+    sender->rtcp_addr = sender->rtp_addr;
+    sender->rtcp_addr.sin_port = htons(port + 1);
+    media_source_add(source, sender);
+    source->tracks[track].multicast_sender = sender;
+    printf("%s: start multicast track %d to %s:%d ttl %d\n",
+           source->file_name.c_str(), track,
+           inet_ntoa(source->multicast.group), port, source->multicast.ttl);
+    return 0;
+}
+
+static void media_source_stop_multicast(struct MediaSource* source,
+                                        enum MediaTrackType track) {
+    struct MediaSubscriber* sender = source->tracks[track].multicast_sender;
+    if (!sender) {
+        return;
+    }
+    media_source_remove(source, sender);
+    rtp_batch_release_socket(sender->rtp_sockfd);
+    close(sender->rtp_sockfd);
+    delete sender;
+    source->tracks[track].multicast_sender = nullptr;
+    printf("%s: stop multicast track %d\n", source->file_name.c_str(), track);
+}
+
+static bool media_source_idle(const struct MediaSource* source) {
+    for (const struct MediaTrack& track : source->tracks) {
+        if (!track.subscribers.empty() || !track.multicast_viewers.empty()) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void media_source_clear_gop(struct MediaSource* source) {
+    for (const struct MediaGopFrame& cached : source->gop) {
+        pool_buffer_unref(cached.buffer);
+    }
+    source->gop.clear();
+    source->gop_bytes = 0;
+}
+
+static void media_source_destroy(struct MediaSource* source) {
+    media_sources.erase(source->key);
+    metrics_add(METRICS_SOURCES, -1);
+    scheduler_cancel(source->scheduler, &source->timer);
+    for (int track = 0; track < MEDIA_TRACK_COUNT; ++track) {
+        media_source_stop_multicast(source, (enum MediaTrackType) track);
+    }
+    if (source->index) {
+        h264_reader_close(&source->reader);
+    }
+    else {
+        media_source_clear_gop(source);
+        event_loop_remove(worker_current()->loop, source->live.wake_fd);
+        live_reader_close(&source->live);
+        if (source->live_buffer) {
+            pool_buffer_unref(source->live_buffer);
+        }
+    }
+    if (source->audio_index) {
+        h264_reader_close(&source->audio_reader);
+    }
+    delete source;
+}
+
+/*
+ * 每次从源中取出一个观看者再回调，回调中可以取消同一客户端在其他轨道上
+ * 的订阅（这些观看者也随之从源中移除），不会用到已经释放的观看者
+ */
+static void media_source_end(struct MediaSource* source) {
+    // 先删除组播发送者，剩下的都是外部的观看者
+    for (int track = 0; track < MEDIA_TRACK_COUNT; ++track) {
+        media_source_stop_multicast(source, (enum MediaTrackType) track);
+    }
+    source->ending = true;
+    while (true) {
+        struct MediaSubscriber* subscriber = nullptr;
+        for (struct MediaTrack& track : source->tracks) {
+            auto& list = !track.subscribers.empty() ? track.subscribers
+                                                    : track.multicast_viewers;
+            if (!list.empty()) {
+                subscriber = list.back();
+                list.pop_back();
+                break;
+            }
+        }
+        if (!subscriber) {
+            break;
+        }
+        subscriber->source = nullptr;
+        media_source_count(source, METRICS_SUBSCRIBERS, -1);
+        if (subscriber->on_end) {
+            subscriber->on_end(subscriber, subscriber->arg);
+        }
+    }
+    media_source_destroy(source);
+}
+
+static uint64_t media_source_deadline(struct MediaSource* source,
+                                      uint64_t timestamp) {
+    return source->start_ns + (timestamp - source->start_timestamp) *
+                                      1000000000ull / H264_CLOCK_RATE;
+}
+
+// 音频包的时间戳换算到视频时间线上
+static uint64_t audio_timestamp(const struct MediaSource* source,
+                                const struct AacIndexPacket* packet) {
+    return source->base_timestamp + packet->timestamp * H264_CLOCK_RATE /
+                                            source->audio_index->sample_rate;
+}
+
+/*
+ * 落后太多（如进程被挂起），补发只会造成突发，从这一帧重新计时。两个
+ * 轨道共用时钟，从两者中还没发送的最早的时间戳开始，另一个轨道的包
+ * 不会落在起点之前
+ */
+static void media_source_resync(struct MediaSource* source, uint64_t now,
+                                uint64_t deadline, uint64_t timestamp) {
+    printf("%s: %llu ms behind schedule, resync\n", source->file_name.c_str(),
+           (unsigned long long) ((now - deadline) / 1000000));
+    if (source->frame_pos < source->index->frames.size()) {
+        uint64_t video = source->index->frames[source->frame_pos].timestamp;
+        if (video < timestamp) {
+            timestamp = video;
+        }
+    }
+    if (source->audio_index &&
+        source->audio_pos < source->audio_index->packets.size()) {
+        uint64_t audio = audio_timestamp(
+                source, &source->audio_index->packets[source->audio_pos]);
+        if (audio < timestamp) {
+            timestamp = audio;
+        }
+    }
+    source->start_ns = now;
+    source->start_timestamp = timestamp;
+}
+
+/*
+ * 发送所有到期的音频包，返回下一个音频包的发送时间，音频发完
+ * （或没有音频）时返回0
+ */
+static uint64_t media_source_send_audio_due(struct MediaSource* source,
+                                            uint64_t now) {
+    const struct AacIndex* index = source->audio_index.get();
+    if (!index) {
+        return 0;
+    }
+    while (source->audio_pos < index->packets.size()) {
+        const struct AacIndexPacket* packet = &index->packets[source->audio_pos];
+        uint64_t timestamp = audio_timestamp(source, packet);
+        uint64_t deadline = media_source_deadline(source, timestamp);
+        if (deadline > now) {
+            return deadline;
+        }
+        if (now - deadline > MEDIA_SOURCE_MAX_LATE_NS) {
+            media_source_resync(source, now, deadline, timestamp);
+        }
+        ++source->audio_pos;
+        media_source_send_audio(source, packet, now);
+    }
+    return 0;
+}
+
+static inline uint64_t earliest(uint64_t a, uint64_t b) {
+    return a && (!b || a < b) ? a : b;
+}
+
+static void on_source_timer(struct SchedulerTimer* timer, void* arg) {
+    struct MediaSource* source = (struct MediaSource*) arg;
+    const struct H264Index* index = source->index.get();
+    uint64_t now = scheduler_now_ns();
+    uint64_t resume = media_source_pace_all(source, now, false);
+    uint64_t next = media_source_catch_up_all(source, now);
+
+    // 事件循环被耽搁时一次补发所有到期的帧，保持平均帧率
+    while (source->frame_pos < index->frames.size()) {
+        const struct H264IndexFrame* frame = &index->frames[source->frame_pos];
+        uint64_t timestamp = frame->timestamp;
+        uint64_t deadline = media_source_deadline(source, timestamp);
+        if (deadline > now) {
+            next = earliest(next, deadline);
+            break;
+        }
+        // 整形只在帧间隔内平滑，下一帧到期时上一帧剩下的包直接发出
+        if (resume) {
+            media_source_pace_all(source, now, true);
+        }
+        metrics_record_lateness(now - deadline);
+        if (now - deadline > MEDIA_SOURCE_MAX_LATE_NS) {
+            media_source_resync(source, now, deadline, timestamp);
+        }
+        source->frame = frame;
+        source->timestamp = (uint32_t) timestamp;
+        if (frame->flags & H264_INDEX_FRAME_KEY) {
+            source->key_pos = source->frame_pos;
+        }
+        ++source->frame_pos;
+        resume = media_source_send(source, now);
+    }
+    next = earliest(next, media_source_send_audio_due(source, now));
+    // 视频最后一帧整形发完、音频也发完后结束
+    next = earliest(next, resume);
+    if (!next) {
+        printf("读取 %s 结束\n", source->file_name.c_str());
+        media_source_end(source);
+        return;
+    }
+    scheduler_add(source->scheduler, &source->timer, next);
+}
+
+// 两种源共同的初始化，以key登记到本线程的源表中
+static void media_source_init(struct MediaSource* source,
+                              struct Scheduler* scheduler,
+                              const char* file_name, const std::string& key) {
+    source->file_name = file_name;
+    source->key = key;
+    source->scheduler = scheduler;
+    source->frame = nullptr;
+    source->timestamp = 0;
+    source->multicast = multicast_config;
+    source->ending = false;
+    source->tcp_shared = nullptr;
+    source->frame_packet = 0;
+    source->next_packet = 0;
+    source->start_ns = scheduler_now_ns();
+    source->start_timestamp = 0;
+    source->metrics = metrics_source_block(file_name);
+    media_sources[key] = source;
+    metrics_add(METRICS_SOURCES, 1);
+    printf("create media source: %s\n", file_name);
+}
+
+/*
+ * 从文件中时间戳不早于第一帧加position的第一帧开始播放，音频从同一时刻
+ * 开始。共享源的position为0
+ */
+static struct MediaSource* media_source_create(struct Scheduler* scheduler,
+                                               const char* file_name,
+                                               const std::string& key,
+                                               uint64_t position) {
+    std::shared_ptr<const struct H264Index> index =
+            h264_index_get(file_name, source_frame_rate, index_persist);
+    if (!index) {
+        printf("读取 %s 失败\n", file_name);
+        return nullptr;
+    }
+    std::shared_ptr<const struct AacIndex> audio_index;
+    if (!audio_file.empty()) {
+        audio_index = aac_index_get(audio_file.c_str());
+        if (!audio_index) {
+            printf("读取 %s 失败\n", audio_file.c_str());
+            return nullptr;
+        }
+    }
+    struct MediaSource* source = new MediaSource();
+    if (h264_reader_open(&source->reader, file_name) < 0 ||
+        source->reader.size != index->file_size) {
+        printf("读取 %s 失败\n", file_name);
+        h264_reader_close(&source->reader);
+        delete source;
+        return nullptr;
+    }
+    if (audio_index &&
+        (h264_reader_open(&source->audio_reader, audio_file.c_str()) < 0 ||
+         source->audio_reader.size != audio_index->file_size)) {
+        printf("读取 %s 失败\n", audio_file.c_str());
+        h264_reader_close(&source->audio_reader);
+        h264_reader_close(&source->reader);
+        delete source;
+        return nullptr;
+    }
+    source->audio_index = audio_index;
+    source->index = index;
+    source->packets = index->packets.data();
+    source->data = source->reader.data;
+    source->aggregates = index->aggregates.data();
+    source->key_pos = UINT32_MAX;
+    source->history.resize(MEDIA_SOURCE_HISTORY_SIZE);
+    media_source_init(source, scheduler, file_name, key);
+    // 帧和音频包的时间戳都是递增的，二分查找起点，起点的帧马上发送
+    source->base_timestamp =
+            index->frames.empty() ? 0 : index->frames[0].timestamp;
+    uint64_t start = source->base_timestamp + position;
+    source->frame_pos =
+            std::lower_bound(index->frames.begin(), index->frames.end(),
+                             start,
+                             [](const struct H264IndexFrame& frame,
+                                uint64_t timestamp) {
+                                 return frame.timestamp < timestamp;
+                             }) -
+            index->frames.begin();
+    source->audio_pos = 0;
+    if (audio_index) {
+        source->audio_pos =
+                std::lower_bound(audio_index->packets.begin(),
+                                 audio_index->packets.end(), start,
+                                 [source](const struct AacIndexPacket& packet,
+                                          uint64_t timestamp) {
+                                     return audio_timestamp(source, &packet) <
+                                            timestamp;
+                                 }) -
+                audio_index->packets.begin();
+    }
+    source->start_timestamp = start;
+    scheduler_timer_init(&source->timer, on_source_timer, source);
+    scheduler_add(scheduler, &source->timer, source->start_ns);
+    return source;
+}
+
+// 直播源的帧加入GOP缓存，IDR帧开始新的GOP，超过上限时清空直到下一个
+static void media_source_cache_live(struct MediaSource* source,
+                                    const struct LiveFrame* frame) {
+    bool key = frame->flags & H264_INDEX_FRAME_KEY;
+    if (key) {
+        media_source_clear_gop(source);
+    }
+    if (!key && source->gop.empty()) {
+        return;
+    }
+    if (source->gop.size() == MEDIA_SOURCE_GOP_MAX_FRAMES ||
+        source->gop_bytes + frame->data->size > MEDIA_SOURCE_GOP_MAX_BYTES) {
+        media_source_clear_gop(source);
+        return;
+    }
+    struct MediaGopFrame cached = {pool_buffer_ref(frame->data),
+                                   frame->timestamp, frame->flags};
+    source->gop.push_back(cached);
+    source->gop_bytes += frame->data->size;
+}
+
+// 换上从环中取出的帧，帧的缓冲同时作为TCP排队的共享负载
+static void media_source_load_live(struct MediaSource* source,
+                                   const struct LiveFrame* frame) {
+    if (source->live_buffer) {
+        pool_buffer_unref(source->live_buffer);
+    }
+    source->live_buffer = frame->data;
+    live_frame_packetize(frame, RTP_MAX_PKT_SIZE, &source->live_packets);
+    struct H264IndexFrame* entry = &source->live_frame;
+    bzero(entry, sizeof(*entry));
+    entry->packet_count = source->live_packets.size();
+    entry->timestamp = frame->timestamp;
+    entry->flags = frame->flags;
+    source->frame = entry;
+    source->packets = source->live_packets.data();
+    source->data = frame->data->data;
+    source->aggregates = frame->data->data;
+    source->timestamp = frame->timestamp;
+    source->tcp_shared = pool_buffer_ref(frame->data);
+    if (gop_cache) {
+        media_source_cache_live(source, frame);
+    }
+    // 时间戳由到达时间换算，SR按最近一帧的到达时间对齐
+    source->start_ns = frame->capture_ns;
+    source->start_timestamp = frame->timestamp;
+}
+
+/*
+ * 发送环中所有新的帧，帧一到就发，不按时间戳计时。发送延迟是从读入帧的
+ * 最后一个字节算起。输入结束并且整形积压发完后结束源
+ */
+static void media_source_send_live(struct MediaSource* source) {
+    uint64_t now = scheduler_now_ns();
+    uint64_t resume = media_source_pace_all(source, now, false);
+    uint64_t catch_up = media_source_catch_up_all(source, now);
+    struct LiveFrame frame;
+    enum LiveReadResult result;
+    while ((result = live_reader_next(&source->live, now, &frame)) ==
+           LIVE_READ_FRAME) {
+        // 当前帧的缓冲马上要换掉，剩下的包直接发出
+        if (resume) {
+            media_source_pace_all(source, now, true);
+        }
+        if (frame.dropped) {
+            media_source_count(source, METRICS_LIVE_DROPPED, frame.dropped);
+        }
+        media_source_load_live(source, &frame);
+        metrics_record_lateness(now > frame.capture_ns ? now - frame.capture_ns
+                                                       : 0);
+        resume = media_source_send(source, now);
+    }
+    resume = earliest(resume, catch_up);
+    if (resume) {
+        scheduler_add(source->scheduler, &source->timer, resume);
+    }
+    else if (result == LIVE_READ_END) {
+        printf("直播 %s 结束\n", source->file_name.c_str());
+        media_source_end(source);
+    }
+}
+
+static void on_live_wake(struct EventLoop* loop, int fd, uint32_t events,
+                         void* arg) {
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+    media_source_send_live((struct MediaSource*) arg);
+}
+
+// 整形积压的继续发送
+static void on_live_timer(struct SchedulerTimer* timer, void* arg) {
+    media_source_send_live((struct MediaSource*) arg);
+}
+
+static struct MediaSource* media_source_create_live(
+        struct Scheduler* scheduler, const char* name) {
+    struct MediaSource* source = new MediaSource();
+    if (live_reader_open(live_ingest, &source->live) < 0) {
+        delete source;
+        return nullptr;
+    }
+    if (event_loop_add(worker_current()->loop, source->live.wake_fd, EPOLLIN,
+                       on_live_wake, source) < 0) {
+        live_reader_close(&source->live);
+        delete source;
+        return nullptr;
+    }
+    source->index = nullptr;
+    source->audio_index = nullptr;
+    source->live_buffer = nullptr;
+    source->gop_bytes = 0;
+    media_source_init(source, scheduler, name, name);
+    // 马上发送环中最新的IDR帧起的帧，之后由读线程唤醒
+    scheduler_timer_init(&source->timer, on_live_timer, source);
+    scheduler_add(scheduler, &source->timer, source->start_ns);
+    return source;
+}
+
+void media_source_set_index_persist(bool persist) {
+    index_persist = persist;
+}
+
+void media_source_set_frame_rate(uint32_t frame_rate) {
+    source_frame_rate = frame_rate;
+}
+
+void media_source_set_audio_file(const char* file_name) {
+    audio_file = file_name ? file_name : "";
+}
+
+const char* media_source_get_audio_file() {
+    return audio_file.empty() ? nullptr : audio_file.c_str();
+}
+
+void media_source_set_gop_cache(bool enabled) {
+    gop_cache = enabled;
+}
+
+int media_source_parameter_sets(const char* file_name, std::string* sps,
+                                std::string* pps) {
+    if (live_ingest && live_name == file_name) {
+        return live_ingest_parameter_sets(live_ingest, sps, pps);
+    }
+    std::shared_ptr<const struct H264Index> index =
+            h264_index_get(file_name, source_frame_rate, index_persist);
+    if (!index || index->sps.empty() || index->pps.empty()) {
+        return -1;
+    }
+    *sps = index->sps;
+    *pps = index->pps;
+    return 0;
+}
+
+// file_name的索引，直播流、读取失败或没有帧时返回nullptr
+static std::shared_ptr<const struct H264Index>
+media_source_file_index(const char* file_name) {
+    if (live_ingest && live_name == file_name) {
+        return nullptr;
+    }
+    std::shared_ptr<const struct H264Index> index =
+            h264_index_get(file_name, source_frame_rate, index_persist);
+    if (!index || index->frames.empty()) {
+        return nullptr;
+    }
+    return index;
+}
+
+int media_source_preload(const char* file_name) {
+    if (!audio_file.empty() && !aac_index_get(audio_file.c_str())) {
+        printf("failed to index %s\n", audio_file.c_str());
+    }
+    if (!media_source_file_index(file_name)) {
+        printf("failed to index %s\n", file_name);
+        return -1;
+    }
+    return 0;
+}
+
+// 最后一帧再加一个帧间隔
+static uint64_t index_duration(const struct H264Index* index) {
+    return index->frames.back().timestamp - index->frames[0].timestamp +
+           (uint64_t) H264_CLOCK_RATE * index->frame_rate_den /
+                   index->frame_rate_num;
+}
+
+int media_source_duration(const char* file_name, uint64_t* duration) {
+    std::shared_ptr<const struct H264Index> index =
+            media_source_file_index(file_name);
+    if (!index) {
+        return -1;
+    }
+    *duration = index_duration(index.get());
+    return 0;
+}
+
+int media_source_seek(const char* file_name, uint64_t npt,
+                      uint64_t* position) {
+    std::shared_ptr<const struct H264Index> index =
+            media_source_file_index(file_name);
+    if (!index || npt >= index_duration(index.get())) {
+        return -1;
+    }
+    uint64_t base = index->frames[0].timestamp;
+    *position =
+            index->frames[h264_index_seek(index.get(), base + npt)].timestamp -
+            base;
+    return 0;
+}
+
+int media_source_join_position(const char* file_name, uint32_t queue_size,
+                               uint64_t* position) {
+    if (live_ingest && live_name == file_name) {
+        return -1;
+    }
+    auto it = media_sources.find(file_name);
+    if (it == media_sources.end()) {
+        *position = 0;
+        return 0;
+    }
+    const struct MediaSource* source = it->second;
+    const std::vector<struct H264IndexFrame>& frames = source->index->frames;
+    uint32_t pos = media_source_join_pos(source, queue_size);
+    *position = pos < frames.size()
+                        ? frames[pos].timestamp - source->base_timestamp
+                        : index_duration(source->index.get());
+    return 0;
+}
+
+void media_source_set_live(const char* name, struct LiveIngest* ingest) {
+    live_name = name;
+    live_ingest = ingest;
+}
+
+int media_source_parse_multicast(const char* text,
+                                 struct MediaMulticast* multicast) {
+    char group[INET_ADDRSTRLEN];
+    int port = 0, ttl = MEDIA_MULTICAST_DEFAULT_TTL;
+    if (sscanf(text, "%15[0-9.]:%d:%d", group, &port, &ttl) < 2) {
+        return -1;
+    }
+    if (inet_pton(AF_INET, group, &multicast->group) != 1 ||
+        !IN_MULTICAST(ntohl(multicast->group.s_addr))) {
+        printf("%s is not a multicast address\n", group);
+        return -1;
+    }
+    if (port <= 0 || port > 65534 || port % 2 != 0 || ttl <= 0 || ttl > 255) {
+        return -1;
+    }
+    multicast->port = port;
+    multicast->ttl = ttl;
+    return 0;
+}
+
+void media_source_set_multicast(const struct MediaMulticast* multicast) {
+    multicast_enabled = multicast != nullptr;
+    if (multicast) {
+        multicast_config = *multicast;
+    }
+}
+
+const struct MediaMulticast* media_source_get_multicast() {
+    return multicast_enabled ? &multicast_config : nullptr;
+}
+
+void media_subscriber_init(struct MediaSubscriber* subscriber, int rtp_sockfd,
+                           const char* ip, int port) {
+    bzero(subscriber, sizeof(*subscriber));
+    subscriber->rtp_sockfd = rtp_sockfd;
+    subscriber->interleaved_channel = -1;
+    subscriber->rtp_addr.sin_family = AF_INET;
+    subscriber->rtp_addr.sin_addr.s_addr = inet_addr(ip);
+    subscriber->rtp_addr.sin_port = htons(port);
+    subscriber->ssrc = (uint32_t) random();
+    subscriber->seq = (uint16_t) random();
+    subscriber->timestamp_offset = (uint32_t) random();
+    subscriber->rtcp_sockfd = -1;
+    subscriber->rtcp_channel = -1;
+    subscriber->rtt_ms = -1;
+    rtp_pacer_init(&subscriber->pacer);
+}
+
+int media_source_subscribe(struct Scheduler* scheduler, const char* file_name,
+                           struct MediaSubscriber* subscriber) {
+    struct MediaSource* source;
+    if ((subscriber->multicast && !multicast_enabled) ||
+        (subscriber->track == MEDIA_TRACK_AUDIO && audio_file.empty())) {
+        return -1;
+    }
+    auto it = media_sources.find(file_name);
+    if (it != media_sources.end()) {
+        source = it->second;
+    }
+    else {
+        source = live_ingest && live_name == file_name
+                         ? media_source_create_live(scheduler, file_name)
+                         : media_source_create(scheduler, file_name,
+                                               file_name, 0);
+        if (!source) {
+            return -1;
+        }
+    }
+    if (!subscriber->multicast) {
+        media_source_add(source, subscriber);
+        media_source_count(source, METRICS_SUBSCRIBERS, 1);
+        return 0;
+    }
+    struct MediaTrack* track = &source->tracks[subscriber->track];
+    if (!track->multicast_sender &&
+        media_source_start_multicast(source, subscriber->track) < 0) {
+        if (media_source_idle(source)) {
+            media_source_destroy(source);
+        }
+        return -1;
+    }
+    subscriber->source = source;
+    track->multicast_viewers.push_back(subscriber);
+    media_source_count(source, METRICS_SUBSCRIBERS, 1);
+    return 0;
+}
+
+int media_source_subscribe_at(struct Scheduler* scheduler,
+                              const char* file_name, const char* session,
+                              uint64_t position,
+                              struct MediaSubscriber* subscriber) {
+    if (subscriber->multicast || (live_ingest && live_name == file_name) ||
+        (subscriber->track == MEDIA_TRACK_AUDIO && audio_file.empty())) {
+        return -1;
+    }
+    // 文件名中不会有'\0'，不会和共享源或其他会话的源重名
+    std::string key = std::string(file_name) + '\0' + session;
+    struct MediaSource* source;
+    auto it = media_sources.find(key);
+    if (it != media_sources.end()) {
+        source = it->second;
+    }
+    else {
+        source = media_source_create(scheduler, file_name, key, position);
+        if (!source) {
+            return -1;
+        }
+        printf("%s: session %s starts at %.3f s\n", file_name, session,
+               (double) position / H264_CLOCK_RATE);
+    }
+    media_source_add(source, subscriber);
+    media_source_count(source, METRICS_SUBSCRIBERS, 1);
+    return 0;
+}
+
+void media_source_unsubscribe(struct MediaSubscriber* subscriber) {
+    struct MediaSource* source = subscriber->source;
+    if (!source) {
+        return;
+    }
+    subscriber->source = nullptr;
+    media_source_count(source, METRICS_SUBSCRIBERS, -1);
+    if (subscriber->multicast) {
+        auto& viewers = source->tracks[subscriber->track].multicast_viewers;
+        for (size_t i = 0; i < viewers.size(); ++i) {
+            if (viewers[i] == subscriber) {
+                viewers[i] = viewers.back();
+                viewers.pop_back();
+                break;
+            }
+        }
+        if (viewers.empty()) {
+            media_source_stop_multicast(source, subscriber->track);
+        }
+    }
+    else {
+        media_source_remove(source, subscriber);
+    }
+    if (!source->ending && media_source_idle(source)) {
+        printf("destroy media source: %s\n", source->file_name.c_str());
+        media_source_destroy(source);
+    }
+}
+
+// subscriber已经发出的包的源包序号上限，用户态整形时当前帧可能还有积压
+static uint32_t media_source_sent_end(struct MediaSource* source,
+                                      struct MediaSubscriber* subscriber) {
+    if (rtp_pacing_get_mode() == RTP_PACING_BUCKET && source->frame &&
+        subscriber->pending_packet < source->frame->packet_count) {
+        return source->frame_packet + subscriber->pending_packet;
+    }
+    return source->next_packet;
+}
+
+uint32_t media_subscriber_backlog(const struct MediaSubscriber* subscriber) {
+    const struct MediaSource* source = subscriber->source;
+    if (!source || !source->frame ||
+        rtp_pacing_get_mode() != RTP_PACING_BUCKET ||
+        subscriber->multicast || subscriber->track != MEDIA_TRACK_VIDEO ||
+        subscriber->interleaved_channel >= 0 ||
+        subscriber->pending_packet >= source->frame->packet_count) {
+        return 0;
+    }
+    return source->frame->packet_count - subscriber->pending_packet;
+}
+
+int media_subscriber_position(const struct MediaSubscriber* subscriber,
+                              uint64_t* position) {
+    const struct MediaSource* source = subscriber->source;
+    if (!source || !source->index) {
+        return -1;
+    }
+    uint64_t timestamp =
+            source->base_timestamp + index_duration(source->index.get());
+    if (subscriber->track == MEDIA_TRACK_AUDIO) {
+        if (source->audio_pos < source->audio_index->packets.size()) {
+            timestamp = audio_timestamp(
+                    source, &source->audio_index->packets[source->audio_pos]);
+        }
+    }
+    else {
+        // 当前帧还有包没有发出时从当前帧继续，补发中时从下一个补发的帧
+        uint32_t pos = source->frame_pos;
+        if (subscriber->catching_up) {
+            pos = subscriber->catch_up_pos;
+        }
+        else if (media_subscriber_backlog(subscriber) > 0) {
+            --pos;
+        }
+        if (pos < source->index->frames.size()) {
+            timestamp = source->index->frames[pos].timestamp;
+        }
+    }
+    *position = timestamp - source->base_timestamp;
+    return 0;
+}
+
+uint32_t media_subscriber_rtptime(const struct MediaSubscriber* subscriber,
+                                  uint64_t position) {
+    if (subscriber->track == MEDIA_TRACK_AUDIO && !audio_file.empty()) {
+        std::shared_ptr<const struct AacIndex> index =
+                aac_index_get(audio_file.c_str());
+        if (index) {
+            return subscriber->timestamp_offset +
+                   (uint32_t) (position * index->sample_rate /
+                               H264_CLOCK_RATE);
+        }
+    }
+    return subscriber->timestamp_offset + (uint32_t) position;
+}
+
+// 按原来的seq、时间戳和ssrc重传，包已经不在历史中时返回-1
+static int media_source_retransmit(struct MediaSource* source,
+                                   struct MediaSubscriber* subscriber,
+                                   uint16_t seq) {
+    // 补发中的包不在历史中，seq也还没有和源的包序号对齐
+    if (!source->index || subscriber->catching_up) {
+        return -1;
+    }
+    uint32_t sent_end = media_source_sent_end(source, subscriber);
+    // seq对应sent_end之前最近的、低16位相同的源包序号
+    uint16_t back = (uint16_t) sent_end -
+                    (uint16_t) (seq - subscriber->seq_offset);
+    if (back == 0 || back > sent_end ||
+        source->next_packet - (sent_end - back) > MEDIA_SOURCE_HISTORY_SIZE) {
+        return -1;
+    }
+    const struct MediaPacketHistory& history =
+            source->history[(sent_end - back) & HISTORY_MASK];
+    media_source_add_packet(source, subscriber,
+                            source->index->packets[history.packet], seq,
+                            history.timestamp, history.last, 0);
+    ++subscriber->retransmitted;
+    media_source_count(source, METRICS_RETRANSMITS, 1);
+    return 0;
+}
+
+static void media_source_on_report(struct MediaSubscriber* subscriber,
+                                   const struct RtcpReportBlock* block) {
+    subscriber->fraction_lost = block->fraction_lost;
+    subscriber->cumulative_lost = block->cumulative_lost;
+    subscriber->jitter = block->jitter;
+    if (block->last_sr) {
+        // 往返时间 = 现在 - 发出SR的时间 - 接收端收到SR后等待的时间，
+        // 都是1/65536秒
+        uint32_t now = (uint32_t) (rtcp_ntp_now() >> 16);
+        int32_t rtt = (int32_t) (now - block->last_sr -
+                                 block->delay_since_last_sr);
+        if (rtt >= 0) {
+            subscriber->rtt_ms = (int32_t) ((int64_t) rtt * 1000 >> 16);
+        }
+    }
+    if (block->fraction_lost) {
+        printf("ssrc %08X: lost %u/256, total %d, jitter %u, rtt %d ms\n",
+               subscriber->ssrc, block->fraction_lost, block->cumulative_lost,
+               block->jitter, subscriber->rtt_ms);
+    }
+}
+
+void media_source_on_rtcp(struct MediaSubscriber* subscriber,
+                          const uint8_t* data, int size) {
+    struct MediaSource* source = subscriber->source;
+    if (!source || subscriber->multicast) {
+        return;
+    }
+    // 只有视频保留了重传历史
+    bool nack = subscriber->track == MEDIA_TRACK_VIDEO &&
+                subscriber->interleaved_channel < 0;
+    struct RtcpPacket packet;
+    int pos = 0;
+    int budget = MEDIA_SOURCE_MAX_NACK_PACKETS;
+    while (rtcp_next_packet(data, size, &pos, &packet) > 0) {
+        if (packet.type == RTCP_TYPE_SR || packet.type == RTCP_TYPE_RR) {
+            struct RtcpReportBlock block;
+            for (int i = 0; rtcp_report_block(&packet, i, &block) == 0; ++i) {
+                if (block.ssrc == subscriber->ssrc) {
+                    media_source_on_report(subscriber, &block);
+                }
+            }
+            continue;
+        }
+        // 通用NACK：发送者SSRC、媒体SSRC，然后是若干PID + BLP，
+        // BLP的第i位表示PID + i + 1也丢了。TCP不会丢包，不处理
+        if (!nack || packet.type != RTCP_TYPE_RTPFB ||
+            packet.count != RTCP_RTPFB_NACK || packet.body_size < 8 ||
+            rtcp_read32(packet.body + 4) != subscriber->ssrc) {
+            continue;
+        }
+        for (uint32_t offset = 8; offset + 4 <= packet.body_size && budget > 0;
+             offset += 4) {
+            uint16_t pid = rtcp_read16(packet.body + offset);
+            uint16_t blp = rtcp_read16(packet.body + offset + 2);
+            media_source_retransmit(source, subscriber, pid);
+            --budget;
+            for (int i = 0; i < 16 && budget > 0; ++i) {
+                if (blp & (1 << i)) {
+                    media_source_retransmit(source, subscriber, pid + i + 1);
+                    --budget;
+                }
+            }
+        }
+    }
+    media_source_flush(source);
+}
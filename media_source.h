@@ -0,0 +1,261 @@
+#ifndef RTSPSERVER_MEDIA_SOURCE_H
+#define RTSPSERVER_MEDIA_SOURCE_H
+
+#include <netinet/in.h>
+#include <sys/uio.h>
+
+#include <cstdint>
+#include <string>
+
+#include "rtp.h"
+#include "rtp_pacing.h"
+
+// 发送落后于计划超过这个时间时不再补发，从当前帧重新计时
+#define MEDIA_SOURCE_MAX_LATE_NS 500000000ull
+#define MEDIA_MULTICAST_DEFAULT_TTL 16
+// 每个源保留最近发送的这么多个包的位置用于重传，必须是2的幂且小于65536
+#define MEDIA_SOURCE_HISTORY_SIZE 4096
+#define MEDIA_SOURCE_SR_INTERVAL_NS 5000000000ull
+// 一个RTCP包中的NACK最多触发的重传数，防止伪造的NACK放大流量
+#define MEDIA_SOURCE_MAX_NACK_PACKETS 256
+// GOP缓存的上限，GOP更长时新的观看者不补发，直播源等下一个IDR帧
+#define MEDIA_SOURCE_GOP_MAX_FRAMES 300
+#define MEDIA_SOURCE_GOP_MAX_BYTES (8 * 1024 * 1024)
+/*
+ * GOP缓存分块补发给UDP观看者：每块不超过这么多字节（小于默认的socket
+ * 发送缓冲），两块之间至少间隔MEDIA_SOURCE_CATCH_UP_INTERVAL_NS，
+ * 补发速率约100Mbit/s
+ */
+#define MEDIA_SOURCE_CATCH_UP_CHUNK (128 * 1024)
+#define MEDIA_SOURCE_CATCH_UP_INTERVAL_NS 10000000ull
+
+struct LiveIngest;
+struct MediaSource;
+struct PoolBuffer;
+struct Scheduler;
+
+// 一个源的轨道。视频轨来自H.264文件，音频轨来自可选的AAC(ADTS)文件，
+// 两个轨道由源的同一个时钟驱动
+enum MediaTrackType {
+    MEDIA_TRACK_VIDEO,
+    MEDIA_TRACK_AUDIO,
+    MEDIA_TRACK_COUNT,
+};
+
+// 源的组播组。视频RTP发到group:port，音频发到group:port+2，
+// RTCP分别为RTP端口+1
+struct MediaMulticast {
+    struct in_addr group;
+    int port;
+    int ttl;
+};
+
+/*
+ * 交给TCP观看者的一帧RTP包（含'$'前缀）。iov中落在[data, data + data_size)
+ * 内的部分是所有观看者共用的负载，其余是各自的前缀和RTP头。连接发不完
+ * 需要排队时用media_tcp_frame_share取得负载的共享缓冲，同一帧只拷贝一次
+ */
+struct MediaTcpFrame {
+    const struct iovec* iov;
+    int iovcnt;
+    uint32_t size;
+    bool key;
+    const uint8_t* data; // 没有共用的负载时为nullptr
+    uint32_t data_size;
+    struct PoolBuffer** shared; // 源上这一帧的共享缓冲，还没有拷贝时为nullptr
+};
+
+/*
+ * 一个观看者。同一个源的所有观看者共享读文件和打包的结果，
+ * 发送前只按观看者改写RTP头中的seq、timestamp和ssrc
+ */
+struct MediaSubscriber {
+    enum MediaTrackType track; // 订阅的轨道，默认视频
+    int rtp_sockfd;
+    struct sockaddr_in rtp_addr;
+    bool rtp_connected; // rtp_sockfd已connect到rtp_addr，发送时不再带地址
+    uint32_t ssrc;
+    uint16_t seq;
+    uint32_t timestamp_offset;
+    // 网络字节序的RTP头模板，加入源时按轨道的负载类型和ssrc生成
+    uint8_t rtp_header[RTP_HEADER_SIZE];
+
+    // UDP观看者的seq = 源的包序号 + seq_offset，收到NACK时由seq找到包
+    uint16_t seq_offset;
+
+    // UDP发送的令牌桶；用户态整形时当前帧中下一个要发送的包，
+    // 等于帧的包数表示没有积压
+    struct RtpPacer pacer;
+    uint32_t pending_packet;
+    // 直播源的观看者在第一个IDR帧之前不发送
+    bool waiting_key;
+    // 正在分块补发GOP缓存，期间源的新帧不发给它。catch_up_pos是下一个
+    // 要补发的帧，文件源是索引中的下标，直播源是GOP缓存中的下标；
+    // catch_up_ns是下一块的发送时间
+    bool catching_up;
+    uint32_t catch_up_pos;
+    uint64_t catch_up_ns;
+
+    // >= 0时为RTP over RTSP(TCP)的通道号，此时不使用rtp_sockfd，
+    // 每帧的RTP包通过on_tcp_frame交给RTSP连接发送，
+    // 返回-1表示整帧被丢弃，seq不前进
+    int interleaved_channel;
+    int (*on_tcp_frame)(struct MediaSubscriber* subscriber,
+                        const struct MediaTcpFrame* frame, void* arg);
+    // RTSP连接最多为交织数据排队的字节数，GOP缓存放不下时不补发
+    uint32_t tcp_queue_size;
+
+    // SR的目的地：UDP时用rtcp_sockfd发到rtcp_addr，TCP时是交织通道
+    // rtcp_channel，通过on_tcp_frame发送。都为-1时不发SR
+    int rtcp_sockfd;
+    struct sockaddr_in rtcp_addr;
+    int rtcp_channel;
+    uint64_t last_sr_ns;
+    uint32_t last_sr_ntp; // 最近一个SR的NTP时间戳中间32位
+
+    // 已发送的RTP包数和负载字节数（SR中的计数），重传的包数
+    uint32_t packet_count;
+    uint32_t octet_count;
+    uint64_t retransmitted;
+    // 最近一个RR报告的接收情况，rtt_ms为-1表示还不知道
+    uint8_t fraction_lost;
+    int32_t cumulative_lost;
+    uint32_t jitter;
+    int32_t rtt_ms;
+
+    // 组播观看者：只登记在源上，包由源唯一的组播发送者发到组播组，
+    // 观看者自己的发送字段都不使用
+    bool multicast;
+
+    // 源播放结束时回调，回调前subscriber已经从源中移除
+    void (*on_end)(struct MediaSubscriber* subscriber, void* arg);
+    void* arg;
+
+    struct MediaSource* source;
+};
+
+// 是否把新建的H.264索引写成旁路文件供之后的进程直接加载
+void media_source_set_index_persist(bool persist);
+// 源的帧率，0（默认）表示取自SPS的VUI，没有时为25fps
+void media_source_set_frame_rate(uint32_t frame_rate);
+/*
+ * 之后创建的源都带一个来自file_name的AAC音频轨，与视频从同一时刻开始
+ * 播放。nullptr（默认）表示只有视频
+ */
+void media_source_set_audio_file(const char* file_name);
+// 音频文件，没有配置时返回nullptr
+const char* media_source_get_audio_file();
+/*
+ * GOP缓存（默认打开）：源记住最近的IDR帧起已经发送的帧，新的视频观看者
+ * 加入时马上补发这些帧，不按时间戳等待，第一个画面只需要一个往返。UDP
+ * 观看者分块补发，TCP观看者的连接排队放不下时不补发。关闭时文件源的
+ * 观看者从当前帧开始，直播源的观看者等下一个IDR帧
+ */
+void media_source_set_gop_cache(bool enabled);
+/*
+ * 在启动工作线程之前加载或建立file_name和音频文件的索引，之后的请求
+ * 都命中缓存，不在事件循环中扫描文件。视频索引失败时返回-1
+ */
+int media_source_preload(const char* file_name);
+/*
+ * file_name（或直播流）的SPS和PPS，不含起始码，用于SDP的
+ * sprop-parameter-sets。没有时返回-1
+ */
+int media_source_parameter_sets(const char* file_name, std::string* sps,
+                                std::string* pps);
+/*
+ * 点播文件中的位置都以90kHz为单位，从第一帧算起，64位不会回绕，只有
+ * RTP时间戳截成32位。直播流没有位置，下面的函数对直播流都返回-1。
+ * duration是文件的时长
+ */
+int media_source_duration(const char* file_name, uint64_t* duration);
+/*
+ * 跳转到npt：position是不晚于npt的最近的IDR帧的位置，由索引中IDR帧的
+ * 表二分查找，不读文件。npt超出文件时长时返回-1
+ */
+int media_source_seek(const char* file_name, uint64_t npt,
+                      uint64_t* position);
+/*
+ * 现在订阅本线程file_name的共享源时收到的第一帧的位置：GOP缓存中的
+ * IDR帧或下一帧，还没有源时为0。queue_size是TCP观看者的tcp_queue_size，
+ * UDP观看者为UINT32_MAX
+ */
+int media_source_join_position(const char* file_name, uint32_t queue_size,
+                               uint64_t* position);
+
+/*
+ * 订阅name时播放ingest的直播流而不是文件。每个工作线程的源是环的一个
+ * 消费者，帧一到就发送；没有音频轨，不支持NACK重传
+ */
+void media_source_set_live(const char* name, struct LiveIngest* ingest);
+
+/*
+ * 解析"group:port[:ttl]"形式的组播配置，group必须是组播地址，
+ * port必须是偶数。失败返回-1
+ */
+int media_source_parse_multicast(const char* text,
+                                 struct MediaMulticast* multicast);
+/*
+ * 之后创建的源都使用这个组播组，nullptr（默认）表示不支持组播。
+ * 每个源在有组播观看者时只有一个发送者，带宽与观看者数量无关
+ */
+void media_source_set_multicast(const struct MediaMulticast* multicast);
+// 当前的组播配置，不支持组播时返回nullptr
+const struct MediaMulticast* media_source_get_multicast();
+
+// 初始化观看者的发送目标，ssrc、起始seq和时间戳偏移随机生成
+void media_subscriber_init(struct MediaSubscriber* subscriber, int rtp_sockfd,
+                           const char* ip, int port);
+
+/*
+ * 订阅file_name对应的源的subscriber->track轨道，源不存在时创建并由
+ * scheduler按每帧时间戳对应的绝对时间发送，同一文件的后续观看者从源的
+ * 当前位置加入。第一个组播观看者加入时源开始向组播组发送，没有配置
+ * 组播或源没有这个轨道时返回-1。源属于调用的工作线程，scheduler必须是
+ * 这个线程的时间轮，不同线程播放同一文件时各有一个源
+ */
+int media_source_subscribe(struct Scheduler* scheduler, const char* file_name,
+                           struct MediaSubscriber* subscriber);
+/*
+ * 订阅会话session私有的源：同一会话的第一个轨道创建源，从时间戳不早于
+ * position的第一帧开始播放，其余轨道加入同一个源。私有源不和其他观看者
+ * 共享，用于跳转和暂停后继续；直播源和组播观看者返回-1
+ */
+int media_source_subscribe_at(struct Scheduler* scheduler,
+                              const char* file_name, const char* session,
+                              uint64_t position,
+                              struct MediaSubscriber* subscriber);
+/*
+ * 处理观看者发来的RTCP复合包：记录RR中的丢包、抖动和往返时间，
+ * 按NACK从源的历史中重传视频的UDP包
+ */
+void media_source_on_rtcp(struct MediaSubscriber* subscriber,
+                          const uint8_t* data, int size);
+
+// 取消订阅，最后一个组播观看者离开时停止组播，最后一个观看者离开时
+// 源被销毁
+void media_source_unsubscribe(struct MediaSubscriber* subscriber);
+
+/*
+ * frame共用负载的共享缓冲，调用者得到一个引用。第一次调用时从映射的
+ * 文件拷贝，之后同一帧的其他观看者直接引用，源被销毁后缓冲仍然有效
+ */
+struct PoolBuffer* media_tcp_frame_share(const struct MediaTcpFrame* frame);
+
+// 用户态整形时观看者当前帧还没有发出的包数，没有积压时为0
+uint32_t media_subscriber_backlog(const struct MediaSubscriber* subscriber);
+
+/*
+ * 观看者还没有完整发出的第一帧（音频是第一个包）的位置，暂停时记下，
+ * 继续时从这里播放。没有订阅或是直播源时返回-1
+ */
+int media_subscriber_position(const struct MediaSubscriber* subscriber,
+                              uint64_t* position);
+/*
+ * 文件源的观看者在position处的RTP时间戳，用于RTP-Info的rtptime。
+ * 要在订阅之前调用，订阅时时间戳偏移会按源调整
+ */
+uint32_t media_subscriber_rtptime(const struct MediaSubscriber* subscriber,
+                                  uint64_t position);
+
+#endif
@@ -0,0 +1,282 @@
+#include "metrics.h"
+
+#include <array>
+#include <cinttypes>
+#include <cstdarg>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <vector>
+
+const uint64_t metrics_lateness_bounds_us[METRICS_LATENESS_BUCKETS - 1] = {
+        50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000};
+
+struct MetricsInfo {
+    const char* name;
+    const char* help;
+    bool gauge;
+};
+
+static const struct MetricsInfo metrics_info[METRICS_COUNTER_COUNT] = {
+        {"rtsp_requests", "RTSP requests handled", false},
+        {"rtsp_connections", "Open RTSP connections", true},
+        {"sessions", "RTSP sessions", true},
+        {"media_sources", "Media sources being played", true},
+        {"tcp_queue_bytes", "Bytes queued on RTSP connections", true},
+        {"subscribers", "Subscribers of media sources", true},
+        {"rtp_packets", "RTP packets sent", false},
+        {"rtp_bytes", "RTP bytes sent, including RTP headers", false},
+        {"send_syscalls", "System calls sending RTP over UDP", false},
+        {"send_dropped",
+         "RTP packets dropped because the UDP send buffer was full", false},
+        {"send_errors", "RTP packets that failed to send", false},
+        {"frames_dropped",
+         "Frames dropped for RTP over TCP connections that fell behind",
+         false},
+        {"retransmits", "RTP packets retransmitted on NACK", false},
+        {"live_frames_dropped",
+         "Live frames skipped by sources that fell behind the input", false},
+};
+
+// 一个线程的服务器计数，各线程的组之间不共享cache line
+struct alignas(64) MetricsThread {
+    struct MetricsBlock block;
+    std::atomic<uint64_t> lateness[METRICS_LATENESS_BUCKETS];
+    std::atomic<uint64_t> lateness_sum_ns;
+};
+
+// 一个文件的源计数。file_name在count发布之前写好，之后只读
+struct MetricsSource {
+    char file_name[METRICS_MAX_FILE_NAME];
+    struct MetricsBlock threads[METRICS_MAX_THREADS];
+};
+
+static struct MetricsThread metrics_threads[METRICS_MAX_THREADS];
+static struct MetricsSource metrics_sources[METRICS_MAX_SOURCES];
+static std::atomic<int> source_count(0);
+static std::mutex source_mutex;
+
+static int thread_slot() {
+    static thread_local int slot = -1;
+    if (slot < 0) {
+        struct Worker* worker = worker_current();
+        slot = worker ? worker->id : WORKER_MAX_COUNT;
+    }
+    return slot;
+}
+
+struct MetricsBlock* metrics_thread_block() {
+    return &metrics_threads[thread_slot()].block;
+}
+
+void metrics_add(enum MetricsCounter counter, int64_t n) {
+    metrics_block_add(metrics_thread_block(), counter, n);
+}
+
+static void relaxed_add(std::atomic<uint64_t>* value, uint64_t n) {
+    value->store(value->load(std::memory_order_relaxed) + n,
+                 std::memory_order_relaxed);
+}
+
+void metrics_record_lateness(uint64_t lateness_ns) {
+    struct MetricsThread* thread = &metrics_threads[thread_slot()];
+    uint64_t lateness_us = lateness_ns / 1000;
+    int bucket = 0;
+    while (bucket < METRICS_LATENESS_BUCKETS - 1 &&
+           lateness_us >= metrics_lateness_bounds_us[bucket]) {
+        ++bucket;
+    }
+    relaxed_add(&thread->lateness[bucket], 1);
+    relaxed_add(&thread->lateness_sum_ns, lateness_ns);
+}
+
+// 已发布的源中查找，不加锁
+static int find_source(const char* file_name, int count) {
+    for (int i = 0; i < count; ++i) {
+        if (strcmp(metrics_sources[i].file_name, file_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+struct MetricsBlock* metrics_source_block(const char* file_name) {
+    if (strlen(file_name) >= METRICS_MAX_FILE_NAME) {
+        return nullptr;
+    }
+    int id = find_source(file_name,
+                         source_count.load(std::memory_order_acquire));
+    if (id < 0) {
+        std::lock_guard<std::mutex> lock(source_mutex);
+        int count = source_count.load(std::memory_order_relaxed);
+        id = find_source(file_name, count);
+        if (id < 0) {
+            if (count == METRICS_MAX_SOURCES) {
+                printf("too many media files for metrics, %s not counted\n",
+                       file_name);
+                return nullptr;
+            }
+            id = count;
+            strcpy(metrics_sources[id].file_name, file_name);
+            source_count.store(count + 1, std::memory_order_release);
+        }
+    }
+    return &metrics_sources[id].threads[thread_slot()];
+}
+
+static void sum_blocks(const struct MetricsBlock* blocks, size_t stride,
+                       int64_t values[METRICS_COUNTER_COUNT]) {
+    memset(values, 0, sizeof(int64_t) * METRICS_COUNTER_COUNT);
+    for (int t = 0; t < METRICS_MAX_THREADS; ++t) {
+        const struct MetricsBlock* block =
+                (const struct MetricsBlock*) ((const char*) blocks +
+                                              t * stride);
+        for (int i = 0; i < METRICS_COUNTER_COUNT; ++i) {
+            values[i] += block->values[i].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void metrics_snapshot(struct MetricsSnapshot* snapshot) {
+    sum_blocks(&metrics_threads[0].block, sizeof(struct MetricsThread),
+               snapshot->values);
+    memset(snapshot->lateness, 0, sizeof(snapshot->lateness));
+    snapshot->lateness_sum_ns = 0;
+    for (const struct MetricsThread& thread : metrics_threads) {
+        for (int i = 0; i < METRICS_LATENESS_BUCKETS; ++i) {
+            snapshot->lateness[i] +=
+                    thread.lateness[i].load(std::memory_order_relaxed);
+        }
+        snapshot->lateness_sum_ns +=
+                thread.lateness_sum_ns.load(std::memory_order_relaxed);
+    }
+}
+
+int metrics_source_snapshot(const char* file_name,
+                            int64_t values[METRICS_COUNTER_COUNT]) {
+    int id = find_source(file_name,
+                         source_count.load(std::memory_order_acquire));
+    if (id < 0) {
+        return -1;
+    }
+    sum_blocks(metrics_sources[id].threads, sizeof(struct MetricsBlock),
+               values);
+    return 0;
+}
+
+const char* metrics_counter_name(enum MetricsCounter counter) {
+    return metrics_info[counter].name;
+}
+
+uint64_t metrics_lateness_quantile_us(const struct MetricsSnapshot* snapshot,
+                                      double quantile) {
+    uint64_t total = 0;
+    for (uint64_t count : snapshot->lateness) {
+        total += count;
+    }
+    if (total == 0) {
+        return 0;
+    }
+    // 落在最后一个桶时返回最大的上界
+    uint64_t rank = (uint64_t) (quantile * total);
+    uint64_t seen = 0;
+    for (int i = 0; i < METRICS_LATENESS_BUCKETS - 1; ++i) {
+        seen += snapshot->lateness[i];
+        if (seen > rank) {
+            return metrics_lateness_bounds_us[i];
+        }
+    }
+    return metrics_lateness_bounds_us[METRICS_LATENESS_BUCKETS - 2];
+}
+
+static void append_format(std::string* out, const char* format, ...)
+        __attribute__((format(printf, 2, 3)));
+
+static void append_format(std::string* out, const char* format, ...) {
+    char line[1024];
+    va_list args;
+    va_start(args, format);
+    int size = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (size > 0) {
+        out->append(line, size < (int) sizeof(line) ? size : sizeof(line) - 1);
+    }
+}
+
+static void append_family(std::string* out, const char* name,
+                          const struct MetricsInfo& info) {
+    append_format(out, "# HELP %s %s\n# TYPE %s %s\n", name, info.help, name,
+                  info.gauge ? "gauge" : "counter");
+}
+
+// 标签值中的反斜杠、双引号和换行要转义
+static void append_label(std::string* out, const char* value) {
+    for (const char* c = value; *c; ++c) {
+        if (*c == '\\' || *c == '"') {
+            out->push_back('\\');
+            out->push_back(*c);
+        }
+        else if (*c == '\n') {
+            out->append("\\n");
+        }
+        else {
+            out->push_back(*c);
+        }
+    }
+}
+
+void metrics_format_prometheus(std::string* out) {
+    struct MetricsSnapshot snapshot;
+    metrics_snapshot(&snapshot);
+    char name[128];
+    for (int i = 0; i < METRICS_COUNTER_COUNT; ++i) {
+        const struct MetricsInfo& info = metrics_info[i];
+        snprintf(name, sizeof(name), "rtspserver_%s%s", info.name,
+                 info.gauge ? "" : "_total");
+        append_family(out, name, info);
+        append_format(out, "%s %" PRId64 "\n", name, snapshot.values[i]);
+    }
+
+    const char* family = "rtspserver_pacing_lateness_seconds";
+    append_format(out,
+                  "# HELP %s Delay of frame sends behind their schedule\n"
+                  "# TYPE %s histogram\n",
+                  family, family);
+    uint64_t cumulative = 0;
+    for (int i = 0; i < METRICS_LATENESS_BUCKETS; ++i) {
+        cumulative += snapshot.lateness[i];
+        if (i < METRICS_LATENESS_BUCKETS - 1) {
+            append_format(out, "%s_bucket{le=\"%g\"} %" PRIu64 "\n", family,
+                          metrics_lateness_bounds_us[i] / 1e6, cumulative);
+        }
+        else {
+            append_format(out, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", family,
+                          cumulative);
+        }
+    }
+    append_format(out, "%s_sum %.6f\n%s_count %" PRIu64 "\n", family,
+                  snapshot.lateness_sum_ns / 1e9, family, cumulative);
+
+    // 按文件的计数，每个文件所有线程的值相加
+    int count = source_count.load(std::memory_order_acquire);
+    if (count == 0) {
+        return;
+    }
+    std::vector<std::array<int64_t, METRICS_COUNTER_COUNT>> values(count);
+    for (int id = 0; id < count; ++id) {
+        sum_blocks(metrics_sources[id].threads, sizeof(struct MetricsBlock),
+                   values[id].data());
+    }
+    for (int i = METRICS_FIRST_SOURCE_COUNTER; i < METRICS_COUNTER_COUNT;
+         ++i) {
+        const struct MetricsInfo& info = metrics_info[i];
+        snprintf(name, sizeof(name), "rtspserver_source_%s%s", info.name,
+                 info.gauge ? "" : "_total");
+        append_family(out, name, info);
+        for (int id = 0; id < count; ++id) {
+            append_format(out, "%s{file=\"", name);
+            append_label(out, metrics_sources[id].file_name);
+            append_format(out, "\"} %" PRId64 "\n", values[id][i]);
+        }
+    }
+}
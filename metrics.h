@@ -0,0 +1,90 @@
+#ifndef RTSPSERVER_METRICS_H
+#define RTSPSERVER_METRICS_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "worker.h"
+
+/*
+ * 运行时计数。每个工作线程写自己的一组计数，按cache line对齐，热路径上
+ * 只有本线程的relaxed读写，没有锁和原子读改写；读取时把所有线程的值
+ * 相加，允许看到略有先后的值。每个文件的源另有一组按线程的计数
+ */
+#define METRICS_MAX_SOURCES 128
+#define METRICS_MAX_FILE_NAME 256
+// 工作线程各一组，其他线程（启动线程等）共用最后一组
+#define METRICS_MAX_THREADS (WORKER_MAX_COUNT + 1)
+
+enum MetricsCounter {
+    // 只有服务器总计
+    METRICS_RTSP_REQUESTS,
+    METRICS_RTSP_CONNECTIONS, // 当前值，下同
+    METRICS_SESSIONS,
+    METRICS_SOURCES,
+    METRICS_TCP_QUEUE_BYTES, // RTSP连接上排队未发出的字节
+    // 服务器总计，同时按源统计
+    METRICS_SUBSCRIBERS,
+    METRICS_RTP_PACKETS,
+    METRICS_RTP_BYTES,
+    METRICS_SEND_SYSCALLS,
+    METRICS_SEND_DROPPED, // UDP发送缓冲满（EAGAIN）丢弃的包
+    METRICS_SEND_ERRORS,
+    METRICS_FRAMES_DROPPED, // RTP over TCP连接积压时丢弃的帧
+    METRICS_RETRANSMITS,
+    METRICS_LIVE_DROPPED, // 直播源落后时跳过的帧
+    METRICS_COUNTER_COUNT,
+};
+
+#define METRICS_FIRST_SOURCE_COUNTER METRICS_SUBSCRIBERS
+
+// 发送相对计划时间的延迟，按上界分桶（微秒），最后一个桶没有上界
+#define METRICS_LATENESS_BUCKETS 12
+extern const uint64_t metrics_lateness_bounds_us[METRICS_LATENESS_BUCKETS - 1];
+
+struct alignas(64) MetricsBlock {
+    std::atomic<int64_t> values[METRICS_COUNTER_COUNT];
+};
+
+struct MetricsSnapshot {
+    int64_t values[METRICS_COUNTER_COUNT];
+    uint64_t lateness[METRICS_LATENESS_BUCKETS];
+    uint64_t lateness_sum_ns;
+};
+
+// 只有本线程写的计数，读写都是relaxed，不需要原子加
+static inline void metrics_block_add(struct MetricsBlock* block,
+                                     enum MetricsCounter counter,
+                                     int64_t n) {
+    std::atomic<int64_t>& value = block->values[counter];
+    value.store(value.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+
+// 当前线程的服务器计数
+struct MetricsBlock* metrics_thread_block();
+void metrics_add(enum MetricsCounter counter, int64_t n);
+void metrics_record_lateness(uint64_t lateness_ns);
+
+/*
+ * 文件对应的源计数在当前线程的那一组，不同线程播放同一文件时计数最后
+ * 相加。第一次出现的文件登记时加锁，表满时返回nullptr，只统计总计
+ */
+struct MetricsBlock* metrics_source_block(const char* file_name);
+
+// 所有线程相加的服务器计数
+void metrics_snapshot(struct MetricsSnapshot* snapshot);
+// 所有线程相加的一个文件的计数，文件没有登记过时返回-1
+int metrics_source_snapshot(const char* file_name,
+                            int64_t values[METRICS_COUNTER_COUNT]);
+// 计数的名字，不带前缀和单位后缀，如"rtp_packets"
+const char* metrics_counter_name(enum MetricsCounter counter);
+// 延迟直方图的分位数（0~1），返回所在桶的上界（微秒），没有样本时返回0
+uint64_t metrics_lateness_quantile_us(const struct MetricsSnapshot* snapshot,
+                                      double quantile);
+
+// Prometheus文本格式（0.0.4）的全部计数
+void metrics_format_prometheus(std::string* out);
+
+#endif
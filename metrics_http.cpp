@@ -0,0 +1,203 @@
+#include "metrics_http.h"
+
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+
+#include "event_loop.h"
+#include "metrics.h"
+
+struct MetricsHttpClient {
+    int sockfd;
+    std::string request;
+    std::string response; // 回复生成后request不再使用
+    size_t sent;
+};
+
+static void close_client(struct EventLoop* loop,
+                         struct MetricsHttpClient* client) {
+    event_loop_remove(loop, client->sockfd);
+    close(client->sockfd);
+    delete client;
+}
+
+static void build_response(struct MetricsHttpClient* client) {
+    // 请求行：GET /metrics HTTP/1.1，忽略查询参数
+    const std::string& request = client->request;
+    size_t path_end = request.find_first_of(" ?\r\n", 4);
+    bool found = request.compare(0, 4, "GET ") == 0 &&
+                 path_end != std::string::npos &&
+                 request.compare(4, path_end - 4, "/metrics") == 0;
+    std::string body;
+    const char* status;
+    const char* type;
+    if (found) {
+        metrics_format_prometheus(&body);
+        status = "200 OK";
+        type = "text/plain; version=0.0.4; charset=utf-8";
+    }
+    else {
+        body = "not found\n";
+        status = "404 Not Found";
+        type = "text/plain; charset=utf-8";
+    }
+    char header[256];
+    snprintf(header, sizeof(header),
+             "HTTP/1.1 %s\r\n"
+             "Content-Type: %s\r\n"
+             "Content-Length: %zu\r\n"
+             "Connection: close\r\n"
+             "\r\n",
+             status, type, body.size());
+    client->response = header;
+    client->response += body;
+    client->sent = 0;
+}
+
+// 返回-1表示连接可以关闭了
+static int flush_response(struct MetricsHttpClient* client) {
+    while (client->sent < client->response.size()) {
+        ssize_t ret = send(client->sockfd,
+                           client->response.data() + client->sent,
+                           client->response.size() - client->sent,
+                           MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        client->sent += ret;
+    }
+    return -1;
+}
+
+static void on_client_event(struct EventLoop* loop, int fd, uint32_t events,
+                            void* arg) {
+    struct MetricsHttpClient* client = (struct MetricsHttpClient*) arg;
+    if (events & (EPOLLERR | EPOLLHUP)) {
+        close_client(loop, client);
+        return;
+    }
+    if (!client->response.empty()) {
+        if (flush_response(client) < 0) {
+            close_client(loop, client);
+        }
+        return;
+    }
+    char buffer[2048];
+    while (true) {
+        ssize_t ret = recv(fd, buffer, sizeof(buffer), 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            }
+            close_client(loop, client);
+            return;
+        }
+        if (ret == 0) {
+            close_client(loop, client);
+            return;
+        }
+        client->request.append(buffer, ret);
+        if (client->request.find("\r\n\r\n") != std::string::npos) {
+            break;
+        }
+        if (client->request.size() > METRICS_HTTP_MAX_REQUEST) {
+            close_client(loop, client);
+            return;
+        }
+    }
+    build_response(client);
+    if (flush_response(client) < 0) {
+        close_client(loop, client);
+        return;
+    }
+    // 回复没有发完，只等待可写
+    event_loop_modify(loop, fd, EPOLLOUT);
+}
+
+static void on_accept(struct EventLoop* loop, int fd, uint32_t events,
+                      void* arg) {
+    while (true) {
+        int sockfd = accept(fd, nullptr, nullptr);
+        if (sockfd < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                printf("metrics: failed to accept: %s\n", strerror(errno));
+            }
+            return;
+        }
+        set_nonblocking(sockfd);
+        struct MetricsHttpClient* client = new MetricsHttpClient();
+        client->sockfd = sockfd;
+        client->sent = 0;
+        if (event_loop_add(loop, sockfd, EPOLLIN, on_client_event, client) <
+            0) {
+            close(sockfd);
+            delete client;
+        }
+    }
+}
+
+int metrics_http_start(struct EventLoop* loop, const char* ip, int port) {
+    int sockfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (sockfd < 0) {
+        printf("metrics: failed to create socket\n");
+        return -1;
+    }
+    int on = 1;
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, ip, &addr.sin_addr) != 1 ||
+        bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0 ||
+        listen(sockfd, SOMAXCONN) < 0) {
+        printf("metrics: failed to listen on %s:%d: %s\n", ip, port,
+               strerror(errno));
+        close(sockfd);
+        return -1;
+    }
+    set_nonblocking(sockfd);
+    if (event_loop_add(loop, sockfd, EPOLLIN, on_accept, nullptr) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    printf("metrics: http://%s:%d/metrics\n", ip, port);
+    return 0;
+}
+
+int metrics_http_parse_addr(const char* text, char* ip, int ip_size,
+                            int* port) {
+    const char* colon = strrchr(text, ':');
+    const char* port_text = colon ? colon + 1 : text;
+    if (colon) {
+        if (colon - text >= ip_size) {
+            return -1;
+        }
+        memcpy(ip, text, colon - text);
+        ip[colon - text] = '\0';
+    }
+    else {
+        snprintf(ip, ip_size, "%s", METRICS_HTTP_DEFAULT_IP);
+    }
+    char* end;
+    long value = strtol(port_text, &end, 10);
+    struct in_addr addr;
+    if (*port_text == '\0' || *end != '\0' || value <= 0 || value > 65535 ||
+        inet_pton(AF_INET, ip, &addr) != 1) {
+        return -1;
+    }
+    *port = (int) value;
+    return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef RTSPSERVER_METRICS_HTTP_H
+#define RTSPSERVER_METRICS_HTTP_H
+
+#define METRICS_HTTP_DEFAULT_IP "127.0.0.1"
+// 请求头的最大长度，超过时直接关闭连接
+#define METRICS_HTTP_MAX_REQUEST 8192
+
+struct EventLoop;
+
+/*
+ * 在loop上监听ip:port的HTTP服务，GET /metrics返回Prometheus文本格式的
+ * 计数，其他路径返回404。每个连接只处理一个请求，回复后关闭。
+ * 只在一个工作线程上运行，读取的是所有线程的计数之和
+ */
+int metrics_http_start(struct EventLoop* loop, const char* ip, int port);
+// 解析"[ip:]port"，没有ip时为METRICS_HTTP_DEFAULT_IP，失败返回-1
+int metrics_http_parse_addr(const char* text, char* ip, int ip_size,
+                            int* port);
+
+#endif
@@ -0,0 +1,110 @@
+#include "rtcp.h"
+
+#include <cstring>
+#include <ctime>
+
+// 1900年到1970年的秒数
+#define NTP_UNIX_OFFSET 2208988800ull
+
+uint64_t rtcp_ntp_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t fraction = ((uint64_t) ts.tv_nsec << 32) / 1000000000ull;
+    return ((uint64_t) ts.tv_sec + NTP_UNIX_OFFSET) << 32 | fraction;
+}
+
+static inline void write16(uint8_t* p, uint16_t value) {
+    p[0] = (uint8_t) (value >> 8);
+    p[1] = (uint8_t) value;
+}
+
+static inline void write32(uint8_t* p, uint32_t value) {
+    p[0] = (uint8_t) (value >> 24);
+    p[1] = (uint8_t) (value >> 16);
+    p[2] = (uint8_t) (value >> 8);
+    p[3] = (uint8_t) value;
+}
+
+int rtcp_build_sr(uint8_t* buffer, uint32_t ssrc, uint64_t ntp,
+                  uint32_t rtp_timestamp, uint32_t packet_count,
+                  uint32_t octet_count, const char* cname) {
+    // SR：头部 + SSRC + 发送者信息，没有报告块
+    buffer[0] = 0x80;
+    buffer[1] = RTCP_TYPE_SR;
+    write16(buffer + 2, 6);
+    write32(buffer + 4, ssrc);
+    write32(buffer + 8, (uint32_t) (ntp >> 32));
+    write32(buffer + 12, (uint32_t) ntp);
+    write32(buffer + 16, rtp_timestamp);
+    write32(buffer + 20, packet_count);
+    write32(buffer + 24, octet_count);
+
+    // SDES：一个块，只有CNAME，以至少一个0结束并补齐到4字节
+    uint8_t* sdes = buffer + 28;
+    size_t cname_size = strlen(cname);
+    if (cname_size > RTCP_SR_MAX_SIZE - 28 - 12) {
+        cname_size = RTCP_SR_MAX_SIZE - 28 - 12;
+    }
+    uint32_t chunk_size = 4 + 2 + cname_size + 1;
+    chunk_size = (chunk_size + 3) & ~3u;
+    sdes[0] = 0x81;
+    sdes[1] = RTCP_TYPE_SDES;
+    write16(sdes + 2, chunk_size / 4);
+    write32(sdes + 4, ssrc);
+    sdes[8] = 1; // CNAME
+    sdes[9] = (uint8_t) cname_size;
+    memcpy(sdes + 10, cname, cname_size);
+    memset(sdes + 10 + cname_size, 0, chunk_size - 6 - cname_size);
+    return 28 + 4 + chunk_size;
+}
+
+int rtcp_next_packet(const uint8_t* data, int size, int* pos,
+                     struct RtcpPacket* packet) {
+    if (*pos >= size) {
+        return 0;
+    }
+    const uint8_t* header = data + *pos;
+    if (size - *pos < RTCP_HEADER_SIZE || header[0] >> 6 != 2) {
+        return -1;
+    }
+    uint32_t length = (rtcp_read16(header + 2) + 1) * 4;
+    if (length > (uint32_t) (size - *pos)) {
+        return -1;
+    }
+    uint32_t body_size = length - RTCP_HEADER_SIZE;
+    if (header[0] & 0x20) {
+        // 最后一个字节是填充的长度
+        uint8_t padding = header[length - 1];
+        if (padding == 0 || padding > body_size) {
+            return -1;
+        }
+        body_size -= padding;
+    }
+    packet->type = header[1];
+    packet->count = header[0] & 0x1F;
+    packet->body = header + RTCP_HEADER_SIZE;
+    packet->body_size = body_size;
+    *pos += length;
+    return 1;
+}
+
+int rtcp_report_block(const struct RtcpPacket* packet, int i,
+                      struct RtcpReportBlock* block) {
+    // 报告块在发送者SSRC之后，SR还要跳过20字节的发送者信息
+    uint32_t offset = packet->type == RTCP_TYPE_SR ? 24 : 4;
+    offset += i * RTCP_REPORT_BLOCK_SIZE;
+    if (i >= packet->count ||
+        offset + RTCP_REPORT_BLOCK_SIZE > packet->body_size) {
+        return -1;
+    }
+    const uint8_t* p = packet->body + offset;
+    block->ssrc = rtcp_read32(p);
+    block->fraction_lost = p[4];
+    // 24位有符号数
+    block->cumulative_lost = (int32_t) (rtcp_read32(p + 4) << 8) >> 8;
+    block->highest_seq = rtcp_read32(p + 8);
+    block->jitter = rtcp_read32(p + 12);
+    block->last_sr = rtcp_read32(p + 16);
+    block->delay_since_last_sr = rtcp_read32(p + 20);
+    return 0;
+}
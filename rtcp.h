@@ -0,0 +1,73 @@
+#ifndef RTSPSERVER_RTCP_H
+#define RTSPSERVER_RTCP_H
+
+#include <cstdint>
+
+#define RTCP_TYPE_SR 200
+#define RTCP_TYPE_RR 201
+#define RTCP_TYPE_SDES 202
+#define RTCP_TYPE_BYE 203
+#define RTCP_TYPE_RTPFB 205 // RFC 4585传输层反馈
+#define RTCP_RTPFB_NACK 1 // 通用NACK，FMT字段的值
+
+#define RTCP_HEADER_SIZE 4
+#define RTCP_REPORT_BLOCK_SIZE 24
+// SR（不带报告块）加只有CNAME的SDES的最大长度
+#define RTCP_SR_MAX_SIZE 128
+
+/*
+ * 复合包中的一个RTCP包
+ *    0                   1                   2                   3
+ *    7 6 5 4 3 2 1 0|7 6 5 4 3 2 1 0|7 6 5 4 3 2 1 0|7 6 5 4 3 2 1 0
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ *   |V=2|P|  RC/FMT |      PT       |             length            |
+ *   +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+ */
+struct RtcpPacket {
+    uint8_t type;
+    uint8_t count; // RC，反馈包中为FMT
+    const uint8_t* body; // 头部之后的数据，不含填充
+    uint32_t body_size;
+};
+
+// SR/RR中对一个媒体源的接收报告
+struct RtcpReportBlock {
+    uint32_t ssrc;
+    uint8_t fraction_lost; // 上个报告以来的丢包率，单位1/256
+    int32_t cumulative_lost;
+    uint32_t highest_seq; // 扩展的最大序号，高16位为回绕次数
+    uint32_t jitter; // 到达间隔抖动，单位为RTP时间戳
+    uint32_t last_sr; // LSR：最近收到的SR的NTP时间戳中间32位
+    uint32_t delay_since_last_sr; // DLSR，单位1/65536秒
+};
+
+static inline uint16_t rtcp_read16(const uint8_t* p) {
+    return (uint16_t) (p[0] << 8 | p[1]);
+}
+
+static inline uint32_t rtcp_read32(const uint8_t* p) {
+    return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+// 当前墙上时间的64位NTP时间戳，高32位为1900年以来的秒数
+uint64_t rtcp_ntp_now();
+
+/*
+ * 在buffer中生成SR加SDES(CNAME)的复合包，buffer至少RTCP_SR_MAX_SIZE字节，
+ * 返回长度
+ */
+int rtcp_build_sr(uint8_t* buffer, uint32_t ssrc, uint64_t ntp,
+                  uint32_t rtp_timestamp, uint32_t packet_count,
+                  uint32_t octet_count, const char* cname);
+
+/*
+ * 取出复合包中*pos处的RTCP包，*pos移到下一个包。
+ * 成功返回1，已经没有更多的包返回0，格式错误返回-1
+ */
+int rtcp_next_packet(const uint8_t* data, int size, int* pos,
+                     struct RtcpPacket* packet);
+// SR或RR中第i个报告块，越界返回-1
+int rtcp_report_block(const struct RtcpPacket* packet, int i,
+                      struct RtcpReportBlock* block);
+
+#endif
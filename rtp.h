@@ -1,7 +1,11 @@
 #ifndef RTSPSERVER_RTP_H
 #define RTSPSERVER_RTP_H
 
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
 #include <cstdint>
+#include <cstring>
 
 #define RTP_VERSION 2
 
@@ -10,6 +14,8 @@
 
 #define RTP_HEADER_SIZE 12
 #define RTP_MAX_PKT_SIZE 1400
+// RTP over RTSP(TCP)时每个包前面的'$'、通道号和2字节长度
+#define RTP_TCP_PREFIX_SIZE 4
 
 /*
  *    0                   1                   2                   3
@@ -27,38 +33,46 @@
  *
  */
 
-struct RtpHeader {
-    // byte 0 位域分配位数是从低位到高位
-    // version padding extension csrc_len
-    uint8_t csrc_len: 4; // CSRC计数器, 占4位, 指示CSRC标识符的个数，低位数据
-    uint8_t extension: 1; // 占1位, if X = 1, 则有扩展头部
-    uint8_t padding: 1; // 填充标志，在该报文的尾部添加一个或多个额外的八位组，他们不是有效载荷的一部分
-    uint8_t version: 2; // RTP协议的版本号，高位数据
-    // byte 1
-    uint8_t payload_type: 7; // 有效载荷类型
-    uint8_t marker: 1; // 标记位, 对于不同的有效载荷有不同的含义
-    // byte 2-3
-    uint16_t seq; // 报文序列号，超过1字节需要在发送时转为大端序
-    // byte 4 - 7
-    uint32_t timestamp; // 时间戳
-    // byte 8 - 11
-    uint32_t ssrc; // 标记同步信源
-    // 0 - 15个特约信源（CSRC）标识符, 每个占32位
-};
+// 第0字节：V=2，没有填充、扩展和CSRC；第1字节的最高位是M位
+#define RTP_HEADER_BYTE0 (RTP_VERSION << 6)
+#define RTP_MARKER 0x80
+
+/*
+ * 生成网络字节序的RTP头模板，每个流（观看者的一个轨道）生成一次，
+ * 版本、负载类型和ssrc之后都不变，每个包拷贝模板后只写seq和timestamp
+ */
+inline void rtp_header_template(uint8_t* header, uint8_t payload_type,
+                                uint32_t ssrc) {
+    header[0] = RTP_HEADER_BYTE0;
+    header[1] = payload_type;
+    header[2] = 0;
+    header[3] = 0;
+    header[4] = 0;
+    header[5] = 0;
+    header[6] = 0;
+    header[7] = 0;
+    header[8] = (uint8_t) (ssrc >> 24);
+    header[9] = (uint8_t) (ssrc >> 16);
+    header[10] = (uint8_t) (ssrc >> 8);
+    header[11] = (uint8_t) ssrc;
+}
 
-struct RtpPacket {
-    struct RtpHeader rtp_header;
-    uint8_t payload[0];
-};
+// 在拷贝的模板中写入seq和timestamp，两次字节序转换加存储，没有分支
+inline void rtp_header_stamp(uint8_t* header, uint16_t seq,
+                             uint32_t timestamp) {
+    uint16_t net_seq = htons(seq);
+    uint32_t net_timestamp = htonl(timestamp);
+    memcpy(header + 2, &net_seq, sizeof(net_seq));
+    memcpy(header + 4, &net_timestamp, sizeof(net_timestamp));
+}
 
-void rtp_header_init(struct RtpPacket* rtp_packet, uint8_t csrc_len,
-                     uint8_t extension, uint8_t padding, uint8_t version,
-                     uint8_t payload_type, uint8_t marker, uint16_t seq,
-                     uint32_t timestamp, uint32_t ssrc);
+/*
+ * 分散/聚集发送一个RTP包：header为已经是网络字节序的RTP头加上负载前缀
+ * （如FU indicator和FU header），payload直接指向原始数据，两者都不拷贝
+ */
+int rtp_send_iov_over_udp(int server_rtp_sockfd,
+                          const struct sockaddr_in* addr,
+                          const uint8_t* header, uint32_t header_size,
+                          const uint8_t* payload, uint32_t payload_size);
 
-int rtp_send_packet_over_tcp(int client_sockfd, struct RtpPacket* rtp_packet,
-                             uint32_t data_size);
-int rtp_send_packet_over_udp(int server_rtp_sockfd, const char* ip,
-                             int16_t port, struct RtpPacket* rtp_packet,
-                             uint32_t data_size);
 #endif
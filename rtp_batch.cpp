@@ -0,0 +1,685 @@
+#include "rtp_batch.h"
+
+#include <linux/io_uring.h>
+#include <netinet/udp.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef SCM_TXTIME
+#define SCM_TXTIME 61
+#endif
+
+// io_uring固定文件表的大小，超出的socket按普通fd提交
+#define RTP_URING_FILES 4096
+
+// 所有工作线程共用，只在启动和GSO失败时修改
+static std::atomic<enum RtpSendMode> send_mode{RTP_SEND_MODE_SENDMMSG};
+static std::atomic<bool> gso_enabled{false};
+
+/*
+ * 每个工作线程一个io_uring，第一次发送时创建。发送都带MSG_DONTWAIT，
+ * 在提交时就地完成，rtp_batch_flush返回前收齐所有完成事件，批次中的
+ * 消息不会在返回之后还被内核引用
+ */
+struct RtpUring {
+    bool ready;
+    bool failed; // 创建失败或运行出错，本线程改用sendmmsg/GSO
+    int fd;
+    unsigned sq_mask;
+    unsigned cq_mask;
+    unsigned* sq_tail;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+
+    // 已注册为固定文件的socket，提交时内核不用每次按fd查找和引用文件
+    bool files;
+    std::vector<int> slots; // 按fd索引的固定文件下标，-1表示未注册
+    std::vector<int> free_slots;
+};
+
+static thread_local struct RtpUring uring;
+
+static int io_uring_setup(unsigned entries, struct io_uring_params* params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, nullptr, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void* arg,
+                             unsigned nr_args) {
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static bool uring_sendmsg_supported(int fd) {
+    size_t size = sizeof(struct io_uring_probe) +
+                  IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = (struct io_uring_probe*) calloc(1, size);
+    if (!probe) {
+        return false;
+    }
+    bool supported =
+            io_uring_register(fd, IORING_REGISTER_PROBE, probe,
+                              IORING_OP_LAST) == 0 &&
+            probe->last_op >= IORING_OP_SENDMSG &&
+            (probe->ops[IORING_OP_SENDMSG].flags & IO_URING_OP_SUPPORTED);
+    free(probe);
+    return supported;
+}
+
+static void uring_close(struct RtpUring* ring) {
+    if (ring->sqes) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ring && ring->cq_ring != ring->sq_ring) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
+    }
+    if (ring->sq_ring) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
+    }
+    if (ring->fd >= 0) {
+        close(ring->fd);
+    }
+    ring->fd = -1;
+    ring->sqes = nullptr;
+    ring->sq_ring = nullptr;
+    ring->cq_ring = nullptr;
+    ring->ready = false;
+    ring->files = false;
+    ring->slots.clear();
+    ring->free_slots.clear();
+}
+
+static int uring_open(struct RtpUring* ring) {
+    ring->fd = -1;
+    ring->sqes = nullptr;
+    ring->sq_ring = nullptr;
+    ring->cq_ring = nullptr;
+
+    struct io_uring_params params;
+    bzero(&params, sizeof(params));
+    // 只有本线程提交，完成事件在下一次io_uring_enter时处理即可
+    params.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                   IORING_SETUP_SINGLE_ISSUER;
+    ring->fd = io_uring_setup(RTP_BATCH_MAX_PACKETS, &params);
+    if (ring->fd < 0 && errno == EINVAL) {
+        // 旧内核不认识这些标志
+        bzero(&params, sizeof(params));
+        ring->fd = io_uring_setup(RTP_BATCH_MAX_PACKETS, &params);
+    }
+    if (ring->fd < 0) {
+        return -1;
+    }
+    if (!uring_sendmsg_supported(ring->fd)) {
+        uring_close(ring);
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+
+    ring->sq_ring_size =
+            params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes +
+                         params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size) {
+            ring->sq_ring_size = ring->cq_ring_size;
+        }
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    void* sq_ring =
+            mmap(nullptr, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+        uring_close(ring);
+        return -1;
+    }
+    ring->sq_ring = sq_ring;
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ring = sq_ring;
+    }
+    else {
+        void* cq_ring =
+                mmap(nullptr, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (cq_ring == MAP_FAILED) {
+            uring_close(ring);
+            return -1;
+        }
+        ring->cq_ring = cq_ring;
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    void* sqes = mmap(nullptr, ring->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+        uring_close(ring);
+        return -1;
+    }
+    ring->sqes = (struct io_uring_sqe*) sqes;
+
+    uint8_t* sq = (uint8_t*) ring->sq_ring;
+    uint8_t* cq = (uint8_t*) ring->cq_ring;
+    ring->sq_mask = *(unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_mask = *(unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    // 先注册一张全空的固定文件表，socket第一次发送时再填入。失败时
+    // 按普通fd提交
+    std::vector<int> fds(RTP_URING_FILES, -1);
+    ring->files = io_uring_register(ring->fd, IORING_REGISTER_FILES, fds.data(),
+                                    RTP_URING_FILES) == 0;
+    ring->slots.clear();
+    ring->free_slots.clear();
+    if (ring->files) {
+        for (int slot = RTP_URING_FILES - 1; slot >= 0; --slot) {
+            ring->free_slots.push_back(slot);
+        }
+    }
+    ring->ready = true;
+    return 0;
+}
+
+// 当前线程的ring，不可用时返回nullptr
+static struct RtpUring* uring_get() {
+    if (uring.ready) {
+        return &uring;
+    }
+    if (uring.failed) {
+        return nullptr;
+    }
+    if (uring_open(&uring) < 0) {
+        printf("failed to set up io_uring: %s, fall back to %s\n",
+               strerror(errno), gso_enabled ? "gso" : "sendmmsg");
+        uring.failed = true;
+        return nullptr;
+    }
+    return &uring;
+}
+
+static bool uring_supported() {
+    struct RtpUring ring;
+    if (uring_open(&ring) < 0) {
+        return false;
+    }
+    uring_close(&ring);
+    return true;
+}
+
+static int uring_update_file(struct RtpUring* ring, int slot, int sockfd) {
+    struct io_uring_files_update update;
+    bzero(&update, sizeof(update));
+    update.offset = slot;
+    update.fds = (uint64_t) (uintptr_t) &sockfd;
+    return io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &update,
+                             1) == 1
+                   ? 0
+                   : -1;
+}
+
+// sockfd对应的固定文件下标，没有注册且无法注册时返回-1
+static int uring_file(struct RtpUring* ring, int sockfd) {
+    if (!ring->files) {
+        return -1;
+    }
+    if ((size_t) sockfd < ring->slots.size() && ring->slots[sockfd] >= 0) {
+        return ring->slots[sockfd];
+    }
+    if (ring->free_slots.empty()) {
+        return -1;
+    }
+    int slot = ring->free_slots.back();
+    if (uring_update_file(ring, slot, sockfd) < 0) {
+        return -1;
+    }
+    ring->free_slots.pop_back();
+    if ((size_t) sockfd >= ring->slots.size()) {
+        ring->slots.resize(sockfd + 1, -1);
+    }
+    ring->slots[sockfd] = slot;
+    return slot;
+}
+
+void rtp_batch_release_socket(int sockfd) {
+    struct RtpUring* ring = &uring;
+    if (!ring->ready || (size_t) sockfd >= ring->slots.size() ||
+        ring->slots[sockfd] < 0) {
+        return;
+    }
+    int slot = ring->slots[sockfd];
+    ring->slots[sockfd] = -1;
+    // 固定文件表持有socket的引用，不清掉的话close之后socket也不会释放
+    if (uring_update_file(ring, slot, -1) == 0) {
+        ring->free_slots.push_back(slot);
+    }
+}
+
+static bool gso_supported() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return false;
+    }
+    int size = RTP_HEADER_SIZE + RTP_MAX_PKT_SIZE;
+    bool supported = setsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &size,
+                                sizeof(size)) == 0;
+    close(sockfd);
+    return supported;
+}
+
+enum RtpSendMode rtp_batch_set_mode(enum RtpSendMode mode) {
+    if (mode == RTP_SEND_MODE_URING && !uring_supported()) {
+        printf("io_uring sendmsg is not available: %s, fall back to gso\n",
+               strerror(errno));
+        mode = RTP_SEND_MODE_GSO;
+    }
+    gso_enabled = false;
+    if (mode == RTP_SEND_MODE_GSO || mode == RTP_SEND_MODE_URING) {
+        gso_enabled = gso_supported();
+        if (!gso_enabled) {
+            printf("UDP GSO is not supported, fall back to sendmmsg\n");
+            if (mode == RTP_SEND_MODE_GSO) {
+                mode = RTP_SEND_MODE_SENDMMSG;
+            }
+        }
+    }
+    send_mode = mode;
+    return mode;
+}
+
+enum RtpSendMode rtp_batch_get_mode() {
+    enum RtpSendMode mode = send_mode;
+    if (mode == RTP_SEND_MODE_GSO && !gso_enabled) {
+        return RTP_SEND_MODE_SENDMMSG;
+    }
+    return mode;
+}
+
+// 运行中GSO发送失败，所有线程以后都按单包组织消息
+static void disable_gso(int error) {
+    if (gso_enabled.exchange(false)) {
+        printf("UDP GSO send failed: %s, fall back to sendmmsg\n",
+               strerror(error));
+    }
+}
+
+const char* rtp_send_mode_name(enum RtpSendMode mode) {
+    switch (mode) {
+        case RTP_SEND_MODE_SENDMSG: return "sendmsg";
+        case RTP_SEND_MODE_SENDMMSG: return "sendmmsg";
+        case RTP_SEND_MODE_GSO: return "gso";
+        case RTP_SEND_MODE_URING: return "uring";
+    }
+    return "unknown";
+}
+
+int rtp_send_mode_parse(const char* name, enum RtpSendMode* mode) {
+    if (strcmp(name, "sendmsg") == 0) {
+        *mode = RTP_SEND_MODE_SENDMSG;
+    }
+    else if (strcmp(name, "sendmmsg") == 0) {
+        *mode = RTP_SEND_MODE_SENDMMSG;
+    }
+    else if (strcmp(name, "gso") == 0) {
+        *mode = RTP_SEND_MODE_GSO;
+    }
+    else if (strcmp(name, "uring") == 0) {
+        *mode = RTP_SEND_MODE_URING;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+void rtp_batch_init(struct RtpBatch* batch) {
+    batch->count = 0;
+    batch->syscalls = 0;
+    batch->packets_sent = 0;
+    batch->bytes_sent = 0;
+    batch->packets_dropped = 0;
+    batch->send_errors = 0;
+}
+
+void rtp_batch_add(struct RtpBatch* batch, int sockfd,
+                   const struct sockaddr_in* addr, const uint8_t* header,
+                   uint32_t header_size, const uint8_t* payload,
+                   uint32_t payload_size, uint64_t txtime_ns) {
+    if (batch->count == RTP_BATCH_MAX_PACKETS) {
+        rtp_batch_flush(batch);
+    }
+    struct RtpBatchPacket* packet = &batch->packets[batch->count++];
+    packet->sockfd = sockfd;
+    packet->addr = addr;
+    memcpy(packet->header, header, header_size);
+    packet->header_size = header_size;
+    packet->payload = payload;
+    packet->payload_size = payload_size;
+    packet->txtime_ns = txtime_ns;
+}
+
+static bool same_addr(const struct sockaddr_in* a,
+                      const struct sockaddr_in* b) {
+    if (a == b) {
+        return true;
+    }
+    if (!a || !b) {
+        return false;
+    }
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+static inline uint32_t packet_size(const struct RtpBatchPacket* packet) {
+    return packet->header_size + packet->payload_size;
+}
+
+/*
+ * 从packets[begin]开始组织一条消息，返回消息包含的包数。GSO时把发往
+ * 同一地址、发送时间相同的等长包拼成一条消息，由内核按第一个包的长度
+ * 切分，比它短的包只能作为最后一段
+ */
+static int build_msg(struct RtpBatch* batch, int begin, int end,
+                     struct mmsghdr* msg, struct iovec* iov, char* control,
+                     bool gso) {
+    const struct RtpBatchPacket* first = &batch->packets[begin];
+    uint32_t segment_size = packet_size(first);
+    uint32_t total_size = segment_size;
+    int n = 1;
+    if (gso) {
+        while (begin + n < end && n < RTP_GSO_MAX_SEGMENTS) {
+            const struct RtpBatchPacket* packet = &batch->packets[begin + n];
+            uint32_t size = packet_size(packet);
+            if (!same_addr(packet->addr, first->addr) || size > segment_size ||
+                packet->txtime_ns != first->txtime_ns ||
+                total_size + size > RTP_GSO_MAX_BYTES) {
+                break;
+            }
+            ++n;
+            total_size += size;
+            if (size < segment_size) {
+                break;
+            }
+        }
+    }
+
+    for (int k = 0; k < n; ++k) {
+        struct RtpBatchPacket* packet = &batch->packets[begin + k];
+        iov[2 * k].iov_base = packet->header;
+        iov[2 * k].iov_len = packet->header_size;
+        iov[2 * k + 1].iov_base = (void*) packet->payload;
+        iov[2 * k + 1].iov_len = packet->payload_size;
+    }
+    bzero(msg, sizeof(*msg));
+    msg->msg_hdr.msg_name = (void*) first->addr;
+    msg->msg_hdr.msg_namelen = first->addr ? sizeof(*first->addr) : 0;
+    msg->msg_hdr.msg_iov = iov;
+    msg->msg_hdr.msg_iovlen = 2 * n;
+    size_t control_size = 0;
+    if (n > 1) {
+        struct cmsghdr* cmsg = (struct cmsghdr*) (control + control_size);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t gso_size = segment_size;
+        memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        control_size += CMSG_SPACE(sizeof(uint16_t));
+    }
+    if (first->txtime_ns) {
+        struct cmsghdr* cmsg = (struct cmsghdr*) (control + control_size);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_TXTIME;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cmsg), &first->txtime_ns, sizeof(uint64_t));
+        control_size += CMSG_SPACE(sizeof(uint64_t));
+    }
+    if (control_size > 0) {
+        msg->msg_hdr.msg_control = control;
+        msg->msg_hdr.msg_controllen = control_size;
+    }
+    return n;
+}
+
+static inline int socket_end(const struct RtpBatch* batch, int begin) {
+    int sockfd = batch->packets[begin].sockfd;
+    int end = begin;
+    while (end < batch->count && batch->packets[end].sockfd == sockfd) {
+        ++end;
+    }
+    return end;
+}
+
+// 一条消息中n个包的字节数
+static uint64_t msg_bytes(const struct RtpBatch* batch, int first, int n) {
+    uint64_t bytes = 0;
+    for (int k = first; k < first + n; ++k) {
+        bytes += batch->packets[k].header_size + batch->packets[k].payload_size;
+    }
+    return bytes;
+}
+
+static bool send_buffer_full(int error) {
+    return error == EAGAIN || error == EWOULDBLOCK || error == ENOBUFS;
+}
+
+// 每个socket一次sendmmsg（或每个包一次sendmsg），返回成功发送的包数
+static int flush_sockets(struct RtpBatch* batch, enum RtpSendMode mode) {
+    int sent = 0;
+    int i = 0;
+
+    while (i < batch->count) {
+        // 同一个socket上连续的包一起发送
+        int sockfd = batch->packets[i].sockfd;
+        int end = socket_end(batch, i);
+        bool gso = mode == RTP_SEND_MODE_GSO && gso_enabled;
+        int msg_count = 0;
+        int iov_pos = 0;
+        for (int pos = i; pos < end; ++msg_count) {
+            int n = build_msg(batch, pos, end, &batch->msgs[msg_count],
+                              &batch->iovs[iov_pos], batch->controls[msg_count],
+                              gso);
+            batch->msg_first[msg_count] = pos;
+            batch->msg_packets[msg_count] = n;
+            iov_pos += 2 * n;
+            pos += n;
+        }
+
+        int next = end;
+        int m = 0;
+        while (m < msg_count) {
+            int ret;
+            if (mode == RTP_SEND_MODE_SENDMSG) {
+                ret = sendmsg(sockfd, &batch->msgs[m].msg_hdr, 0) < 0 ? -1 : 1;
+            }
+            else {
+                ret = sendmmsg(sockfd, &batch->msgs[m], msg_count - m, 0);
+            }
+            ++batch->syscalls;
+            if (ret > 0) {
+                for (int k = m; k < m + ret; ++k) {
+                    sent += batch->msg_packets[k];
+                    batch->bytes_sent += msg_bytes(batch, batch->msg_first[k],
+                                                   batch->msg_packets[k]);
+                }
+                m += ret;
+                continue;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            if (send_buffer_full(errno)) {
+                // 发送缓冲满，UDP直接丢弃剩下的包
+                for (int k = m; k < msg_count; ++k) {
+                    batch->packets_dropped += batch->msg_packets[k];
+                }
+                break;
+            }
+            if (gso && batch->msg_packets[m] > 1 &&
+                (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+                disable_gso(errno);
+                // 从失败的消息开始按单包重新组织
+                next = batch->msg_first[m];
+                break;
+            }
+            // 其他错误（如已connect的socket收到ICMP不可达）只丢弃这一条消息
+            batch->send_errors += batch->msg_packets[m];
+            ++m;
+        }
+        i = next;
+    }
+    batch->count = 0;
+    return sent;
+}
+
+/*
+ * 整个批次的消息一起提交到io_uring，一次io_uring_enter提交并等待全部
+ * 完成，不再是每个socket一次系统调用。返回成功发送的包数
+ */
+static int flush_uring(struct RtpBatch* batch, struct RtpUring* ring) {
+    bool gso = gso_enabled;
+    int msg_count = 0;
+    int iov_pos = 0;
+    for (int i = 0; i < batch->count;) {
+        int end = socket_end(batch, i);
+        for (; i < end; ++msg_count) {
+            int n = build_msg(batch, i, end, &batch->msgs[msg_count],
+                              &batch->iovs[iov_pos], batch->controls[msg_count],
+                              gso);
+            batch->msg_first[msg_count] = i;
+            batch->msg_packets[msg_count] = n;
+            batch->msg_errors[msg_count] = 0;
+            iov_pos += 2 * n;
+            i += n;
+        }
+    }
+
+    // 只有本线程写提交队列，tail不需要原子读
+    unsigned tail = *ring->sq_tail;
+    for (int m = 0; m < msg_count; ++m) {
+        unsigned index = tail & ring->sq_mask;
+        struct io_uring_sqe* sqe = &ring->sqes[index];
+        bzero(sqe, sizeof(*sqe));
+        sqe->opcode = IORING_OP_SENDMSG;
+        int sockfd = batch->packets[batch->msg_first[m]].sockfd;
+        int slot = uring_file(ring, sockfd);
+        if (slot >= 0) {
+            sqe->fd = slot;
+            sqe->flags = IOSQE_FIXED_FILE;
+        }
+        else {
+            sqe->fd = sockfd;
+        }
+        sqe->addr = (uint64_t) (uintptr_t) &batch->msgs[m].msg_hdr;
+        sqe->len = 1;
+        // 发送缓冲满时立即返回EAGAIN，不让内核排队等待
+        sqe->msg_flags = MSG_DONTWAIT;
+        sqe->user_data = m;
+        ring->sq_array[index] = index;
+        ++tail;
+    }
+    __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned to_submit = msg_count;
+    int done = 0;
+    while (done < msg_count) {
+        int ret = io_uring_enter(ring->fd, to_submit, msg_count - done,
+                                 IORING_ENTER_GETEVENTS);
+        ++batch->syscalls;
+        if (ret >= 0) {
+            to_submit -= ret;
+        }
+        else if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            // ring不可用了，没有完成的消息按丢弃统计，本线程以后不再使用
+            printf("io_uring_enter failed: %s, fall back to %s\n",
+                   strerror(errno), gso_enabled ? "gso" : "sendmmsg");
+            uring_close(ring);
+            ring->failed = true;
+            for (int m = 0; m < msg_count; ++m) {
+                if (!batch->msg_errors[m]) {
+                    batch->msg_errors[m] = EIO;
+                }
+            }
+            break;
+        }
+        unsigned head = *ring->cq_head;
+        unsigned cq_tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; ++head, ++done) {
+            const struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+            // 成功时res为发送的字节数，失败时为负的errno
+            batch->msg_errors[cqe->user_data] = cqe->res < 0 ? -cqe->res : 0;
+        }
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    // 统计结果，GSO失败的消息把包移到批次前部，按单包重新提交
+    int sent = 0;
+    int retry = 0;
+    for (int m = 0; m < msg_count; ++m) {
+        int error = batch->msg_errors[m];
+        int first = batch->msg_first[m];
+        int n = batch->msg_packets[m];
+        if (!error) {
+            sent += n;
+            batch->bytes_sent += msg_bytes(batch, first, n);
+        }
+        else if (gso && n > 1 && ring->ready &&
+                 (error == EIO || error == EINVAL || error == EOPNOTSUPP)) {
+            disable_gso(error);
+            memmove(&batch->packets[retry], &batch->packets[first],
+                    n * sizeof(struct RtpBatchPacket));
+            retry += n;
+        }
+        else if (send_buffer_full(error)) {
+            // 发送缓冲满，UDP直接丢弃
+            batch->packets_dropped += n;
+        }
+        else {
+            batch->send_errors += n;
+        }
+    }
+    batch->count = retry;
+    if (retry > 0) {
+        sent += flush_uring(batch, ring);
+    }
+    return sent;
+}
+
+int rtp_batch_flush(struct RtpBatch* batch) {
+    if (batch->count == 0) {
+        return 0;
+    }
+    enum RtpSendMode mode = send_mode;
+    struct RtpUring* ring = nullptr;
+    if (mode == RTP_SEND_MODE_URING) {
+        ring = uring_get();
+        if (!ring) {
+            mode = RTP_SEND_MODE_GSO;
+        }
+    }
+    int sent = ring ? flush_uring(batch, ring) : flush_sockets(batch, mode);
+    batch->packets_sent += sent;
+    return sent;
+}
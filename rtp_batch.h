@@ -0,0 +1,90 @@
+#ifndef RTSPSERVER_RTP_BATCH_H
+#define RTSPSERVER_RTP_BATCH_H
+
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <cstdint>
+
+#include "rtp.h"
+
+// 一次批量发送最多缓存的RTP包数量，也是一次sendmmsg的最大消息数
+#define RTP_BATCH_MAX_PACKETS 1024
+// 包头缓冲：RTP头加上最多2字节的负载前缀（FU indicator和FU header）
+#define RTP_BATCH_HEADER_SIZE (RTP_HEADER_SIZE + 2)
+// 内核对一次UDP GSO发送的限制
+#define RTP_GSO_MAX_SEGMENTS 64
+#define RTP_GSO_MAX_BYTES 65000
+
+enum RtpSendMode {
+    RTP_SEND_MODE_SENDMSG, // 每个包一次sendmsg
+    RTP_SEND_MODE_SENDMMSG, // 同一socket上的包合并为一次sendmmsg
+    RTP_SEND_MODE_GSO, // 同一目的地址的等长包再合并为一条UDP_SEGMENT消息
+    // 按GSO组织消息，整个批次的所有socket一起提交到io_uring，一次系统调用
+    RTP_SEND_MODE_URING,
+};
+
+struct RtpBatchPacket {
+    int sockfd;
+    const struct sockaddr_in* addr; // 已connect的socket为nullptr
+    uint8_t header[RTP_BATCH_HEADER_SIZE];
+    uint32_t header_size;
+    const uint8_t* payload;
+    uint32_t payload_size;
+    uint64_t txtime_ns; // SO_TXTIME发送时间，0表示立即发送
+};
+
+/*
+ * 待发送RTP包的批次。头部拷贝进批次，负载和目的地址只保存指针，
+ * 在rtp_batch_flush之前必须保持有效
+ */
+struct RtpBatch {
+    struct RtpBatchPacket packets[RTP_BATCH_MAX_PACKETS];
+    int count;
+
+    struct mmsghdr msgs[RTP_BATCH_MAX_PACKETS];
+    struct iovec iovs[RTP_BATCH_MAX_PACKETS * 2];
+    // UDP_SEGMENT和SCM_TXTIME两个控制消息
+    char controls[RTP_BATCH_MAX_PACKETS][CMSG_SPACE(sizeof(uint16_t)) +
+                                         CMSG_SPACE(sizeof(uint64_t))];
+    // 每条消息对应的第一个包和包数，用于统计和GSO失败后重新组织
+    int msg_first[RTP_BATCH_MAX_PACKETS];
+    int msg_packets[RTP_BATCH_MAX_PACKETS];
+    int msg_errors[RTP_BATCH_MAX_PACKETS]; // io_uring每条消息的errno
+
+    uint64_t syscalls; // 累计发送系统调用次数
+    uint64_t packets_sent;
+    uint64_t bytes_sent; // 成功发送的RTP包字节数（含RTP头）
+    uint64_t packets_dropped; // 发送缓冲满而丢弃的包
+    uint64_t send_errors; // 其他发送错误丢弃的包，如ICMP不可达
+};
+
+/*
+ * 设置全局发送方式，io_uring不可用时退回GSO，GSO不可用时退回sendmmsg，
+ * 返回实际生效的方式。运行中GSO发送失败也会自动退回sendmmsg，
+ * io_uring模式下改为逐包提交
+ */
+enum RtpSendMode rtp_batch_set_mode(enum RtpSendMode mode);
+enum RtpSendMode rtp_batch_get_mode();
+const char* rtp_send_mode_name(enum RtpSendMode mode);
+// 按名字解析发送方式，失败返回-1
+int rtp_send_mode_parse(const char* name, enum RtpSendMode* mode);
+
+void rtp_batch_init(struct RtpBatch* batch);
+/*
+ * 追加一个包，批次满时先自动flush。txtime_ns不为0时作为SCM_TXTIME
+ * 发送时间，socket需要已开启SO_TXTIME
+ */
+void rtp_batch_add(struct RtpBatch* batch, int sockfd,
+                   const struct sockaddr_in* addr, const uint8_t* header,
+                   uint32_t header_size, const uint8_t* payload,
+                   uint32_t payload_size, uint64_t txtime_ns);
+// 发出批次中的所有包，返回成功发送的包数。UDP发送缓冲满时丢弃剩余的包
+int rtp_batch_flush(struct RtpBatch* batch);
+/*
+ * io_uring模式下发送过的socket会注册为当前线程ring的固定文件，
+ * 关闭之前必须在同一线程调用，否则fd复用后会发到旧的socket上
+ */
+void rtp_batch_release_socket(int sockfd);
+
+#endif
@@ -0,0 +1,221 @@
+#include "rtp_pacing.h"
+
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+#ifndef SO_MAX_PACING_RATE
+#define SO_MAX_PACING_RATE 47
+#endif
+#ifndef SO_TXTIME
+#define SO_TXTIME 61
+#endif
+
+// 单个RTP包的最大长度，桶深至少要能容纳一个包
+#define RTP_PACING_MAX_PACKET (RTP_HEADER_SIZE + 2 + RTP_MAX_PKT_SIZE)
+
+// 与linux/net_tstamp.h中的struct sock_txtime一致
+struct SockTxtime {
+    clockid_t clockid;
+    uint32_t flags;
+};
+
+struct RtpBucket {
+    uint64_t rate; // 字节每秒，0表示不限制
+    uint32_t burst;
+};
+
+static enum RtpPacingMode pacing_mode = RTP_PACING_NONE;
+static struct RtpBucket session_bucket = {0, RTP_PACING_DEFAULT_BURST};
+static struct RtpBucket global_bucket = {0, RTP_PACING_DEFAULT_BURST};
+// 全局令牌桶的状态按工作线程各自维护，多个线程时由调用者把全局速率
+// 按线程数分摊，发送路径上不需要同步
+static thread_local struct RtpPacer global_pacer = {0};
+
+static bool txtime_supported() {
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return false;
+    }
+    struct SockTxtime txtime = {CLOCK_MONOTONIC, 0};
+    bool supported = setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &txtime,
+                                sizeof(txtime)) == 0;
+    close(sockfd);
+    return supported;
+}
+
+static void bucket_set(struct RtpBucket* bucket, uint64_t rate,
+                       uint32_t burst) {
+    bucket->rate = rate;
+    bucket->burst = burst < RTP_PACING_MAX_PACKET ? RTP_PACING_MAX_PACKET
+                                                  : burst;
+}
+
+enum RtpPacingMode rtp_pacing_configure(enum RtpPacingMode mode,
+                                        uint64_t session_rate,
+                                        uint32_t session_burst,
+                                        uint64_t global_rate,
+                                        uint32_t global_burst) {
+    if (mode == RTP_PACING_TXTIME && !txtime_supported()) {
+        printf("SO_TXTIME is not supported, fall back to token bucket\n");
+        mode = RTP_PACING_BUCKET;
+    }
+    if (mode == RTP_PACING_FQ && global_rate > 0) {
+        printf("global rate is not enforced with fq pacing\n");
+    }
+    bucket_set(&session_bucket, session_rate, session_burst);
+    bucket_set(&global_bucket, global_rate, global_burst);
+    rtp_pacer_init(&global_pacer);
+    pacing_mode = mode;
+    return pacing_mode;
+}
+
+enum RtpPacingMode rtp_pacing_get_mode() {
+    return pacing_mode;
+}
+
+const char* rtp_pacing_mode_name(enum RtpPacingMode mode) {
+    switch (mode) {
+        case RTP_PACING_NONE: return "none";
+        case RTP_PACING_BUCKET: return "bucket";
+        case RTP_PACING_FQ: return "fq";
+        case RTP_PACING_TXTIME: return "txtime";
+    }
+    return "unknown";
+}
+
+int rtp_pacing_mode_parse(const char* name, enum RtpPacingMode* mode) {
+    if (strcmp(name, "none") == 0) {
+        *mode = RTP_PACING_NONE;
+    }
+    else if (strcmp(name, "bucket") == 0) {
+        *mode = RTP_PACING_BUCKET;
+    }
+    else if (strcmp(name, "fq") == 0) {
+        *mode = RTP_PACING_FQ;
+    }
+    else if (strcmp(name, "txtime") == 0) {
+        *mode = RTP_PACING_TXTIME;
+    }
+    else {
+        return -1;
+    }
+    return 0;
+}
+
+// 解析带k/m/g后缀的数，返回解析结束的位置，失败返回nullptr
+static const char* parse_size(const char* text, uint64_t* value) {
+    char* end;
+    errno = 0;
+    unsigned long long n = strtoull(text, &end, 10);
+    if (end == text || errno != 0) {
+        return nullptr;
+    }
+    switch (*end) {
+        case 'k': case 'K': n *= 1000; ++end; break;
+        case 'm': case 'M': n *= 1000000; ++end; break;
+        case 'g': case 'G': n *= 1000000000; ++end; break;
+        default: break;
+    }
+    *value = n;
+    return end;
+}
+
+int rtp_pacing_parse_rate(const char* text, uint64_t* rate, uint32_t* burst) {
+    uint64_t bits;
+    const char* end = parse_size(text, &bits);
+    if (!end || bits == 0) {
+        return -1;
+    }
+    *rate = bits / 8;
+    *burst = RTP_PACING_DEFAULT_BURST;
+    if (*end == ':') {
+        uint64_t bytes;
+        end = parse_size(end + 1, &bytes);
+        if (!end || bytes == 0 || bytes > UINT32_MAX) {
+            return -1;
+        }
+        *burst = bytes;
+    }
+    return *end == '\0' ? 0 : -1;
+}
+
+int rtp_pacing_setup_socket(int sockfd, bool tcp) {
+    if (pacing_mode == RTP_PACING_NONE) {
+        return 0;
+    }
+    if (tcp || pacing_mode == RTP_PACING_FQ) {
+        if (session_bucket.rate == 0) {
+            return 0;
+        }
+        uint32_t rate = session_bucket.rate > UINT32_MAX
+                                ? UINT32_MAX
+                                : (uint32_t) session_bucket.rate;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_MAX_PACING_RATE, &rate,
+                       sizeof(rate)) < 0) {
+            printf("failed to set SO_MAX_PACING_RATE: %s\n", strerror(errno));
+            return -1;
+        }
+        return 0;
+    }
+    if (pacing_mode == RTP_PACING_TXTIME) {
+        struct SockTxtime txtime = {CLOCK_MONOTONIC, 0};
+        if (setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &txtime,
+                       sizeof(txtime)) < 0) {
+            printf("failed to set SO_TXTIME: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void rtp_pacer_init(struct RtpPacer* pacer) {
+    pacer->tat_ns = 0;
+}
+
+/*
+ * GCRA：每个包把理论到达时间推后size / rate，只要推后的量不超过
+ * 桶深对应的时间就可以发送，等价于按rate补充、容量为burst的令牌桶
+ */
+static uint64_t bucket_ready_ns(const struct RtpBucket* bucket,
+                                const struct RtpPacer* pacer, uint64_t now,
+                                uint32_t size) {
+    if (bucket->rate == 0) {
+        return now;
+    }
+    uint64_t cost = (uint64_t) size * 1000000000ull / bucket->rate;
+    uint64_t depth = (uint64_t) bucket->burst * 1000000000ull / bucket->rate;
+    if (pacer->tat_ns + cost <= now + depth) {
+        return now;
+    }
+    return pacer->tat_ns + cost - depth;
+}
+
+static void bucket_consume(const struct RtpBucket* bucket,
+                           struct RtpPacer* pacer, uint64_t send_ns,
+                           uint32_t size) {
+    if (bucket->rate == 0) {
+        return;
+    }
+    uint64_t cost = (uint64_t) size * 1000000000ull / bucket->rate;
+    pacer->tat_ns = (pacer->tat_ns > send_ns ? pacer->tat_ns : send_ns) + cost;
+}
+
+uint64_t rtp_pacer_ready_ns(const struct RtpPacer* pacer, uint64_t now,
+                            uint32_t size) {
+    uint64_t ready = bucket_ready_ns(&session_bucket, pacer, now, size);
+    uint64_t global_ready =
+            bucket_ready_ns(&global_bucket, &global_pacer, now, size);
+    return ready > global_ready ? ready : global_ready;
+}
+
+void rtp_pacer_consume(struct RtpPacer* pacer, uint64_t send_ns,
+                       uint32_t size) {
+    bucket_consume(&session_bucket, pacer, send_ns, size);
+    bucket_consume(&global_bucket, &global_pacer, send_ns, size);
+}
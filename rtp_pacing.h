@@ -0,0 +1,63 @@
+#ifndef RTSPSERVER_RTP_PACING_H
+#define RTSPSERVER_RTP_PACING_H
+
+#include <cstdint>
+
+#include "rtp.h"
+
+// 没有指定桶深时允许连续发出的字节数，约8个满包
+#define RTP_PACING_DEFAULT_BURST (8 * (RTP_HEADER_SIZE + 2 + RTP_MAX_PKT_SIZE))
+// 用户态整形时，最早发送时间在这个范围内的包提前一起发出，减少唤醒次数
+#define RTP_PACING_SLACK_NS 250000
+
+/*
+ * 发送整形方式。令牌桶的速率和桶深对每个会话和全局分别配置，
+ * 速率为0表示不限制
+ */
+enum RtpPacingMode {
+    RTP_PACING_NONE, // 一帧的包一次发完
+    RTP_PACING_BUCKET, // 用户态令牌桶，超出的包由定时器稍后发送
+    RTP_PACING_FQ, // SO_MAX_PACING_RATE，由fq qdisc按会话速率平滑
+    RTP_PACING_TXTIME, // 按令牌桶给每个包标上SO_TXTIME发送时间，由fq/etf发出
+};
+
+// 令牌桶，用GCRA的理论到达时间表示，不需要定时补充令牌
+struct RtpPacer {
+    uint64_t tat_ns;
+};
+
+/*
+ * 设置全局整形方式和参数，rate为字节每秒。TXTIME不可用时退回BUCKET，
+ * 返回实际生效的方式
+ */
+enum RtpPacingMode rtp_pacing_configure(enum RtpPacingMode mode,
+                                        uint64_t session_rate,
+                                        uint32_t session_burst,
+                                        uint64_t global_rate,
+                                        uint32_t global_burst);
+enum RtpPacingMode rtp_pacing_get_mode();
+const char* rtp_pacing_mode_name(enum RtpPacingMode mode);
+// 按名字解析整形方式，失败返回-1
+int rtp_pacing_mode_parse(const char* name, enum RtpPacingMode* mode);
+/*
+ * 解析"速率[:桶深]"，速率单位bit/s、桶深单位字节，都可带k/m/g后缀，
+ * 如"20m:64k"。rate返回字节每秒，没有桶深时为RTP_PACING_DEFAULT_BURST
+ */
+int rtp_pacing_parse_rate(const char* text, uint64_t* rate, uint32_t* burst);
+
+/*
+ * 按整形方式设置一个会话的发送socket：FQ时设置SO_MAX_PACING_RATE，
+ * TXTIME时UDP socket开启SO_TXTIME。TCP自带按速率发送，
+ * 除NONE外都只设置SO_MAX_PACING_RATE
+ */
+int rtp_pacing_setup_socket(int sockfd, bool tcp);
+
+void rtp_pacer_init(struct RtpPacer* pacer);
+// size字节的包最早可以发送的时间，同时受会话和全局令牌桶限制
+uint64_t rtp_pacer_ready_ns(const struct RtpPacer* pacer, uint64_t now,
+                            uint32_t size);
+// 记录在send_ns发出了size字节，会话和全局令牌桶同时扣除
+void rtp_pacer_consume(struct RtpPacer* pacer, uint64_t send_ns,
+                       uint32_t size);
+
+#endif
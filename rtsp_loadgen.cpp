@@ -0,0 +1,577 @@
+/*
+ * 回环压测：模拟N个RTSP客户端，DESCRIBE、SETUP视频轨、PLAY之后持续
+ * 接收RTP，统计持续播放的会话数、包速率、丢包（按序列号）和包间抖动
+ * 的分位数。抖动是RFC 3550中相邻两个包传输时间之差的绝对值，同一帧的
+ * 包时间戳相同，因此也反映了帧内的突发。
+ * 所有客户端在一个线程的事件循环中，客户端很多时压测工具本身可能成为
+ * 瓶颈，可以同时运行多个实例。-G生成合成的测试码流，不需要外部文件
+ */
+#include <arpa/inet.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "event_loop.h"
+#include "rtp.h"
+#include "synth_media.h"
+
+#define LOADGEN_DEFAULT_URL "rtsp://127.0.0.1:8554/live"
+#define LOADGEN_DEFAULT_CLIENTS 10
+#define LOADGEN_DEFAULT_SECONDS 10
+#define LOADGEN_DEFAULT_WARMUP 1
+#define LOADGEN_SYNTH_SECONDS 120
+#define LOADGEN_SYNTH_FRAME_RATE 25
+#define LOADGEN_RECV_BUFFER_SIZE (1 << 20)
+#define LOADGEN_MAX_PACKET_SIZE 2048
+// 抖动直方图：10us一格，覆盖1s，更大的值计入最后一格
+#define JITTER_BUCKET_US 10
+#define JITTER_BUCKETS 100000
+#define NS_PER_SECOND 1000000000ull
+
+enum LoadClientState {
+    LOAD_CLIENT_CONNECTING,
+    LOAD_CLIENT_DESCRIBE,
+    LOAD_CLIENT_SETUP,
+    LOAD_CLIENT_PLAY,
+    LOAD_CLIENT_PLAYING,
+    LOAD_CLIENT_FAILED,
+    LOAD_CLIENT_CLOSED, // 播放中服务器关闭了连接
+};
+
+struct LoadClient {
+    int id;
+    enum LoadClientState state;
+    int sockfd;
+    int rtp_sockfd; // 交织模式下为-1
+    int rtcp_sockfd;
+    int rtp_port;
+    int cseq;
+    std::string session;
+    std::string in; // RTSP连接上还没有处理的数据
+
+    // 统计窗口内收到的RTP包
+    bool have_packet;
+    uint32_t base_seq; // 扩展的序列号
+    uint32_t max_seq;
+    uint64_t received;
+    uint64_t bytes;
+    double transit; // 上一个包的传输时间，90kHz单位
+    uint64_t last_packet_ns; // 不限于统计窗口
+};
+
+struct LoadGen {
+    struct EventLoop* loop;
+    struct sockaddr_in server_addr;
+    std::string url;
+    bool tcp;
+    std::vector<struct LoadClient*> clients;
+
+    uint64_t start_ns;
+    uint64_t measure_ns; // 统计窗口的开始和结束
+    uint64_t end_ns;
+
+    uint64_t packets; // 统计窗口内所有客户端收到的包
+    uint64_t last_packets; // 上一次打印进度时的packets
+    std::vector<uint32_t> jitter_histogram;
+    uint64_t jitter_samples;
+    double jitter_max_ms;
+    int failures_reported;
+};
+
+static struct LoadGen gen;
+
+static uint64_t now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * NS_PER_SECOND + ts.tv_nsec;
+}
+
+static void load_client_fail(struct LoadClient* client, const char* reason) {
+    // 同样的错误通常出现在所有客户端，只打印前几个
+    if (gen.failures_reported < 5) {
+        printf("client %d: %s\n", client->id, reason);
+        ++gen.failures_reported;
+    }
+    client->state = client->state == LOAD_CLIENT_PLAYING ? LOAD_CLIENT_CLOSED
+                                                         : LOAD_CLIENT_FAILED;
+    event_loop_remove(gen.loop, client->sockfd);
+    close(client->sockfd);
+    client->sockfd = -1;
+    if (client->rtp_sockfd >= 0) {
+        event_loop_remove(gen.loop, client->rtp_sockfd);
+        event_loop_remove(gen.loop, client->rtcp_sockfd);
+        close(client->rtp_sockfd);
+        close(client->rtcp_sockfd);
+        client->rtp_sockfd = -1;
+        client->rtcp_sockfd = -1;
+    }
+}
+
+static int send_request(struct LoadClient* client, const char* method,
+                        const char* url, const char* headers) {
+    char buffer[1024];
+    int size = snprintf(buffer, sizeof(buffer),
+                        "%s %s RTSP/1.0\r\n"
+                        "CSeq: %d\r\n"
+                        "User-Agent: rtsp_loadgen\r\n"
+                        "%s"
+                        "\r\n",
+                        method, url, ++client->cseq, headers);
+    // 请求很小，新连接的发送缓冲总能一次写完
+    if (send(client->sockfd, buffer, size, MSG_NOSIGNAL) != size) {
+        load_client_fail(client, "failed to send request");
+        return -1;
+    }
+    return 0;
+}
+
+static void on_rtp_packet(struct LoadClient* client, const uint8_t* data,
+                          uint32_t size, uint64_t now) {
+    if (size < RTP_HEADER_SIZE || (data[0] >> 6) != RTP_VERSION) {
+        return;
+    }
+    client->last_packet_ns = now;
+    if (now < gen.measure_ns || now >= gen.end_ns) {
+        return;
+    }
+    uint16_t seq = (uint16_t) (data[2] << 8 | data[3]);
+    uint32_t timestamp = (uint32_t) data[4] << 24 | data[5] << 16 |
+                         data[6] << 8 | data[7];
+    double transit = now * 90000.0 / NS_PER_SECOND - timestamp;
+    ++client->received;
+    client->bytes += size;
+    ++gen.packets;
+    if (!client->have_packet) {
+        client->have_packet = true;
+        client->base_seq = seq;
+        client->max_seq = seq;
+        client->transit = transit;
+        return;
+    }
+    // 扩展序列号处理回绕，乱序和重复的包不推进max_seq
+    uint16_t delta = seq - (uint16_t) client->max_seq;
+    if (delta < 0x8000) {
+        client->max_seq += delta;
+    }
+    double jitter_ms = fabs(transit - client->transit) / 90.0;
+    client->transit = transit;
+    uint64_t bucket = (uint64_t) (jitter_ms * 1000 / JITTER_BUCKET_US);
+    ++gen.jitter_histogram[bucket < JITTER_BUCKETS ? bucket
+                                                    : JITTER_BUCKETS - 1];
+    ++gen.jitter_samples;
+    if (jitter_ms > gen.jitter_max_ms) {
+        gen.jitter_max_ms = jitter_ms;
+    }
+}
+
+static void on_udp_readable(struct EventLoop* loop, int fd, uint32_t events,
+                            void* arg) {
+    struct LoadClient* client = (struct LoadClient*) arg;
+    uint8_t buffer[LOADGEN_MAX_PACKET_SIZE];
+    ssize_t size;
+    while ((size = recv(fd, buffer, sizeof(buffer), 0)) >= 0) {
+        if (fd == client->rtp_sockfd) {
+            on_rtp_packet(client, buffer, size, now_ns());
+        }
+    }
+}
+
+static int bind_udp(int port) {
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    int size = LOADGEN_RECV_BUFFER_SIZE;
+    setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+// 由内核分配一个偶数RTP端口，RTCP用下一个端口
+static int open_udp_pair(struct LoadClient* client) {
+    for (int attempt = 0; attempt < 100; ++attempt) {
+        int rtp_sockfd = bind_udp(0);
+        if (rtp_sockfd < 0) {
+            return -1;
+        }
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        getsockname(rtp_sockfd, (struct sockaddr*) &addr, &len);
+        int port = ntohs(addr.sin_port);
+        int rtcp_sockfd = port % 2 == 0 ? bind_udp(port + 1) : -1;
+        if (rtcp_sockfd < 0) {
+            close(rtp_sockfd);
+            continue;
+        }
+        client->rtp_sockfd = rtp_sockfd;
+        client->rtcp_sockfd = rtcp_sockfd;
+        client->rtp_port = port;
+        return 0;
+    }
+    return -1;
+}
+
+// 按名字查找响应头（不区分大小写），返回值的起始位置
+static const char* find_header(const std::string& head, const char* name) {
+    size_t name_size = strlen(name);
+    size_t pos = 0;
+    while ((pos = head.find("\r\n", pos)) != std::string::npos) {
+        pos += 2;
+        if (strncasecmp(head.c_str() + pos, name, name_size) == 0 &&
+            head[pos + name_size] == ':') {
+            const char* value = head.c_str() + pos + name_size + 1;
+            while (*value == ' ') {
+                ++value;
+            }
+            return value;
+        }
+    }
+    return nullptr;
+}
+
+static void on_response(struct LoadClient* client, const std::string& head) {
+    int status = 0;
+    if (sscanf(head.c_str(), "RTSP/1.0 %d", &status) != 1 || status != 200) {
+        char reason[64];
+        snprintf(reason, sizeof(reason), "request failed with status %d",
+                 status);
+        load_client_fail(client, reason);
+        return;
+    }
+    char headers[256];
+    switch (client->state) {
+        case LOAD_CLIENT_DESCRIBE: {
+            if (gen.tcp) {
+                snprintf(headers, sizeof(headers),
+                         "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+            }
+            else {
+                snprintf(headers, sizeof(headers),
+                         "Transport: RTP/AVP;unicast;client_port=%d-%d\r\n",
+                         client->rtp_port, client->rtp_port + 1);
+            }
+            std::string url = gen.url + "/track0";
+            client->state = LOAD_CLIENT_SETUP;
+            send_request(client, "SETUP", url.c_str(), headers);
+            break;
+        }
+        case LOAD_CLIENT_SETUP: {
+            const char* session = find_header(head, "Session");
+            if (!session) {
+                load_client_fail(client, "no session in SETUP response");
+                return;
+            }
+            client->session.assign(session, strcspn(session, ";\r"));
+            snprintf(headers, sizeof(headers),
+                     "Session: %s\r\nRange: npt=0.000-\r\n",
+                     client->session.c_str());
+            client->state = LOAD_CLIENT_PLAY;
+            send_request(client, "PLAY", gen.url.c_str(), headers);
+            break;
+        }
+        case LOAD_CLIENT_PLAY: client->state = LOAD_CLIENT_PLAYING; break;
+        default: break;
+    }
+}
+
+// 处理连接上收到的数据，返回消费的字节数
+static size_t process_input(struct LoadClient* client) {
+    size_t pos = 0;
+    const std::string& in = client->in;
+    while (client->sockfd >= 0) {
+        if (client->state == LOAD_CLIENT_PLAYING) {
+            // 播放时连接上只有'$'交织帧
+            if (in.size() - pos < RTP_TCP_PREFIX_SIZE) {
+                break;
+            }
+            if (in[pos] != '$') {
+                load_client_fail(client, "unexpected data while playing");
+                break;
+            }
+            uint32_t size = (uint8_t) in[pos + 2] << 8 | (uint8_t) in[pos + 3];
+            if (in.size() - pos < RTP_TCP_PREFIX_SIZE + size) {
+                break;
+            }
+            if (in[pos + 1] == 0) {
+                on_rtp_packet(client,
+                              (const uint8_t*) in.data() + pos +
+                                      RTP_TCP_PREFIX_SIZE,
+                              size, now_ns());
+            }
+            pos += RTP_TCP_PREFIX_SIZE + size;
+            continue;
+        }
+        size_t end = in.find("\r\n\r\n", pos);
+        if (end == std::string::npos) {
+            break;
+        }
+        std::string head = in.substr(pos, end + 2 - pos);
+        const char* length = find_header(head, "Content-Length");
+        size_t body = length ? strtoul(length, nullptr, 10) : 0;
+        if (in.size() < end + 4 + body) {
+            break;
+        }
+        pos = end + 4 + body;
+        on_response(client, head);
+    }
+    return pos;
+}
+
+static void on_client_event(struct EventLoop* loop, int fd, uint32_t events,
+                            void* arg) {
+    struct LoadClient* client = (struct LoadClient*) arg;
+    if (client->state == LOAD_CLIENT_CONNECTING) {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error) {
+            load_client_fail(client, strerror(error));
+            return;
+        }
+        event_loop_modify(loop, fd, EPOLLIN);
+        client->state = LOAD_CLIENT_DESCRIBE;
+        send_request(client, "DESCRIBE", gen.url.c_str(),
+                     "Accept: application/sdp\r\n");
+        return;
+    }
+    char buffer[65536];
+    while (client->sockfd >= 0) {
+        ssize_t size = recv(fd, buffer, sizeof(buffer), 0);
+        if (size > 0) {
+            client->in.append(buffer, size);
+            client->in.erase(0, process_input(client));
+            continue;
+        }
+        if (size < 0 && (errno == EAGAIN || errno == EINTR)) {
+            break;
+        }
+        load_client_fail(client, size == 0 ? "connection closed by server"
+                                           : strerror(errno));
+    }
+}
+
+static int load_client_start(struct LoadClient* client) {
+    client->sockfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (client->sockfd < 0) {
+        printf("failed to create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if (!gen.tcp) {
+        if (open_udp_pair(client) < 0) {
+            printf("failed to bind udp ports: %s\n", strerror(errno));
+            return -1;
+        }
+        event_loop_add(gen.loop, client->rtp_sockfd, EPOLLIN, on_udp_readable,
+                       client);
+        event_loop_add(gen.loop, client->rtcp_sockfd, EPOLLIN,
+                       on_udp_readable, client);
+    }
+    if (connect(client->sockfd, (struct sockaddr*) &gen.server_addr,
+                sizeof(gen.server_addr)) < 0 &&
+        errno != EINPROGRESS) {
+        printf("failed to connect: %s\n", strerror(errno));
+        return -1;
+    }
+    return event_loop_add(gen.loop, client->sockfd, EPOLLOUT, on_client_event,
+                          client);
+}
+
+static void count_states(int counts[]) {
+    for (int i = 0; i <= LOAD_CLIENT_CLOSED; ++i) {
+        counts[i] = 0;
+    }
+    for (struct LoadClient* client : gen.clients) {
+        ++counts[client->state];
+    }
+}
+
+static void on_tick(struct EventLoop* loop, int fd, uint32_t events,
+                    void* arg) {
+    event_loop_read_timer(fd);
+    uint64_t now = now_ns();
+    if (now >= gen.end_ns) {
+        event_loop_stop(loop);
+        return;
+    }
+    int counts[LOAD_CLIENT_CLOSED + 1];
+    count_states(counts);
+    printf("%5.1fs playing %d failed %d closed %d  %llu pkt/s\n",
+           (double) (now - gen.start_ns) / NS_PER_SECOND,
+           counts[LOAD_CLIENT_PLAYING], counts[LOAD_CLIENT_FAILED],
+           counts[LOAD_CLIENT_CLOSED],
+           (unsigned long long) (gen.packets - gen.last_packets));
+    gen.last_packets = gen.packets;
+}
+
+static double jitter_percentile(double percentile) {
+    uint64_t target = (uint64_t) ceil(gen.jitter_samples * percentile / 100);
+    uint64_t count = 0;
+    for (int i = 0; i < JITTER_BUCKETS; ++i) {
+        count += gen.jitter_histogram[i];
+        if (count >= target && count > 0) {
+            // 取格子的上界
+            return (i + 1) * JITTER_BUCKET_US / 1000.0;
+        }
+    }
+    return 0;
+}
+
+static void report(double seconds) {
+    int counts[LOAD_CLIENT_CLOSED + 1];
+    count_states(counts);
+    uint64_t expected = 0, received = 0, bytes = 0;
+    int sustained = 0;
+    for (struct LoadClient* client : gen.clients) {
+        if (client->have_packet) {
+            expected += client->max_seq - client->base_seq + 1;
+            received += client->received;
+            bytes += client->bytes;
+        }
+        // 窗口最后一秒内还在收包的会话
+        if (client->state == LOAD_CLIENT_PLAYING &&
+            client->last_packet_ns + NS_PER_SECOND >= gen.end_ns) {
+            ++sustained;
+        }
+    }
+    uint64_t lost = expected > received ? expected - received : 0;
+    printf("clients %zu: %d sustained, %d playing, %d failed, %d closed\n",
+           gen.clients.size(), sustained, counts[LOAD_CLIENT_PLAYING],
+           counts[LOAD_CLIENT_FAILED], counts[LOAD_CLIENT_CLOSED]);
+    printf("%.1f s: %llu packets, %.1f pkt/s, %.2f Mbit/s, lost %llu "
+           "(%.3f%%)\n",
+           seconds, (unsigned long long) received, received / seconds,
+           bytes * 8 / seconds / 1e6, (unsigned long long) lost,
+           expected ? 100.0 * lost / expected : 0.0);
+    printf("jitter ms: p50 %.3f p90 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+           jitter_percentile(50), jitter_percentile(90),
+           jitter_percentile(99), jitter_percentile(99.9), gen.jitter_max_ms);
+}
+
+static int parse_url(const char* url) {
+    char host[64];
+    int port = 554;
+    if (sscanf(url, "rtsp://%63[^:/]:%d", host, &port) < 1) {
+        return -1;
+    }
+    bzero(&gen.server_addr, sizeof(gen.server_addr));
+    gen.server_addr.sin_family = AF_INET;
+    gen.server_addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host, &gen.server_addr.sin_addr) != 1) {
+        return -1;
+    }
+    gen.url = url;
+    return 0;
+}
+
+static int generate(const char* prefix) {
+    std::vector<uint8_t> data;
+    std::string h264_file = std::string(prefix) + ".h264";
+    std::string aac_file = std::string(prefix) + ".aac";
+    synth_h264_generate(&data, LOADGEN_SYNTH_SECONDS,
+                        LOADGEN_SYNTH_FRAME_RATE);
+    if (synth_write_file(h264_file.c_str(), data) < 0) {
+        return -1;
+    }
+    synth_adts_generate(&data, LOADGEN_SYNTH_SECONDS);
+    if (synth_write_file(aac_file.c_str(), data) < 0) {
+        return -1;
+    }
+    printf("wrote %d s of synthetic media: %s %s\n", LOADGEN_SYNTH_SECONDS,
+           h264_file.c_str(), aac_file.c_str());
+    return 0;
+}
+
+static void usage(const char* prog) {
+    printf("usage: %s [-u url] [-n clients] [-d seconds] [-w seconds] [-T]\n"
+           "       %s -G prefix\n"
+           "  -u  stream to play, default %s (IPv4 address only)\n"
+           "  -n  simulated clients, default %d\n"
+           "  -d  measured duration, default %d\n"
+           "  -w  warm-up after the clients start, not measured, default %d\n"
+           "  -T  RTP over the RTSP connection instead of UDP\n"
+           "  -G  write %d s of synthetic H.264 and ADTS to prefix.h264 and "
+           "prefix.aac\n"
+           "      for the server (-f prefix.h264 -a prefix.aac) and exit\n",
+           prog, prog, LOADGEN_DEFAULT_URL, LOADGEN_DEFAULT_CLIENTS,
+           LOADGEN_DEFAULT_SECONDS, LOADGEN_DEFAULT_WARMUP,
+           LOADGEN_SYNTH_SECONDS);
+}
+
+int main(int argc, char* argv[]) {
+    const char* url = LOADGEN_DEFAULT_URL;
+    int client_count = LOADGEN_DEFAULT_CLIENTS;
+    double seconds = LOADGEN_DEFAULT_SECONDS;
+    double warmup = LOADGEN_DEFAULT_WARMUP;
+    int opt;
+    while ((opt = getopt(argc, argv, "u:n:d:w:TG:h")) != -1) {
+        switch (opt) {
+            case 'u': url = optarg; break;
+            case 'n': client_count = atoi(optarg); break;
+            case 'd': seconds = atof(optarg); break;
+            case 'w': warmup = atof(optarg); break;
+            case 'T': gen.tcp = true; break;
+            case 'G': return generate(optarg) < 0 ? 1 : 0;
+            default: usage(argv[0]); return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (parse_url(url) < 0) {
+        printf("invalid url: %s\n", url);
+        return 1;
+    }
+    if (client_count < 1 || seconds <= 0 || warmup < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+    // 每个客户端最多3个fd
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+        limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    gen.loop = event_loop_create();
+    if (!gen.loop) {
+        return 1;
+    }
+    gen.jitter_histogram.assign(JITTER_BUCKETS, 0);
+    gen.start_ns = now_ns();
+    gen.measure_ns = gen.start_ns + (uint64_t) (warmup * NS_PER_SECOND);
+    gen.end_ns = gen.measure_ns + (uint64_t) (seconds * NS_PER_SECOND);
+    for (int i = 0; i < client_count; ++i) {
+        struct LoadClient* client = new LoadClient();
+        client->id = i;
+        client->state = LOAD_CLIENT_CONNECTING;
+        client->sockfd = -1;
+        client->rtp_sockfd = -1;
+        client->rtcp_sockfd = -1;
+        gen.clients.push_back(client);
+        if (load_client_start(client) < 0) {
+            return 1;
+        }
+    }
+    printf("%d clients, %s, %.1f s warm-up, %.1f s measured\n", client_count,
+           gen.tcp ? "tcp" : "udp", warmup, seconds);
+    event_loop_add_timer(gen.loop, 1000000, on_tick, nullptr);
+    event_loop_run(gen.loop);
+    report(seconds);
+    return 0;
+}
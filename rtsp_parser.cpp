@@ -0,0 +1,238 @@
+#include "rtsp_parser.h"
+
+#include <strings.h>
+
+#include <cstring>
+
+void rtsp_parser_init(struct RtspParser* parser) {
+    parser->scanned = 0;
+    parser->status = 0;
+}
+
+static inline bool is_space(char c) {
+    return c == ' ' || c == '\t';
+}
+
+static struct RtspView trim(const char* begin, const char* end) {
+    while (begin < end && is_space(*begin)) {
+        ++begin;
+    }
+    while (end > begin && is_space(end[-1])) {
+        --end;
+    }
+    struct RtspView view = {begin, (uint32_t) (end - begin)};
+    return view;
+}
+
+static enum RtspParseResult parse_error(struct RtspParser* parser,
+                                        int status) {
+    parser->scanned = 0;
+    parser->status = status;
+    return RTSP_PARSE_ERROR;
+}
+
+/*
+ * 查找头部结束的空行（兼容只用'\n'换行的客户端），返回空行之后的位置，
+ * 没找到返回0。parser->scanned记录下次从哪里继续查找
+ */
+static uint32_t find_header_end(struct RtspParser* parser, const char* data,
+                                uint32_t size) {
+    uint32_t pos = parser->scanned;
+    while (pos < size) {
+        const char* lf = (const char*) memchr(data + pos, '\n', size - pos);
+        if (!lf) {
+            parser->scanned = size;
+            return 0;
+        }
+        pos = lf - data;
+        if (pos + 1 >= size || (data[pos + 1] == '\r' && pos + 2 >= size)) {
+            // 还不能判断下一行是否为空
+            parser->scanned = pos;
+            return 0;
+        }
+        if (data[pos + 1] == '\n') {
+            return pos + 2;
+        }
+        if (data[pos + 1] == '\r' && data[pos + 2] == '\n') {
+            return pos + 3;
+        }
+        ++pos;
+    }
+    parser->scanned = pos;
+    return 0;
+}
+
+// 取出[pos, end)中的一行，不含行尾的"\r\n"，pos移到下一行
+static struct RtspView next_line(const char* data, uint32_t* pos,
+                                 uint32_t end) {
+    const char* begin = data + *pos;
+    const char* lf = (const char*) memchr(begin, '\n', end - *pos);
+    const char* line_end = lf ? lf : data + end;
+    *pos = lf ? lf - data + 1 : end;
+    if (line_end > begin && line_end[-1] == '\r') {
+        --line_end;
+    }
+    struct RtspView view = {begin, (uint32_t) (line_end - begin)};
+    return view;
+}
+
+static int parse_request_line(struct RtspView line,
+                              struct RtspMessage* message) {
+    struct RtspView* fields[3] = {&message->method, &message->url,
+                                  &message->version};
+    for (int i = 0; i < 3; ++i) {
+        if (!rtsp_view_next_token(&line, ' ', fields[i]) ||
+            fields[i]->size == 0) {
+            return 400;
+        }
+    }
+    if (line.size > 0 || !rtsp_view_starts_with(&message->version, "RTSP/")) {
+        return 400;
+    }
+    if (message->url.size > RTSP_MAX_URL_SIZE) {
+        return 414;
+    }
+    return 0;
+}
+
+enum RtspParseResult rtsp_parse(struct RtspParser* parser, const char* data,
+                                uint32_t size, struct RtspMessage* message,
+                                uint32_t* consumed) {
+    if (size == 0) {
+        return RTSP_PARSE_INCOMPLETE;
+    }
+    if (data[0] == '$') {
+        // $ + 通道号 + 2字节长度 + 数据
+        if (size < 4) {
+            return RTSP_PARSE_INCOMPLETE;
+        }
+        uint32_t length = (uint8_t) data[2] << 8 | (uint8_t) data[3];
+        if (size < 4 + length) {
+            return RTSP_PARSE_INCOMPLETE;
+        }
+        message->channel = (uint8_t) data[1];
+        message->body.data = data + 4;
+        message->body.size = length;
+        *consumed = 4 + length;
+        parser->scanned = 0;
+        return RTSP_PARSE_INTERLEAVED;
+    }
+
+    uint32_t limit = size < RTSP_MAX_HEADER_SIZE ? size : RTSP_MAX_HEADER_SIZE;
+    uint32_t header_end = find_header_end(parser, data, limit);
+    if (header_end == 0) {
+        if (size >= RTSP_MAX_HEADER_SIZE) {
+            return parse_error(parser, 413);
+        }
+        return RTSP_PARSE_INCOMPLETE;
+    }
+
+    uint32_t pos = 0;
+    int status = parse_request_line(next_line(data, &pos, header_end), message);
+    if (status != 0) {
+        return parse_error(parser, status);
+    }
+    message->header_count = 0;
+    message->cseq = -1;
+    uint32_t content_length = 0;
+    while (pos < header_end) {
+        struct RtspView line = next_line(data, &pos, header_end);
+        if (line.size == 0) {
+            break;
+        }
+        const char* colon = (const char*) memchr(line.data, ':', line.size);
+        if (!colon || message->header_count == RTSP_MAX_HEADERS) {
+            return parse_error(parser, 400);
+        }
+        struct RtspHeader* header = &message->headers[message->header_count++];
+        header->name = trim(line.data, colon);
+        header->value = trim(colon + 1, line.data + line.size);
+        if (header->name.size == 0) {
+            return parse_error(parser, 400);
+        }
+        int value;
+        if (header->name.size == 4 &&
+            strncasecmp(header->name.data, "CSeq", 4) == 0) {
+            if (rtsp_view_to_int(&header->value, &value) < 0) {
+                return parse_error(parser, 400);
+            }
+            message->cseq = value;
+        }
+        else if (header->name.size == 14 &&
+                 strncasecmp(header->name.data, "Content-Length", 14) == 0) {
+            if (rtsp_view_to_int(&header->value, &value) < 0) {
+                return parse_error(parser, 400);
+            }
+            if (value > RTSP_MAX_BODY_SIZE) {
+                return parse_error(parser, 413);
+            }
+            content_length = value;
+        }
+    }
+
+    if (size - header_end < content_length) {
+        // 头部已经完整，下次从空行前的换行处继续，马上就能再次找到
+        parser->scanned = header_end - 3;
+        return RTSP_PARSE_INCOMPLETE;
+    }
+    message->body.data = data + header_end;
+    message->body.size = content_length;
+    message->channel = -1;
+    *consumed = header_end + content_length;
+    parser->scanned = 0;
+    return RTSP_PARSE_REQUEST;
+}
+
+const struct RtspView* rtsp_message_header(const struct RtspMessage* message,
+                                           const char* name) {
+    size_t length = strlen(name);
+    for (int i = 0; i < message->header_count; ++i) {
+        const struct RtspView* header_name = &message->headers[i].name;
+        if (header_name->size == length &&
+            strncasecmp(header_name->data, name, length) == 0) {
+            return &message->headers[i].value;
+        }
+    }
+    return nullptr;
+}
+
+bool rtsp_view_equals(const struct RtspView* view, const char* text) {
+    size_t length = strlen(text);
+    return view->size == length && memcmp(view->data, text, length) == 0;
+}
+
+bool rtsp_view_starts_with(const struct RtspView* view, const char* prefix) {
+    size_t length = strlen(prefix);
+    return view->size >= length && memcmp(view->data, prefix, length) == 0;
+}
+
+int rtsp_view_to_int(const struct RtspView* view, int* value) {
+    if (view->size == 0 || view->size > 9) {
+        return -1;
+    }
+    int result = 0;
+    for (uint32_t i = 0; i < view->size; ++i) {
+        char c = view->data[i];
+        if (c < '0' || c > '9') {
+            return -1;
+        }
+        result = result * 10 + (c - '0');
+    }
+    *value = result;
+    return 0;
+}
+
+bool rtsp_view_next_token(struct RtspView* view, char sep,
+                          struct RtspView* token) {
+    if (view->size == 0) {
+        return false;
+    }
+    const char* end = view->data + view->size;
+    const char* found = (const char*) memchr(view->data, sep, view->size);
+    const char* token_end = found ? found : end;
+    *token = trim(view->data, token_end);
+    const char* next = found ? found + 1 : end;
+    view->size = end - next;
+    view->data = next;
+    return true;
+}
@@ -0,0 +1,77 @@
+#ifndef RTSPSERVER_RTSP_PARSER_H
+#define RTSPSERVER_RTSP_PARSER_H
+
+#include <cstdint>
+
+// 请求行加头部的最大长度，超过时回复413
+#define RTSP_MAX_HEADER_SIZE 8192
+#define RTSP_MAX_URL_SIZE 1024
+#define RTSP_MAX_HEADERS 32
+#define RTSP_MAX_BODY_SIZE 65536
+
+// 指向接收缓冲的字符串，不以'\0'结尾，只在缓冲中的数据被移走前有效
+struct RtspView {
+    const char* data;
+    uint32_t size;
+};
+
+struct RtspHeader {
+    struct RtspView name;
+    struct RtspView value; // 去掉了两端的空白
+};
+
+enum RtspParseResult {
+    RTSP_PARSE_INCOMPLETE, // 数据不够，收到更多数据后用同一个parser继续
+    RTSP_PARSE_REQUEST, // 解析出一个完整请求
+    RTSP_PARSE_INTERLEAVED, // 解析出一个'$'开头的交织数据帧
+    RTSP_PARSE_ERROR, // 格式错误或超出限制，错误码在parser->status
+};
+
+struct RtspMessage {
+    struct RtspView method;
+    struct RtspView url;
+    struct RtspView version;
+    struct RtspHeader headers[RTSP_MAX_HEADERS];
+    int header_count;
+    int cseq; // 没有CSeq头时为-1
+    struct RtspView body;
+
+    int channel; // 交织数据帧的通道号，数据在body
+};
+
+/*
+ * 流式解析的状态。记录已经检查过的位置，数据分多次到达时不用从头
+ * 查找头部结束的空行
+ */
+struct RtspParser {
+    uint32_t scanned;
+    int status; // RTSP_PARSE_ERROR时应回复的状态码
+};
+
+void rtsp_parser_init(struct RtspParser* parser);
+/*
+ * 从data开始解析一个请求或交织数据帧。结果是完整的消息时*consumed为它
+ * 占用的字节数，message中的字段都指向data，parser已经重置，可以直接
+ * 解析data + *consumed处的下一个消息（流水线请求）。INCOMPLETE时
+ * 调用者保留data开始的数据，追加新数据后再次调用
+ */
+enum RtspParseResult rtsp_parse(struct RtspParser* parser, const char* data,
+                                uint32_t size, struct RtspMessage* message,
+                                uint32_t* consumed);
+
+// 按名字查找头部（不区分大小写），没有返回nullptr
+const struct RtspView* rtsp_message_header(const struct RtspMessage* message,
+                                           const char* name);
+
+bool rtsp_view_equals(const struct RtspView* view, const char* text);
+bool rtsp_view_starts_with(const struct RtspView* view, const char* prefix);
+// 解析十进制非负整数，view中必须全是数字，失败返回-1
+int rtsp_view_to_int(const struct RtspView* view, int* value);
+/*
+ * 取出view中下一个以sep分隔的字段（去掉两端空白），view前移到字段之后。
+ * view为空时返回false
+ */
+bool rtsp_view_next_token(struct RtspView* view, char sep,
+                          struct RtspView* token);
+
+#endif
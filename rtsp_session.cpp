@@ -0,0 +1,280 @@
+#include "rtsp_session.h"
+
+#include <arpa/inet.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <unordered_map>
+#include <vector>
+
+#include "event_loop.h"
+#include "metrics.h"
+#include "rtp_batch.h"
+#include "rtp_pacing.h"
+
+struct RtspSessionManager {
+    struct EventLoop* loop;
+    bool shared;
+    RtspSessionRtcpCallback on_rtcp;
+
+    std::unordered_map<uint64_t, struct RtspSession*> sessions;
+    // 空闲的偶数端口，后释放的先分配，刚关闭的端口马上可以复用
+    std::vector<int> free_ports;
+
+    // 共享模式的一对socket，以及按客户端RTCP地址分发的表
+    int shared_rtp_sockfd;
+    int shared_rtcp_sockfd;
+    int shared_rtp_port;
+    std::unordered_map<uint64_t, struct RtspTransport*> rtcp_routes;
+};
+
+// 每个工作线程有自己的会话表、端口池和共享socket
+static thread_local struct RtspSessionManager manager = {
+        nullptr, false, nullptr, {}, {}, -1, -1, 0, {}};
+
+static int create_udp_socket(int port) {
+    int on = 1;
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        return -1;
+    }
+    setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(sockfd, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+        close(sockfd);
+        return -1;
+    }
+    set_nonblocking(sockfd);
+    return sockfd;
+}
+
+static inline uint64_t addr_key(const struct sockaddr_in* addr) {
+    return (uint64_t) addr->sin_addr.s_addr << 16 | addr->sin_port;
+}
+
+static void on_rtcp_readable(struct EventLoop* loop, int fd, uint32_t events,
+                             void* arg) {
+    uint8_t buffer[1500];
+    while (true) {
+        struct sockaddr_in from;
+        socklen_t from_len = sizeof(from);
+        int size = recvfrom(fd, buffer, sizeof(buffer), 0,
+                            (struct sockaddr*) &from, &from_len);
+        if (size < 0) {
+            return;
+        }
+        struct RtspTransport* transport = (struct RtspTransport*) arg;
+        if (!transport) {
+            // 共享socket，按来源地址找到会话的轨道
+            auto it = manager.rtcp_routes.find(addr_key(&from));
+            if (it == manager.rtcp_routes.end()) {
+                continue;
+            }
+            transport = it->second;
+        }
+        if (manager.on_rtcp) {
+            manager.on_rtcp(transport->session, transport->track, buffer,
+                            size);
+        }
+    }
+}
+
+int rtsp_session_manager_init(struct EventLoop* loop, int port_min,
+                              int port_max, bool shared,
+                              RtspSessionRtcpCallback on_rtcp) {
+    manager.loop = loop;
+    manager.shared = shared;
+    manager.on_rtcp = on_rtcp;
+    if (shared) {
+        manager.shared_rtp_port = port_min & ~1;
+        manager.shared_rtp_sockfd = create_udp_socket(manager.shared_rtp_port);
+        manager.shared_rtcp_sockfd =
+                create_udp_socket(manager.shared_rtp_port + 1);
+        if (manager.shared_rtp_sockfd < 0 || manager.shared_rtcp_sockfd < 0) {
+            printf("failed to bind shared rtp/rtcp ports %d-%d\n",
+                   manager.shared_rtp_port, manager.shared_rtp_port + 1);
+            return -1;
+        }
+        if (rtp_pacing_get_mode() == RTP_PACING_FQ) {
+            printf("fq pacing is per socket, not applied to the shared "
+                   "socket\n");
+        }
+        else if (rtp_pacing_setup_socket(manager.shared_rtp_sockfd, false) <
+                 0) {
+            return -1;
+        }
+        return event_loop_add(loop, manager.shared_rtcp_sockfd, EPOLLIN,
+                              on_rtcp_readable, nullptr);
+    }
+    // 从高到低压入，先分配低端口
+    for (int port = (port_max - 1) & ~1; port >= port_min; port -= 2) {
+        manager.free_ports.push_back(port);
+    }
+    return 0;
+}
+
+void rtsp_session_manager_destroy() {
+    if (manager.shared_rtcp_sockfd >= 0) {
+        event_loop_remove(manager.loop, manager.shared_rtcp_sockfd);
+        close(manager.shared_rtcp_sockfd);
+        manager.shared_rtcp_sockfd = -1;
+    }
+    if (manager.shared_rtp_sockfd >= 0) {
+        rtp_batch_release_socket(manager.shared_rtp_sockfd);
+        close(manager.shared_rtp_sockfd);
+        manager.shared_rtp_sockfd = -1;
+    }
+}
+
+struct RtspSession* rtsp_session_create(void* owner) {
+    struct RtspSession* session =
+            (struct RtspSession*) calloc(1, sizeof(struct RtspSession));
+    do {
+        // 会话ID不能被猜到，用内核随机数而不是random()
+        if (getrandom(&session->id, sizeof(session->id), 0) !=
+            sizeof(session->id)) {
+            session->id = (uint64_t) random() << 32 | random();
+        }
+    } while (session->id == 0 || manager.sessions.count(session->id));
+    snprintf(session->id_str, sizeof(session->id_str), "%016llX",
+             (unsigned long long) session->id);
+    session->owner = owner;
+    for (int i = 0; i < RTSP_SESSION_MAX_TRACKS; ++i) {
+        session->transports[i].session = session;
+        session->transports[i].track = i;
+        session->transports[i].rtp_sockfd = -1;
+        session->transports[i].rtcp_sockfd = -1;
+    }
+    manager.sessions[session->id] = session;
+    metrics_add(METRICS_SESSIONS, 1);
+    return session;
+}
+
+struct RtspSession* rtsp_session_find(const char* id) {
+    char* end;
+    uint64_t value = strtoull(id, &end, 16);
+    if (end - id != RTSP_SESSION_ID_SIZE) {
+        return nullptr;
+    }
+    auto it = manager.sessions.find(value);
+    return it == manager.sessions.end() ? nullptr : it->second;
+}
+
+static void release_udp(struct RtspTransport* transport) {
+    if (!transport->udp) {
+        return;
+    }
+    if (transport->shared) {
+        auto it = manager.rtcp_routes.find(
+                addr_key(&transport->client_rtcp_addr));
+        if (it != manager.rtcp_routes.end() && it->second == transport) {
+            manager.rtcp_routes.erase(it);
+        }
+    }
+    else {
+        event_loop_remove(manager.loop, transport->rtcp_sockfd);
+        close(transport->rtcp_sockfd);
+        rtp_batch_release_socket(transport->rtp_sockfd);
+        close(transport->rtp_sockfd);
+        manager.free_ports.push_back(transport->server_rtp_port);
+    }
+    transport->udp = false;
+    transport->rtp_sockfd = -1;
+    transport->rtcp_sockfd = -1;
+}
+
+// 从端口池分配一对端口并创建socket，被其他程序占用的端口移出池
+static int alloc_port_pair(struct RtspTransport* transport) {
+    while (!manager.free_ports.empty()) {
+        int port = manager.free_ports.back();
+        manager.free_ports.pop_back();
+        int rtp_sockfd = create_udp_socket(port);
+        int rtcp_sockfd = rtp_sockfd < 0 ? -1 : create_udp_socket(port + 1);
+        if (rtcp_sockfd < 0) {
+            if (rtp_sockfd >= 0) {
+                close(rtp_sockfd);
+            }
+            printf("rtp port %d-%d is in use\n", port, port + 1);
+            continue;
+        }
+        transport->rtp_sockfd = rtp_sockfd;
+        transport->rtcp_sockfd = rtcp_sockfd;
+        transport->server_rtp_port = port;
+        transport->server_rtcp_port = port + 1;
+        return 0;
+    }
+    printf("no free rtp port\n");
+    return -1;
+}
+
+int rtsp_session_setup_udp(struct RtspSession* session, int track,
+                           const char* client_ip, int client_rtp_port,
+                           int client_rtcp_port) {
+    struct RtspTransport* transport = &session->transports[track];
+    release_udp(transport);
+    bzero(&transport->client_rtp_addr, sizeof(transport->client_rtp_addr));
+    transport->client_rtp_addr.sin_family = AF_INET;
+    transport->client_rtp_addr.sin_addr.s_addr = inet_addr(client_ip);
+    transport->client_rtp_addr.sin_port = htons(client_rtp_port);
+    transport->client_rtcp_addr = transport->client_rtp_addr;
+    transport->client_rtcp_addr.sin_port = htons(client_rtcp_port);
+
+    if (manager.shared) {
+        transport->shared = true;
+        transport->rtp_sockfd = manager.shared_rtp_sockfd;
+        transport->rtcp_sockfd = manager.shared_rtcp_sockfd;
+        transport->server_rtp_port = manager.shared_rtp_port;
+        transport->server_rtcp_port = manager.shared_rtp_port + 1;
+        manager.rtcp_routes[addr_key(&transport->client_rtcp_addr)] =
+                transport;
+        transport->udp = true;
+        return 0;
+    }
+
+    if (alloc_port_pair(transport) < 0) {
+        return -1;
+    }
+    // RTP socket只发给这一个客户端，connect后发送时内核不用再查路由，
+    // 也满足UDP GSO的使用条件
+    if (connect(transport->rtp_sockfd,
+                (struct sockaddr*) &transport->client_rtp_addr,
+                sizeof(transport->client_rtp_addr)) < 0 ||
+        rtp_pacing_setup_socket(transport->rtp_sockfd, false) < 0 ||
+        event_loop_add(manager.loop, transport->rtcp_sockfd, EPOLLIN,
+                       on_rtcp_readable, transport) < 0) {
+        printf("failed to set up rtp socket\n");
+        close(transport->rtp_sockfd);
+        close(transport->rtcp_sockfd);
+        manager.free_ports.push_back(transport->server_rtp_port);
+        transport->rtp_sockfd = -1;
+        transport->rtcp_sockfd = -1;
+        return -1;
+    }
+    transport->udp = true;
+    return 0;
+}
+
+void rtsp_session_destroy(struct RtspSession* session) {
+    if (!session) {
+        return;
+    }
+    for (int i = 0; i < RTSP_SESSION_MAX_TRACKS; ++i) {
+        release_udp(&session->transports[i]);
+    }
+    manager.sessions.erase(session->id);
+    metrics_add(METRICS_SESSIONS, -1);
+    free(session);
+}
+
+uint32_t rtsp_session_count() {
+    return manager.sessions.size();
+}
@@ -0,0 +1,72 @@
+#ifndef RTSPSERVER_RTSP_SESSION_H
+#define RTSPSERVER_RTSP_SESSION_H
+
+#include <netinet/in.h>
+
+#include <cstdint>
+
+// 会话ID为16位十六进制的随机数
+#define RTSP_SESSION_ID_SIZE 16
+// 一个会话最多包含的轨道数（视频和音频）
+#define RTSP_SESSION_MAX_TRACKS 2
+
+struct EventLoop;
+struct RtspSession;
+
+// 收到会话中某个轨道的RTCP包，data只在回调期间有效
+typedef void (*RtspSessionRtcpCallback)(struct RtspSession* session,
+                                        int track, const uint8_t* data,
+                                        int size);
+
+/*
+ * 一个轨道的UDP传输。独占模式下是轨道自己的socket（RTP已connect到
+ * 客户端），共享模式下是所有会话共用的一对socket，发送时要带目的地址
+ */
+struct RtspTransport {
+    struct RtspSession* session;
+    int track;
+    bool udp;
+    bool shared;
+    int rtp_sockfd;
+    int rtcp_sockfd;
+    int server_rtp_port;
+    int server_rtcp_port;
+    struct sockaddr_in client_rtp_addr;
+    struct sockaddr_in client_rtcp_addr;
+};
+
+struct RtspSession {
+    uint64_t id;
+    char id_str[RTSP_SESSION_ID_SIZE + 1];
+    void* owner; // 创建会话的RTSP连接
+    struct RtspTransport transports[RTSP_SESSION_MAX_TRACKS];
+};
+
+/*
+ * 初始化会话管理。独占模式下每个UDP会话从[port_min, port_max]中分配一对
+ * 偶/奇端口；shared为true时所有会话共用绑定在port_min/port_min+1上的
+ * 一对socket，收到的RTCP按来源地址分发给会话，fd数与会话数无关。
+ * 会话表属于调用线程，每个工作线程用各自不重叠的端口范围初始化一次
+ */
+int rtsp_session_manager_init(struct EventLoop* loop, int port_min,
+                              int port_max, bool shared,
+                              RtspSessionRtcpCallback on_rtcp);
+void rtsp_session_manager_destroy();
+
+// 创建一个随机ID的会话并加入会话表
+struct RtspSession* rtsp_session_create(void* owner);
+// 按请求中Session头的值查找，没有返回nullptr
+struct RtspSession* rtsp_session_find(const char* id);
+/*
+ * 为会话的一个轨道准备UDP传输：分配端口对并创建socket，或者登记到
+ * 共享socket。重复SETUP时先释放之前的端口。失败返回-1
+ */
+int rtsp_session_setup_udp(struct RtspSession* session, int track,
+                           const char* client_ip, int client_rtp_port,
+                           int client_rtcp_port);
+// 从会话表中移除，释放所有轨道的端口和socket
+void rtsp_session_destroy(struct RtspSession* session);
+
+uint32_t rtsp_session_count();
+
+#endif
@@ -0,0 +1,331 @@
+#include "scheduler.h"
+
+#include <sys/timerfd.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include "event_loop.h"
+
+struct Scheduler {
+    struct EventLoop* loop;
+    int timer_fd;
+    uint64_t base_ns; // tick 0对应的时间
+    uint64_t current_tick;
+    uint64_t armed_ns; // timerfd当前设置的到期时间，0表示未设置
+    bool running; // 正在处理到期任务，结束后统一设置timerfd
+    uint32_t count;
+    uint32_t level0_count;
+
+    // 各槽的链表头（哨兵节点）
+    struct SchedulerTimer level0[SCHEDULER_LEVEL0_SIZE];
+    struct SchedulerTimer levels[SCHEDULER_LEVELS - 1][SCHEDULER_LEVEL_SIZE];
+    uint64_t level0_bitmap[SCHEDULER_LEVEL0_SIZE / 64]; // 第0层非空槽
+};
+
+uint64_t scheduler_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline void list_init(struct SchedulerTimer* head) {
+    head->prev = head;
+    head->next = head;
+}
+
+static inline bool list_empty(const struct SchedulerTimer* head) {
+    return head->next == head;
+}
+
+static inline void list_push(struct SchedulerTimer* head,
+                             struct SchedulerTimer* timer) {
+    timer->prev = head->prev;
+    timer->next = head;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static inline void list_unlink(struct SchedulerTimer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->prev = timer;
+    timer->next = timer;
+}
+
+// 第level层（level >= 1）的槽下标从tick的哪一位开始
+static inline int level_shift(int level) {
+    return SCHEDULER_LEVEL0_BITS + SCHEDULER_LEVEL_BITS * (level - 1);
+}
+
+static inline uint64_t tick_of(struct Scheduler* scheduler,
+                               uint64_t deadline_ns) {
+    if (deadline_ns <= scheduler->base_ns) {
+        return 0;
+    }
+    return (deadline_ns - scheduler->base_ns) >> SCHEDULER_TICK_SHIFT;
+}
+
+static inline uint64_t tick_to_ns(struct Scheduler* scheduler, uint64_t tick) {
+    return scheduler->base_ns + (tick << SCHEDULER_TICK_SHIFT);
+}
+
+static void place(struct Scheduler* scheduler, struct SchedulerTimer* timer) {
+    uint64_t tick = tick_of(scheduler, timer->deadline_ns);
+    if (tick < scheduler->current_tick) {
+        tick = scheduler->current_tick;
+    }
+    uint64_t diff = tick - scheduler->current_tick;
+    if (diff < SCHEDULER_LEVEL0_SIZE) {
+        int slot = tick & (SCHEDULER_LEVEL0_SIZE - 1);
+        timer->level = 0;
+        timer->slot = slot;
+        list_push(&scheduler->level0[slot], timer);
+        scheduler->level0_bitmap[slot >> 6] |= 1ull << (slot & 63);
+        ++scheduler->level0_count;
+        return;
+    }
+    int level = 1;
+    while (level < SCHEDULER_LEVELS - 1 &&
+           diff >= (1ull << (level_shift(level) + SCHEDULER_LEVEL_BITS))) {
+        ++level;
+    }
+    int shift = level_shift(level);
+    if (diff >= (1ull << (shift + SCHEDULER_LEVEL_BITS))) {
+        // 超出时间轮范围，放在最高层最后才会下放的槽里，下放时重新安排
+        tick = scheduler->current_tick - (1ull << shift);
+    }
+    timer->level = level;
+    timer->slot = (tick >> shift) & (SCHEDULER_LEVEL_SIZE - 1);
+    list_push(&scheduler->levels[level - 1][timer->slot], timer);
+}
+
+static void unplace(struct Scheduler* scheduler, struct SchedulerTimer* timer) {
+    list_unlink(timer);
+    if (timer->level == 0) {
+        --scheduler->level0_count;
+        if (list_empty(&scheduler->level0[timer->slot])) {
+            scheduler->level0_bitmap[timer->slot >> 6] &=
+                    ~(1ull << (timer->slot & 63));
+        }
+    }
+}
+
+// current_tick进入新的第0层周期时，把高层对应槽中的任务下放
+static void cascade(struct Scheduler* scheduler) {
+    for (int level = SCHEDULER_LEVELS - 1; level >= 1; --level) {
+        int shift = level_shift(level);
+        if (scheduler->current_tick & ((1ull << shift) - 1)) {
+            continue;
+        }
+        int slot = (scheduler->current_tick >> shift) &
+                   (SCHEDULER_LEVEL_SIZE - 1);
+        struct SchedulerTimer* head = &scheduler->levels[level - 1][slot];
+        struct SchedulerTimer pending;
+        list_init(&pending);
+        while (!list_empty(head)) {
+            struct SchedulerTimer* timer = head->next;
+            list_unlink(timer);
+            list_push(&pending, timer);
+        }
+        while (!list_empty(&pending)) {
+            struct SchedulerTimer* timer = pending.next;
+            list_unlink(timer);
+            place(scheduler, timer);
+        }
+    }
+}
+
+// 运行当前tick槽中到期的任务，同一tick中还没到期的放回原槽
+static void expire_slot(struct Scheduler* scheduler, int slot, uint64_t now) {
+    struct SchedulerTimer* head = &scheduler->level0[slot];
+    struct SchedulerTimer expired;
+    list_init(&expired);
+    while (!list_empty(head)) {
+        struct SchedulerTimer* timer = head->next;
+        unplace(scheduler, timer);
+        timer->level = -1; // 已从时间轮摘下，取消时不再更新槽的状态
+        list_push(&expired, timer);
+    }
+    // 回调中可能取消expired中的其他任务，每次都从链表头重新取
+    while (!list_empty(&expired)) {
+        struct SchedulerTimer* timer = expired.next;
+        list_unlink(timer);
+        if (timer->deadline_ns > now) {
+            place(scheduler, timer);
+            continue;
+        }
+        timer->pending = false;
+        --scheduler->count;
+        timer->callback(timer, timer->arg);
+    }
+}
+
+// 第0层中从slot（含）开始、到本周期结束前的第一个非空槽，没有返回-1
+static int next_level0_slot(struct Scheduler* scheduler, int slot) {
+    while (slot < SCHEDULER_LEVEL0_SIZE) {
+        uint64_t bits = scheduler->level0_bitmap[slot >> 6] >> (slot & 63);
+        if (bits) {
+            return slot + __builtin_ctzll(bits);
+        }
+        slot = (slot | 63) + 1;
+    }
+    return -1;
+}
+
+static void advance(struct Scheduler* scheduler, uint64_t now) {
+    uint64_t now_tick = tick_of(scheduler, now);
+    while (true) {
+        int slot = scheduler->current_tick & (SCHEDULER_LEVEL0_SIZE - 1);
+        expire_slot(scheduler, slot, now);
+        if (scheduler->current_tick >= now_tick) {
+            break;
+        }
+        // 跳过空槽，但不能越过周期边界，边界处要下放高层任务
+        uint64_t block = scheduler->current_tick - slot;
+        int next = next_level0_slot(scheduler, slot + 1);
+        uint64_t target = next >= 0 ? block + next
+                                    : block + SCHEDULER_LEVEL0_SIZE;
+        if (target > now_tick) {
+            target = now_tick;
+        }
+        scheduler->current_tick = target;
+        if ((target & (SCHEDULER_LEVEL0_SIZE - 1)) == 0) {
+            cascade(scheduler);
+        }
+    }
+}
+
+static void arm(struct Scheduler* scheduler) {
+    uint64_t deadline = 0;
+    if (scheduler->level0_count > 0) {
+        int slot = scheduler->current_tick & (SCHEDULER_LEVEL0_SIZE - 1);
+        int next = next_level0_slot(scheduler, slot);
+        if (next < 0) {
+            // 只剩落在下一周期的任务
+            next = next_level0_slot(scheduler, 0);
+        }
+        struct SchedulerTimer* head = &scheduler->level0[next];
+        for (struct SchedulerTimer* timer = head->next; timer != head;
+             timer = timer->next) {
+            if (deadline == 0 || timer->deadline_ns < deadline) {
+                deadline = timer->deadline_ns;
+            }
+        }
+    }
+    if (scheduler->count > scheduler->level0_count) {
+        // 高层还有任务，至少在下一个周期边界醒来下放
+        uint64_t block_end = (scheduler->current_tick |
+                              (SCHEDULER_LEVEL0_SIZE - 1)) + 1;
+        uint64_t block_end_ns = tick_to_ns(scheduler, block_end);
+        if (deadline == 0 || block_end_ns < deadline) {
+            deadline = block_end_ns;
+        }
+    }
+    if (deadline == scheduler->armed_ns) {
+        return;
+    }
+    struct itimerspec spec;
+    bzero(&spec, sizeof(spec));
+    if (deadline > 0) {
+        spec.it_value.tv_sec = deadline / 1000000000ull;
+        spec.it_value.tv_nsec = deadline % 1000000000ull;
+    }
+    timerfd_settime(scheduler->timer_fd, TFD_TIMER_ABSTIME, &spec, nullptr);
+    scheduler->armed_ns = deadline;
+}
+
+static void on_scheduler_timer(struct EventLoop* loop, int fd, uint32_t events,
+                               void* arg) {
+    struct Scheduler* scheduler = (struct Scheduler*) arg;
+    event_loop_read_timer(fd);
+    scheduler->armed_ns = 0;
+    scheduler->running = true;
+    advance(scheduler, scheduler_now_ns());
+    scheduler->running = false;
+    arm(scheduler);
+}
+
+struct Scheduler* scheduler_create(struct EventLoop* loop) {
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0) {
+        return nullptr;
+    }
+    struct Scheduler* scheduler = new Scheduler();
+    scheduler->loop = loop;
+    scheduler->timer_fd = timer_fd;
+    scheduler->base_ns = scheduler_now_ns();
+    scheduler->current_tick = 0;
+    scheduler->armed_ns = 0;
+    scheduler->running = false;
+    scheduler->count = 0;
+    scheduler->level0_count = 0;
+    for (int i = 0; i < SCHEDULER_LEVEL0_SIZE; ++i) {
+        list_init(&scheduler->level0[i]);
+    }
+    for (int level = 0; level < SCHEDULER_LEVELS - 1; ++level) {
+        for (int i = 0; i < SCHEDULER_LEVEL_SIZE; ++i) {
+            list_init(&scheduler->levels[level][i]);
+        }
+    }
+    bzero(scheduler->level0_bitmap, sizeof(scheduler->level0_bitmap));
+    if (event_loop_add(loop, timer_fd, EPOLLIN, on_scheduler_timer,
+                       scheduler) < 0) {
+        close(timer_fd);
+        delete scheduler;
+        return nullptr;
+    }
+    return scheduler;
+}
+
+void scheduler_destroy(struct Scheduler* scheduler) {
+    if (!scheduler) {
+        return;
+    }
+    event_loop_remove(scheduler->loop, scheduler->timer_fd);
+    close(scheduler->timer_fd);
+    delete scheduler;
+}
+
+void scheduler_timer_init(struct SchedulerTimer* timer,
+                          SchedulerCallback callback, void* arg) {
+    list_init(timer);
+    timer->deadline_ns = 0;
+    timer->level = 0;
+    timer->slot = 0;
+    timer->pending = false;
+    timer->callback = callback;
+    timer->arg = arg;
+}
+
+void scheduler_add(struct Scheduler* scheduler, struct SchedulerTimer* timer,
+                   uint64_t deadline_ns) {
+    if (timer->pending) {
+        scheduler_cancel(scheduler, timer);
+    }
+    timer->deadline_ns = deadline_ns;
+    timer->pending = true;
+    ++scheduler->count;
+    place(scheduler, timer);
+    if (!scheduler->running &&
+        (scheduler->armed_ns == 0 || deadline_ns < scheduler->armed_ns)) {
+        arm(scheduler);
+    }
+}
+
+void scheduler_cancel(struct Scheduler* scheduler,
+                      struct SchedulerTimer* timer) {
+    if (!timer->pending) {
+        return;
+    }
+    if (timer->level < 0) {
+        list_unlink(timer);
+    }
+    else {
+        unplace(scheduler, timer);
+    }
+    timer->pending = false;
+    --scheduler->count;
+}
@@ -0,0 +1,53 @@
+#ifndef RTSPSERVER_SCHEDULER_H
+#define RTSPSERVER_SCHEDULER_H
+
+#include <cstdint>
+
+/*
+ * 分层时间轮，所有定时任务共用一个timerfd。
+ * 第0层256个槽，每槽 2^SCHEDULER_TICK_SHIFT 纳秒（约131us），之后3层
+ * 各64个槽，覆盖约2.4小时，更远的到期时间放在最高层最后一个槽，到时再下放。
+ * timerfd按绝对时间设置为最近一个非空槽中最早的到期时间，
+ * 因此释放时刻不受槽精度影响，只取决于唤醒延迟
+ */
+#define SCHEDULER_TICK_SHIFT 17
+#define SCHEDULER_LEVEL0_BITS 8
+#define SCHEDULER_LEVEL_BITS 6
+#define SCHEDULER_LEVELS 4
+#define SCHEDULER_LEVEL0_SIZE (1 << SCHEDULER_LEVEL0_BITS)
+#define SCHEDULER_LEVEL_SIZE (1 << SCHEDULER_LEVEL_BITS)
+
+struct EventLoop;
+struct Scheduler;
+struct SchedulerTimer;
+
+typedef void (*SchedulerCallback)(struct SchedulerTimer* timer, void* arg);
+
+// 侵入式定时任务，由使用者分配，在到期或取消前必须保持有效
+struct SchedulerTimer {
+    struct SchedulerTimer* prev;
+    struct SchedulerTimer* next;
+    uint64_t deadline_ns; // CLOCK_MONOTONIC绝对时间
+    int level; // -1表示正在处理到期，已从时间轮摘下
+    int slot;
+    bool pending;
+
+    SchedulerCallback callback;
+    void* arg;
+};
+
+// CLOCK_MONOTONIC当前时间，纳秒
+uint64_t scheduler_now_ns();
+
+struct Scheduler* scheduler_create(struct EventLoop* loop);
+void scheduler_destroy(struct Scheduler* scheduler);
+
+void scheduler_timer_init(struct SchedulerTimer* timer,
+                          SchedulerCallback callback, void* arg);
+// 在绝对时间deadline_ns运行timer的回调，已经在等待的timer会被重新安排
+void scheduler_add(struct Scheduler* scheduler, struct SchedulerTimer* timer,
+                   uint64_t deadline_ns);
+void scheduler_cancel(struct Scheduler* scheduler,
+                      struct SchedulerTimer* timer);
+
+#endif
@@ -0,0 +1,202 @@
+#include "synth_media.h"
+
+#include <cstdio>
+
+#include "adts.h"
+#include "h264_reader.h"
+
+struct BitWriter {
+    std::vector<uint8_t> bytes;
+    int bits; // 最后一个字节中已写入的位数，8表示写满
+};
+
+static void write_bits(struct BitWriter* writer, uint32_t value, int n) {
+    for (int i = n - 1; i >= 0; --i) {
+        if (writer->bits == 8) {
+            writer->bytes.push_back(0);
+            writer->bits = 0;
+        }
+        writer->bytes.back() |= ((value >> i) & 1) << (7 - writer->bits);
+        ++writer->bits;
+    }
+}
+
+// 无符号指数哥伦布码ue(v)
+static void write_ue(struct BitWriter* writer, uint32_t value) {
+    uint32_t code = value + 1;
+    int length = 0;
+    while ((code >> length) > 1) {
+        ++length;
+    }
+    write_bits(writer, 0, length);
+    write_bits(writer, code, length + 1);
+}
+
+// xorshift32，不依赖rand()的全局状态
+static inline uint32_t next_random(uint32_t* state) {
+    uint32_t x = *state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    *state = x;
+    return x;
+}
+
+static uint32_t random_between(uint32_t* state, uint32_t min, uint32_t max) {
+    return min + next_random(state) % (max - min + 1);
+}
+
+// 起始码加NALU，rbsp按需插入防竞争字节
+static void append_nalu(std::vector<uint8_t>* out, uint8_t header,
+                        const std::vector<uint8_t>& rbsp) {
+    static const uint8_t start_code[] = {0x00, 0x00, 0x00, 0x01};
+    out->insert(out->end(), start_code, start_code + sizeof(start_code));
+    out->push_back(header);
+    int zeros = 0;
+    for (uint8_t byte : rbsp) {
+        if (zeros >= 2 && byte <= 0x03) {
+            out->push_back(0x03);
+            zeros = 0;
+        }
+        out->push_back(byte);
+        zeros = byte == 0 ? zeros + 1 : 0;
+    }
+}
+
+// 负载不含0字节，不会出现起始码。每帧一个slice，第一个字节的最高位
+// 是first_mb_in_slice = 0，其余是随机数
+static void append_slice(std::vector<uint8_t>* out, uint8_t type,
+                         uint32_t size, uint32_t* state) {
+    static const uint8_t start_code[] = {0x00, 0x00, 0x00, 0x01};
+    out->insert(out->end(), start_code, start_code + sizeof(start_code));
+    out->push_back((uint8_t) (0x60 | type)); // nal_ref_idc = 3
+    out->push_back((uint8_t) (0x80 | next_random(state)));
+    for (uint32_t i = 2; i < size; ++i) {
+        out->push_back((uint8_t) (1 + next_random(state) % 255));
+    }
+}
+
+// Baseline profile的SPS，VUI中带固定帧率
+static void append_sps(std::vector<uint8_t>* out, uint32_t frame_rate) {
+    struct BitWriter writer = {{}, 8};
+    write_bits(&writer, 66, 8); // profile_idc
+    write_bits(&writer, 0xC0, 8); // constraint_set0/1_flag
+    write_bits(&writer, 31, 8); // level_idc
+    write_ue(&writer, 0); // seq_parameter_set_id
+    write_ue(&writer, 0); // log2_max_frame_num_minus4
+    write_ue(&writer, 2); // pic_order_cnt_type
+    write_ue(&writer, 1); // max_num_ref_frames
+    write_bits(&writer, 0, 1); // gaps_in_frame_num_value_allowed_flag
+    write_ue(&writer, SYNTH_H264_WIDTH / 16 - 1);
+    write_ue(&writer, SYNTH_H264_HEIGHT / 16 - 1);
+    write_bits(&writer, 1, 1); // frame_mbs_only_flag
+    write_bits(&writer, 1, 1); // direct_8x8_inference_flag
+    write_bits(&writer, 0, 1); // frame_cropping_flag
+    write_bits(&writer, 1, 1); // vui_parameters_present_flag
+    write_bits(&writer, 0, 1); // aspect_ratio_info_present_flag
+    write_bits(&writer, 0, 1); // overscan_info_present_flag
+    write_bits(&writer, 0, 1); // video_signal_type_present_flag
+    write_bits(&writer, 0, 1); // chroma_loc_info_present_flag
+    write_bits(&writer, 1, 1); // timing_info_present_flag
+    write_bits(&writer, 1, 32); // num_units_in_tick
+    write_bits(&writer, 2 * frame_rate, 32); // time_scale
+    write_bits(&writer, 1, 1); // fixed_frame_rate_flag
+    write_bits(&writer, 0, 1); // nal_hrd_parameters_present_flag
+    write_bits(&writer, 0, 1); // vcl_hrd_parameters_present_flag
+    write_bits(&writer, 0, 1); // pic_struct_present_flag
+    write_bits(&writer, 0, 1); // bitstream_restriction_flag
+    write_bits(&writer, 1, 1); // rbsp_stop_one_bit
+    append_nalu(out, 0x60 | H264_NALU_TYPE_SPS, writer.bytes);
+}
+
+static void append_pps(std::vector<uint8_t>* out) {
+    struct BitWriter writer = {{}, 8};
+    write_ue(&writer, 0); // pic_parameter_set_id
+    write_ue(&writer, 0); // seq_parameter_set_id
+    write_bits(&writer, 0, 1); // entropy_coding_mode_flag
+    write_bits(&writer, 0, 1); // bottom_field_pic_order_in_frame_present_flag
+    write_ue(&writer, 0); // num_slice_groups_minus1
+    write_ue(&writer, 0); // num_ref_idx_l0_default_active_minus1
+    write_ue(&writer, 0); // num_ref_idx_l1_default_active_minus1
+    write_bits(&writer, 0, 1); // weighted_pred_flag
+    write_bits(&writer, 0, 2); // weighted_bipred_idc
+    write_ue(&writer, 0); // pic_init_qp_minus26，se(0)和ue(0)编码相同
+    write_ue(&writer, 0); // pic_init_qs_minus26
+    write_ue(&writer, 0); // chroma_qp_index_offset
+    write_bits(&writer, 1, 1); // deblocking_filter_control_present_flag
+    write_bits(&writer, 0, 1); // constrained_intra_pred_flag
+    write_bits(&writer, 0, 1); // redundant_pic_cnt_present_flag
+    write_bits(&writer, 1, 1); // rbsp_stop_one_bit
+    append_nalu(out, 0x60 | H264_NALU_TYPE_PPS, writer.bytes);
+}
+
+void synth_h264_generate(std::vector<uint8_t>* out, uint32_t seconds,
+                         uint32_t frame_rate) {
+    uint32_t state = 0x12345678;
+    uint32_t frames = seconds * frame_rate;
+    uint32_t gop = SYNTH_H264_GOP_SECONDS * frame_rate;
+    out->clear();
+    for (uint32_t i = 0; i < frames; ++i) {
+        if (i % gop == 0) {
+            append_sps(out, frame_rate);
+            append_pps(out);
+            append_slice(out, H264_NALU_TYPE_IDR, SYNTH_H264_IDR_SIZE, &state);
+        }
+        else if (i % SYNTH_H264_SMALL_SLICE_INTERVAL == 0) {
+            append_slice(out, H264_NALU_TYPE_SLICE,
+                         random_between(&state,
+                                        SYNTH_H264_SMALL_SLICE_MIN_SIZE,
+                                        SYNTH_H264_SMALL_SLICE_MAX_SIZE),
+                         &state);
+        }
+        else {
+            append_slice(out, H264_NALU_TYPE_SLICE,
+                         random_between(&state, SYNTH_H264_SLICE_MIN_SIZE,
+                                        SYNTH_H264_SLICE_MAX_SIZE),
+                         &state);
+        }
+    }
+}
+
+void synth_adts_generate(std::vector<uint8_t>* out, uint32_t seconds) {
+    uint32_t state = 0x9E3779B9;
+    uint32_t sample_rate =
+            adts_sample_rate(SYNTH_AAC_SAMPLING_FREQUENCY_INDEX);
+    uint32_t frames = (seconds * sample_rate + AAC_SAMPLES_PER_FRAME - 1) /
+                      AAC_SAMPLES_PER_FRAME;
+    out->clear();
+    for (uint32_t i = 0; i < frames; ++i) {
+        uint32_t au_size = random_between(&state, SYNTH_AAC_AU_MIN_SIZE,
+                                          SYNTH_AAC_AU_MAX_SIZE);
+        uint32_t length = ADTS_HEADER_SIZE + au_size;
+        uint8_t profile = 1; // AAC-LC
+        // MPEG-4，layer 0，没有CRC，buffer fullness 0x7FF表示VBR
+        out->push_back(0xFF);
+        out->push_back(0xF1);
+        out->push_back((uint8_t) (profile << 6 |
+                                  SYNTH_AAC_SAMPLING_FREQUENCY_INDEX << 2 |
+                                  SYNTH_AAC_CHANNELS >> 2));
+        out->push_back((uint8_t) ((SYNTH_AAC_CHANNELS & 0x03) << 6 |
+                                  length >> 11));
+        out->push_back((uint8_t) (length >> 3));
+        out->push_back((uint8_t) ((length & 0x07) << 5 | 0x1F));
+        out->push_back(0xFC);
+        for (uint32_t k = 0; k < au_size; ++k) {
+            out->push_back((uint8_t) next_random(&state));
+        }
+    }
+}
+
+int synth_write_file(const char* file_name, const std::vector<uint8_t>& data) {
+    FILE* fp = fopen(file_name, "wb");
+    if (!fp) {
+        printf("failed to create %s\n", file_name);
+        return -1;
+    }
+    size_t written = fwrite(data.data(), 1, data.size(), fp);
+    if (fclose(fp) != 0 || written != data.size()) {
+        printf("failed to write %s\n", file_name);
+        return -1;
+    }
+    return 0;
+}
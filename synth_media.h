@@ -0,0 +1,36 @@
+#ifndef RTSPSERVER_SYNTH_MEDIA_H
+#define RTSPSERVER_SYNTH_MEDIA_H
+
+#include <cstdint>
+#include <vector>
+
+/*
+ * 合成的测试码流，基准测试和压测不依赖外部媒体文件。负载是伪随机字节，
+ * 不能解码，但起始码、NALU类型、SPS（含VUI帧率）和ADTS头都和真实文件
+ * 一样，服务器按正常流程建索引和打包。同样的参数总是生成同样的内容
+ */
+#define SYNTH_H264_WIDTH 1280
+#define SYNTH_H264_HEIGHT 720
+#define SYNTH_H264_GOP_SECONDS 2
+#define SYNTH_H264_IDR_SIZE 40000
+#define SYNTH_H264_SLICE_MIN_SIZE 2000
+#define SYNTH_H264_SLICE_MAX_SIZE 8000
+// 每隔若干个P帧出一个小于MTU的帧（接近静止的画面），按单NALU模式发送
+#define SYNTH_H264_SMALL_SLICE_INTERVAL 8
+#define SYNTH_H264_SMALL_SLICE_MIN_SIZE 300
+#define SYNTH_H264_SMALL_SLICE_MAX_SIZE 1200
+
+// 44.1kHz双声道AAC-LC，AU大小大致相当于128kbit/s
+#define SYNTH_AAC_SAMPLING_FREQUENCY_INDEX 4
+#define SYNTH_AAC_CHANNELS 2
+#define SYNTH_AAC_AU_MIN_SIZE 300
+#define SYNTH_AAC_AU_MAX_SIZE 420
+
+// 生成seconds秒、frame_rate帧/秒的Annex-B码流，每个GOP以SPS、PPS、IDR开头
+void synth_h264_generate(std::vector<uint8_t>* out, uint32_t seconds,
+                         uint32_t frame_rate);
+// 生成seconds秒的ADTS码流，每帧一个AU，没有CRC
+void synth_adts_generate(std::vector<uint8_t>* out, uint32_t seconds);
+int synth_write_file(const char* file_name, const std::vector<uint8_t>& data);
+
+#endif
@@ -0,0 +1,183 @@
+#include "worker.h"
+
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+
+#include "event_loop.h"
+#include "scheduler.h"
+
+static struct Worker workers[WORKER_MAX_COUNT];
+static int workers_count = 0;
+static thread_local struct Worker* current_worker = nullptr;
+
+// 启动时等待所有线程初始化完成
+static std::mutex start_mutex;
+static std::condition_variable start_cond;
+static int start_done = 0;
+static int start_failed = 0;
+
+struct WorkerStart {
+    struct Worker* worker;
+    WorkerInitCallback init;
+    void* arg;
+};
+
+static void on_wake(struct EventLoop* loop, int fd, uint32_t events,
+                    void* arg) {
+    struct Worker* worker = (struct Worker*) arg;
+    uint64_t count;
+    while (read(fd, &count, sizeof(count)) < 0 && errno == EINTR) {
+    }
+    struct WorkerTask* task =
+            worker->tasks.exchange(nullptr, std::memory_order_acquire);
+    // 栈是后进先出，反转后按投递顺序运行
+    struct WorkerTask* ordered = nullptr;
+    while (task) {
+        struct WorkerTask* next = task->next;
+        task->next = ordered;
+        ordered = task;
+        task = next;
+    }
+    while (ordered) {
+        struct WorkerTask* next = ordered->next;
+        ordered->callback(worker, ordered->arg);
+        ordered = next;
+    }
+}
+
+static int worker_init(struct Worker* worker) {
+    worker->loop = event_loop_create();
+    if (!worker->loop) {
+        return -1;
+    }
+    worker->scheduler = scheduler_create(worker->loop);
+    if (!worker->scheduler) {
+        return -1;
+    }
+    worker->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (worker->wake_fd < 0 ||
+        event_loop_add(worker->loop, worker->wake_fd, EPOLLIN, on_wake,
+                       worker) < 0) {
+        return -1;
+    }
+    if (worker->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(worker->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+            printf("worker %d: failed to pin to cpu %d\n", worker->id,
+                   worker->cpu);
+        }
+    }
+    return 0;
+}
+
+static void* worker_main(void* arg) {
+    struct WorkerStart* start = (struct WorkerStart*) arg;
+    struct Worker* worker = start->worker;
+    current_worker = worker;
+    int ret = worker_init(worker);
+    if (ret == 0) {
+        ret = start->init(worker, start->arg);
+    }
+    delete start;
+    {
+        std::lock_guard<std::mutex> lock(start_mutex);
+        ++start_done;
+        if (ret < 0) {
+            ++start_failed;
+        }
+    }
+    start_cond.notify_all();
+    if (ret < 0) {
+        return nullptr;
+    }
+    event_loop_run(worker->loop);
+    scheduler_destroy(worker->scheduler);
+    event_loop_remove(worker->loop, worker->wake_fd);
+    close(worker->wake_fd);
+    event_loop_destroy(worker->loop);
+    return nullptr;
+}
+
+int worker_default_count() {
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count < 1) {
+        return 1;
+    }
+    return count > WORKER_MAX_COUNT ? WORKER_MAX_COUNT : (int) count;
+}
+
+int worker_start(int count, bool pin_cpu, WorkerInitCallback init,
+                 void* arg) {
+    if (count < 1 || count > WORKER_MAX_COUNT) {
+        return -1;
+    }
+    int cpus = worker_default_count();
+    workers_count = count;
+    for (int i = 0; i < count; ++i) {
+        struct Worker* worker = &workers[i];
+        worker->id = i;
+        worker->cpu = pin_cpu ? i % cpus : -1;
+        worker->loop = nullptr;
+        worker->scheduler = nullptr;
+        worker->wake_fd = -1;
+        worker->tasks.store(nullptr, std::memory_order_relaxed);
+    }
+    for (int i = 0; i < count; ++i) {
+        struct WorkerStart* start = new WorkerStart{&workers[i], init, arg};
+        if (pthread_create(&workers[i].thread, nullptr, worker_main, start) !=
+            0) {
+            printf("failed to create worker %d: %s\n", i, strerror(errno));
+            delete start;
+            return -1;
+        }
+    }
+    std::unique_lock<std::mutex> lock(start_mutex);
+    start_cond.wait(lock, [count] { return start_done == count; });
+    return start_failed ? -1 : 0;
+}
+
+void worker_join() {
+    for (int i = 0; i < workers_count; ++i) {
+        pthread_join(workers[i].thread, nullptr);
+    }
+}
+
+int worker_count() {
+    return workers_count;
+}
+
+struct Worker* worker_get(int id) {
+    return id >= 0 && id < workers_count ? &workers[id] : nullptr;
+}
+
+struct Worker* worker_current() {
+    return current_worker;
+}
+
+void worker_task_init(struct WorkerTask* task, WorkerTaskCallback callback,
+                      void* arg) {
+    task->callback = callback;
+    task->arg = arg;
+    task->next = nullptr;
+}
+
+void worker_post(struct Worker* worker, struct WorkerTask* task) {
+    struct WorkerTask* head = worker->tasks.load(std::memory_order_relaxed);
+    do {
+        task->next = head;
+    } while (!worker->tasks.compare_exchange_weak(
+            head, task, std::memory_order_release, std::memory_order_relaxed));
+    // 栈原来为空时对方可能已经取完任务，总是唤醒一次
+    uint64_t one = 1;
+    while (write(worker->wake_fd, &one, sizeof(one)) < 0 && errno == EINTR) {
+    }
+}
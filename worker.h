@@ -0,0 +1,65 @@
+#ifndef RTSPSERVER_WORKER_H
+#define RTSPSERVER_WORKER_H
+
+#include <pthread.h>
+
+#include <atomic>
+
+#define WORKER_MAX_COUNT 64
+
+struct EventLoop;
+struct Scheduler;
+struct Worker;
+
+typedef void (*WorkerTaskCallback)(struct Worker* worker, void* arg);
+
+// 投递给其他工作线程的任务，侵入式，由使用者分配，在运行之前必须保持有效
+struct WorkerTask {
+    WorkerTaskCallback callback;
+    void* arg;
+    struct WorkerTask* next;
+};
+
+/*
+ * 一个工作线程：自己的事件循环和时间轮，线程之间在热路径上不共享任何
+ * 数据。其他线程只能通过worker_post投递任务，任务在本线程中运行
+ */
+struct Worker {
+    int id;
+    int cpu; // 绑定的CPU，-1表示不绑定
+    pthread_t thread;
+    struct EventLoop* loop;
+    struct Scheduler* scheduler;
+
+    // 投递的任务是一个无锁栈，eventfd唤醒事件循环后整体取出
+    int wake_fd;
+    std::atomic<struct WorkerTask*> tasks;
+};
+
+// 在工作线程中初始化线程自己的资源（监听socket、会话表等），失败返回-1
+typedef int (*WorkerInitCallback)(struct Worker* worker, void* arg);
+
+// 在线的CPU数，作为默认的工作线程数
+int worker_default_count();
+
+/*
+ * 启动count个工作线程，每个线程创建事件循环和时间轮后调用init，再进入
+ * 事件循环。pin_cpu时第i个线程绑定到第i个CPU（按CPU数取模）。
+ * 所有线程都初始化成功才返回0
+ */
+int worker_start(int count, bool pin_cpu, WorkerInitCallback init,
+                 void* arg);
+// 等待所有工作线程退出
+void worker_join();
+
+int worker_count();
+struct Worker* worker_get(int id);
+// 当前线程所属的工作线程，不是工作线程时返回nullptr
+struct Worker* worker_current();
+
+void worker_task_init(struct WorkerTask* task, WorkerTaskCallback callback,
+                      void* arg);
+// 把task交给worker的线程运行，可以在任何线程调用，不加锁
+void worker_post(struct Worker* worker, struct WorkerTask* task);
+
+#endif